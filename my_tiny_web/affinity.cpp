@@ -0,0 +1,67 @@
+#include "affinity.h"
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool parse_cpu_list(const std::string& text, std::vector<int>& cpus, std::string& err)
+{
+    cpus.clear();
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t comma = text.find(',', pos);
+        if (comma == std::string::npos)
+            comma = text.size();
+        std::string item = text.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty())
+            continue;
+        int first = 0, last = 0;
+        char tail = 0;
+        // 单个CPU或者一个闭区间
+        if (sscanf(item.c_str(), "%d-%d%c", &first, &last, &tail) != 2)
+        {
+            if (sscanf(item.c_str(), "%d%c", &first, &tail) != 1)
+            {
+                err = "bad cpu list item: '" + item + "'";
+                return false;
+            }
+            last = first;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+        {
+            err = "cpu out of range: '" + item + "'";
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return true;
+}
+
+bool pin_current_thread(const std::vector<int>& cpus)
+{
+    if (cpus.empty())
+        return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+    {
+        printf("pthread_setaffinity_np failed: %s\n", strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+int current_numa_node()
+{
+    unsigned int cpu = 0, node = 0;
+    if (getcpu(&cpu, &node) != 0)
+        return 0;
+    return (int)node;
+}
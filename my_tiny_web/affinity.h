@@ -0,0 +1,32 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <string>
+#include <vector>
+
+/*
+    CPU亲和性与NUMA相关的小工具
+    事件循环和工作线程可以绑定到配置的CPU上，避免被调度器在不同CPU/不同NUMA节点之间迁移
+*/
+
+/// @brief 解析形如 "0,2,4-7" 的CPU列表，空字符串得到空列表
+/// @return 格式错误或CPU编号超出范围时返回false
+bool parse_cpu_list(const std::string& text, std::vector<int>& cpus, std::string& err);
+
+/// @brief 把当前线程绑定到cpus中的CPU上，cpus为空时什么也不做
+bool pin_current_thread(const std::vector<int>& cpus);
+
+/// @brief 当前线程正在运行的CPU所属的NUMA节点
+int current_numa_node();
+
+/// @brief 自旋等待时的CPU提示，让出流水线资源给同一物理核上的另一个超线程
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#endif
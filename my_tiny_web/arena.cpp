@@ -0,0 +1,86 @@
+#include "arena.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* 大页的大小；映射都按它对齐、按它取整，arena_unmap不需要知道映射时用的是哪种页 */
+static const size_t HUGE_SIZE = 2 << 20;
+
+static size_t round_huge(size_t bytes)
+{
+    return (bytes + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1);
+}
+
+// 预先写入每一页，让内核现在就分配物理页；MADV_POPULATE_WRITE（5.14起）一次系统调用完成
+static void prefault(char* p, size_t bytes)
+{
+    if (madvise(p, bytes, MADV_POPULATE_WRITE) == 0)
+        return;
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < bytes; off += page)
+        p[off] = 0;
+}
+
+void* arena_map(size_t bytes, ARENA_PAGES pages, bool prefault_all, ARENA_PAGES& got)
+{
+    bytes = round_huge(bytes);
+    if (pages == ARENA_HUGETLB)
+    {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (prefault_all ? MAP_POPULATE : 0);
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            got = ARENA_HUGETLB;
+            return p;
+        }
+        printf("arena: no hugetlbfs pages for %zu MB (vm.nr_hugepages), using transparent huge pages\n",
+               bytes >> 20);
+        pages = ARENA_THP;
+    }
+    // 多映射一个大页再裁掉两头，得到按2MB对齐的一块，透明大页只能放在对齐的地址上
+    char* raw = (char*)mmap(nullptr, bytes + HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return nullptr;
+    char* p = (char*)(((uintptr_t)raw + HUGE_SIZE - 1) & ~(uintptr_t)(HUGE_SIZE - 1));
+    if (p > raw)
+        munmap(raw, p - raw);
+    if (raw + HUGE_SIZE > p)
+        munmap(p + bytes, raw + HUGE_SIZE - p);
+    got = ARENA_SMALL;
+    if (pages == ARENA_THP && madvise(p, bytes, MADV_HUGEPAGE) == 0)
+        got = ARENA_THP;
+    if (prefault_all)
+        prefault(p, bytes);
+    return p;
+}
+
+void arena_unmap(void* p, size_t bytes)
+{
+    if (p)
+        munmap(p, round_huge(bytes));
+}
+
+void arena_huge_usage(long& thp, long& hugetlb)
+{
+    thp = hugetlb = 0;
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f)
+        return;
+    char line[256];
+    long kb;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+            thp = kb << 10;
+        else if (sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1)
+            hugetlb += kb << 10;
+        else if (sscanf(line, "Shared_Hugetlb: %ld kB", &kb) == 1)
+            hugetlb += kb << 10;
+    }
+    fclose(f);
+}
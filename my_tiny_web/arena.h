@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+    大页内存区。连接数组和按fd编号排列的读写缓冲区各占一整块连续的匿名映射，
+    按fd随机访问连接时用2MB的页代替4KB的页，同样的TLB条目覆盖512倍的内存。
+    透明大页（THP）只需要madvise，内核不保证一定给大页；hugetlbfs的大页要事先在vm.nr_hugepages里预留，
+    预留不够时退回透明大页
+*/
+
+enum ARENA_PAGES
+{
+    ARENA_SMALL = 0,   // 普通的4KB页
+    ARENA_THP,         // 透明大页：按2MB对齐并MADV_HUGEPAGE
+    ARENA_HUGETLB      // hugetlbfs的大页（MAP_HUGETLB）
+};
+
+/// @brief 映射一块匿名内存，内容为0
+/// @param pages 想要的页类型，got返回实际得到的类型
+/// @param prefault 映射时就分配好所有物理页（MAP_POPULATE），运行中不再缺页
+/// @return 失败时返回nullptr
+void* arena_map(size_t bytes, ARENA_PAGES pages, bool prefault, ARENA_PAGES& got);
+
+/// @brief 释放arena_map得到的内存，bytes和映射时相同
+void arena_unmap(void* p, size_t bytes);
+
+/// @brief 进程当前使用的透明大页和hugetlbfs大页（字节），从/proc/self/smaps_rollup读取
+void arena_huge_usage(long& thp, long& hugetlb);
+
+#endif
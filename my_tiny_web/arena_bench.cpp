@@ -0,0 +1,136 @@
+// 连接内存区微基准：模拟事件循环按fd随机访问连接对象和它的读写缓冲区，比较
+//   heap   new[]的连接数组 + 每个连接单独new的缓冲区（原来的做法）
+//   4k     arena_map的连续内存区，普通页
+//   thp    arena_map的连续内存区，透明大页
+//   hugetlb arena_map的连续内存区，hugetlbfs大页（没有预留时退回透明大页）
+// 输出每次访问的平均耗时和dTLB读缺失（perf_event_open，没有权限或虚拟机不支持时显示n/a）
+//
+// 用法: arena_bench [-c 连接数] [-n 访问次数]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "arena.h"
+#include "http_conn.h"
+
+static const size_t READ_BUF = 2048;
+static const size_t WRITE_BUF = 1024;
+
+static int open_tlb_counter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct layout {
+    char* conns;                 // 连接对象，每个sizeof(http_conn)字节
+    std::vector<char*> rbufs;    // 每个连接的读缓冲区
+    std::vector<char*> wbufs;    // 每个连接的写缓冲区
+};
+
+// 每次访问：连接开头的状态、结尾附近的原子量、读缓冲区的第一行和写缓冲区的响应头
+static unsigned long run(const layout& l, const std::vector<unsigned>& order, int fd_tlb, double& ns) {
+    const size_t size = sizeof(http_conn);
+    unsigned long sum = 0;
+    if (fd_tlb >= 0) {
+        ioctl(fd_tlb, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_tlb, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < order.size(); ++i) {
+        unsigned fd = order[i];
+        char* c = l.conns + fd * size;
+        sum += (unsigned char)c[0];
+        c[size - 8]++;
+        sum += (unsigned char)l.rbufs[fd][0];
+        l.wbufs[fd][0] = (char)sum;
+    }
+    auto end = std::chrono::steady_clock::now();
+    unsigned long misses = 0;
+    if (fd_tlb >= 0) {
+        ioctl(fd_tlb, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd_tlb, &misses, sizeof(misses)) != sizeof(misses)) misses = 0;
+    }
+    ns = std::chrono::duration<double, std::nano>(end - start).count() / order.size();
+    (void)sum;
+    return misses;
+}
+
+static void report(const char* name, const layout& l, const std::vector<unsigned>& order, int fd_tlb) {
+    double ns;
+    run(l, order, fd_tlb, ns); // 预热：让所有页都已经分配
+    unsigned long misses = run(l, order, fd_tlb, ns);
+    if (fd_tlb >= 0)
+        printf("%-8s %8.1f ns/访问  dTLB缺失 %.3f/访问\n", name, ns, (double)misses / order.size());
+    else
+        printf("%-8s %8.1f ns/访问  dTLB缺失 n/a\n", name, ns);
+}
+
+int main(int argc, char* argv[]) {
+    int conns = 65536;
+    long accesses = 20000000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-c") == 0) conns = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0) accesses = atol(argv[i + 1]);
+    }
+    std::vector<unsigned> order(accesses);
+    srand(1);
+    for (long i = 0; i < accesses; ++i) order[i] = (unsigned)rand() % conns;
+    int fd_tlb = open_tlb_counter();
+    printf("连接数 %d，sizeof(http_conn)=%zu，访问 %ld 次\n", conns, sizeof(http_conn), accesses);
+
+    // 原来的做法：连接数组和缓冲区都来自堆，缓冲区按连接建立的顺序散落在堆里
+    layout heap;
+    heap.conns = new char[sizeof(http_conn) * conns]();
+    heap.rbufs.resize(conns);
+    heap.wbufs.resize(conns);
+    std::vector<char*> spill; // 模拟其他分配穿插在缓冲区之间
+    for (int i = 0; i < conns; ++i) {
+        heap.rbufs[i] = new char[READ_BUF]();
+        heap.wbufs[i] = new char[WRITE_BUF]();
+        spill.push_back(new char[200]());
+    }
+    report("heap", heap, order, fd_tlb);
+
+    static const char* const names[] = {"4k", "thp", "hugetlb"};
+    for (int p = ARENA_SMALL; p <= ARENA_HUGETLB; ++p) {
+        ARENA_PAGES got1, got2;
+        size_t conn_bytes = sizeof(http_conn) * conns;
+        size_t slot = (READ_BUF + WRITE_BUF + 63) & ~(size_t)63;
+        layout a;
+        a.conns = (char*)arena_map(conn_bytes, (ARENA_PAGES)p, true, got1);
+        char* bufs = (char*)arena_map(slot * conns, (ARENA_PAGES)p, true, got2);
+        if (!a.conns || !bufs) {
+            printf("%-8s 映射失败\n", names[p]);
+            continue;
+        }
+        a.rbufs.resize(conns);
+        a.wbufs.resize(conns);
+        for (int i = 0; i < conns; ++i) {
+            a.rbufs[i] = bufs + i * slot;
+            a.wbufs[i] = bufs + i * slot + READ_BUF;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%s%s", names[p], got1 == p && got2 == p ? "" : "*");
+        report(name, a, order, fd_tlb);
+        long thp, hugetlb;
+        arena_huge_usage(thp, hugetlb);
+        printf("         透明大页 %ld MB，hugetlbfs大页 %ld MB\n", thp >> 20, hugetlb >> 20);
+        arena_unmap(a.conns, conn_bytes);
+        arena_unmap(bufs, slot * conns);
+    }
+    printf("（*：没有得到想要的页类型，hugetlb没有预留时退回透明大页）\n");
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include "autoindex.h"
+#include "file_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include "locker.h"
+#include "mem_budget.h"
+
+/* getdents64返回的目录项，glibc的头文件里没有这个结构 */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* 缓存的一页列表，mtime是生成时目录的修改时间 */
+struct autoindex_page
+{
+    std::shared_ptr<const std::string> body;
+    struct timespec mtime;
+    std::list<std::string>::iterator lru;
+};
+
+static locker g_lock;
+static std::unordered_map<std::string, autoindex_page> g_pages;
+static std::list<std::string> g_lru;
+static size_t g_used = 0;
+static size_t g_limit = 0;
+
+static std::atomic<long> g_hits(0);
+static std::atomic<long> g_renders(0);
+static std::atomic<long> g_streamed(0);
+
+void autoindex_init(int cache_kb)
+{
+    g_limit = cache_kb > 0 ? (size_t)cache_kb << 10 : 0;
+}
+
+bool autoindex_wants_json(const char* url, size_t len)
+{
+    const char* end = url + len;
+    const char* p = (const char*)memchr(url, '?', len);
+    if (!p)
+        return false;
+    static const size_t n = sizeof("format=json") - 1;
+    for (; end - p >= (ptrdiff_t)n; ++p)
+        if ((p[-1] == '?' || p[-1] == '&') && memcmp(p, "format=json", n) == 0 && (p + n == end || p[n] == '&'))
+            return true;
+    return false;
+}
+
+// 名字放进HTML文本和属性值时转义
+static void append_html(std::string& out, const char* s, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        switch (s[i])
+        {
+        case '&': out += "&amp;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        case '"': out += "&quot;"; break;
+        case '\'': out += "&#39;"; break;
+        default: out += s[i];
+        }
+    }
+}
+
+// 名字放进链接时做百分号编码，只保留URL中不需要编码的字符
+static void append_href(std::string& out, const char* s)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (; *s; ++s)
+    {
+        unsigned char c = *s;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-._~", c))
+            out += c;
+        else
+        {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+}
+
+static void append_json(std::string& out, const char* s, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20)
+        {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        }
+        else
+            out += c;
+    }
+}
+
+autoindex_stream::autoindex_stream(int fd, bool json, const char* url, size_t url_len)
+    : m_fd(fd), m_json(json), m_eof(false), m_first(true), m_url(url, url_len)
+{
+    // 链接是 "请求路径/名字"，请求路径不以'/'结尾时补上，不依赖浏览器对相对链接的解析
+    if (m_url.empty() || m_url[m_url.size() - 1] != '/')
+        m_url += '/';
+    if (m_json)
+    {
+        m_pending = "[";
+        return;
+    }
+    m_pending = "<html><head><meta charset=\"utf-8\"><title>Index of ";
+    append_html(m_pending, m_url.data(), m_url.size());
+    m_pending += "</title></head><body><h1>Index of ";
+    append_html(m_pending, m_url.data(), m_url.size());
+    m_pending += "</h1><hr><pre>\n";
+    if (m_url != "/")
+    {
+        // 上一级目录：去掉最后一段
+        size_t parent = m_url.rfind('/', m_url.size() - 2);
+        m_pending += "<a href=\"";
+        append_html(m_pending, m_url.data(), parent + 1);
+        m_pending += "\">../</a>\n";
+    }
+}
+
+autoindex_stream::~autoindex_stream()
+{
+    close(m_fd);
+}
+
+void autoindex_stream::render(const char* name, unsigned char type)
+{
+    size_t n = strlen(name);
+    const char* kind = type == DT_DIR ? "directory" : type == DT_REG || type == DT_LNK ? "file" : "other";
+    if (m_json)
+    {
+        m_pending += m_first ? "\n{\"name\":\"" : ",\n{\"name\":\"";
+        append_json(m_pending, name, n);
+        m_pending += "\",\"type\":\"";
+        m_pending += kind;
+        m_pending += "\"}";
+    }
+    else
+    {
+        const char* slash = type == DT_DIR ? "/" : "";
+        m_pending += "<a href=\"";
+        append_html(m_pending, m_url.data(), m_url.size());
+        append_href(m_pending, name);
+        m_pending += slash;
+        m_pending += "\">";
+        append_html(m_pending, name, n);
+        m_pending += slash;
+        m_pending += "</a>\n";
+    }
+    m_first = false;
+}
+
+void autoindex_stream::fill(size_t want)
+{
+    char buf[32 * 1024];
+    while (!m_eof && m_pending.size() <= want)
+    {
+        long n = syscall(SYS_getdents64, m_fd, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            // 读完，或者读目录出错（已经发出的部分无法撤回，按列表结束处理）
+            m_eof = true;
+            m_pending += m_json ? "\n]\n" : "</pre><hr></body></html>\n";
+            break;
+        }
+        for (long off = 0; off < n;)
+        {
+            const linux_dirent64* d = (const linux_dirent64*)(buf + off);
+            off += d->d_reclen;
+            // 不列出 "."、".." 和隐藏文件
+            if (d->d_name[0] == '.')
+                continue;
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                // 有的文件系统不填d_type，只对这些项补一次stat
+                struct stat st;
+                if (fstatat(m_fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            render(d->d_name, type);
+        }
+    }
+}
+
+bool autoindex_stream::next(std::string& chunk)
+{
+    fill(CHUNK);
+    if (m_eof && m_pending.size() <= CHUNK)
+    {
+        chunk.swap(m_pending);
+        m_pending.clear();
+        return false;
+    }
+    chunk.assign(m_pending, 0, CHUNK);
+    m_pending.erase(0, CHUNK);
+    return true;
+}
+
+// 调用时持有g_lock
+static void drop_page(std::unordered_map<std::string, autoindex_page>::iterator it)
+{
+    size_t size = it->second.body->size() + it->first.size();
+    g_used -= size;
+    mem_charge(MEM_CACHE, -(long)size);
+    g_lru.erase(it->second.lru);
+    g_pages.erase(it);
+}
+
+int autoindex_open(const file_entry* dir, const char* url, size_t url_len, bool json,
+                   std::shared_ptr<const std::string>& page, autoindex_stream*& stream)
+{
+    page.reset();
+    stream = nullptr;
+    // 新的目录流有自己的读取位置，缓存条目的fd可能同时被别的请求使用
+    int fd = openat(dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    char id[64];
+    int n = snprintf(id, sizeof(id), "%lu:%lu:%c:", (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+                     json ? 'j' : 'h');
+    std::string key(id, n);
+    key.append(url, url_len);
+
+    g_lock.lock();
+    std::unordered_map<std::string, autoindex_page>::iterator it = g_pages.find(key);
+    if (it != g_pages.end())
+    {
+        if (it->second.mtime.tv_sec == st.st_mtim.tv_sec && it->second.mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            page = it->second.body;
+            g_lru.splice(g_lru.begin(), g_lru, it->second.lru);
+            g_lock.unlock();
+            close(fd);
+            g_hits.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+        drop_page(it);
+    }
+    g_lock.unlock();
+
+    autoindex_stream* s = new autoindex_stream(fd, json, url, url_len);
+    s->fill(autoindex_stream::PAGE_MAX);
+    if (!s->done())
+    {
+        // 大目录：已经渲染的部分作为第一块，剩下的边读边发
+        stream = s;
+        g_streamed.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+    // 整页可能超过一块（CHUNK < 页面 <= PAGE_MAX），把所有块都接上
+    std::shared_ptr<std::string> body = std::make_shared<std::string>();
+    std::string part;
+    bool more;
+    do
+    {
+        more = s->next(part);
+        body->append(part);
+    } while (more);
+    delete s;
+    page = body;
+    g_renders.fetch_add(1, std::memory_order_relaxed);
+
+    size_t size = body->size() + key.size();
+    if (size > g_limit)
+        return 0;
+    g_lock.lock();
+    it = g_pages.find(key);
+    if (it != g_pages.end())
+        drop_page(it);
+    while (g_used + size > g_limit && !g_lru.empty())
+        drop_page(g_pages.find(g_lru.back()));
+    g_lru.push_front(key);
+    autoindex_page& p = g_pages[key];
+    p.body = body;
+    p.mtime = st.st_mtim;
+    p.lru = g_lru.begin();
+    g_used += size;
+    mem_charge(MEM_CACHE, (long)size);
+    g_lock.unlock();
+    return 0;
+}
+
+void autoindex_shrink()
+{
+    g_lock.lock();
+    size_t target = g_used / 2;
+    while (g_used > target && !g_lru.empty())
+        drop_page(g_pages.find(g_lru.back()));
+    g_lock.unlock();
+}
+
+void autoindex_stats(long& hits, long& renders, long& streamed)
+{
+    hits = g_hits.load();
+    renders = g_renders.load();
+    streamed = g_streamed.load();
+}
@@ -0,0 +1,67 @@
+#ifndef AUTOINDEX_H
+#define AUTOINDEX_H
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+struct file_entry;
+
+/*
+    目录列表（autoindex）：目录下没有index.html时列出其中的文件，输出HTML或者JSON（查询参数带 format=json）。
+    列表用getdents64一次读出一批目录项直接渲染，不对每一项调用stat（类型来自d_type），按目录中的顺序输出。
+    渲染结果不超过PAGE_MAX的目录整页缓存，按目录的(dev, ino)、请求路径和格式查找，
+    目录的mtime变化（增删文件）后重新生成；更大的目录不缓存，边读边分块输出，内存中只保留一块
+*/
+
+/* 分块输出的大目录的列表，只被持有它的连接访问 */
+class autoindex_stream
+{
+public:
+    static const size_t CHUNK = 64 * 1024;
+    /* 整页缓存的目录列表的上限，超过时分块输出 */
+    static const size_t PAGE_MAX = 256 * 1024;
+
+    autoindex_stream(int fd, bool json, const char* url, size_t url_len);
+    ~autoindex_stream();
+
+    /// @brief 取下一块输出，最后一块不为空
+    /// @return 后面还有数据时返回true
+    bool next(std::string& chunk);
+    /* 继续读目录、渲染，直到缓冲的输出超过want字节或者读完 */
+    void fill(size_t want);
+    bool done() const { return m_eof; }
+
+private:
+    void render(const char* name, unsigned char type);
+
+    int m_fd;
+    bool m_json;
+    bool m_eof;
+    bool m_first;
+    std::string m_url;
+    std::string m_pending;
+};
+
+/// @brief 启动时调用，cache_kb为整页缓存占用的内存上限
+void autoindex_init(int cache_kb);
+
+/// @brief 请求的查询参数是否要求JSON输出，url是长度为len的请求目标
+bool autoindex_wants_json(const char* url, size_t len);
+
+/// @brief 生成目录的列表
+/// @param dir 目录在文件缓存中的条目，只借用它的fd打开新的目录流
+/// @param url 请求路径（不含查询参数），链接都以它为前缀
+/// @param page 小目录的整页输出，可能来自缓存
+/// @param stream 大目录的分块输出，调用方负责delete；和page只有一个非空
+/// @return 0，或者打开、读取目录失败时的errno
+int autoindex_open(const file_entry* dir, const char* url, size_t url_len, bool json,
+                   std::shared_ptr<const std::string>& page, autoindex_stream*& stream);
+
+/// @brief 内存紧张时调用：淘汰最久没用过的整页缓存，直到占用减半
+void autoindex_shrink();
+
+/// @brief 整页缓存命中、生成整页、分块输出的次数
+void autoindex_stats(long& hits, long& renders, long& streamed);
+
+#endif
@@ -0,0 +1,315 @@
+#include "cache.h"
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <atomic>
+#include <unordered_map>
+#include "locker.h"
+#include "mem_budget.h"
+
+/* 一个键下的所有变体，以及正在去上游取这个键的请求和排队等它的请求 */
+struct cache_bucket
+{
+    std::vector<std::shared_ptr<cache_entry>> variants;
+    bool fetching = false;
+    std::vector<int> waiters;
+};
+
+static locker g_lock;
+static std::unordered_map<std::string, cache_bucket> g_buckets;
+static std::list<cache_entry*> g_lru;
+static size_t g_used = 0;
+static size_t g_limit = 0;
+
+static std::atomic<long> g_hits(0);
+static std::atomic<long> g_stale(0);
+static std::atomic<long> g_fetches(0);
+static std::atomic<long> g_coalesced(0);
+static std::atomic<long> g_stores(0);
+static std::atomic<long> g_evictions(0);
+
+int cache_entry::fill_iov(struct iovec* iov, const std::string& tail, bool head_only) const
+{
+    iov[0].iov_base = (void*)head.data();
+    iov[0].iov_len = head.size();
+    iov[1].iov_base = (void*)tail.data();
+    iov[1].iov_len = tail.size();
+    if (head_only || body.empty())
+        return 2;
+    iov[2].iov_base = (void*)body.data();
+    iov[2].iov_len = body.size();
+    return 3;
+}
+
+void cache_init(int size_mb)
+{
+    g_limit = (size_t)size_mb << 20;
+}
+
+bool cache_enabled()
+{
+    return g_limit > 0;
+}
+
+// 在请求头里找一个头部的值，没有则返回空串
+static std::string header_value(const std::string& head, const std::string& name)
+{
+    size_t pos = head.find("\r\n");
+    while (pos != std::string::npos && pos + 2 < head.size())
+    {
+        size_t line = pos + 2;
+        size_t end = head.find("\r\n", line);
+        if (end == std::string::npos)
+            end = head.size();
+        if (end - line > name.size() && head[line + name.size()] == ':' &&
+            strncasecmp(head.c_str() + line, name.c_str(), name.size()) == 0)
+        {
+            size_t v = head.find_first_not_of(" \t", line + name.size() + 1);
+            return v == std::string::npos || v >= end ? std::string() : head.substr(v, end - v);
+        }
+        pos = end;
+    }
+    return std::string();
+}
+
+static bool vary_matches(const cache_entry& e, const std::string& request_head)
+{
+    for (size_t i = 0; i < e.vary.size(); ++i)
+        if (header_value(request_head, e.vary[i].first) != e.vary[i].second)
+            return false;
+    return true;
+}
+
+// 以下函数都在持有g_lock时调用
+static void remove_variant(cache_bucket& b, size_t i)
+{
+    cache_entry* e = b.variants[i].get();
+    g_lru.erase(e->lru);
+    g_used -= e->size();
+    mem_charge(MEM_CACHE, -(long)e->size());
+    b.variants.erase(b.variants.begin() + i);
+}
+
+static void erase_if_unused(const std::string& key)
+{
+    std::unordered_map<std::string, cache_bucket>::iterator it = g_buckets.find(key);
+    if (it != g_buckets.end() && it->second.variants.empty() && !it->second.fetching)
+        g_buckets.erase(it);
+}
+
+static void wake_waiters(cache_bucket& b)
+{
+    uint64_t one = 1;
+    for (size_t i = 0; i < b.waiters.size(); ++i)
+        ::write(b.waiters[i], &one, sizeof(one));
+    b.waiters.clear();
+}
+
+// 从最久没用过的开始淘汰，直到占用不超过limit；keep（刚加入的条目）在表头，不会淘汰到它
+static void evict_to(size_t limit, const cache_entry* keep)
+{
+    while (g_used > limit && !g_lru.empty() && g_lru.back() != keep)
+    {
+        std::string key = g_lru.back()->key;
+        cache_bucket& victim = g_buckets[key];
+        for (size_t i = 0; i < victim.variants.size(); ++i)
+        {
+            if (victim.variants[i].get() == g_lru.back())
+            {
+                remove_variant(victim, i);
+                break;
+            }
+        }
+        g_evictions.fetch_add(1, std::memory_order_relaxed);
+        // keep所在的桶里至少还有keep，不会被删掉
+        erase_if_unused(key);
+    }
+}
+
+static void insert_entry(cache_bucket& b, std::shared_ptr<cache_entry> e)
+{
+    g_lru.push_front(e.get());
+    e->lru = g_lru.begin();
+    g_used += e->size();
+    mem_charge(MEM_CACHE, (long)e->size());
+    b.variants.push_back(e);
+    evict_to(g_limit, e.get());
+}
+
+CACHE_LOOKUP cache_lookup(const std::string& key, const std::string& request_head, bool may_fetch, int waiter_fd,
+                          std::shared_ptr<const cache_entry>& entry)
+{
+    if (!g_limit)
+        return CACHE_PASS;
+    time_t now = time(nullptr);
+    g_lock.lock();
+    cache_bucket& b = g_buckets[key];
+    std::shared_ptr<cache_entry> found;
+    for (size_t i = 0; i < b.variants.size();)
+    {
+        cache_entry* e = b.variants[i].get();
+        if (now >= e->stale_until)
+        {
+            remove_variant(b, i); // 连旧响应也不能用了
+            continue;
+        }
+        if (!found && (e->pass || vary_matches(*e, request_head)))
+            found = b.variants[i];
+        ++i;
+    }
+    CACHE_LOOKUP ret;
+    if (found && found->pass)
+    {
+        ret = CACHE_PASS;
+    }
+    else if (found)
+    {
+        g_lru.splice(g_lru.begin(), g_lru, found->lru);
+        if (now < found->expires)
+        {
+            ret = CACHE_HIT;
+        }
+        else if (may_fetch && !b.fetching)
+        {
+            // 过期了，这个请求去上游更新，更新期间的其他请求拿旧响应
+            b.fetching = true;
+            ret = CACHE_FETCH;
+        }
+        else
+        {
+            ret = CACHE_STALE;
+        }
+    }
+    else if (!may_fetch)
+    {
+        ret = CACHE_PASS;
+    }
+    else if (!b.fetching)
+    {
+        b.fetching = true;
+        ret = CACHE_FETCH;
+    }
+    else
+    {
+        // waiter_fd为-1时只报告需要排队，调用方准备好eventfd后再查一次
+        if (waiter_fd >= 0)
+            b.waiters.push_back(waiter_fd);
+        ret = CACHE_WAIT;
+    }
+    if (ret == CACHE_HIT || ret == CACHE_STALE)
+        entry = found;
+    else if (ret == CACHE_PASS)
+        erase_if_unused(key);
+    g_lock.unlock();
+
+    if (ret == CACHE_HIT)
+        g_hits.fetch_add(1, std::memory_order_relaxed);
+    else if (ret == CACHE_STALE)
+        g_stale.fetch_add(1, std::memory_order_relaxed);
+    else if (ret == CACHE_FETCH)
+        g_fetches.fetch_add(1, std::memory_order_relaxed);
+    else if (ret == CACHE_WAIT && waiter_fd >= 0)
+        g_coalesced.fetch_add(1, std::memory_order_relaxed);
+    return ret;
+}
+
+void cache_store(const std::string& key, const std::string& request_head, const std::string& vary,
+                 std::string& head, std::string& body, int ttl, int swr)
+{
+    std::shared_ptr<cache_entry> e = std::make_shared<cache_entry>();
+    e->key = key;
+    e->head.swap(head);
+    e->body.swap(body);
+    e->pass = false;
+    e->expires = time(nullptr) + ttl;
+    e->stale_until = e->expires + swr;
+    size_t pos = 0;
+    while (pos < vary.size())
+    {
+        size_t comma = vary.find(',', pos);
+        if (comma == std::string::npos)
+            comma = vary.size();
+        size_t b = vary.find_first_not_of(" \t", pos);
+        size_t end = vary.find_last_not_of(" \t", comma - 1);
+        if (b < comma && end != std::string::npos && end >= b)
+        {
+            std::string name = vary.substr(b, end - b + 1);
+            e->vary.emplace_back(name, header_value(request_head, name));
+        }
+        pos = comma + 1;
+    }
+
+    g_lock.lock();
+    cache_bucket& b = g_buckets[key];
+    b.fetching = false;
+    // 同样的变体（以及hit-for-pass条目）被新响应替换
+    for (size_t i = 0; i < b.variants.size();)
+    {
+        if (b.variants[i]->pass || vary_matches(*b.variants[i], request_head))
+            remove_variant(b, i);
+        else
+            ++i;
+    }
+    insert_entry(b, e);
+    wake_waiters(b);
+    g_lock.unlock();
+    g_stores.fetch_add(1, std::memory_order_relaxed);
+}
+
+void cache_abandon(const std::string& key, int pass_ttl)
+{
+    g_lock.lock();
+    cache_bucket& b = g_buckets[key];
+    b.fetching = false;
+    if (pass_ttl > 0)
+    {
+        // 上游明确表示不能缓存，之前的变体也一并作废
+        while (!b.variants.empty())
+            remove_variant(b, b.variants.size() - 1);
+        std::shared_ptr<cache_entry> e = std::make_shared<cache_entry>();
+        e->key = key;
+        e->pass = true;
+        e->expires = e->stale_until = time(nullptr) + pass_ttl;
+        insert_entry(b, e);
+    }
+    wake_waiters(b);
+    erase_if_unused(key);
+    g_lock.unlock();
+}
+
+void cache_cancel_wait(const std::string& key, int waiter_fd)
+{
+    // 取完的请求在持有g_lock时写eventfd，这里把它去掉之后调用方才能关闭这个fd
+    g_lock.lock();
+    std::unordered_map<std::string, cache_bucket>::iterator it = g_buckets.find(key);
+    if (it != g_buckets.end())
+    {
+        std::vector<int>& w = it->second.waiters;
+        for (size_t i = 0; i < w.size(); ++i)
+        {
+            if (w[i] == waiter_fd)
+            {
+                w.erase(w.begin() + i);
+                break;
+            }
+        }
+    }
+    g_lock.unlock();
+}
+
+void cache_shrink()
+{
+    g_lock.lock();
+    evict_to(g_used / 2, nullptr);
+    g_lock.unlock();
+}
+
+void cache_stats(long& hits, long& stale, long& fetches, long& coalesced, long& stores, long& evictions)
+{
+    hits = g_hits.load();
+    stale = g_stale.load();
+    fetches = g_fetches.load();
+    coalesced = g_coalesced.load();
+    stores = g_stores.load();
+    evictions = g_evictions.load();
+}
@@ -0,0 +1,78 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <time.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <list>
+
+/*
+    反向代理的微缓存：把上游的GET响应在内存里保存很短的时间（通常一两秒），突发的相同请求不再打到上游。
+    键为 主机名 + URL，响应带Vary时同一个键下按这些请求头的值保存多个变体。
+    同一个键同时只有一个请求去上游取（single-flight），其余的请求登记一个eventfd等它取完，
+    过期后在stale-while-revalidate窗口内，去上游更新的那个请求之外的请求直接拿到旧的响应
+*/
+
+/* 一个缓存的响应，响应头（不含Connection和结尾的空行）和响应体可以直接作为iovec发送 */
+struct cache_entry
+{
+    std::string key;
+    /* Vary列出的请求头和写入缓存的那个请求里它们的值 */
+    std::vector<std::pair<std::string, std::string>> vary;
+    std::string head;
+    std::string body;
+    /* 过期时间，以及过期后还可以当作旧响应使用到的时间 */
+    time_t expires;
+    time_t stale_until;
+    /* 上游的响应不能缓存：在expires之前同一个键的请求不再排队，直接转发（hit-for-pass） */
+    bool pass;
+    /* 在LRU链表中的位置，表头是最近使用的 */
+    std::list<cache_entry*>::iterator lru;
+
+    size_t size() const { return key.size() + head.size() + body.size(); }
+    /// @brief 填充发送用的iovec：响应头、调用方给出的Connection等结尾几行、响应体（head_only时没有）
+    /// @return iovec的数量
+    int fill_iov(struct iovec* iov, const std::string& tail, bool head_only) const;
+};
+
+enum CACHE_LOOKUP
+{
+    CACHE_HIT = 0,   // 新鲜的响应
+    CACHE_STALE,     // 过期但在stale-while-revalidate窗口内，已经有别的请求在更新
+    CACHE_FETCH,     // 没有可用的响应，调用方负责去上游取，取完调用cache_store或cache_abandon
+    CACHE_WAIT,      // 别的请求正在取，waiter_fd已经登记，取完时会被写入
+    CACHE_PASS       // 不使用缓存，直接转发
+};
+
+/// @brief 启动时调用，size_mb为0时缓存关闭，之后的查找都返回CACHE_PASS
+void cache_init(int size_mb);
+bool cache_enabled();
+
+/// @brief 查找缓存
+/// @param request_head 转发给上游的请求头，用来取Vary列出的请求头的值
+/// @param may_fetch 为false时（HEAD请求、排队被唤醒后）不会返回CACHE_FETCH和CACHE_WAIT
+/// @param waiter_fd 返回CACHE_WAIT时登记的eventfd
+/// @param entry 返回CACHE_HIT/CACHE_STALE时的响应，持有期间不会被释放
+CACHE_LOOKUP cache_lookup(const std::string& key, const std::string& request_head, bool may_fetch, int waiter_fd,
+                          std::shared_ptr<const cache_entry>& entry);
+
+/// @brief 取到了可以缓存的响应
+/// @param vary 响应的Vary头的值，为空表示没有
+void cache_store(const std::string& key, const std::string& request_head, const std::string& vary,
+                 std::string& head, std::string& body, int ttl, int swr);
+
+/// @brief 没有取到可以缓存的响应，唤醒排队的请求；pass_ttl大于0时记一个hit-for-pass条目
+void cache_abandon(const std::string& key, int pass_ttl);
+
+/// @brief 排队的请求在被唤醒之前放弃（客户端断开），把它的eventfd从队列中去掉
+void cache_cancel_wait(const std::string& key, int waiter_fd);
+
+/// @brief 内存紧张时调用：从最久没用过的开始淘汰，直到占用减半
+void cache_shrink();
+
+/* 退出时打印的统计 */
+void cache_stats(long& hits, long& stale, long& fetches, long& coalesced, long& stores, long& evictions);
+
+#endif
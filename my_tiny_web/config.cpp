@@ -0,0 +1,346 @@
+#include "config.h"
+#include "affinity.h"
+#include "proxy.h"
+#include "vhost.h"
+#include "router.h"
+#include "sock_tune.h"
+#include "rcu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#define INT_ITEM(name, reloadable) {#name, &server_config::name, nullptr, reloadable}
+#define STR_ITEM(name, reloadable) {#name, nullptr, &server_config::name, reloadable}
+
+static const config_item g_items[] = {
+    STR_ITEM(ip, false),
+    INT_ITEM(port, false),
+    INT_ITEM(backlog, false),
+    STR_ITEM(doc_root, true),
+    STR_ITEM(vhosts, false),
+    STR_ITEM(routes, false),
+    INT_ITEM(file_cache_entries, false),
+    INT_ITEM(file_cache_valid, true),
+    INT_ITEM(autoindex, true),
+    INT_ITEM(autoindex_cache_kb, false),
+    INT_ITEM(limit_conn_per_ip, true),
+    INT_ITEM(limit_conn_per_net, true),
+    INT_ITEM(limit_rate_per_ip, true),
+    INT_ITEM(limit_rate_per_net, true),
+    INT_ITEM(limit_burst, true),
+    INT_ITEM(limit_table_slots, false),
+    INT_ITEM(memory_budget_mb, true),
+    INT_ITEM(event_loops, false),
+    INT_ITEM(max_event_number, false),
+    INT_ITEM(max_fd, false),
+    INT_ITEM(pool_min, true),
+    INT_ITEM(pool_max, true),
+    INT_ITEM(queue_limit, true),
+    INT_ITEM(sched_weight_admin, true),
+    INT_ITEM(sched_weight_cheap, true),
+    INT_ITEM(sched_weight_bulk, true),
+    INT_ITEM(sched_bulk_kb, true),
+    INT_ITEM(disk_threads, false),
+    INT_ITEM(zerocopy_kb, true),
+    INT_ITEM(read_buffer_size, false),
+    INT_ITEM(write_buffer_size, false),
+    INT_ITEM(idle_timeout, true),
+    INT_ITEM(drain_timeout, true),
+    STR_ITEM(loop_cpus, false),
+    STR_ITEM(worker_cpus, false),
+    INT_ITEM(numa_local_buffers, false),
+    INT_ITEM(conn_arena, false),
+    INT_ITEM(arena_prefault, false),
+    INT_ITEM(low_latency, true),
+    INT_ITEM(spin_us, true),
+    INT_ITEM(busy_poll_us, false),
+    STR_ITEM(socket_profile, false),
+    INT_ITEM(tcp_nodelay, false),
+    INT_ITEM(sndbuf_kb, false),
+    INT_ITEM(rcvbuf_kb, false),
+    INT_ITEM(notsent_lowat_kb, false),
+    INT_ITEM(keepalive_idle, false),
+    INT_ITEM(keepalive_intvl, false),
+    INT_ITEM(keepalive_cnt, false),
+    INT_ITEM(tcp_fastopen, false),
+    INT_ITEM(reuseport_steer, false),
+    INT_ITEM(http2, true),
+    INT_ITEM(http2_max_streams, true),
+    INT_ITEM(tls_port, false),
+    STR_ITEM(tls_cert, false),
+    STR_ITEM(tls_key, false),
+    INT_ITEM(ktls, false),
+    INT_ITEM(tls_tickets, false),
+    STR_ITEM(proxy_routes, false),
+    INT_ITEM(proxy_keepalive, true),
+    INT_ITEM(proxy_keepalive_timeout, true),
+    INT_ITEM(proxy_health_interval, true),
+    STR_ITEM(proxy_health_uri, true),
+    INT_ITEM(proxy_max_fails, true),
+    INT_ITEM(proxy_fail_timeout, true),
+    INT_ITEM(microcache_mb, false),
+    INT_ITEM(microcache_ttl, true),
+    INT_ITEM(microcache_swr, true),
+    INT_ITEM(microcache_max_entry_kb, true),
+    {nullptr, nullptr, nullptr, false}};
+
+const config_item* config_items()
+{
+    return g_items;
+}
+
+// 去掉字符串首尾的空白
+static std::string trim(const std::string& s)
+{
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos)
+        return "";
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+bool config_set(server_config& cfg, const char* key, const char* value, std::string& err)
+{
+    for (const config_item* it = g_items; it->key; ++it)
+    {
+        if (strcmp(it->key, key) != 0)
+            continue;
+        if (it->str_field)
+        {
+            cfg.*(it->str_field) = value;
+            return true;
+        }
+        char* end = nullptr;
+        errno = 0;
+        long v = strtol(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || v < INT_MIN || v > INT_MAX)
+        {
+            err = std::string("invalid integer for ") + key + ": '" + value + "'";
+            return false;
+        }
+        cfg.*(it->int_field) = (int)v;
+        return true;
+    }
+    err = std::string("unknown config key: ") + key;
+    return false;
+}
+
+bool config_load_file(const char* path, server_config& cfg, std::string& err)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+    {
+        err = std::string("cannot open ") + path + ": " + strerror(errno);
+        return false;
+    }
+    char line[1024];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp))
+    {
+        ++lineno;
+        std::string text = trim(line);
+        if (text.empty() || text[0] == '#')
+            continue;
+        size_t eq = text.find('=');
+        if (eq == std::string::npos)
+        {
+            err = std::string(path) + ":" + std::to_string(lineno) + ": expected key = value";
+            ok = false;
+            break;
+        }
+        std::string key = trim(text.substr(0, eq));
+        std::string value = trim(text.substr(eq + 1));
+        if (!config_set(cfg, key.c_str(), value.c_str(), err))
+        {
+            err = std::string(path) + ":" + std::to_string(lineno) + ": " + err;
+            ok = false;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+bool config_validate(const server_config& cfg, std::string& err)
+{
+    if (cfg.port <= 0 || cfg.port > 65535)
+        err = "port must be in 1..65535";
+    else if (cfg.backlog <= 0)
+        err = "backlog must be positive";
+    else if (cfg.doc_root.empty())
+        err = "doc_root must not be empty";
+    else if (cfg.event_loops < 1)
+        err = "event_loops must be at least 1";
+    else if (cfg.max_event_number < 1)
+        err = "max_event_number must be positive";
+    else if (cfg.max_fd < 16)
+        err = "max_fd must be at least 16";
+    else if (cfg.pool_min < 1 || cfg.pool_max < cfg.pool_min)
+        err = "need 1 <= pool_min <= pool_max";
+    else if (cfg.queue_limit < 0)
+        err = "queue_limit must not be negative";
+    else if (cfg.sched_weight_admin < 1 || cfg.sched_weight_cheap < 1 || cfg.sched_weight_bulk < 1)
+        err = "sched_weight_* must be at least 1";
+    else if (cfg.sched_bulk_kb < 0)
+        err = "sched_bulk_kb must not be negative";
+    else if (cfg.conn_arena < 0 || cfg.conn_arena > 2)
+        err = "conn_arena must be 0, 1 or 2";
+    else if (cfg.disk_threads < 0 || cfg.disk_threads > 64)
+        err = "disk_threads must be in 0..64";
+    else if (cfg.zerocopy_kb < 0)
+        err = "zerocopy_kb must not be negative";
+    else if (cfg.read_buffer_size < 256 || cfg.write_buffer_size < 256)
+        err = "buffer sizes must be at least 256 bytes";
+    else if (cfg.idle_timeout < 0)
+        err = "idle_timeout must not be negative";
+    else if (cfg.drain_timeout < 0)
+        err = "drain_timeout must not be negative";
+    else if (cfg.spin_us < 0 || cfg.spin_us > 1000000 || cfg.busy_poll_us < 0)
+        err = "spin_us must be in 0..1000000 and busy_poll_us must not be negative";
+    else if (cfg.tcp_fastopen < 0)
+        err = "tcp_fastopen must not be negative";
+    else if (cfg.http2_max_streams < 1)
+        err = "http2_max_streams must be positive";
+    else if (cfg.tls_port < 0 || cfg.tls_port > 65535 || cfg.tls_port == cfg.port)
+        err = "tls_port must be in 0..65535 and differ from port";
+    else if (cfg.tls_port && (cfg.tls_cert.empty() || cfg.tls_key.empty()))
+        err = "tls_port requires tls_cert and tls_key";
+    else if (cfg.proxy_keepalive < 0 || cfg.proxy_keepalive_timeout < 1 || cfg.proxy_health_interval < 0 ||
+             cfg.proxy_max_fails < 1 || cfg.proxy_fail_timeout < 0)
+        err = "need proxy_keepalive >= 0, proxy_keepalive_timeout >= 1, proxy_health_interval >= 0, "
+              "proxy_max_fails >= 1, proxy_fail_timeout >= 0";
+    else if (cfg.microcache_mb < 0 || cfg.microcache_ttl < 0 || cfg.microcache_swr < 0 ||
+             cfg.microcache_max_entry_kb < 1)
+        err = "microcache sizes and times must not be negative";
+    else if (cfg.file_cache_entries < 0 || cfg.file_cache_valid < 0 || cfg.autoindex_cache_kb < 0)
+        err = "file_cache_entries, file_cache_valid and autoindex_cache_kb must not be negative";
+    else if (cfg.limit_conn_per_ip < 0 || cfg.limit_conn_per_net < 0 || cfg.limit_rate_per_ip < 0 ||
+             cfg.limit_rate_per_net < 0 || cfg.limit_burst < 0 || cfg.limit_table_slots < 1 ||
+             cfg.limit_table_slots > (1 << 24))
+        err = "limits must not be negative and limit_table_slots must be in 1..16777216";
+    else if ((long)cfg.limit_rate_per_ip + cfg.limit_burst > 4000000 ||
+             (long)cfg.limit_rate_per_net + cfg.limit_burst > 4000000)
+        err = "limit_rate_per_ip/limit_rate_per_net plus limit_burst must not exceed 4000000";
+    else if (cfg.memory_budget_mb < 0)
+        err = "memory_budget_mb must not be negative";
+    else
+    {
+        std::vector<int> cpus;
+        std::vector<std::pair<std::string, std::vector<sockaddr_in>>> routes;
+        std::vector<vhost_spec> vhosts;
+        std::vector<std::pair<std::string, std::string>> url_routes;
+        sock_profile profile;
+        if (!parse_cpu_list(cfg.loop_cpus, cpus, err))
+            err = "loop_cpus: " + err;
+        else if (!parse_cpu_list(cfg.worker_cpus, cpus, err))
+            err = "worker_cpus: " + err;
+        else if (!proxy_parse_routes(cfg.proxy_routes, routes, err))
+            err = "proxy_routes: " + err;
+        else if (!vhost_parse(cfg.vhosts, vhosts, err))
+            err = "vhosts: " + err;
+        else if (!router_parse(cfg.routes, url_routes, err))
+            err = "routes: " + err;
+        else if (!sock_profile_resolve(cfg, profile, err))
+            err = "socket profile: " + err;
+        else
+            return true;
+    }
+    return false;
+}
+
+bool config_parse_args(int argc, char* argv[], config_args& args, std::string& err)
+{
+    std::vector<const char*> positional;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strcmp(arg, "-c") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                err = "-c requires a file name";
+                return false;
+            }
+            args.config_path = argv[++i];
+        }
+        else if (strncmp(arg, "--", 2) == 0)
+        {
+            const char* eq = strchr(arg + 2, '=');
+            if (!eq)
+            {
+                err = std::string("expected --key=value, got ") + arg;
+                return false;
+            }
+            args.overrides.emplace_back(std::string(arg + 2, eq), std::string(eq + 1));
+        }
+        else
+        {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() == 2)
+    {
+        args.overrides.emplace_back("ip", positional[0]);
+        args.overrides.emplace_back("port", positional[1]);
+    }
+    else if (!positional.empty())
+    {
+        err = "expected either no positional arguments or: ip_address port_number";
+        return false;
+    }
+    return true;
+}
+
+bool config_build(const config_args& args, server_config& cfg, std::string& err)
+{
+    server_config c;
+    if (!args.config_path.empty() && !config_load_file(args.config_path.c_str(), c, err))
+        return false;
+    for (const auto& kv : args.overrides)
+    {
+        if (!config_set(c, kv.first.c_str(), kv.second.c_str(), err))
+            return false;
+    }
+    if (!config_validate(c, err))
+        return false;
+    cfg = c;
+    return true;
+}
+
+server_config config_merge_reloadable(const server_config& old_cfg, const server_config& new_cfg)
+{
+    server_config merged = old_cfg;
+    for (const config_item* it = g_items; it->key; ++it)
+    {
+        if (!it->reloadable)
+            continue;
+        if (it->str_field)
+            merged.*(it->str_field) = new_cfg.*(it->str_field);
+        else
+            merged.*(it->int_field) = new_cfg.*(it->int_field);
+    }
+    return merged;
+}
+
+// 快照里放的是shared_ptr：config_read在读区内直接用，config_current复制一份引用，调用方可以一直持有
+static rcu_snapshot<std::shared_ptr<const server_config>> g_current(
+    new std::shared_ptr<const server_config>(std::make_shared<server_config>()));
+
+std::shared_ptr<const server_config> config_current()
+{
+    rcu_read_guard guard;
+    return *g_current.read();
+}
+
+const server_config* config_read()
+{
+    return g_current.read()->get();
+}
+
+void config_publish(std::shared_ptr<const server_config> cfg)
+{
+    // 换下的旧快照在没有读者之后释放，它持有的引用随之交还，仍被config_current的调用方持有的配置继续有效
+    g_current.publish(new std::shared_ptr<const server_config>(std::move(cfg)));
+}
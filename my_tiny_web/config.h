@@ -0,0 +1,212 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+/*
+    服务器运行时配置
+    配置文件格式为每行一个 key = value，# 开头的行为注释；
+    命令行可以用 --key=value 覆盖任意一项，覆盖项在SIGHUP重载时会重新应用到新读入的文件上
+*/
+struct server_config
+{
+    /* 监听地址和端口 */
+    std::string ip = "0.0.0.0";
+    int port = 8080;
+    /* listen的监听队列长度 */
+    int backlog = 5;
+    /* 网站根目录 */
+    std::string doc_root = "output/www";
+    /* 虚拟主机，格式为 "名字,名字=根目录 [max_requests=N] [cache=0|1];..."，Host不匹配任何名字时使用doc_root；为空则不开启 */
+    std::string vhosts;
+    /* URL路由，格式为 "模式=static:目录;模式=handler:名字"，模式支持 :参数 段和结尾的 '*'；为空时只有反向代理的前缀参与路由 */
+    std::string routes;
+    /* 打开文件缓存的条目数，0表示不缓存（路径解析依然限制在根目录之内） */
+    int file_cache_entries = 1024;
+    /* 缓存的文件在多少秒内不重新检查路径 */
+    int file_cache_valid = 5;
+    /* 目录下没有index.html时列出目录内容（HTML，或者查询参数带format=json时为JSON） */
+    int autoindex = 0;
+    /* 缓存整页目录列表占用的内存上限（KB） */
+    int autoindex_cache_kb = 4096;
+
+    /* 每个客户端IP、每个/24网段同时保持的连接数上限，0表示不限制 */
+    int limit_conn_per_ip = 0;
+    int limit_conn_per_net = 0;
+    /* 每个客户端IP、每个/24网段每秒的请求数上限（令牌桶），0表示不限制 */
+    int limit_rate_per_ip = 0;
+    int limit_rate_per_net = 0;
+    /* 令牌桶在每秒速率之外允许的突发请求数 */
+    int limit_burst = 0;
+    /* 限流哈希表的槽数（每个活跃的IP和/24各占一个），表满时新地址不受限制 */
+    int limit_table_slots = 65536;
+
+    /* 内存预算（MB），占用接近预算时依次缩减缓存、拒绝新连接、暂停读取新请求；0表示不限制 */
+    int memory_budget_mb = 0;
+
+    /* epoll事件循环(线程)的数量，大于1时每个循环有自己的SO_REUSEPORT监听socket */
+    int event_loops = 1;
+    /* 一次epoll_wait最多返回的事件数 */
+    int max_event_number = 10000;
+    /* 最大文件描述符数，同时也是http_conn数组的大小 */
+    int max_fd = 65536;
+
+    /* 线程池的最小、最大线程数 */
+    int pool_min = 3;
+    int pool_max = 8;
+    /* 任务队列最多允许堆积的任务数，0表示不限制 */
+    int queue_limit = 0;
+    /* 三个优先级队列（内置处理函数、小请求、大文件）的权重，都有积压时按这个比例取任务 */
+    int sched_weight_admin = 8;
+    int sched_weight_cheap = 4;
+    int sched_weight_bulk = 1;
+    /* 响应体超过这个大小（KB）的文件算作大文件，连接上的下一个请求排进低优先级队列 */
+    int sched_bulk_kb = 64;
+
+    /* 每个连接的读、写缓冲区大小 */
+    int read_buffer_size = 2048;
+    int write_buffer_size = 1024;
+
+    /* 磁盘I/O线程数：发送前发现文件页不在内存里时由它们预读，0表示不开启（发送的线程直接缺页） */
+    int disk_threads = 2;
+    /* 一次发送中不小于这个大小（KB）的文件数据用MSG_ZEROCOPY发送，0表示不用零拷贝 */
+    int zerocopy_kb = 128;
+
+    /* 连接空闲多少秒后被关闭，0表示不超时 */
+    int idle_timeout = 0;
+    /* 优雅退出时等待进行中请求完成的最长秒数，超时后强制关闭剩余连接 */
+    int drain_timeout = 30;
+
+    /* 事件循环绑定的CPU列表，如 "0,2,4-6"，第i个循环绑定到第i个CPU（循环数多于CPU时轮流使用）；为空则不绑定 */
+    std::string loop_cpus;
+    /* 工作线程允许运行的CPU集合，格式同上；为空则不绑定 */
+    std::string worker_cpus;
+    /* 连接的缓冲区是否跟随接受它的事件循环所在的NUMA节点分配（依赖first-touch，需配合loop_cpus） */
+    int numa_local_buffers = 0;
+    /* 连接数组和读写缓冲区放在大页内存区里：0为普通的new，1为透明大页，2为hugetlbfs大页（不够时退回透明大页） */
+    int conn_arena = 1;
+    /* 启动时就为内存区分配好所有物理页，运行中不再缺页；RSS一开始就是max_fd个连接的全部占用 */
+    int arena_prefault = 0;
+
+    /* 低延迟模式：事件循环和空闲工作线程在休眠前先自旋，用CPU换取唤醒延迟 */
+    int low_latency = 0;
+    /* 自旋预算的上限（微秒），实际预算在1和它之间自适应 */
+    int spin_us = 50;
+    /* 大于0时为epoll实例和监听socket开启内核busy poll（SO_BUSY_POLL/EPIOCSPARAMS），单位微秒 */
+    int busy_poll_us = 0;
+
+    /* socket参数的预设：default、latency、throughput、mobile，设置在监听socket上由新连接继承 */
+    std::string socket_profile = "default";
+    /* 覆盖预设中的单项，-1表示沿用预设：TCP_NODELAY（0/1）、发送/接收缓冲区（KB）、TCP_NOTSENT_LOWAT（KB） */
+    int tcp_nodelay = -1;
+    int sndbuf_kb = -1;
+    int rcvbuf_kb = -1;
+    int notsent_lowat_kb = -1;
+    /* keepalive：空闲多少秒后开始探测（0为关闭）、探测间隔秒数、多少次无响应后断开 */
+    int keepalive_idle = -1;
+    int keepalive_intvl = -1;
+    int keepalive_cnt = -1;
+    /* 监听socket的TCP Fast Open队列长度，0表示不开启 */
+    int tcp_fastopen = 0;
+    /* 多个事件循环时按收到连接的CPU选择监听socket（SO_ATTACH_REUSEPORT_CBPF），而不是按四元组哈希 */
+    int reuseport_steer = 0;
+
+    /* 是否接受h2c（明文HTTP/2）：以连接前言开头的连接和 "Upgrade: h2c" 请求 */
+    int http2 = 1;
+    /* 一个HTTP/2连接上允许同时打开的流数（SETTINGS_MAX_CONCURRENT_STREAMS） */
+    int http2_max_streams = 100;
+
+    /* TLS监听端口，0表示不开启；每个事件循环除了明文监听socket外再有一个TLS监听socket */
+    int tls_port = 0;
+    /* PEM格式的证书链和私钥 */
+    std::string tls_cert;
+    std::string tls_key;
+    /* 握手后尝试把记录层交给内核TLS（kTLS），内核不支持时自动退回用户态加密 */
+    int ktls = 1;
+    /* 发放会话票据，客户端可以用它跳过完整握手 */
+    int tls_tickets = 1;
+
+    /* 反向代理路由，格式为 "前缀=ip:port,ip:port;前缀=ip:port"，URL以前缀开头的请求转发给这些上游服务器；为空则不开启 */
+    std::string proxy_routes;
+    /* 每个上游服务器最多保留的空闲keep-alive连接数 */
+    int proxy_keepalive = 32;
+    /* 空闲的上游连接保留多少秒 */
+    int proxy_keepalive_timeout = 60;
+    /* 主动健康检查的间隔秒数，0表示不检查 */
+    int proxy_health_interval = 5;
+    /* 健康检查请求的URI，为空时只检查能否建立TCP连接 */
+    std::string proxy_health_uri;
+    /* 被动健康检查：连续失败这么多次后，proxy_fail_timeout秒内不再向该服务器转发 */
+    int proxy_max_fails = 3;
+    int proxy_fail_timeout = 10;
+
+    /* 反向代理的微缓存大小（MB），0表示不开启 */
+    int microcache_mb = 0;
+    /* 上游的响应没有Cache-Control: max-age时的缓存秒数 */
+    int microcache_ttl = 1;
+    /* 过期后还可以返回旧响应的秒数（stale-while-revalidate），期间只有一个请求去上游更新 */
+    int microcache_swr = 10;
+    /* 单个响应超过这个大小（KB）就不缓存 */
+    int microcache_max_entry_kb = 1024;
+};
+
+/* 配置项的描述：名字、对应的成员、是否能在SIGHUP时热更新 */
+struct config_item
+{
+    const char* key;
+    int server_config::* int_field;
+    std::string server_config::* str_field;
+    /* 结构性参数（端口、缓冲区大小、事件循环数量等）只在启动时生效 */
+    bool reloadable;
+};
+
+/// @brief 返回所有已知配置项的表，以 {nullptr} 结尾
+const config_item* config_items();
+
+/// @brief 设置一个配置项
+/// @param cfg
+/// @param key 配置项名字
+/// @param value 字符串形式的值
+/// @param err 出错时的原因
+/// @return key未知或value不合法时返回false
+bool config_set(server_config& cfg, const char* key, const char* value, std::string& err);
+
+/// @brief 读取配置文件，文件里的配置项覆盖cfg中已有的值
+bool config_load_file(const char* path, server_config& cfg, std::string& err);
+
+/// @brief 检查配置之间的约束（例如 pool_min <= pool_max）
+bool config_validate(const server_config& cfg, std::string& err);
+
+/*
+    命令行参数：
+        my_tiny_web [-c 配置文件] [--key=value ...] [ip port]
+    为了兼容旧的用法，末尾的两个位置参数依然被当作ip和端口
+*/
+struct config_args
+{
+    std::string config_path;
+    std::vector<std::pair<std::string, std::string>> overrides;
+};
+
+/// @brief 解析命令行，结果存入args
+bool config_parse_args(int argc, char* argv[], config_args& args, std::string& err);
+
+/// @brief 按 默认值 -> 配置文件 -> 命令行覆盖 的顺序构造一份完整配置
+bool config_build(const config_args& args, server_config& cfg, std::string& err);
+
+/// @brief 重载时使用：只把new_cfg中可热更新的配置项复制到一份old_cfg的拷贝上
+server_config config_merge_reloadable(const server_config& old_cfg, const server_config& new_cfg);
+
+/// @brief 获取当前生效的配置快照，调用方持有shared_ptr期间快照不会被释放
+std::shared_ptr<const server_config> config_current();
+
+/// @brief 每个请求都要读的地方用这个：在rcu_read_guard的作用域内调用，不碰引用计数，
+///        返回的指针在离开读区之前有效
+const server_config* config_read();
+
+/// @brief 发布新的配置快照，已经持有旧快照的线程不受影响
+void config_publish(std::shared_ptr<const server_config> cfg);
+
+#endif
@@ -0,0 +1,242 @@
+// 连接布局微基准：模拟事件循环按fd分派事件和空闲检查扫描所有fd，比较
+//   interleaved 原来的布局：所有权状态、事件和socket与持有者的字段混在同一个连接对象里
+//               （对象1736字节，不按缓存行对齐，字段偏移取自拆分前的http_conn）
+//   split       现在的布局：按fd排列的conn_hot数组（每个fd一个缓存行）+ 按缓存行对齐的http_conn，
+//               读socket要用的持有者字段都在对象的第一个缓存行
+// 分派期间另有一个线程在刚分派过的连接上写持有者的字段，模拟工作线程处理请求。
+// 输出每次访问的耗时、按字段偏移算出的触及缓存行数，以及cache-miss计数
+// （perf_event_open，没有权限或虚拟机不支持时显示n/a）
+//
+// 用法: conn_layout_bench [-c 连接数] [-n 事件数]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <chrono>
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "arena.h"
+#include "http_conn.h"
+
+static int open_miss_counter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// 一种布局：事件循环碰的共享字段在hot + fd * hot_stride，持有者的字段在conns + fd * stride
+struct layout {
+    const char* name;
+    size_t stride;
+    size_t hot_stride;
+    // 共享字段的偏移
+    size_t state, events, sockfd, epollfd, last_active;
+    // 事件循环读socket时碰到的持有者字段：m_read_buf、m_read_idx、m_h2、m_tls
+    size_t read_path[4];
+    // 工作线程处理请求时写的持有者字段：m_checked_idx、m_write_idx、m_task_class、
+    // 发送队列（拆分前是m_iv）、m_file_address、m_dynamic_body
+    size_t work_path[6];
+    char* conns;
+    char* hot;
+};
+
+static layout interleaved() {
+    layout l;
+    l.name = "interleaved";
+    l.stride = l.hot_stride = 1736;
+    l.sockfd = 0;
+    l.epollfd = 28;
+    l.last_active = 1712;
+    l.state = 1720;
+    l.events = 1724;
+    size_t r[4] = {32, 40, 1480, 1488};
+    size_t w[6] = {44, 68, 1616, 1416, 1264, 1624};
+    memcpy(l.read_path, r, sizeof(r));
+    memcpy(l.work_path, w, sizeof(w));
+    return l;
+}
+
+static layout split() {
+    layout l;
+    l.name = "split";
+    l.stride = sizeof(http_conn);
+    l.hot_stride = sizeof(conn_hot);
+    l.state = offsetof(conn_hot, state);
+    l.events = offsetof(conn_hot, events);
+    l.sockfd = offsetof(conn_hot, sockfd);
+    l.epollfd = offsetof(conn_hot, epollfd);
+    l.last_active = offsetof(conn_hot, last_active);
+    size_t r[4] = {0, 16, 48, 56};
+    size_t w[6] = {20, 28, 40, 64, 144, 1640};
+    memcpy(l.read_path, r, sizeof(r));
+    memcpy(l.work_path, w, sizeof(w));
+    return l;
+}
+
+// 分派一个事件触及的缓存行数，对所有fd取平均（对象大小不是64的倍数时每个fd不一样）
+static double lines_per_event(const layout& l, int conns) {
+    long total = 0;
+    for (int fd = 0; fd < conns; ++fd) {
+        std::set<size_t> lines;
+        size_t hot = (l.hot == l.conns ? 0 : 1ul << 40) + fd * l.hot_stride;
+        size_t obj = fd * l.stride;
+        for (size_t off : {l.state, l.events, l.sockfd, l.last_active})
+            lines.insert((hot + off) / 64);
+        for (size_t off : l.read_path)
+            lines.insert((obj + off) / 64);
+        total += lines.size();
+    }
+    return (double)total / conns;
+}
+
+static double lines_per_sweep(const layout& l, int conns) {
+    long total = 0;
+    for (int fd = 0; fd < conns; ++fd) {
+        std::set<size_t> lines;
+        for (size_t off : {l.epollfd, l.sockfd, l.last_active})
+            lines.insert((fd * l.hot_stride + off) / 64);
+        total += lines.size();
+    }
+    return (double)total / conns;
+}
+
+// 累加读到的值，防止编译器把只读不用的访问优化掉
+static volatile unsigned long g_sink;
+
+static int* field(char* base, size_t stride, unsigned fd, size_t off) {
+    return (int*)(base + fd * stride + off);
+}
+
+// 事件循环：CAS所有权、记事件、读socket要用的字段、更新活跃时间，再交出去
+static unsigned long dispatch(const layout& l, const std::vector<unsigned>& order, int fd_miss, double& ns) {
+    std::atomic<size_t> progress{0};
+    std::atomic<bool> stop{false};
+    // 工作线程落后事件循环一段距离，处理刚分派过的连接
+    std::thread worker([&]() {
+        size_t done = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            size_t upto = progress.load(std::memory_order_relaxed);
+            for (; done + 64 < upto; ++done) {
+                unsigned fd = order[done];
+                for (size_t off : l.work_path)
+                    ++*field(l.conns, l.stride, fd, off);
+            }
+        }
+    });
+    unsigned long sum = 0;
+    if (fd_miss >= 0) {
+        ioctl(fd_miss, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_miss, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < order.size(); ++i) {
+        unsigned fd = order[i];
+        int idle = 0;
+        __atomic_compare_exchange_n(field(l.hot, l.hot_stride, fd, l.state), &idle, 1, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST);
+        __atomic_fetch_or(field(l.hot, l.hot_stride, fd, l.events), EPOLLIN, __ATOMIC_SEQ_CST);
+        sum += *field(l.hot, l.hot_stride, fd, l.sockfd);
+        for (size_t off : l.read_path)
+            sum += *field(l.conns, l.stride, fd, off);
+        *(time_t*)(l.hot + fd * l.hot_stride + l.last_active) = (time_t)i;
+        __atomic_store_n(field(l.hot, l.hot_stride, fd, l.state), 0, __ATOMIC_SEQ_CST);
+        if ((i & 63) == 0)
+            progress.store(i, std::memory_order_relaxed);
+    }
+    auto end = std::chrono::steady_clock::now();
+    unsigned long misses = 0;
+    if (fd_miss >= 0) {
+        ioctl(fd_miss, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd_miss, &misses, sizeof(misses)) != sizeof(misses)) misses = 0;
+    }
+    stop = true;
+    worker.join();
+    ns = std::chrono::duration<double, std::nano>(end - start).count() / order.size();
+    g_sink = sum;
+    return misses;
+}
+
+// 空闲检查：每个fd读所属的事件循环、socket和最后活跃时间
+static unsigned long sweep(const layout& l, int conns, int rounds, int fd_miss, double& ns) {
+    unsigned long sum = 0;
+    if (fd_miss >= 0) {
+        ioctl(fd_miss, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_miss, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (int fd = 0; fd < conns; ++fd) {
+            if (*field(l.hot, l.hot_stride, fd, l.epollfd) == 0 && *field(l.hot, l.hot_stride, fd, l.sockfd) != -1)
+                sum += *(time_t*)(l.hot + fd * l.hot_stride + l.last_active);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    unsigned long misses = 0;
+    if (fd_miss >= 0) {
+        ioctl(fd_miss, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd_miss, &misses, sizeof(misses)) != sizeof(misses)) misses = 0;
+    }
+    ns = std::chrono::duration<double, std::nano>(end - start).count() / ((double)conns * rounds);
+    g_sink = sum;
+    return misses;
+}
+
+static void print_row(const char* what, double ns, double lines, unsigned long misses, double count, int fd_miss) {
+    if (fd_miss >= 0)
+        printf("  %-8s %7.1f ns  %4.2f 缓存行  cache-miss %.3f\n", what, ns, lines, misses / count);
+    else
+        printf("  %-8s %7.1f ns  %4.2f 缓存行  cache-miss n/a\n", what, ns, lines);
+}
+
+int main(int argc, char* argv[]) {
+    int conns = 65536;
+    long events = 20000000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-c") == 0) conns = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0) events = atol(argv[i + 1]);
+    }
+    std::vector<unsigned> order(events);
+    srand(1);
+    for (long i = 0; i < events; ++i) order[i] = (unsigned)rand() % conns;
+    int fd_miss = open_miss_counter();
+    printf("连接数 %d，事件 %ld 个；sizeof(http_conn)=%zu，sizeof(conn_hot)=%zu\n", conns, events, sizeof(http_conn),
+           sizeof(conn_hot));
+
+    const int rounds = 20;
+    for (layout l : {interleaved(), split()}) {
+        // 两种布局都放在透明大页上，只比较字段的排列
+        ARENA_PAGES got;
+        size_t conn_bytes = l.stride * conns, hot_bytes = l.hot_stride * conns;
+        bool separate = l.hot_stride != l.stride;
+        l.conns = (char*)arena_map(conn_bytes, ARENA_THP, true, got);
+        l.hot = separate ? (char*)arena_map(hot_bytes, ARENA_THP, true, got) : l.conns;
+        if (!l.conns || !l.hot) {
+            printf("%s: 映射失败\n", l.name);
+            continue;
+        }
+        double ns;
+        printf("%s（每个fd %zu + %zu 字节）\n", l.name, l.stride, separate ? l.hot_stride : 0);
+        dispatch(l, order, fd_miss, ns); // 预热
+        unsigned long misses = dispatch(l, order, fd_miss, ns);
+        print_row("分派", ns, lines_per_event(l, conns), misses, (double)events, fd_miss);
+        sweep(l, conns, 1, fd_miss, ns);
+        misses = sweep(l, conns, rounds, fd_miss, ns);
+        print_row("扫描", ns, lines_per_sweep(l, conns), misses, (double)conns * rounds, fd_miss);
+        arena_unmap(l.conns, conn_bytes);
+        if (separate)
+            arena_unmap(l.hot, hot_bytes);
+    }
+    return 0;
+}
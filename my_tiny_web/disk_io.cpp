@@ -0,0 +1,152 @@
+#include "disk_io.h"
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+struct disk_job
+{
+    std::vector<iovec> ranges;
+    std::function<void()> done;
+};
+
+static std::vector<std::thread> g_threads;
+static std::mutex g_lock;
+static std::condition_variable g_cond;
+static std::deque<disk_job> g_jobs;
+static bool g_stop = false;
+static std::atomic<bool> g_enabled(false);
+static size_t g_page = 4096;
+
+static std::atomic<long> g_checks(0);
+static std::atomic<long> g_prefetches(0);
+static std::atomic<long> g_prefetch_us(0);
+
+static long now_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// 把一段映射读进内存。MADV_POPULATE_READ（5.14起）同步地读入所有页，文件被截短时返回EFAULT而不是SIGBUS；
+// 旧内核上退回MADV_WILLNEED，它只发起异步预读，之后的发送仍可能等一部分页
+static void populate(const iovec& r)
+{
+    if (madvise(r.iov_base, r.iov_len, MADV_POPULATE_READ) == 0)
+        return;
+    madvise(r.iov_base, r.iov_len, MADV_WILLNEED);
+}
+
+static void disk_loop()
+{
+    while (true)
+    {
+        disk_job job;
+        {
+            std::unique_lock<std::mutex> lck(g_lock);
+            g_cond.wait(lck, [] { return g_stop || !g_jobs.empty(); });
+            if (g_jobs.empty())
+                return; // 只有退出时队列才会是空的
+            job = std::move(g_jobs.front());
+            g_jobs.pop_front();
+        }
+        long start = now_us();
+        for (size_t i = 0; i < job.ranges.size(); ++i)
+            populate(job.ranges[i]);
+        g_prefetch_us.fetch_add(now_us() - start, std::memory_order_relaxed);
+        job.done();
+    }
+}
+
+void disk_init(int threads)
+{
+    g_page = sysconf(_SC_PAGESIZE);
+    g_stop = false;
+    for (int i = 0; i < threads; ++i)
+        g_threads.emplace_back(disk_loop);
+    g_enabled.store(threads > 0);
+}
+
+void disk_shutdown()
+{
+    g_enabled.store(false);
+    {
+        std::lock_guard<std::mutex> lck(g_lock);
+        g_stop = true;
+    }
+    g_cond.notify_all();
+    for (size_t i = 0; i < g_threads.size(); ++i)
+        g_threads[i].join();
+    g_threads.clear();
+}
+
+bool disk_enabled()
+{
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+bool disk_resident(const iovec* iov, int count, size_t limit, std::vector<iovec>& cold)
+{
+    g_checks.fetch_add(1, std::memory_order_relaxed);
+    size_t before = cold.size();
+    // mincore一次最多查这么多页，结果放在栈上
+    static const size_t BATCH = 256;
+    unsigned char vec[BATCH];
+    for (int i = 0; i < count && limit > 0; ++i)
+    {
+        size_t len = iov[i].iov_len < limit ? iov[i].iov_len : limit;
+        limit -= len;
+        if (len == 0)
+            continue;
+        uintptr_t begin = (uintptr_t)iov[i].iov_base & ~(uintptr_t)(g_page - 1);
+        uintptr_t end = (uintptr_t)iov[i].iov_base + len;
+        while (begin < end)
+        {
+            size_t pages = (end - begin + g_page - 1) / g_page;
+            if (pages > BATCH)
+                pages = BATCH;
+            if (mincore((void*)begin, pages * g_page, vec) < 0)
+                break; // 查不了就当作在内存里，最坏情况是发送时缺页
+            for (size_t p = 0; p < pages; ++p)
+            {
+                if (vec[p] & 1)
+                    continue;
+                // 和上一段相邻时合并
+                char* page = (char*)(begin + p * g_page);
+                if (cold.size() > before && (char*)cold.back().iov_base + cold.back().iov_len == page)
+                    cold.back().iov_len += g_page;
+                else
+                    cold.push_back(iovec{page, g_page});
+            }
+            begin += pages * g_page;
+        }
+    }
+    return cold.size() == before;
+}
+
+void disk_prefetch(const std::vector<iovec>& cold, std::function<void()> done)
+{
+    g_prefetches.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lck(g_lock);
+        g_jobs.push_back(disk_job{cold, std::move(done)});
+    }
+    g_cond.notify_one();
+}
+
+void disk_stats(long& checks, long& prefetches, long& prefetch_us)
+{
+    checks = g_checks.load();
+    prefetches = g_prefetches.load();
+    prefetch_us = g_prefetch_us.load();
+}
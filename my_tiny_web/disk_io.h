@@ -0,0 +1,39 @@
+#ifndef DISK_IO_H
+#define DISK_IO_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <functional>
+#include <vector>
+
+/*
+    专用的磁盘I/O线程。响应体是文件的只读映射，页不在页缓存里时writev会在发送的线程里缺页、等磁盘，
+    事件循环线程等磁盘的时候它负责的其他连接也都停住了。发送之前先用mincore检查将要发送的一段，
+    不在内存里的部分交给这里的线程用MADV_POPULATE_READ读进来，读完再继续发送；
+    发送一次最多发送检查过的DISK_WINDOW字节，所以发送的线程不会碰到没检查过的页
+*/
+
+/* 一次检查、发送的文件数据的上限 */
+static const size_t DISK_WINDOW = 1 << 20;
+
+/// @brief 启动时调用，threads为I/O线程数，0表示不开启（发送时直接缺页）
+void disk_init(int threads);
+
+/// @brief 退出时调用：做完队列中的预读并回收线程，此后disk_enabled返回false
+void disk_shutdown();
+
+/// @brief 是否开启了I/O线程
+bool disk_enabled();
+
+/// @brief 检查iov中前limit字节所在的页是否都在内存里
+/// @param cold 追加不在内存里的部分（按页对齐）
+/// @return 都在内存里时返回true
+bool disk_resident(const iovec* iov, int count, size_t limit, std::vector<iovec>& cold);
+
+/// @brief 在I/O线程上把cold读进内存，完成后在I/O线程上调用done；cold指向的映射在done之前必须保持有效
+void disk_prefetch(const std::vector<iovec>& cold, std::function<void()> done);
+
+/// @brief 检查的次数、交给I/O线程的预读次数和预读花费的总时间（微秒）
+void disk_stats(long& checks, long& prefetches, long& prefetch_us);
+
+#endif
@@ -0,0 +1,266 @@
+#include "file_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <atomic>
+#include <unordered_map>
+#include "locker.h"
+#include "mem_budget.h"
+#include "disk_io.h"
+
+/* 不超过这个大小的文件在映射时就读入所有页（MAP_POPULATE），第一次发送不会缺页 */
+static const off_t POPULATE_MAX = 64 * 1024;
+
+static locker g_lock;
+static std::unordered_map<std::string, file_entry*> g_entries;
+static std::list<file_entry*> g_lru;
+static size_t g_limit = 0;
+/* 根目录到目录fd的映射，根目录只来自配置，数量很少，fd一直保留到进程退出 */
+static std::unordered_map<std::string, int> g_roots;
+/* 内核不支持openat2（5.6之前）时退回openat，并在用户态拒绝 ".." 段 */
+static std::atomic<bool> g_no_openat2(false);
+
+static std::atomic<long> g_hits(0);
+static std::atomic<long> g_misses(0);
+static std::atomic<long> g_revalidated(0);
+static std::atomic<long> g_evictions(0);
+
+void file_cache_init(int entries)
+{
+    g_limit = entries > 0 ? entries : 0;
+}
+
+// 调用时持有g_lock
+static int root_fd(const char* root)
+{
+    std::unordered_map<std::string, int>::iterator it = g_roots.find(root);
+    if (it != g_roots.end())
+        return it->second;
+    int fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    g_roots[root] = fd;
+    return fd;
+}
+
+static bool has_dotdot(const char* p)
+{
+    for (const char* s = p; (s = strstr(s, "..")) != nullptr; s += 2)
+        if ((s == p || s[-1] == '/') && (s[2] == '\0' || s[2] == '/'))
+            return true;
+    return false;
+}
+
+// 相对根目录打开path并取得文件状态，成功时返回新的条目（引用计数为1，不在表中）
+static int open_beneath(int dirfd, const char* path, file_entry*& out)
+{
+    while (*path == '/')
+        ++path;
+    if (*path == '\0')
+        path = ".";
+    // O_NONBLOCK：路径指向FIFO时open不会阻塞工作线程，之后按不是普通文件拒绝
+    int flags = O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK;
+    int fd = -1;
+    if (!g_no_openat2.load(std::memory_order_relaxed))
+    {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+        if (fd < 0 && errno == ENOSYS)
+            g_no_openat2.store(true);
+    }
+    if (g_no_openat2.load(std::memory_order_relaxed))
+    {
+        if (has_dotdot(path))
+            return EXDEV;
+        fd = openat(dirfd, path, flags);
+    }
+    if (fd < 0)
+        return errno == EAGAIN ? ENOENT : errno;
+    file_entry* e = new file_entry;
+    e->fd = fd;
+    e->data = nullptr;
+    e->refs = 1;
+    e->cached = false;
+    e->checked = time(nullptr);
+    if (fstat(fd, &e->st) < 0)
+    {
+        int err = errno;
+        close(fd);
+        delete e;
+        return err;
+    }
+    if (S_ISREG(e->st.st_mode) && e->st.st_size > 0)
+    {
+        // 打开文件在工作线程里，小文件在这里等磁盘；大文件按顺序发送，让内核加大预读
+        int mflags = MAP_PRIVATE | (e->st.st_size <= POPULATE_MAX ? MAP_POPULATE : 0);
+        void* p = mmap(nullptr, e->st.st_size, PROT_READ, mflags, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            int err = errno;
+            close(fd);
+            delete e;
+            return err;
+        }
+        e->data = (char*)p;
+        if ((size_t)e->st.st_size > DISK_WINDOW)
+            madvise(p, e->st.st_size, MADV_SEQUENTIAL);
+        mem_charge(MEM_MAPPED, (long)e->st.st_size);
+    }
+    out = e;
+    return 0;
+}
+
+static void destroy(file_entry* e)
+{
+    if (e->data)
+    {
+        munmap(e->data, e->st.st_size);
+        mem_charge(MEM_MAPPED, -(long)e->st.st_size);
+    }
+    close(e->fd);
+    delete e;
+}
+
+// 路径重新解析后是否还是同一个没有被改过的文件
+static bool same_file(const struct stat& a, const struct stat& b)
+{
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size && a.st_mode == b.st_mode &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+           a.st_ctim.tv_sec == b.st_ctim.tv_sec && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+// 从表中移走，调用时持有g_lock
+static void unlink_entry(file_entry* e)
+{
+    g_entries.erase(e->key);
+    g_lru.erase(e->lru);
+    e->cached = false;
+    if (e->refs == 0)
+        destroy(e);
+}
+
+int file_cache_open(const char* root, const char* path, size_t len, int valid, file_entry*& out)
+{
+    // 路径里的'\0'会让open_beneath只看到它前面的部分，而键却包含整个路径：
+    // "/a.html\0任意后缀" 会打开a.html，每个不同的后缀还各占一个条目，可以用来冲刷LRU和打开的fd
+    if (memchr(path, '\0', len))
+        return ENOENT;
+    // 键是根目录、'\0'和路径；键里的路径同时是open_beneath要的以'\0'结尾的字符串，请求路径只复制这一次
+    size_t root_len = strlen(root);
+    std::string key;
+    key.reserve(root_len + 1 + len);
+    key.append(root, root_len);
+    key.push_back('\0');
+    key.append(path, len);
+    time_t now = time(nullptr);
+    g_lock.lock();
+    int dirfd = root_fd(root);
+    if (dirfd < 0)
+    {
+        g_lock.unlock();
+        return -dirfd;
+    }
+    file_entry* old = nullptr;
+    std::unordered_map<std::string, file_entry*>::iterator it = g_entries.find(key);
+    if (it != g_entries.end())
+    {
+        old = it->second;
+        if (now - old->checked < valid)
+        {
+            ++old->refs;
+            g_lru.splice(g_lru.begin(), g_lru, old->lru);
+            g_lock.unlock();
+            g_hits.fetch_add(1, std::memory_order_relaxed);
+            out = old;
+            return 0;
+        }
+        // 过期的条目先留在表里，检查期间其它请求依然可以命中它
+        ++old->refs;
+    }
+    g_lock.unlock();
+
+    file_entry* e = nullptr;
+    int err = open_beneath(dirfd, key.c_str() + root_len + 1, e);
+    g_lock.lock();
+    if (old)
+    {
+        if (!err && same_file(old->st, e->st))
+        {
+            // 文件没有变化，沿用旧条目和它的映射
+            old->checked = now;
+            if (old->cached)
+                g_lru.splice(g_lru.begin(), g_lru, old->lru);
+            g_lock.unlock();
+            destroy(e);
+            g_revalidated.fetch_add(1, std::memory_order_relaxed);
+            out = old;
+            return 0;
+        }
+        --old->refs;
+        if (old->cached)
+            unlink_entry(old);
+        else if (old->refs == 0)
+            destroy(old);
+    }
+    g_misses.fetch_add(1, std::memory_order_relaxed);
+    if (err || g_limit == 0)
+    {
+        g_lock.unlock();
+        out = e;
+        return err;
+    }
+    // 并发的未命中可能已经放进了同一个键，用新的替换它
+    it = g_entries.find(key);
+    if (it != g_entries.end())
+        unlink_entry(it->second);
+    e->key.swap(key);
+    e->cached = true;
+    ++e->refs;
+    g_lru.push_front(e);
+    e->lru = g_lru.begin();
+    g_entries[e->key] = e;
+    while (g_entries.size() > g_limit)
+    {
+        unlink_entry(g_lru.back());
+        g_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    g_lock.unlock();
+    out = e;
+    return 0;
+}
+
+void file_cache_release(file_entry* e)
+{
+    g_lock.lock();
+    bool last = --e->refs == 0 && !e->cached;
+    g_lock.unlock();
+    if (last)
+        destroy(e);
+}
+
+void file_cache_shrink()
+{
+    g_lock.lock();
+    size_t target = g_entries.size() / 2;
+    while (g_entries.size() > target)
+    {
+        unlink_entry(g_lru.back());
+        g_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    g_lock.unlock();
+}
+
+void file_cache_stats(long& hits, long& misses, long& revalidated, long& evictions)
+{
+    hits = g_hits.load();
+    misses = g_misses.load();
+    revalidated = g_revalidated.load();
+    evictions = g_evictions.load();
+}
@@ -0,0 +1,56 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <time.h>
+#include <list>
+#include <string>
+
+/*
+    静态文件的打开文件缓存。
+    每个根目录（doc_root、虚拟主机和静态路由的目录）保留一个目录fd，请求的路径用openat2(RESOLVE_BENEATH)
+    相对它解析，内核保证解析结果不会通过 ".."、绝对路径或符号链接逃出根目录。
+    解析得到的fd连同fstat的结果和文件的只读映射放进一个有上限的LRU表，同一个文件的后续请求直接共享这份映射，
+    不再有stat/open/mmap/munmap；条目在file_cache_valid秒后重新解析一次路径，文件被替换或修改时换成新的条目。
+    条目有引用计数，被淘汰或替换时仍在发送的响应继续持有旧的映射，最后一个引用释放时才关闭和解除映射
+*/
+
+struct file_entry
+{
+    /* 打开的文件（或目录） */
+    int fd;
+    struct stat st;
+    /* st_size大于0的普通文件的只读映射，其余为nullptr */
+    char* data;
+
+    /* 以下由缓存内部使用，受缓存的锁保护 */
+    std::string key;
+    int refs;
+    /* 仍在表中；不在表中的条目在引用归零时释放 */
+    bool cached;
+    /* 上一次确认路径仍然指向这个文件的时间 */
+    time_t checked;
+    std::list<file_entry*>::iterator lru;
+};
+
+/// @brief 启动时调用
+/// @param entries 缓存的条目数上限，0表示不缓存（每次都重新打开，但路径解析仍然限制在根目录之内）
+void file_cache_init(int entries);
+
+/// @brief 在根目录root下打开path，命中缓存时只增加引用计数
+/// @param path 以'/'开头的请求路径，不含查询参数，长度为len，不需要以'\0'结尾
+/// @param valid 缓存的条目在多少秒内不需要重新检查路径
+/// @param out 成功时返回的条目，用完后交给file_cache_release
+/// @return 0，或者errno：路径逃出根目录时为EXDEV，文件不存在（包括路径中含有'\0'）为ENOENT
+int file_cache_open(const char* root, const char* path, size_t len, int valid, file_entry*& out);
+
+/// @brief 释放file_cache_open返回的条目
+void file_cache_release(file_entry* e);
+
+/// @brief 内存紧张时调用：淘汰最久没用过的一半条目，仍在发送的响应持有的映射在释放时才解除
+void file_cache_shrink();
+
+/// @brief 命中、未命中（需要打开文件）、重新检查后沿用、淘汰的次数
+void file_cache_stats(long& hits, long& misses, long& revalidated, long& evictions);
+
+#endif
@@ -0,0 +1,352 @@
+#include "hpack.h"
+#include <stdio.h>
+#include <algorithm>
+
+// RFC 7541 附录A 静态表，索引从1开始
+static const char* const g_static_table[hpack_decoder::STATIC_TABLE_SIZE][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// RFC 7541 附录B 中每个符号（0~255和EOS=256）的Huffman码长。
+// 这套编码是规范Huffman编码：同一码长的码字按符号值从小到大连续分配，所以只保存码长，码字在启动时推导
+static const uint8_t g_huffman_bits[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static const int HUFFMAN_MIN_BITS = 5;
+static const int HUFFMAN_MAX_BITS = 30;
+static const int HUFFMAN_EOS = 256;
+
+/*
+    规范Huffman的解码表：码长为L的码字是从first_code[L]开始的count[L]个连续值，
+    对应的符号依次存放在symbols[first_index[L]]开始的位置
+*/
+struct huffman_table
+{
+    uint32_t first_code[HUFFMAN_MAX_BITS + 1];
+    int first_index[HUFFMAN_MAX_BITS + 1];
+    int count[HUFFMAN_MAX_BITS + 1];
+    uint16_t symbols[257];
+
+    huffman_table()
+    {
+        for (int i = 0; i < 257; ++i)
+            symbols[i] = i;
+        std::stable_sort(symbols, symbols + 257, [](uint16_t a, uint16_t b)
+                         { return g_huffman_bits[a] < g_huffman_bits[b]; });
+        uint32_t code = 0;
+        int index = 0;
+        for (int len = 1; len <= HUFFMAN_MAX_BITS; ++len)
+        {
+            first_code[len] = code;
+            first_index[len] = index;
+            count[len] = 0;
+            while (index < 257 && g_huffman_bits[symbols[index]] == len)
+            {
+                ++count[len];
+                ++index;
+            }
+            code = (code + count[len]) << 1;
+        }
+    }
+};
+
+bool hpack_huffman_decode(const uint8_t* p, size_t len, std::string& out)
+{
+    static const huffman_table table;
+    uint64_t acc = 0; // 只有低nbits位有效
+    int nbits = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        acc = (acc << 8) | p[i];
+        nbits += 8;
+        while (nbits >= HUFFMAN_MIN_BITS)
+        {
+            // 码字互不为前缀，从短到长找到的第一个落在区间内的就是当前符号
+            int sym = -1, bits = HUFFMAN_MIN_BITS;
+            for (; bits <= HUFFMAN_MAX_BITS && bits <= nbits; ++bits)
+            {
+                uint32_t code = (uint32_t)(acc >> (nbits - bits)) & ((1u << bits) - 1);
+                uint32_t offset = code - table.first_code[bits];
+                if (code >= table.first_code[bits] && offset < (uint32_t)table.count[bits])
+                {
+                    sym = table.symbols[table.first_index[bits] + offset];
+                    break;
+                }
+            }
+            if (sym < 0)
+                break; // 位数不够，等下一个字节
+            if (sym == HUFFMAN_EOS)
+                return false;
+            out += (char)sym;
+            nbits -= bits;
+        }
+    }
+    // 末尾的填充必须少于8位，并且是EOS码字的前缀（全1）
+    if (nbits >= 8)
+        return false;
+    uint32_t mask = (1u << nbits) - 1;
+    return ((uint32_t)acc & mask) == mask;
+}
+
+bool hpack_decode_int(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint32_t& value)
+{
+    if (p >= end)
+        return false;
+    uint32_t max = (1u << prefix_bits) - 1;
+    value = *p++ & max;
+    if (value < max)
+        return true;
+    for (int shift = 0; p < end; shift += 7)
+    {
+        if (shift > 28)
+            return false; // 超过32位，视为格式错误
+        uint8_t b = *p++;
+        value += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// 读一个字符串字面值：H标志位 + 7位前缀的长度 + 内容
+static bool read_string(const uint8_t*& p, const uint8_t* end, std::string& out)
+{
+    if (p >= end)
+        return false;
+    bool huffman = *p & 0x80;
+    uint32_t len;
+    if (!hpack_decode_int(p, end, 7, len) || len > (size_t)(end - p))
+        return false;
+    out.clear();
+    if (huffman)
+    {
+        if (!hpack_huffman_decode(p, len, out))
+            return false;
+    }
+    else
+    {
+        out.assign((const char*)p, len);
+    }
+    p += len;
+    return true;
+}
+
+bool hpack_decoder::lookup(uint32_t index, hpack_header& out) const
+{
+    if (index == 0)
+        return false;
+    if (index <= STATIC_TABLE_SIZE)
+    {
+        out.first = g_static_table[index - 1][0];
+        out.second = g_static_table[index - 1][1];
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= m_table.size())
+        return false;
+    out = m_table[index];
+    return true;
+}
+
+void hpack_decoder::evict(size_t limit)
+{
+    while (m_size > limit && !m_table.empty())
+    {
+        m_size -= m_table.back().first.size() + m_table.back().second.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert(const std::string& name, const std::string& value)
+{
+    size_t entry = name.size() + value.size() + 32;
+    // 比整个表还大的条目会清空动态表，自己也不插入
+    evict(entry > m_max_size ? 0 : m_max_size - entry);
+    if (entry > m_max_size)
+        return;
+    m_table.emplace_front(name, value);
+    m_size += entry;
+}
+
+bool hpack_decoder::decode(const uint8_t* data, size_t len, std::vector<hpack_header>& headers)
+{
+    // 解码后的头部列表大小上限，防止一个很小的头部块反复引用动态表里的大条目
+    const size_t max_list_size = 65536;
+    size_t list_size = 0;
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    hpack_header field;
+    while (p < end)
+    {
+        uint8_t b = *p;
+        uint32_t index;
+        if (b & 0x80)
+        {
+            // 索引字段
+            if (!hpack_decode_int(p, end, 7, index) || !lookup(index, field))
+                return false;
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // 动态表大小更新，不产生字段
+            if (!hpack_decode_int(p, end, 5, index) || index > m_limit)
+                return false;
+            m_max_size = index;
+            evict(m_max_size);
+            continue;
+        }
+        else
+        {
+            // 字面值字段：01带索引（6位前缀），0000不索引、0001永不索引（4位前缀）
+            bool indexing = b & 0x40;
+            if (!hpack_decode_int(p, end, indexing ? 6 : 4, index))
+                return false;
+            if (index == 0)
+            {
+                if (!read_string(p, end, field.first))
+                    return false;
+            }
+            else
+            {
+                hpack_header named;
+                if (!lookup(index, named))
+                    return false;
+                field.first.swap(named.first);
+            }
+            if (!read_string(p, end, field.second))
+                return false;
+            if (indexing)
+                insert(field.first, field.second);
+        }
+        list_size += field.first.size() + field.second.size() + 32;
+        if (list_size > max_list_size)
+            return false;
+        headers.push_back(field);
+    }
+    return true;
+}
+
+void hpack_encode_int(std::string& out, uint8_t flags, int prefix_bits, uint32_t value)
+{
+    uint32_t max = (1u << prefix_bits) - 1;
+    if (value < max)
+    {
+        out += (char)(flags | value);
+        return;
+    }
+    out += (char)(flags | max);
+    value -= max;
+    while (value >= 128)
+    {
+        out += (char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+void hpack_encode_status(std::string& out, int status)
+{
+    int index = 0;
+    switch (status)
+    {
+    case 200: index = 8; break;
+    case 204: index = 9; break;
+    case 206: index = 10; break;
+    case 304: index = 11; break;
+    case 400: index = 12; break;
+    case 404: index = 13; break;
+    case 500: index = 14; break;
+    }
+    if (index)
+    {
+        hpack_encode_int(out, 0x80, 7, index);
+        return;
+    }
+    char text[16];
+    int len = snprintf(text, sizeof(text), "%d", status);
+    hpack_encode_literal(out, 8, text, len);
+}
+
+void hpack_encode_literal(std::string& out, uint32_t name_index, const char* value, size_t len)
+{
+    hpack_encode_int(out, 0x00, 4, name_index);
+    hpack_encode_int(out, 0x00, 7, len);
+    out.append(value, len);
+}
@@ -0,0 +1,72 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <utility>
+
+/* 解码出的一个头部字段：名字和值 */
+typedef std::pair<std::string, std::string> hpack_header;
+
+/*
+    HPACK（RFC 7541）解码器：静态表 + 动态表 + Huffman解码
+    动态表是连接级的状态，所以每个HTTP/2连接一个解码器，头部块必须按收到的顺序解码
+*/
+class hpack_decoder
+{
+public:
+    /* 静态表的条目数，动态表的索引从62开始 */
+    static const size_t STATIC_TABLE_SIZE = 61;
+
+    explicit hpack_decoder(size_t max_table_size = 4096)
+        : m_limit(max_table_size), m_max_size(max_table_size), m_size(0) {}
+
+    /// @brief 解码一个完整的头部块（HEADERS及其后的CONTINUATION拼起来的内容）
+    /// @param data
+    /// @param len
+    /// @param headers 解码出的字段按出现顺序追加到这里
+    /// @return 格式错误时返回false，调用方应以COMPRESSION_ERROR关闭连接
+    bool decode(const uint8_t* data, size_t len, std::vector<hpack_header>& headers);
+
+private:
+    /* 按索引取静态表或动态表中的条目 */
+    bool lookup(uint32_t index, hpack_header& out) const;
+    /* 插入动态表，必要时淘汰最旧的条目 */
+    void insert(const std::string& name, const std::string& value);
+    /* 淘汰条目直到动态表大小不超过limit */
+    void evict(size_t limit);
+
+    /* 动态表，front是最新插入的条目（索引62） */
+    std::deque<hpack_header> m_table;
+    /* 我们在SETTINGS_HEADER_TABLE_SIZE中允许的上限，对端的动态表大小更新不能超过它 */
+    size_t m_limit;
+    /* 对端通过动态表大小更新指定的当前上限 */
+    size_t m_max_size;
+    /* 动态表当前大小，每个条目按 name + value + 32 字节计算 */
+    size_t m_size;
+};
+
+/// @brief 解码HPACK整数
+/// @param p 输入位置，成功时前进到整数之后
+/// @param end 输入结束位置
+/// @param prefix_bits 首字节中属于整数的低位数（1~8）
+/// @param value 解码结果
+bool hpack_decode_int(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint32_t& value);
+
+/// @brief 解码Huffman编码的字符串，结果追加到out；填充位不是EOS前缀或者出现EOS时返回false
+bool hpack_huffman_decode(const uint8_t* p, size_t len, std::string& out);
+
+/// @brief 编码HPACK整数
+/// @param flags 首字节中前缀以外的高位，如0x80表示索引字段
+void hpack_encode_int(std::string& out, uint8_t flags, int prefix_bits, uint32_t value);
+
+/// @brief 编码":status"，静态表里有的状态码（200、304、404等）只占一个字节
+void hpack_encode_status(std::string& out, int status);
+
+/// @brief 以"不索引的字面值"编码一个字段，名字取静态表第name_index项，值不做Huffman编码
+void hpack_encode_literal(std::string& out, uint32_t name_index, const char* value, size_t len);
+
+#endif
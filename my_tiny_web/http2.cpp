@@ -0,0 +1,827 @@
+#include "http2.h"
+#include "proxy.h"
+#include "vhost.h"
+#include "router.h"
+#include "file_cache.h"
+#include "autoindex.h"
+#include "mem_budget.h"
+#include "disk_io.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+const char http2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// 帧类型
+enum
+{
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9
+};
+
+// 帧标志
+enum
+{
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+// 错误码
+enum
+{
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+// SETTINGS参数
+enum
+{
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+static const int64_t DEFAULT_WINDOW = 65535;
+static const int64_t MAX_WINDOW = 0x7fffffff;
+/* 一个发送批次最多排多少字节，批次之间会重新轮转，保证各个流交替前进 */
+static const size_t BATCH_BYTES = 256 * 1024;
+/* 一个头部块（HEADERS + CONTINUATION）的最大长度 */
+static const size_t MAX_HEADER_BLOCK = 65536;
+
+static uint32_t read_u32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// 解码base64url（HTTP2-Settings使用，不带填充）
+static bool base64url_decode(const char* text, size_t len, std::string& out)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    for (const char* p = text; p < text + len && *p != '='; ++p)
+    {
+        int v;
+        char c = *p;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            v = 62;
+        else if (c == '_' || c == '/')
+            v = 63;
+        else
+            return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out += (char)((acc >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+http2_session::http2_session(int max_streams, int input_size, const limiter_ticket& limit)
+    : m_input(new char[input_size]), m_input_size(input_size), m_preface_left(PREFACE_LEN), m_got_settings(false),
+      m_settings_sent(false), m_continuation_stream(0), m_next(0), m_max_streams(max_streams), m_last_stream_id(0),
+      m_limit(limit),
+      m_conn_window(DEFAULT_WINDOW), m_peer_initial_window(DEFAULT_WINDOW), m_peer_max_frame(MAX_FRAME_SIZE),
+      m_goaway_sent(false), m_goaway_received(false), m_closing(false), m_iov_count(0), m_iov_pos(0)
+{
+    mem_charge(MEM_BUFFERS, input_size);
+}
+
+http2_session::~http2_session()
+{
+    for (size_t i = 0; i < m_streams.size(); ++i)
+    {
+        if (m_streams[i].file)
+            file_cache_release(m_streams[i].file);
+        if (m_streams[i].host)
+            vhost_leave(m_streams[i].host);
+    }
+    for (size_t i = 0; i < m_retired.size(); ++i)
+        if (m_retired[i].file)
+            file_cache_release(m_retired[i].file);
+    delete[] m_input;
+    mem_charge(MEM_BUFFERS, -(long)m_input_size);
+}
+
+void http2_session::queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, uint32_t len)
+{
+    uint8_t header[FRAME_HEADER_LEN];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put_u32(header + 5, stream_id & 0x7fffffff);
+    m_ctrl.append((const char*)header, FRAME_HEADER_LEN);
+    if (payload && len)
+        m_ctrl.append((const char*)payload, len);
+}
+
+void http2_session::queue_window_update(uint32_t stream_id, uint32_t increment)
+{
+    uint8_t payload[4];
+    put_u32(payload, increment);
+    queue_frame(FRAME_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+void http2_session::queue_settings()
+{
+    // 只需要告诉对端并发流的上限，其它参数用默认值
+    uint8_t payload[6];
+    payload[0] = 0;
+    payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32(payload + 2, m_max_streams);
+    queue_frame(FRAME_SETTINGS, 0, 0, payload, 6);
+    m_settings_sent = true;
+}
+
+void http2_session::connection_error(uint32_t code)
+{
+    if (m_closing)
+        return;
+    uint8_t payload[8];
+    put_u32(payload, m_last_stream_id);
+    put_u32(payload + 4, code);
+    queue_frame(FRAME_GOAWAY, 0, 0, payload, 8);
+    m_goaway_sent = true;
+    m_closing = true;
+    // 解析时发送批次一定是空的，可以直接释放所有流
+    while (!m_streams.empty())
+        close_stream(m_streams.size() - 1);
+}
+
+void http2_session::shutdown()
+{
+    if (m_goaway_sent)
+        return;
+    uint8_t payload[8];
+    put_u32(payload, m_last_stream_id);
+    put_u32(payload + 4, H2_NO_ERROR);
+    queue_frame(FRAME_GOAWAY, 0, 0, payload, 8);
+    m_goaway_sent = true;
+}
+
+bool http2_session::finished() const
+{
+    return m_closing || ((m_goaway_sent || m_goaway_received) && m_streams.empty());
+}
+
+bool http2_session::upgrade(const char* settings, size_t len, http_conn::HTTP_CODE code, file_entry* file,
+                            bool head_only)
+{
+    std::string payload;
+    if (!base64url_decode(settings, len, payload) || payload.size() % 6 != 0)
+        return false;
+    // 101之后第一个帧必须是服务器的SETTINGS；HTTP2-Settings由101隐式确认，不需要回ACK
+    m_ctrl.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    queue_settings();
+    apply_settings((const uint8_t*)payload.data(), payload.size());
+    m_last_stream_id = 1;
+    start_response(1, code, file, head_only);
+    return true;
+}
+
+int http2_session::on_input(int len)
+{
+    const uint8_t* buf = (const uint8_t*)m_input;
+    int pos = 0;
+    if (m_preface_left)
+    {
+        int offset = PREFACE_LEN - m_preface_left;
+        int n = len < m_preface_left ? len : m_preface_left;
+        if (memcmp(buf, PREFACE + offset, n) != 0)
+        {
+            connection_error(H2_PROTOCOL_ERROR);
+            return 0;
+        }
+        m_preface_left -= n;
+        pos = n;
+        if (!m_preface_left && !m_settings_sent)
+            queue_settings();
+    }
+    while (!m_closing && len - pos >= FRAME_HEADER_LEN)
+    {
+        const uint8_t* h = buf + pos;
+        uint32_t flen = ((uint32_t)h[0] << 16) | ((uint32_t)h[1] << 8) | h[2];
+        if (flen > (uint32_t)MAX_FRAME_SIZE)
+        {
+            connection_error(H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if ((uint32_t)(len - pos) < FRAME_HEADER_LEN + flen)
+            break;
+        // 前言之后的第一个帧必须是SETTINGS
+        if (!m_got_settings && h[3] != FRAME_SETTINGS)
+        {
+            connection_error(H2_PROTOCOL_ERROR);
+            break;
+        }
+        handle_frame(h[3], h[4], read_u32(h + 5) & 0x7fffffff, h + FRAME_HEADER_LEN, flen);
+        pos += FRAME_HEADER_LEN + flen;
+    }
+    if (m_closing)
+        return 0; // 出错之后剩下的输入都丢弃
+    memmove(m_input, m_input + pos, len - pos);
+    return len - pos;
+}
+
+void http2_session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload,
+                                 uint32_t len)
+{
+    // 头部块没结束之前只能收到同一个流的CONTINUATION
+    if (m_continuation_stream && (type != FRAME_CONTINUATION || stream_id != m_continuation_stream))
+    {
+        connection_error(H2_PROTOCOL_ERROR);
+        return;
+    }
+    switch (type)
+    {
+    case FRAME_DATA:
+    {
+        if (stream_id == 0)
+        {
+            connection_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        // 我们只提供静态文件，请求体直接丢弃，但要把窗口还给对端，否则它会被流量控制卡住
+        if (len)
+        {
+            queue_window_update(0, len);
+            if (find_stream(stream_id))
+                queue_window_update(stream_id, len);
+        }
+        break;
+    }
+    case FRAME_HEADERS:
+        handle_headers(flags, stream_id, payload, len);
+        break;
+    case FRAME_CONTINUATION:
+        if (!m_continuation_stream)
+        {
+            connection_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (m_header_block.size() + len > MAX_HEADER_BLOCK)
+        {
+            connection_error(H2_ENHANCE_YOUR_CALM);
+            return;
+        }
+        m_header_block.append((const char*)payload, len);
+        if (flags & FLAG_END_HEADERS)
+            end_headers();
+        break;
+    case FRAME_RST_STREAM:
+    {
+        if (stream_id == 0 || len != 4)
+        {
+            connection_error(stream_id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        for (size_t i = 0; i < m_streams.size(); ++i)
+            if (m_streams[i].id == stream_id)
+            {
+                close_stream(i);
+                break;
+            }
+        break;
+    }
+    case FRAME_SETTINGS:
+        if (stream_id != 0)
+        {
+            connection_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (flags & FLAG_ACK)
+            break;
+        if (len % 6 != 0)
+        {
+            connection_error(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!apply_settings(payload, len))
+            return;
+        m_got_settings = true;
+        queue_frame(FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0);
+        break;
+    case FRAME_PING:
+        if (stream_id != 0 || len != 8)
+        {
+            connection_error(stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!(flags & FLAG_ACK))
+            queue_frame(FRAME_PING, FLAG_ACK, 0, payload, 8);
+        break;
+    case FRAME_GOAWAY:
+        m_goaway_received = true;
+        break;
+    case FRAME_WINDOW_UPDATE:
+    {
+        if (len != 4)
+        {
+            connection_error(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        uint32_t increment = read_u32(payload) & 0x7fffffff;
+        if (increment == 0)
+        {
+            connection_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        int64_t* window = &m_conn_window;
+        if (stream_id)
+        {
+            http2_stream* s = find_stream(stream_id);
+            if (!s)
+                break; // 已经发完的流，忽略
+            window = &s->window;
+        }
+        *window += increment;
+        if (*window > MAX_WINDOW)
+            connection_error(H2_FLOW_CONTROL_ERROR);
+        break;
+    }
+    case FRAME_PUSH_PROMISE:
+        connection_error(H2_PROTOCOL_ERROR); // 客户端不能推送
+        break;
+    default:
+        break; // PRIORITY和未知类型的帧直接忽略
+    }
+}
+
+void http2_session::handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len)
+{
+    if (stream_id == 0 || !(stream_id & 1))
+    {
+        connection_error(H2_PROTOCOL_ERROR);
+        return;
+    }
+    // 去掉填充和优先级字段，剩下的是头部块片段
+    uint32_t pad = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1)
+        {
+            connection_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        pad = payload[0];
+        payload++;
+        len--;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        if (len < 5)
+        {
+            connection_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        payload += 5;
+        len -= 5;
+    }
+    if (pad > len)
+    {
+        connection_error(H2_PROTOCOL_ERROR);
+        return;
+    }
+    m_header_block.assign((const char*)payload, len - pad);
+    m_continuation_stream = stream_id;
+    if (flags & FLAG_END_HEADERS)
+        end_headers();
+}
+
+void http2_session::end_headers()
+{
+    uint32_t stream_id = m_continuation_stream;
+    m_continuation_stream = 0;
+    // 即使这个流会被忽略也要解码：动态表是整个连接共享的
+    std::vector<hpack_header> headers;
+    if (!m_decoder.decode((const uint8_t*)m_header_block.data(), m_header_block.size(), headers))
+    {
+        connection_error(H2_COMPRESSION_ERROR);
+        return;
+    }
+    m_header_block.clear();
+    if (stream_id <= m_last_stream_id)
+        return; // 已有流上的trailer，静态文件用不到
+    m_last_stream_id = stream_id;
+    if (m_goaway_sent)
+        return; // GOAWAY之后的新流不处理
+    if (m_streams.size() >= m_max_streams)
+    {
+        uint8_t payload[4];
+        put_u32(payload, H2_REFUSED_STREAM);
+        queue_frame(FRAME_RST_STREAM, 0, stream_id, payload, 4);
+        return;
+    }
+    open_stream(stream_id, headers);
+}
+
+bool http2_session::apply_settings(const uint8_t* payload, uint32_t len)
+{
+    for (uint32_t i = 0; i + 6 <= len; i += 6)
+    {
+        uint16_t id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = read_u32(payload + i + 2);
+        if (id == SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if (value > MAX_WINDOW)
+            {
+                connection_error(H2_FLOW_CONTROL_ERROR);
+                return false;
+            }
+            // 初始窗口的变化要同步到所有已经打开的流上
+            int64_t delta = (int64_t)value - m_peer_initial_window;
+            for (size_t j = 0; j < m_streams.size(); ++j)
+                m_streams[j].window += delta;
+            m_peer_initial_window = value;
+        }
+        else if (id == SETTINGS_MAX_FRAME_SIZE)
+        {
+            if (value < 16384 || value > 16777215)
+            {
+                connection_error(H2_PROTOCOL_ERROR);
+                return false;
+            }
+            m_peer_max_frame = value;
+        }
+        // 其它参数（头部表大小、服务器推送等）不影响我们发出的内容
+    }
+    return true;
+}
+
+void http2_session::open_stream(uint32_t stream_id, const std::vector<hpack_header>& headers)
+{
+    const std::string* method = nullptr;
+    const std::string* path = nullptr;
+    const std::string* authority = nullptr;
+    for (size_t i = 0; i < headers.size(); ++i)
+    {
+        if (headers[i].first == ":method")
+            method = &headers[i].second;
+        else if (headers[i].first == ":path")
+            path = &headers[i].second;
+        else if (headers[i].first == ":authority" || (headers[i].first == "host" && !authority))
+            authority = &headers[i].second;
+    }
+    http_conn::m_request_count.fetch_add(1, std::memory_order_relaxed);
+    bool head_only = method && *method == "HEAD";
+    if (!limiter_take(m_limit))
+    {
+        start_response(stream_id, http_conn::TOO_MANY_REQUESTS, nullptr, head_only);
+        return;
+    }
+    // 反向代理只转发HTTP/1.1的请求，HTTP/2的流不能独占一个上游连接，先明确地回502而不是当成本地文件
+    route_match m;
+    const route* r = path ? router_match(path->data(), path->size(), m) : nullptr;
+    if (r && r->kind == ROUTE_PROXY)
+    {
+        start_response(stream_id, http_conn::BAD_GATEWAY, nullptr, head_only);
+        return;
+    }
+    if (!method || !path || (*method != "GET" && !head_only) || path->empty() || (*path)[0] != '/')
+    {
+        start_response(stream_id, http_conn::BAD_REQUEST, nullptr, head_only);
+        return;
+    }
+    vhost* host = authority ? vhost_lookup(authority->data(), authority->size()) : vhost_lookup(nullptr, 0);
+    if (!vhost_enter(host))
+    {
+        start_response(stream_id, http_conn::SERVICE_UNAVAILABLE, nullptr, head_only);
+        return;
+    }
+    if (r && r->kind == ROUTE_HANDLER)
+    {
+        start_handler(stream_id, r, m, *method, *path, head_only, host);
+        return;
+    }
+    // 和HTTP/1.1共用同一套文件映射逻辑
+    const char* root;
+    http_span target = {path->data(), (uint32_t)path->size()};
+    http_span url = {path->data(), (uint32_t)strcspn(path->c_str(), "?")};
+    http_conn::resolve_static(r, m, host, root, url);
+    file_entry* file = nullptr;
+    http_conn::HTTP_CODE code = http_conn::map_file(root, url, file);
+    if (code == http_conn::DIRECTORY_REQUEST)
+    {
+        std::shared_ptr<const std::string> page;
+        autoindex_stream* listing = nullptr;
+        const char* type;
+        code = http_conn::list_directory(file, target, page, listing, type);
+        start_response(stream_id, code, nullptr, head_only, host);
+        http2_stream& s = m_streams.back();
+        if (page)
+        {
+            s.body = page->data();
+            s.body_len = page->size();
+            s.dynamic = page;
+        }
+        if (listing)
+        {
+            s.body_len = 0;
+            s.listing.reset(listing);
+        }
+        if (page || listing)
+            s.content_type = type;
+        return;
+    }
+    start_response(stream_id, code, file, head_only, host);
+}
+
+void http2_session::start_handler(uint32_t stream_id, const route* r, const route_match& m, const std::string& method,
+                                  const std::string& path, bool head_only, vhost* host)
+{
+    route_request req;
+    req.method = method.c_str();
+    req.path = path.c_str();
+    req.path_len = strcspn(req.path, "?");
+    req.match = &m;
+    req.names = &r->names;
+    req.request = nullptr;
+    std::shared_ptr<std::string> body = std::make_shared<std::string>();
+    std::string type;
+    if (!r->handler(req, *body, type))
+    {
+        start_response(stream_id, http_conn::NO_RESOURCE, nullptr, head_only, host);
+        return;
+    }
+    start_response(stream_id, http_conn::DYNAMIC_REQUEST, nullptr, head_only, host);
+    http2_stream& s = m_streams.back();
+    s.body = body->data();
+    s.body_len = body->size();
+    s.dynamic = body;
+    s.content_type = type;
+}
+
+void http2_session::start_response(uint32_t stream_id, http_conn::HTTP_CODE code, file_entry* file, bool head_only,
+                                   vhost* host)
+{
+    http2_stream s;
+    const char* title;
+    const char* form;
+    if (!http_conn::status_page(code, s.status, title, form))
+    {
+        code = http_conn::INTERNAL_ERROR;
+        http_conn::status_page(code, s.status, title, form);
+    }
+    s.id = stream_id;
+    s.file = file;
+    if (code == http_conn::FILE_REQUEST && file && file->data)
+    {
+        s.body = file->data;
+        s.body_len = file->st.st_size;
+    }
+    else
+    {
+        s.body = form;
+        s.body_len = strlen(form);
+    }
+    s.sent = 0;
+    s.head_only = head_only;
+    s.headers_sent = false;
+    s.window = m_peer_initial_window;
+    s.host = host;
+    m_streams.push_back(s);
+}
+
+http2_stream* http2_session::find_stream(uint32_t stream_id)
+{
+    for (size_t i = 0; i < m_streams.size(); ++i)
+        if (m_streams[i].id == stream_id)
+            return &m_streams[i];
+    return nullptr;
+}
+
+void http2_session::close_stream(size_t index)
+{
+    if (m_streams[index].file)
+        file_cache_release(m_streams[index].file);
+    if (m_streams[index].host)
+        vhost_leave(m_streams[index].host);
+    m_streams.erase(m_streams.begin() + index);
+    if (m_next > index)
+        --m_next;
+}
+
+void http2_session::add_segment(const char* data, size_t offset, size_t len)
+{
+    // 相邻的控制缓冲区片段合并成一个iovec
+    if (!data && !m_segments.empty())
+    {
+        out_segment& last = m_segments.back();
+        if (!last.data && last.offset + last.len == offset)
+        {
+            last.len += len;
+            return;
+        }
+    }
+    out_segment seg = {data, offset, len};
+    m_segments.push_back(seg);
+}
+
+bool http2_session::schedule(http2_stream& s, size_t& bytes)
+{
+    if (!s.headers_sent)
+    {
+        std::string block;
+        hpack_encode_status(block, s.status);
+        // 分块输出的目录列表事先不知道长度，由END_STREAM标记结束
+        if (!s.listing)
+        {
+            char length[24];
+            int n = snprintf(length, sizeof(length), "%zu", s.body_len);
+            hpack_encode_literal(block, 28, length, n); // 28: content-length
+        }
+        if (!s.content_type.empty())
+            hpack_encode_literal(block, 31, s.content_type.data(), s.content_type.size()); // 31: content-type
+        bool end = s.head_only || (s.body_len == 0 && !s.listing);
+        size_t offset = m_ctrl.size();
+        queue_frame(FRAME_HEADERS, FLAG_END_HEADERS | (end ? FLAG_END_STREAM : 0), s.id, block.data(), block.size());
+        add_segment(nullptr, offset, m_ctrl.size() - offset);
+        bytes += m_ctrl.size() - offset;
+        s.headers_sent = true;
+        return true;
+    }
+    if (s.head_only)
+        return false;
+    if (s.sent >= s.body_len && s.listing)
+    {
+        // 上一块可能还被当前批次引用，等批次发完再释放
+        if (s.dynamic)
+            m_retired_chunks.push_back(s.dynamic);
+        std::shared_ptr<std::string> chunk = std::make_shared<std::string>();
+        if (!s.listing->next(*chunk))
+            s.listing.reset();
+        s.dynamic = chunk;
+        s.body = chunk->data();
+        s.body_len = chunk->size();
+        s.sent = 0;
+    }
+    if (s.sent >= s.body_len)
+        return false;
+    // 升级的连接上，等客户端处理完101、发来连接前言之后再发响应体，
+    // 否则有的客户端会在切换协议之前就收到大量DATA帧
+    if (m_preface_left)
+        return false;
+    // 一个DATA帧的大小受对端最大帧长度、连接窗口和流窗口三者限制
+    int64_t room = s.window < m_conn_window ? s.window : m_conn_window;
+    if (room <= 0)
+        return false;
+    size_t n = s.body_len - s.sent;
+    if (n > m_peer_max_frame)
+        n = m_peer_max_frame;
+    if ((int64_t)n > room)
+        n = room;
+    bool end = s.sent + n == s.body_len && !s.listing;
+    size_t offset = m_ctrl.size();
+    queue_frame(FRAME_DATA, end ? FLAG_END_STREAM : 0, s.id, nullptr, n); // 只写帧头，内容直接引用文件
+    add_segment(nullptr, offset, FRAME_HEADER_LEN);
+    add_segment(s.body + s.sent, 0, n);
+    s.sent += n;
+    s.window -= n;
+    m_conn_window -= n;
+    bytes += FRAME_HEADER_LEN + n;
+    return true;
+}
+
+bool http2_session::build_batch()
+{
+    m_segments.clear();
+    // 解析时排队的控制帧（SETTINGS ACK、PING、WINDOW_UPDATE、GOAWAY等）先发
+    if (!m_ctrl.empty())
+        add_segment(nullptr, 0, m_ctrl.size());
+    size_t bytes = m_ctrl.size();
+    // 每轮给每个流一个帧的机会，多个文件交替发送，不会被一个大文件独占连接
+    bool progress = true;
+    while (progress && !m_closing)
+    {
+        progress = false;
+        for (size_t n = m_streams.size(); n > 0; --n)
+        {
+            if (m_segments.size() + 2 > (size_t)MAX_SEGMENTS || bytes >= BATCH_BYTES)
+            {
+                progress = false;
+                break;
+            }
+            if (m_next >= m_streams.size())
+                m_next = 0;
+            http2_stream& s = m_streams[m_next];
+            if (schedule(s, bytes))
+                progress = true;
+            if (s.headers_sent && (s.head_only || (s.sent >= s.body_len && !s.listing)))
+            {
+                // 流已经发完，文件映射要等这一批发出去之后才能释放
+                if (s.host)
+                    vhost_leave(s.host);
+                m_retired.push_back(s);
+                m_streams.erase(m_streams.begin() + m_next);
+            }
+            else
+            {
+                ++m_next;
+            }
+        }
+    }
+    m_iov_count = m_segments.size();
+    m_iov_pos = 0;
+    for (int i = 0; i < m_iov_count; ++i)
+    {
+        const out_segment& seg = m_segments[i];
+        m_iov[i].iov_base = (void*)(seg.data ? seg.data : m_ctrl.data() + seg.offset);
+        m_iov[i].iov_len = seg.len;
+    }
+    return m_iov_count > 0;
+}
+
+void http2_session::finish_batch()
+{
+    m_ctrl.clear();
+    m_iov_count = m_iov_pos = 0;
+    for (size_t i = 0; i < m_retired.size(); ++i)
+        if (m_retired[i].file)
+            file_cache_release(m_retired[i].file);
+    m_retired.clear();
+    m_retired_chunks.clear();
+}
+
+http_conn::WRITE_RESULT http2_session::send(int sockfd, tls_conn* tls, std::vector<iovec>& cold)
+{
+    while (true)
+    {
+        if (m_iov_pos == m_iov_count && !build_batch())
+        {
+            finish_batch();
+            return http_conn::WRITE_DONE; // 没有可发的数据，或者所有流都在等对端的WINDOW_UPDATE
+        }
+        if (disk_enabled())
+        {
+            // 帧头在m_ctrl里，只检查响应体（文件的映射）：一批的大小受流量控制窗口限制，整批检查
+            cold.clear();
+            for (int i = m_iov_pos; i < m_iov_count; ++i)
+            {
+                const char* p = (const char*)m_iov[i].iov_base;
+                if (p < m_ctrl.data() || p >= m_ctrl.data() + m_ctrl.size())
+                    disk_resident(&m_iov[i], 1, m_iov[i].iov_len, cold);
+            }
+            if (!cold.empty())
+                return http_conn::WRITE_DISK;
+        }
+        ssize_t n = tls ? tls->writev(m_iov + m_iov_pos, m_iov_count - m_iov_pos)
+                        : writev(sockfd, m_iov + m_iov_pos, m_iov_count - m_iov_pos);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return http_conn::WRITE_AGAIN;
+            return http_conn::WRITE_ERROR;
+        }
+        // 跳过已经完整发出的iovec，调整发了一半的那个
+        while (m_iov_pos < m_iov_count && (size_t)n >= m_iov[m_iov_pos].iov_len)
+        {
+            n -= m_iov[m_iov_pos].iov_len;
+            ++m_iov_pos;
+        }
+        if (m_iov_pos < m_iov_count)
+        {
+            m_iov[m_iov_pos].iov_base = (char*)m_iov[m_iov_pos].iov_base + n;
+            m_iov[m_iov_pos].iov_len -= n;
+        }
+        else
+        {
+            finish_batch();
+        }
+    }
+}
@@ -0,0 +1,163 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "hpack.h"
+#include "http_conn.h"
+#include "tls.h"
+
+/* HTTP/2上的一个请求流，以及它对应的静态响应 */
+struct http2_stream
+{
+    uint32_t id;
+    int status;
+    /* 响应体：mmap的目标文件、处理函数生成的内容，或者静态的错误页面 */
+    const char* body;
+    size_t body_len;
+    /* 响应体已经排进发送批次的字节数 */
+    size_t sent;
+    /* 文件缓存的条目，流结束后释放；错误页面时为空 */
+    file_entry* file;
+    /* HEAD请求只发响应头 */
+    bool head_only;
+    bool headers_sent;
+    /* 对端给这个流的发送窗口（流级流量控制） */
+    int64_t window;
+    /* 计入了并发请求数的虚拟主机，流结束时减回去；没有计入时为空 */
+    vhost* host;
+    /* 处理函数或者目录列表生成的响应体和Content-Type，流退休之后随拷贝一起释放 */
+    std::shared_ptr<const std::string> dynamic;
+    std::string content_type;
+    /* 分块输出的大目录列表：当前一块发完后取下一块，没有更多块时置空 */
+    std::shared_ptr<autoindex_stream> listing;
+};
+
+/*
+    一个HTTP/2连接（h2c，或者TLS上经ALPN协商的h2）的会话状态，由http_conn持有，只被连接的持有者访问，不需要加锁。
+    收到的帧在工作线程的process()中解析；响应由调度器按轮转方式在各个流之间交替切成DATA帧，
+    帧头放在控制缓冲区里，帧的内容直接指向mmap的文件，用writev一次发出多个帧。
+    解析只发生在发送批次为空的时候（连接回到CONN_IDLE之后才会再读），所以控制缓冲区不会在发送途中被修改
+*/
+class http2_session
+{
+public:
+    /* 连接前言 "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" */
+    static const char PREFACE[];
+    static const int PREFACE_LEN = 24;
+    static const int FRAME_HEADER_LEN = 9;
+    /* 我们接受的最大帧，等于SETTINGS_MAX_FRAME_SIZE的默认值，输入缓冲区恰好能放下一个完整的帧 */
+    static const int MAX_FRAME_SIZE = 16384;
+    static const int INPUT_SIZE = FRAME_HEADER_LEN + MAX_FRAME_SIZE;
+
+    /// @param max_streams 允许对端同时打开的流数
+    /// @param input_size 输入缓冲区大小，不小于INPUT_SIZE
+    /// @param limit 连接在限流表中的槽，每个新的流消耗一个令牌
+    http2_session(int max_streams, int input_size, const limiter_ticket& limit);
+    ~http2_session();
+
+    /// @brief 处理 "Upgrade: h2c" 请求：排入101响应和我们的SETTINGS，升级前的请求成为流1
+    /// @param settings HTTP2-Settings请求头的值（base64url编码的SETTINGS载荷），长度为len
+    /// @param code 升级请求本身的处理结果，file为FILE_REQUEST时的文件缓存条目，引用交给会话
+    /// @return HTTP2-Settings不合法时返回false，此时会话没有被修改
+    bool upgrade(const char* settings, size_t len, http_conn::HTTP_CODE code, file_entry* file, bool head_only);
+
+    /* 输入缓冲区，http_conn直接把socket数据读到这里 */
+    char* input() { return m_input; }
+    int input_size() const { return m_input_size; }
+    /// @brief 解析输入缓冲区前len字节中所有完整的帧
+    /// @return 剩下的不完整帧的字节数，它们被移到缓冲区开头
+    int on_input(int len);
+    /// @brief 把排队的帧写到socket，一批发完就调度下一批，直到没有可发的数据或者socket写满
+    /// @param tls 经过TLS（ALPN协商的h2）时的记录层，h2c为空
+    /// @param cold 返回WRITE_DISK时为这一批中不在内存里的响应体页
+    http_conn::WRITE_RESULT send(int sockfd, tls_conn* tls, std::vector<iovec>& cold);
+    /* 优雅关闭：发送GOAWAY，不再接受新的流，已有的流发完后连接结束 */
+    void shutdown();
+    /* 会话已经结束（出错或者GOAWAY之后所有流都发完了），连接可以关闭 */
+    bool finished() const;
+    /* 没有进行中的流，也没有待发送的数据 */
+    bool idle() const { return m_streams.empty() && m_iov_pos == m_iov_count; }
+
+private:
+    struct out_segment
+    {
+        /* 为空时表示控制缓冲区中从offset开始的数据 */
+        const char* data;
+        size_t offset;
+        size_t len;
+    };
+
+    void handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len);
+    void handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len);
+    void end_headers();
+    bool apply_settings(const uint8_t* payload, uint32_t len);
+    void open_stream(uint32_t stream_id, const std::vector<hpack_header>& headers);
+    void start_response(uint32_t stream_id, http_conn::HTTP_CODE code, file_entry* file, bool head_only,
+                        vhost* host = nullptr);
+    /* 调用路由的处理函数，作为流的响应 */
+    void start_handler(uint32_t stream_id, const route* r, const route_match& m, const std::string& method,
+                       const std::string& path, bool head_only, vhost* host);
+    void close_stream(size_t index);
+    http2_stream* find_stream(uint32_t stream_id);
+
+    void queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, uint32_t len);
+    void queue_window_update(uint32_t stream_id, uint32_t increment);
+    void queue_settings();
+    void connection_error(uint32_t code);
+
+    /* 调度下一个发送批次，没有可发的数据时返回false */
+    bool build_batch();
+    /* 为一个流排入响应头或一个DATA帧，有进展返回true */
+    bool schedule(http2_stream& s, size_t& bytes);
+    void add_segment(const char* data, size_t offset, size_t len);
+    /* 一个批次发送完毕：清空控制缓冲区，释放已经发完的流的文件映射 */
+    void finish_batch();
+
+    char* m_input;
+    int m_input_size;
+    /* 还没收到的连接前言字节数 */
+    int m_preface_left;
+    bool m_got_settings;
+    bool m_settings_sent;
+
+    hpack_decoder m_decoder;
+    /* 正在接收CONTINUATION的流和已经收到的头部块 */
+    uint32_t m_continuation_stream;
+    std::string m_header_block;
+
+    /* 活跃的流，m_next是轮转调度的位置 */
+    std::vector<http2_stream> m_streams;
+    size_t m_next;
+    /* 已经发完但文件映射还被当前批次引用的流 */
+    std::vector<http2_stream> m_retired;
+    /* 目录列表中已经排进当前批次、被新的一块替换掉的块 */
+    std::vector<std::shared_ptr<const std::string>> m_retired_chunks;
+    size_t m_max_streams;
+    uint32_t m_last_stream_id;
+    limiter_ticket m_limit;
+
+    /* 连接级发送窗口，以及对端SETTINGS指定的流初始窗口和最大帧长度 */
+    int64_t m_conn_window;
+    int64_t m_peer_initial_window;
+    uint32_t m_peer_max_frame;
+
+    bool m_goaway_sent;
+    bool m_goaway_received;
+    /* 发生连接错误，GOAWAY发出后关闭连接 */
+    bool m_closing;
+
+    /* 控制缓冲区：控制帧、响应头和DATA帧的帧头 */
+    std::string m_ctrl;
+    std::vector<out_segment> m_segments;
+    /* 当前批次，m_iov_pos之前的部分已经发出 */
+    static const int MAX_SEGMENTS = 64;
+    struct iovec m_iov[MAX_SEGMENTS];
+    int m_iov_count;
+    int m_iov_pos;
+};
+
+#endif
@@ -0,0 +1,275 @@
+// HTTP压测客户端：多个keep-alive连接并发请求同一个URL，统计延迟分位数、吞吐量，
+// 指定服务器pid时还统计这段时间服务器消耗的CPU时间，用来对比各种模式（如低延迟自旋）的收益和代价
+//
+// 用法: http_bench ip port [-c 连接数] [-n 每个连接的请求数] [-u URL] [-p 服务器pid]
+//
+// 内存压力场景（-s 秒数）：-c个线程在这段时间里不停地建立连接，一半只发送不完整的请求头（占住读缓冲区），
+// 一半请求URL但从不读取响应（占住文件映射和socket发送缓冲区），连接一直保持到结束。
+// 同时每100ms采样服务器的RSS，报告峰值；给出 -m 上限MB 时匿名页（RssAnon）的峰值超过上限则以2退出，用来验证
+// memory_budget_mb。预算管的就是匿名页：没读完的响应占住的文件映射是干净的页缓存，算在VmRSS里但不计入预算，
+// VmRSS只作参考输出
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+struct bench_options {
+    const char* ip = "127.0.0.1";
+    int port = 8080;
+    int connections = 4;
+    int requests = 1000;
+    std::string url = "/index.html";
+    int server_pid = 0;
+    int stress_seconds = 0;
+    int rss_limit_mb = 0;
+};
+
+// 读取/proc/<pid>/stat里的utime+stime，单位为时钟滴答
+static long read_cpu_ticks(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) return -1;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    // 第2个字段(comm)可能含空格，从最后一个')'之后开始数，utime和stime是第14、15个字段
+    char* p = strrchr(buf, ')');
+    if (!p) return -1;
+    long utime = 0, stime = 0;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime) != 2) return -1;
+    return utime + stime;
+}
+
+// 读取/proc/<pid>/status里的一项（如 "VmRSS:"、"RssAnon:"），单位为KB
+static long read_status_kb(int pid, const char* field) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) return -1;
+    char line[256];
+    long kb = -1;
+    size_t len = strlen(field);
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, field, len) == 0) {
+            kb = strtol(line + len, nullptr, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+static int connect_to(const bench_options& opt) {
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    inet_pton(AF_INET, opt.ip, &addr.sin_addr);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// 读完一个完整的响应（响应头+Content-Length指定的响应体），返回false表示连接出错或被关闭
+static bool read_response(int fd, std::string& buf, bool& keep_alive) {
+    size_t header_end;
+    char tmp[16384];
+    while ((header_end = buf.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0) return false;
+        buf.append(tmp, n);
+    }
+    size_t body_len = 0;
+    size_t pos = buf.find("Content-Length:");
+    if (pos != std::string::npos && pos < header_end) body_len = strtoul(buf.c_str() + pos + 15, nullptr, 10);
+    keep_alive = buf.find("Connection: keep-alive") < header_end;
+    size_t total = header_end + 4 + body_len;
+    while (buf.size() < total) {
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0) return false;
+        buf.append(tmp, n);
+    }
+    buf.erase(0, total);
+    return true;
+}
+
+// 一个连接上顺序发送请求，记录每个请求的延迟（纳秒）
+static void run_connection(const bench_options& opt, std::vector<long>& latencies, int& errors) {
+    std::string request = "GET " + opt.url + " HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n";
+    std::string buf;
+    int fd = -1;
+    for (int i = 0; i < opt.requests; ++i) {
+        if (fd < 0) {
+            fd = connect_to(opt);
+            buf.clear();
+            if (fd < 0) {
+                errors++;
+                continue;
+            }
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool keep_alive = false;
+        if (send(fd, request.data(), request.size(), 0) != (ssize_t)request.size() ||
+            !read_response(fd, buf, keep_alive)) {
+            errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        auto end = std::chrono::steady_clock::now();
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        if (!keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) close(fd);
+}
+
+// 内存压力场景的一个线程：建立连接直到时间用完，返回时关闭所有连接
+static void run_stress(const bench_options& opt, std::chrono::steady_clock::time_point deadline, int id,
+                       long& held, long& refused) {
+    std::string full = "GET " + opt.url + " HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n";
+    std::string partial = "GET " + opt.url + " HTTP/1.1\r\nHost: bench\r\nX-Pad: ";
+    partial.append(1500, 'a');
+    std::vector<int> fds;
+    for (long i = 0; std::chrono::steady_clock::now() < deadline; ++i) {
+        int fd = connect_to(opt);
+        if (fd < 0) {
+            refused++;
+            usleep(1000); // 本机的端口或fd用完了，稍等再试
+            continue;
+        }
+        // 只缩小接收缓冲区，让不读取的响应尽快把服务器的发送缓冲区堵住
+        int small = 4096;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+        const std::string& req = (i + id) % 2 ? full : partial;
+        if (send(fd, req.data(), req.size(), MSG_NOSIGNAL) != (ssize_t)req.size()) {
+            refused++;
+            close(fd);
+            continue;
+        }
+        fds.push_back(fd);
+    }
+    // 被服务器在accept之后关闭的连接读到EOF或者RST
+    char c;
+    for (int fd : fds) {
+        ssize_t n = recv(fd, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) refused++;
+        else held++;
+        close(fd);
+    }
+}
+
+static int stress_main(const bench_options& opt) {
+    if (!opt.server_pid) {
+        printf("内存压力场景需要 -p 服务器pid\n");
+        return 1;
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opt.stress_seconds);
+    std::vector<long> held(opt.connections, 0), refused(opt.connections, 0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < opt.connections; ++i) {
+        threads.emplace_back(run_stress, std::cref(opt), deadline, i, std::ref(held[i]), std::ref(refused[i]));
+    }
+    // 连接数组和缓冲区的内存区都是私有匿名映射，没有用共享内存，所以只看RssAnon
+    long peak_kb = 0, last_kb = 0, peak_rss_kb = 0;
+    while (std::chrono::steady_clock::now() < deadline) {
+        long kb = read_status_kb(opt.server_pid, "RssAnon:");
+        if (kb > 0) last_kb = kb;
+        peak_kb = std::max(peak_kb, kb);
+        peak_rss_kb = std::max(peak_rss_kb, read_status_kb(opt.server_pid, "VmRSS:"));
+        usleep(100000);
+    }
+    for (auto& t : threads) t.join();
+    long total_held = 0, total_refused = 0;
+    for (int i = 0; i < opt.connections; ++i) {
+        total_held += held[i];
+        total_refused += refused[i];
+    }
+    printf("保持的连接: %ld  被拒绝/关闭: %ld  服务器匿名页: 峰值 %.1f MB 结束时 %.1f MB（VmRSS峰值 %.1f MB）\n",
+           total_held, total_refused, peak_kb / 1024.0, last_kb / 1024.0, peak_rss_kb / 1024.0);
+    if (opt.rss_limit_mb && peak_kb > (long)opt.rss_limit_mb * 1024) {
+        printf("匿名页峰值超过了上限 %d MB\n", opt.rss_limit_mb);
+        return 2;
+    }
+    return 0;
+}
+
+static long percentile(const std::vector<long>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t idx = (size_t)(p * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s ip port [-c connections] [-n requests_per_conn] [-u url] [-p server_pid] "
+               "[-s stress_seconds [-m rss_limit_mb]]\n", argv[0]);
+        return 1;
+    }
+    bench_options opt;
+    opt.ip = argv[1];
+    opt.port = atoi(argv[2]);
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-c") == 0) opt.connections = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0) opt.requests = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-u") == 0) opt.url = argv[i + 1];
+        else if (strcmp(argv[i], "-p") == 0) opt.server_pid = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-s") == 0) opt.stress_seconds = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-m") == 0) opt.rss_limit_mb = atoi(argv[i + 1]);
+    }
+    if (opt.stress_seconds > 0) return stress_main(opt);
+
+    std::vector<std::vector<long>> per_conn(opt.connections);
+    std::vector<int> errors(opt.connections, 0);
+    long cpu_before = opt.server_pid ? read_cpu_ticks(opt.server_pid) : -1;
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < opt.connections; ++i) {
+        per_conn[i].reserve(opt.requests);
+        threads.emplace_back(run_connection, std::cref(opt), std::ref(per_conn[i]), std::ref(errors[i]));
+    }
+    for (auto& t : threads) t.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    long cpu_after = opt.server_pid ? read_cpu_ticks(opt.server_pid) : -1;
+
+    std::vector<long> all;
+    int total_errors = 0;
+    for (int i = 0; i < opt.connections; ++i) {
+        all.insert(all.end(), per_conn[i].begin(), per_conn[i].end());
+        total_errors += errors[i];
+    }
+    std::sort(all.begin(), all.end());
+
+    printf("请求数: %zu  错误: %d  耗时: %.3f s  吞吐: %.0f req/s\n", all.size(), total_errors, seconds, all.size() / seconds);
+    printf("延迟(us): p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+           percentile(all, 0.50) / 1000.0, percentile(all, 0.90) / 1000.0,
+           percentile(all, 0.99) / 1000.0, all.empty() ? 0.0 : all.back() / 1000.0);
+    if (cpu_before >= 0 && cpu_after >= 0) {
+        double cpu_seconds = (double)(cpu_after - cpu_before) / sysconf(_SC_CLK_TCK);
+        printf("服务器CPU: %.2f s (%.0f%% 单核)  每请求 %.1f us\n", cpu_seconds, 100.0 * cpu_seconds / seconds,
+               all.empty() ? 0.0 : cpu_seconds * 1e6 / all.size());
+    }
+    return total_errors ? 2 : 0;
+}
@@ -1,18 +1,35 @@
 #include "http_conn.h"
+#include "config.h"
+#include "affinity.h"
+#include "http2.h"
+#include "tls.h"
+#include "proxy.h"
+#include "vhost.h"
+#include "router.h"
+#include "file_cache.h"
+#include "autoindex.h"
+#include "mem_budget.h"
+#include "disk_io.h"
+#include "rcu.h"
 
 // HTTP响应状态相关字符串
 const char *ok_200_title = "OK";
+const char *ok_200_empty_form = "<html><body></body></html>";
 const char *error_400_title = "Bad Request";
 const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char *error_403_title = "Forbidden";
 const char *error_403_form = "You do not have permission to get file from this server.\n";
 const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
+const char *error_429_title = "Too Many Requests";
+const char *error_429_form = "You are sending requests too quickly, please slow down.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the requested file.\n";
+const char *error_502_title = "Bad Gateway";
+const char *error_502_form = "The upstream server is unavailable or sent an invalid response.\n";
+const char *error_503_title = "Service Unavailable";
+const char *error_503_form = "This site is handling too many requests, please try again later.\n";
 
-// 网站根目录
-const char *doc_root = "/home/asus/linux-high-effective/linux-high-effective/Pool_of_thread_process/code/my_tiny_web/output/www";
 // 设置文件描述符为非阻塞
 int setnonblocking(int fd)
 {
@@ -22,67 +39,216 @@ int setnonblocking(int fd)
     return old_option;
 }
 
-void addfd(int epollfd, int fd, bool one_shot)
+void addfd(int epollfd, int fd, bool one_shot, bool writable)
 {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = (uint32_t)fd; // 高32位留给反向代理标记上游socket
     event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
     if (one_shot)
         event.events |= EPOLLONESHOT;
+    if (writable)
+        event.events |= EPOLLOUT;
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    http_conn::m_epoll_ctl_count.fetch_add(1, std::memory_order_relaxed);
     setnonblocking(fd);
 }
 
 void modfd(int epollfd, int fd, int ev)
 {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = (uint32_t)fd;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP; // 采用EPOLLET边缘触发模式
     // 水平触发 LT默认模式 当文件描述符上fd有未处理的事件 epoll会持续发通知 知道事件被完全处理 例如如果有100字节 只读了50字节 epoll会在每次epoll_wait时都返回该fd的可读事件 直到100字节全被读取
     // 边缘触发 仅在fd状态发生变化的时触发一次通知 如果只读取了50字节 剩余的字节 会在新写入的数据中被读取 可以配合非阻塞的IO 实现一次性处理完所有当前可用的数据
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    http_conn::m_epoll_ctl_count.fetch_add(1, std::memory_order_relaxed);
 }
 
 void removefd(int epollfd, int fd)
 {
     epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    http_conn::m_epoll_ctl_count.fetch_add(1, std::memory_order_relaxed);
     close(fd);
 }
 
 // 初始化静态成员
-int http_conn::m_epollfd = -1;
-int http_conn::m_user_count = 0;
+std::atomic<int> http_conn::m_user_count(0);
+std::atomic<bool> http_conn::m_draining(false);
+std::atomic<long> http_conn::m_request_count(0);
+std::atomic<long> http_conn::m_bulk_bytes(64 * 1024);
+std::atomic<long> http_conn::m_zerocopy_bytes(128 * 1024);
+void (*http_conn::m_disk_done)(http_conn *conn) = nullptr;
+std::atomic<long> http_conn::m_epoll_ctl_count(0);
+int http_conn::m_read_buffer_size = 2048;
+int http_conn::m_write_buffer_size = 1024;
+bool http_conn::m_numa_local = false;
+char *http_conn::m_buf_arena = nullptr;
+size_t http_conn::m_buf_slot = 0;
+http_conn *http_conn::m_conns = nullptr;
+conn_hot *http_conn::m_hot = nullptr;
+ssl_ctx_st *http_conn::m_tls_ctx = nullptr;
+
+http_conn::~http_conn()
+{
+    delete m_h2;
+    delete m_tls;
+    delete m_proxy;
+    m_out.reset();
+    free_buffers();
+}
+
+void http_conn::free_buffers()
+{
+    // 区域里的缓冲区属于fd的槽，一直留着
+    if (m_buf_arena)
+        return;
+    if (m_read_buf)
+        mem_charge(MEM_BUFFERS, -(long)m_read_buffer_size);
+    if (m_write_buf)
+        mem_charge(MEM_BUFFERS, -(long)m_write_buffer_size);
+    if (m_request.headers)
+        mem_charge(MEM_BUFFERS, -(long)sizeof(http_header_index));
+    delete[] m_read_buf;
+    delete[] m_write_buf;
+    delete m_request.headers;
+    m_read_buf = m_write_buf = nullptr;
+    m_request.headers = nullptr;
+}
 
 // 关闭连接
 void http_conn::close_conn(bool real_close)
 {
-    if (real_close && m_sockfd != -1)
+    conn_hot &h = hot();
+    if (real_close && h.sockfd != -1)
     {
-        removefd(m_epollfd, m_sockfd);
-        m_sockfd = -1;
+        // 先清掉sockfd再close：close之后同一个fd号可能立刻被事件循环accept并重新init
+        int sockfd = h.sockfd;
+        h.sockfd = -1;
         m_user_count--;
+        unmap();
+        m_out.reset();
+        if (m_vhost_entered)
+        {
+            vhost_leave(m_vhost);
+            m_vhost_entered = false;
+        }
+        delete m_h2;
+        m_h2 = nullptr;
+        // 转发到一半的上游连接不能再复用，连同管道一起关闭
+        delete m_proxy;
+        m_proxy = nullptr;
+        if (m_tls)
+        {
+            m_tls->shutdown();
+            delete m_tls;
+            m_tls = nullptr;
+        }
+        // 内存紧张时不为这个fd号保留缓冲区，下一次init时再分配
+        if (mem_level() >= MEM_SHRINK)
+            free_buffers();
+        // 会话已经删除，没有人再用这张票扣令牌；要在close之前释放，之后同一个fd号可能被重新init
+        limiter_release(m_limit);
+        removefd(h.epollfd, sockfd);
     }
 }
 
 // 初始化新连接
-void http_conn::init(int sockfd, const sockaddr_in &addr)
+void http_conn::init(int sockfd, const sockaddr_in &addr, int epollfd, const limiter_ticket &limit, bool tls)
 {
-    m_sockfd = sockfd;
+    conn_hot &h = hot();
+    h.sockfd = sockfd;
+    m_limit = limit;
+    if (tls)
+        m_tls = new tls_conn(m_tls_ctx, sockfd);
     m_address = addr;
+    h.epollfd = epollfd;
+    if (m_buf_arena && !m_read_buf)
+    {
+        char *slot = m_buf_arena + (size_t)sockfd * m_buf_slot;
+        m_request.headers = (http_header_index *)slot;
+        m_read_buf = slot + HEADER_INDEX_BYTES;
+        m_write_buf = m_read_buf + m_read_buffer_size;
+        mem_charge(MEM_BUFFERS, HEADER_INDEX_BYTES + m_read_buffer_size + m_write_buffer_size);
+    }
+    if (m_numa_local)
+    {
+        // 同一个fd上一次可能被另一个NUMA节点上的事件循环使用过，这时换一份缓冲区；
+        // 新缓冲区由当前（已绑核的）事件循环线程在init()里第一次写入，按first-touch策略落在本节点
+        int node = current_numa_node();
+        if (node != m_buf_node)
+        {
+            free_buffers();
+            m_buf_node = node;
+        }
+    }
+    if (!m_read_buf)
+    {
+        m_read_buf = new char[m_read_buffer_size];
+        mem_charge(MEM_BUFFERS, m_read_buffer_size);
+    }
+    if (!m_write_buf)
+    {
+        m_write_buf = new char[m_write_buffer_size];
+        mem_charge(MEM_BUFFERS, m_write_buffer_size);
+    }
+    if (!m_request.headers)
+    {
+        m_request.headers = new http_header_index;
+        mem_charge(MEM_BUFFERS, sizeof(http_header_index));
+    }
 
-    // 允许地址重用
-    int reuse = 1;
-    // SOL_SOCKET说明 当前选项所属的层级为套接字层
-    // SO_REUSEADDR 表示运行重用本地地址和端口
-    // 在 TCP 协议中，当一个套接字关闭后，其占用的端口会进入 TIME_WAIT 状态（通常持续几分钟），用于确保网络中残留的数据包被正确处理。若此时尝试用同一个端口重新创建套接字，默认情况下会失败（提示 “地址已在使用中”）。
-    // SO_REUSEADDR 选项的作用是允许在端口处于 TIME_WAIT 状态时，重新绑定该端口
-    // 在服务器 程序频繁重启和快速恢复的服务十分有用
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-    // 加入epoll
-    addfd(m_epollfd, sockfd, true);
     m_user_count++;
+    m_task_class = TASK_CHEAP;
     init();
+    // 状态要在注册到epoll之前复位，注册之后事件随时可能到达
+    h.events.store(0);
+    h.state.store(CONN_IDLE);
+    // 加入epoll，读写事件一次注册，之后不再epoll_ctl
+    addfd(h.epollfd, sockfd, false, true);
+}
+
+bool http_conn::try_own(int from)
+{
+    return hot().state.compare_exchange_strong(from, CONN_READING);
+}
+
+bool http_conn::close_if_idle(time_t now, int timeout)
+{
+    if (hot().sockfd == -1 || now - hot().last_active.load() < timeout)
+        return false;
+    if (!try_own(CONN_IDLE) && !try_own(CONN_WRITE_BLOCKED) && !try_own(CONN_PROXY_WAIT))
+        return false;
+    close_conn();
+    return true;
+}
+
+bool http_conn::close_if_drainable(bool force)
+{
+    if (hot().sockfd == -1)
+        return false;
+    if (force)
+    {
+        if (!try_own(CONN_IDLE) && !try_own(CONN_WRITE_BLOCKED) && !try_own(CONN_PROXY_WAIT))
+            return false;
+        close_conn();
+        return true;
+    }
+    if (!try_own(CONN_IDLE))
+        return false;
+    // 只关闭两次请求之间的连接：已经读了一半的请求，或者请求已经到达内核但还没被读取的，都算进行中；
+    // HTTP/2连接上还有流在等对端的WINDOW_UPDATE时也算进行中
+    char c;
+    bool between_requests = m_read_idx == 0 && (!m_h2 || m_h2->idle()) &&
+        recv(hot().sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    if (between_requests)
+    {
+        close_conn();
+        return true;
+    }
+    // 本函数和handle_event都只在该连接所属的事件循环线程中调用，持有期间不会有新事件记入events，
+    // 直接还原为空闲状态即可
+    hot().state.store(CONN_IDLE);
+    return false;
 }
 
 // 初始化连接内部状态
@@ -90,19 +256,27 @@ void http_conn::init()
 {
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
+    m_upgrade_h2c = false;
+    m_expect_continue = false;
+    m_proxy_route = nullptr;
+    m_route = nullptr;
+    if (m_vhost_entered)
+    {
+        vhost_leave(m_vhost);
+        m_vhost_entered = false;
+    }
+    m_vhost = nullptr;
 
     m_method = GET;
-    m_url = m_version = m_host = nullptr;
+    m_request.reset();
     m_content_length = 0;
     m_start_line = 0;
 
     m_checked_idx = m_read_idx = m_write_idx = 0;
-    m_iv_count = 0;  // 确保初始化m_iv_count
-    m_file_address = nullptr; // 确保初始化文件地址
-    
-    memset(m_read_buf, 0, READ_BUFFER_SIZE);
-    memset(m_write_buf, 0, WRITE_BUFFER_SIZE);
-    memset(m_real_file, 0, FILENAME_LEN);
+    m_out.clear();
+    unmap(); // 确保释放上一个请求的文件，初始化文件地址
+    hot().last_active = time(nullptr);
+    // 解析不再依赖缓冲区里的'\0'，读写缓冲区都不用清零
 }
 
 // 解析一行HTTP数据
@@ -118,9 +292,8 @@ http_conn::LINE_STATUS http_conn::parse_line()
                 return LINE_OPEN;
             else if (m_read_buf[m_checked_idx + 1] == '\n')
             {
-                // 把/r/n当成\0 表面这一行读取完毕
-                m_read_buf[m_checked_idx++] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
+                // 行尾的\r\n原样留在缓冲区里，get_line按长度取出这一行
+                m_checked_idx += 2;
                 return LINE_OK;
             }
             return LINE_BAD;
@@ -129,8 +302,7 @@ http_conn::LINE_STATUS http_conn::parse_line()
         {
             if (m_checked_idx > 1 && m_read_buf[m_checked_idx - 1] == '\r')
             {
-                m_read_buf[m_checked_idx - 1] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
+                m_checked_idx++;
                 return LINE_OK;
             }
             return LINE_BAD;
@@ -142,13 +314,27 @@ http_conn::LINE_STATUS http_conn::parse_line()
 // 非阻塞读数据
 bool http_conn::read()
 {
-    printf("Debug: Starting read, current idx: %d\n", m_read_idx); // 添加调试输出
-    if (m_read_idx >= READ_BUFFER_SIZE)                            // 说明读缓冲区以及存满,没有剩余空间再接受新数据
+    if (m_tls && !m_tls->established())
+        return true; // 握手的数据由工作线程里的SSL_do_handshake读取
+    // HTTP/2连接读到会话自己的输入缓冲区里
+    char *buf = m_h2 ? m_h2->input() : m_read_buf;
+    int size = m_h2 ? m_h2->input_size() : m_read_buffer_size;
+    if (m_read_idx >= size) // 说明读缓冲区以及存满,没有剩余空间再接受新数据
         return false;
+    hot().last_active = time(nullptr);
     int bytes_read = 0;
     while (true)
     {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        if (m_read_idx == size)
+        {
+            // 缓冲区满了，socket里可能还有数据，边沿触发不会再通知：记一个可读事件，处理完已读的数据后接着读
+            hot().events.fetch_or(EPOLLIN);
+            break;
+        }
+        if (m_tls)
+            bytes_read = m_tls->read(buf + m_read_idx, size - m_read_idx);
+        else
+            bytes_read = recv(hot().sockfd, buf + m_read_idx, size - m_read_idx, 0);
         if (bytes_read == -1)                         // 如果有错误的话
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK) // 如果没有数据可读的话 或者 是非阻塞的话 直接退出循环
@@ -162,33 +348,57 @@ bool http_conn::read()
     return true;
 }
 
-// 解析HTTP请求行
-http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
+// 解析HTTP请求行，方法、目标和版本都是读缓冲区上的片段
+http_conn::HTTP_CODE http_conn::parse_request_line(http_span text)
 {
-    m_url = strpbrk(text, " \t");
-    if (!m_url)
+    const char *end = text.data + text.len;
+    const char *sp = text.data;
+    while (sp < end && *sp != ' ' && *sp != '\t')
+        ++sp;
+    if (sp == end)
     {
         return BAD_REQUEST;
     }
-    *m_url++ = '\0';
+    m_request.method = http_span{text.data, (uint32_t)(sp - text.data)};
 
-    char *method = text;
-
-    if (strcasecmp(method, "GET") != 0)
+    int id = http_method_id(m_request.method.data, m_request.method.len);
+    if (id < 0)
     {
         return BAD_REQUEST;
     }
+    m_method = (METHOD)id;
 
-    m_version = strpbrk(m_url, " \t");
-    if (!m_version)
+    const char *url = sp + 1;
+    sp = url;
+    while (sp < end && *sp != ' ' && *sp != '\t')
+        ++sp;
+    if (sp == end)
     {
         return BAD_REQUEST;
     }
-    *m_version++ = '\0';
+    m_request.target = http_span{url, (uint32_t)(sp - url)};
+    const char *query = (const char *)memchr(url, '?', sp - url);
+    m_request.path = http_span{url, (uint32_t)((query ? query : sp) - url)};
+    m_request.version = http_span{sp + 1, (uint32_t)(end - sp - 1)};
 
-    printf("Debug: URL: '%s', Version: '%s'\n", m_url, m_version); // 添加调试输出
+    if (!m_request.version.iequals("HTTP/1.1"))
+    {
+        return BAD_REQUEST;
+    }
 
-    if (strcasecmp(m_version, "HTTP/1.1") != 0)
+    // 匹配反向代理路由的请求原样转发（隧道和回显除外），其余的只支持GET
+    m_route = router_match(m_request.path.data, m_request.path.len, m_route_match);
+    m_proxy_route = m_route && m_route->kind == ROUTE_PROXY ? m_route->proxy : nullptr;
+    if (m_proxy_route && m_method != CONNECT && m_method != TRACE)
+    {
+        if (!m_proxy)
+            m_proxy = new proxy_session;
+        m_proxy->begin(m_proxy_route, http_method_name(m_method), m_request.target.data, m_request.target.len,
+                       m_method == HEAD);
+        return NO_REQUEST;
+    }
+    m_proxy_route = nullptr;
+    if (m_method != GET)
     {
         return BAD_REQUEST;
     }
@@ -196,45 +406,71 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     return NO_REQUEST;
 }
 
-// 解析HTTP请求头
-http_conn::HTTP_CODE http_conn::parse_headers(char *text)
+// 请求头的值按十进制解析，不是数字或者超出范围时返回-1
+static int parse_length(const http_span &v)
 {
-    if (*text == '\0')
-    { // 空行表示请求头结束
-        return m_content_length ? NO_REQUEST : GET_REQUEST;
-    }
-    else if (strncasecmp(text, "Connection:", 11) == 0) // 返回0 表是请求成功
+    if (v.empty() || v.len > 9)
+        return -1;
+    int n = 0;
+    for (uint32_t i = 0; i < v.len; ++i)
     {
-        text += 11;
-        text += strspn(text, " \t"); // 功能是计算字符串text开头连续匹配字符集" \t"（空格或制表符）的长度
-        m_linger = (strcasecmp(text, "keep-alive") == 0);
+        if (v.data[i] < '0' || v.data[i] > '9')
+            return -1;
+        n = n * 10 + (v.data[i] - '0');
     }
-    else if (strncasecmp(text, "Content-Length:", 15) == 0)
-    {
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atoi(text);
+    return n;
+}
+
+// 解析HTTP请求头：名字和值记入m_request，常用头部按编号处理
+http_conn::HTTP_CODE http_conn::parse_headers(http_span text)
+{
+    if (text.empty())
+    { // 空行表示请求头结束；转发的请求不等请求体，请求头结束就开始转发
+        if (m_proxy_route)
+            return PROXY_REQUEST;
+        return m_content_length ? NO_REQUEST : GET_REQUEST;
     }
-    else if (strncasecmp(text, "Host:", 5) == 0)
+    http_span name, value;
+    HTTP_HEADER id;
+    if (!m_request.add_header(text.data, text.len, name, value, id))
     {
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
+        return BAD_REQUEST;
     }
-    else
+    // 每一行请求头都交给代理，下面仍然处理要用到的几个
+    if (m_proxy_route && !m_proxy->add_header(name, value, id))
+        return BAD_REQUEST;
+    switch (id)
     {
-        // 忽略其他请求头
+    case HEADER_CONNECTION:
+        m_linger = value.iequals("keep-alive");
+        break;
+    case HEADER_CONTENT_LENGTH:
+        m_content_length = parse_length(value);
+        if (m_content_length < 0)
+            return BAD_REQUEST;
+        break;
+    case HEADER_HOST:
+        // 直接在读缓冲区上计算哈希查表，不复制主机名
+        m_vhost = vhost_lookup(value.data, value.len);
+        break;
+    case HEADER_UPGRADE:
+        m_upgrade_h2c = value.iequals("h2c");
+        break;
+    case HEADER_EXPECT:
+        m_expect_continue = value.iequals("100-continue");
+        break;
+    default:
+        break; // 其他请求头只记下来
     }
     return NO_REQUEST;
 }
 
 // 解析HTTP请求体 并没有解析 只是判断是否被完整的读入了
 // 仅仅post报文中有 请求体
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+http_conn::HTTP_CODE http_conn::parse_content()
 {
     if (m_read_idx >= m_content_length + m_start_line)
     {
-        text[m_content_length] = '\0';
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -245,12 +481,12 @@ http_conn::HTTP_CODE http_conn::process_read()
 {
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
-    char *text = nullptr;
 
     while ((m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) ||
            (line_status = parse_line()) == LINE_OK)
     {
-        text = get_line();
+        // 请求体不按行切分，只有请求行和请求头需要取出一行
+        http_span text = m_check_state == CHECK_STATE_CONTENT ? http_span{nullptr, 0} : get_line();
         m_start_line = m_checked_idx;
 
         switch (m_check_state)
@@ -267,9 +503,17 @@ http_conn::HTTP_CODE http_conn::process_read()
                 return BAD_REQUEST;
             else if (ret == GET_REQUEST)
                 return do_request();
+            else if (ret == PROXY_REQUEST)
+            {
+                if (limiter_take(m_limit))
+                    return PROXY_REQUEST;
+                // 请求体还没有读，回完429就关闭连接
+                m_linger = false;
+                return TOO_MANY_REQUESTS;
+            }
             break;
         case CHECK_STATE_CONTENT:
-            ret = parse_content(text);
+            ret = parse_content();
             if (ret == GET_REQUEST)
                 return do_request();
             line_status = LINE_OPEN; // 告知主循环：当前请求体数据尚未完全读取，解析过程需要暂停，等待更多数据到达后再继续。
@@ -285,91 +529,203 @@ http_conn::HTTP_CODE http_conn::process_read()
 // 处理请求（映射目标文件）
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    // 处理URL，移除查询参数（问号后面的部分）
-    char url_path[FILENAME_LEN] = {0};
-    strcpy(url_path, m_url);
-    // 找到第一个?，并在那里截断URL
-    char* query_start = strchr(url_path, '?');
-    if (query_start) {
-        *query_start = '\0';
+    if (!limiter_take(m_limit))
+        return TOO_MANY_REQUESTS;
+    if (!enter_vhost())
+        return SERVICE_UNAVAILABLE;
+    if (m_route && m_route->kind == ROUTE_HANDLER)
+        return run_handler();
+    const char *root;
+    http_span path = m_request.path;
+    resolve_static(m_route, m_route_match, m_vhost, root, path);
+    HTTP_CODE ret = map_file(root, path, m_file);
+    if (ret == DIRECTORY_REQUEST)
+    {
+        const char *type;
+        ret = list_directory(m_file, m_request.target, m_dynamic_body, m_listing, type);
+        m_file = nullptr;
+        m_dynamic_type = type;
+        return ret;
     }
-    
-    strcpy(m_real_file, doc_root); // 从doc_root中复制到m_real_life
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, url_path, FILENAME_LEN - len - 1);
-
-    struct stat st;
-    if (stat(m_real_file, &st) == 0 && S_ISDIR(st.st_mode))
-    {
-        // 是目录，添加默认文件 index.html
-        printf("Path is directory, adding index.html\n");
-        
-        // 检查路径末尾是否已有斜杠
-        int path_len = strlen(m_real_file);
-        if (path_len > 0 && m_real_file[path_len-1] != '/') {
-            strcat(m_real_file, "/");
+    if (ret == FILE_REQUEST)
+    {
+        m_file_stat = m_file->st;
+        m_file_address = m_file->data;
+    }
+    return ret;
+}
+
+http_conn::HTTP_CODE http_conn::run_handler()
+{
+    static const char *const methods[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT",
+                                          "PATCH"};
+    route_request req;
+    req.method = methods[m_method];
+    req.path = m_request.path.data;
+    req.path_len = m_request.path.len;
+    req.request = &m_request;
+    req.match = &m_route_match;
+    req.names = &m_route->names;
+    std::shared_ptr<std::string> body = std::make_shared<std::string>();
+    m_dynamic_type.clear();
+    if (!m_route->handler(req, *body, m_dynamic_type))
+        return NO_RESOURCE;
+    m_dynamic_body = body;
+    return DYNAMIC_REQUEST;
+}
+
+void http_conn::resolve_static(const route *r, const route_match &m, const vhost *host, const char *&root,
+                               http_span &path)
+{
+    root = host && !host->doc_root.empty() ? host->doc_root.c_str() : nullptr;
+    if (!r || r->kind != ROUTE_STATIC || r->doc_root.empty())
+        return;
+    // 静态路由的目录对应模式中 '*' 之前的部分，和它前面的'/'一起保留，没有通配符时目录本身就是目标
+    root = r->doc_root.c_str();
+    const char *end = path.data + path.len;
+    const char *start = !m.tail ? end : m.tail[-1] == '/' ? m.tail - 1 : m.tail;
+    path = http_span{start, (uint32_t)(end - start)};
+}
+
+bool http_conn::enter_vhost()
+{
+    if (!m_vhost)
+        m_vhost = vhost_lookup(nullptr, 0);
+    m_vhost_entered = vhost_enter(m_vhost);
+    return m_vhost_entered;
+}
+
+http_conn::HTTP_CODE http_conn::map_file(const char *root, http_span path, file_entry *&file)
+{
+    // 每个请求读一次配置快照，SIGHUP重载doc_root不会影响正在处理的请求。
+    // 读区里只复制要用的几项：下面打开文件可能在冷盘上阻塞，读区不能跨过它，否则整个服务器都回收不了旧配置
+    std::string default_root;
+    int cache_valid, autoindex;
+    {
+        rcu_read_guard guard;
+        const server_config *cfg = config_read();
+        if (!root)
+            default_root = cfg->doc_root;
+        cache_valid = cfg->file_cache_valid;
+        autoindex = cfg->autoindex;
+    }
+    const char *doc_root = root ? root : default_root.c_str();
+
+    // 路径相对根目录的fd解析，不会逃出根目录；重复的请求直接命中打开文件缓存，没有路径查找
+    file = nullptr;
+    file_entry *e = nullptr;
+    int err = file_cache_open(doc_root, path.data, path.len, cache_valid, e);
+    if (err == 0 && S_ISDIR(e->st.st_mode))
+    {
+        // 是目录，添加默认文件 index.html；只有这里需要拼出一个新的路径
+        file_entry *dir = e;
+        e = nullptr;
+        std::string index(path.data, path.len);
+        if (index.empty() || index[index.size() - 1] != '/') {
+            index += '/';
         }
-        strcat(m_real_file, "index.html");
+        index += "index.html";
+        err = file_cache_open(doc_root, index.data(), index.size(), cache_valid, e);
+        // 没有首页时列出目录
+        if (err == ENOENT && autoindex && (dir->st.st_mode & S_IROTH)) {
+            file = dir;
+            return DIRECTORY_REQUEST;
+        }
+        file_cache_release(dir);
     }
     
-    // stat 是一个系统调用函数，用于获取指定文件（FILE）的属性信息，并将这些信息存储到一个结构体（BUF）中。
-    if (stat(m_real_file, &m_file_stat) < 0) {
+    if (err == EXDEV || err == EACCES) { // 路径试图逃出根目录，或者没有权限打开
+        return FORBIDDEN_REQUEST;
+    }
+    if (err) {
         return NO_RESOURCE;
     }
     
-    if (!(m_file_stat.st_mode & S_IROTH)) { // S_IROTH是表示其他用户（others）拥有读权限
+    if (!(e->st.st_mode & S_IROTH)) { // S_IROTH是表示其他用户（others）拥有读权限
+        file_cache_release(e);
         return FORBIDDEN_REQUEST;
     }
     
-    if (S_ISDIR(m_file_stat.st_mode)) {
+    if (!S_ISREG(e->st.st_mode)) {
+        file_cache_release(e);
         return NO_RESOURCE; // 注意网站没有做 就是首页目录没做好
     }
 
-    int fd = open(m_real_file, O_RDONLY);
-    if (fd < 0) {
-        return NO_RESOURCE;
-    }
-    
-    /*
-    nullptr：让系统自动选择映射的起始内存地址（不手动指定）。
-    m_file_stat.st_size：映射的长度（字节数），即目标文件的大小（通过 stat 函数获取）。
-    PROT_READ：映射区域的保护模式为只读（进程只能读取该内存区域，不能修改）。
-    MAP_PRIVATE：创建私有映射（写时复制，进程对映射区域的修改不会影响原文件，也不会被其他进程看到）。
-    fd：要映射的文件的文件描述符（通过 open 函数打开的目标文件）。
-    0：映射的偏移量（从文件起始位置开始映射）。
-    */
-    m_file_address = (char *)mmap(nullptr, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (m_file_address == MAP_FAILED) {
-        close(fd);
-        return NO_RESOURCE;
-    }
-    
-    close(fd);
+    // 文件的只读映射（mmap MAP_PRIVATE）由缓存的条目持有，多个请求共享同一份映射
+    file = e;
     return FILE_REQUEST;
 }
 
-// 释放内存映射
+http_conn::HTTP_CODE http_conn::list_directory(file_entry *dir, http_span target,
+                                               std::shared_ptr<const std::string> &page, autoindex_stream *&stream,
+                                               const char *&content_type)
+{
+    bool json = autoindex_wants_json(target.data, target.len);
+    content_type = json ? "application/json" : "text/html; charset=utf-8";
+    const char *query = (const char *)memchr(target.data, '?', target.len);
+    size_t path_len = query ? query - target.data : target.len;
+    int err = autoindex_open(dir, target.data, path_len, json, page, stream);
+    file_cache_release(dir);
+    if (err)
+        return err == EACCES ? FORBIDDEN_REQUEST : NO_RESOURCE;
+    return stream ? CHUNKED_REQUEST : DYNAMIC_REQUEST;
+}
+
+// 释放对文件缓存条目的引用（映射由缓存管理），以及没有发完的目录列表
 void http_conn::unmap()
 {
-    if (m_file_address)
+    if (m_file)
+    {
+        // 零拷贝发出的文件页在完成通知到达之前还被内核引用着，条目交给发送队列，收到通知后再释放
+        if (m_out.zerocopy_pending())
+            m_out.hold(m_file);
+        else
+            file_cache_release(m_file);
+        m_file = nullptr;
+    }
+    m_file_address = nullptr;
+    m_dynamic_body.reset();
+    if (m_listing)
+    {
+        delete m_listing;
+        m_listing = nullptr;
+    }
+}
+
+bool http_conn::next_chunk()
+{
+    if (!m_listing)
+        return false;
+    std::string data;
+    bool more = m_listing->next(data);
+    char size[16];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    m_chunk.assign(size, n);
+    m_chunk += data;
+    m_chunk += "\r\n";
+    if (!more)
     {
-        munmap(m_file_address, m_file_stat.st_size);
-        m_file_address = nullptr;
+        // 最后一块之后紧接着结束块
+        m_chunk += "0\r\n\r\n";
+        delete m_listing;
+        m_listing = nullptr;
     }
+    m_out.push(m_chunk.data(), m_chunk.size());
+    return true;
 }
 
 // 向写缓冲区添加响应内容（格式化）
 // 这个似乎可以c++泛型化
 bool http_conn::add_response(const char *format, ...)
 {
-    if (m_write_idx >= WRITE_BUFFER_SIZE)
+    if (m_write_idx >= m_write_buffer_size)
         return false;
     va_list arg_list;                                                                                      // 函数参数是可变参数 需要用va_list类型的遍历arg_list接受参数列表
     va_start(arg_list, format);                                                                            // va_start用于初始化arg_list 使其指向第一个可变参数 format是最后一个固定参数
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - m_write_idx - 1, format, arg_list); // 功能是将 format 格式的字符串与可变参数 arg_list 拼接后，写入 m_write_buf + m_write_idx 位置（即缓冲区的剩余空间）
-    // WRITE_BUFFER_SIZE - m_write_idx - 1 预留空间 len是返回的实际写入的数量
+    int len = vsnprintf(m_write_buf + m_write_idx, m_write_buffer_size - m_write_idx - 1, format, arg_list); // 功能是将 format 格式的字符串与可变参数 arg_list 拼接后，写入 m_write_buf + m_write_idx 位置（即缓冲区的剩余空间）
+    // m_write_buffer_size - m_write_idx - 1 预留空间 len是返回的实际写入的数量
     va_end(arg_list);
-    if (len >= WRITE_BUFFER_SIZE - m_write_idx - 1)
+    if (len >= m_write_buffer_size - m_write_idx - 1)
         return false;
     m_write_idx += len;
     return true;
@@ -381,7 +737,7 @@ bool http_conn::add_status_line(int status, const char *title)
     return add_response("HTTP/1.1 %d %s\r\n", status, title);
 }
 // 添加响应头集合
-bool http_conn::add_headers(int content_length)
+bool http_conn::add_headers(off_t content_length)
 {
     add_content_length(content_length);
     add_linger();
@@ -389,9 +745,9 @@ bool http_conn::add_headers(int content_length)
     return true;
 }
 // 添加内容长度头
-bool http_conn::add_content_length(int content_length)
+bool http_conn::add_content_length(off_t content_length)
 {
-    return add_response("Content-Length: %d\r\n", content_length);
+    return add_response("Content-Length: %lld\r\n", (long long)content_length);
 }
 // 添加连接保持头
 bool http_conn::add_linger()
@@ -409,157 +765,519 @@ bool http_conn::add_content(const char *content)
     return add_response("%s", content);
 }
 
-// 填充HTTP响应并准备写操作
-bool http_conn::process_write(HTTP_CODE ret)
+bool http_conn::status_page(HTTP_CODE code, int &status, const char *&title, const char *&form)
 {
-    switch (ret)
+    switch (code)
     {
     case INTERNAL_ERROR:
-        add_status_line(500, error_500_title);
-        add_headers(strlen(error_500_form));
-        add_content(error_500_form);
-        break;
+        status = 500, title = error_500_title, form = error_500_form;
+        return true;
     case BAD_REQUEST:
-        add_status_line(400, error_400_title);
-        add_headers(strlen(error_400_form));
-        add_content(error_400_form);
-        break;
+        status = 400, title = error_400_title, form = error_400_form;
+        return true;
     case NO_RESOURCE:
-        add_status_line(404, error_404_title);
-        add_headers(strlen(error_404_form));
-        add_content(error_404_form);
-        break;
+        status = 404, title = error_404_title, form = error_404_form;
+        return true;
     case FORBIDDEN_REQUEST:
-        add_status_line(403, error_403_title);
-        add_headers(strlen(error_403_form));
-        add_content(error_403_form);
-        break;
+        status = 403, title = error_403_title, form = error_403_form;
+        return true;
+    case BAD_GATEWAY:
+        status = 502, title = error_502_title, form = error_502_form;
+        return true;
+    case SERVICE_UNAVAILABLE:
+        status = 503, title = error_503_title, form = error_503_form;
+        return true;
+    case TOO_MANY_REQUESTS:
+        status = 429, title = error_429_title, form = error_429_form;
+        return true;
     case FILE_REQUEST:
-        add_status_line(200, ok_200_title);
-        if (m_file_stat.st_size)
-        {
-            add_headers(m_file_stat.st_size);
-            // 不要在这里直接返回，让下面的代码设置m_iv和m_iv_count
-        }
-        else // 如果目标文件的大小为0
+    case DYNAMIC_REQUEST:
+    case CHUNKED_REQUEST:
+        status = 200, title = ok_200_title, form = ok_200_empty_form;
+        return true;
+    default:
+        return false;
+    }
+}
+
+http_conn::TASK_CLASS http_conn::task_class() const
+{
+    // 请求行已经读到时先看路由：内置处理函数的请求总是最先处理，不用等前面排队的大文件
+    if (!m_h2 && m_check_state == CHECK_STATE_REQUESTLINE)
+    {
+        const char *end = m_read_buf + m_read_idx;
+        const char *url = (const char *)memchr(m_read_buf + m_start_line, ' ', end - m_read_buf - m_start_line);
+        const char *p = url ? ++url : end;
+        while (p < end && *p != ' ' && *p != '?' && *p != '\r')
+            ++p;
+        if (p < end)
         {
-            const char *empty_html = "<html><body></body></html>";
-            add_headers(strlen(empty_html));
-            add_content(empty_html);
+            route_match m;
+            const route *r = router_match(url, p - url, m);
+            if (r && r->kind == ROUTE_HANDLER)
+                return TASK_ADMIN;
         }
-        break;
-    default:
+    }
+    return m_task_class;
+}
+
+// 填充HTTP响应并准备写操作
+bool http_conn::process_write(HTTP_CODE ret)
+{
+    // 优雅退出期间告诉客户端这是最后一个响应
+    if (m_draining.load())
+        m_linger = false;
+    int status;
+    const char *title, *form;
+    if (!status_page(ret, status, title, form))
         return false;
+    add_status_line(status, title);
+    if (ret == DYNAMIC_REQUEST)
+    {
+        if (!m_dynamic_type.empty())
+            add_response("Content-Type: %s\r\n", m_dynamic_type.c_str());
+        add_headers(m_dynamic_body->size());
+    }
+    else if (ret == CHUNKED_REQUEST)
+    {
+        // 总长度事先不知道，响应体在write()中一块一块地生成
+        add_response("Content-Type: %s\r\nTransfer-Encoding: chunked\r\n", m_dynamic_type.c_str());
+        add_linger();
+        add_blank_line();
+    }
+    else if (ret == FILE_REQUEST && m_file_stat.st_size)
+    {
+        add_headers(m_file_stat.st_size);
+        // 不要在这里直接返回，下面把文件数据排进发送队列
+    }
+    else // 错误页面，或者目标文件的大小为0
+    {
+        add_headers(strlen(form));
+        add_content(form);
     }
 
-    // 为后续的writev做充足的准备
-    // writev 系统调用可以通过一次系统调用写入多个不连续的内存块（即 m_iv 数组中的所有块）
-    //  组装写缓冲区（仅响应头，无文件内容时,所以只需要一个内存块）
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1; // 至少有一个块（响应头）
-    
+    // 响应头和响应体按顺序排进发送队列，write()尽量用一次系统调用把它们一起发出去
+    m_out.push(m_write_buf, m_write_idx);
     if (m_file_address)
-    { // 有文件内容时，用writev同时写响应头和文件内存
-        m_iv[1].iov_base = m_file_address;
-        m_iv[1].iov_len = m_file_stat.st_size;
-        m_iv_count = 2;
-    }
-    
+        m_out.push(m_file_address, m_file_stat.st_size, true);
+    else if (ret == DYNAMIC_REQUEST)
+        m_out.push(m_dynamic_body->data(), m_dynamic_body->size());
+
+    // 客户端往往连续请求同一类资源，连接上的下一个请求按这个响应的开销排队
+    bool bulk = ret == CHUNKED_REQUEST ||
+                (ret == FILE_REQUEST && m_file_stat.st_size > m_bulk_bytes.load(std::memory_order_relaxed));
+    m_task_class = bulk ? TASK_BULK : TASK_CHEAP;
     return true;
 }
 
-// 非阻塞写数据（用writev批量写）
-bool http_conn::write()
+// 非阻塞写数据：发送队列从上次停下的位置继续发送
+http_conn::WRITE_RESULT http_conn::write()
+{
+    if (m_h2)
+    {
+        hot().last_active = time(nullptr);
+        return m_h2->send(hot().sockfd, m_tls, m_cold);
+    }
+    if (m_out.empty() && !m_listing)
+        return WRITE_ERROR;
+    hot().last_active = time(nullptr);
+    size_t zerocopy_bytes = (size_t)m_zerocopy_bytes.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        switch (m_out.send(hot().sockfd, m_tls, m_listing != nullptr, zerocopy_bytes, m_cold))
+        {
+        case OUT_DONE:
+            // 分块输出的目录列表：上一块发完再生成下一块，内存里只有一块
+            if (next_chunk())
+                continue;
+            // 数据已全部发送
+            unmap();
+            return WRITE_DONE;
+        case OUT_AGAIN:
+            // 不用重新注册写事件：socket一直监听着EPOLLOUT，发送缓冲区腾出空间时会再来一次边沿
+            return WRITE_AGAIN;
+        case OUT_DISK:
+            return WRITE_DISK;
+        default:
+            unmap();
+            return WRITE_ERROR;
+        }
+    }
+}
+
+int http_conn::after_write(WRITE_RESULT ret)
+{
+    if (ret == WRITE_AGAIN)
+        return CONN_WRITE_BLOCKED;
+    if (ret == WRITE_DISK)
+        return CONN_DISK_WAIT;
+    if (m_h2)
+    {
+        // HTTP/2连接一直保持，直到GOAWAY之后所有流都发完
+        if (ret == WRITE_DONE && !m_h2->finished())
+            return CONN_IDLE;
+    }
+    else if (ret == WRITE_DONE && m_linger)
+    {
+        init(); // 重置连接状态，准备下一个请求
+        return CONN_IDLE;
+    }
+    close_conn(); // 出错，或者响应发完且不保持连接
+    return -1;
+}
+
+bool http_conn::start_proxy()
 {
-    int bytes_to_send = 0;
-    if (m_iv_count == 0) {
-        if (m_write_idx > 0) {
-            m_iv[0].iov_base = m_write_buf;
-            m_iv[0].iov_len = m_write_idx;
-            m_iv_count = 1;
-        } else {
+    if (m_content_length < 0)
+    {
+        close_conn();
+        return false;
+    }
+    // 上一个请求留下的上游事件和这次的上游连接无关
+    hot().events.fetch_and(~(PROXY_UPSTREAM_IN | PROXY_UPSTREAM_OUT));
+    // 和请求头一起读进来的请求体先随请求头发出，剩下的由代理直接从socket搬运
+    int buffered = m_read_idx - m_checked_idx;
+    if (buffered > m_content_length)
+        buffered = m_content_length;
+    hot().state.store(CONN_WRITING);
+    if (!enter_vhost())
+    {
+        // 请求体没有读，回完503就关闭连接
+        m_linger = false;
+        if (!process_write(SERVICE_UNAVAILABLE))
+        {
+            close_conn();
             return false;
         }
+        int next = after_write(write());
+        if (next < 0)
+            return false;
+        return release((CONN_STATE)next);
     }
+    int next = after_proxy(m_proxy->start(this, hot().epollfd, hot().sockfd, m_tls, m_address, m_read_buf + m_checked_idx,
+                                          buffered, m_content_length, m_linger && !m_draining.load(),
+                                          m_expect_continue, m_vhost));
+    if (next < 0)
+        return false;
+    return release((CONN_STATE)next);
+}
 
-    for (int i = 0; i < m_iv_count; i++) {
-        bytes_to_send += m_iv[i].iov_len;
+int http_conn::after_proxy(int ret)
+{
+    hot().last_active = time(nullptr);
+    switch (ret)
+    {
+    case proxy_session::PROXY_WAIT:
+        hot().proxy_wait.store(m_proxy->wait_events());
+        return CONN_PROXY_WAIT;
+    case proxy_session::PROXY_DONE:
+        if (!m_proxy->client_keep_alive())
+            break;
+        init();
+        return CONN_IDLE;
+    case proxy_session::PROXY_FAILED:
+        // 请求体可能还有一部分没读，回完502就关闭连接
+        m_linger = false;
+        if (!process_write(BAD_GATEWAY))
+            break;
+        return after_write(write());
+    default:
+        break;
     }
-    
-    int bytes_have_send = 0;
-    
-    while (bytes_to_send > 0)
+    close_conn();
+    return -1;
+}
+
+bool http_conn::flush()
+{
+    // 之前记下的EPOLLOUT已经过时：这次写到EAGAIN之后才需要新的可写边沿
+    hot().events.fetch_and(~(uint32_t)EPOLLOUT);
+    int next = after_write(write());
+    if (next < 0)
+        return false;
+    return release((CONN_STATE)next);
+}
+
+bool http_conn::release(CONN_STATE next)
+{
+    if (next == CONN_DISK_WAIT)
+    {
+        wait_for_disk();
+        return false;
+    }
+    // 先放弃所有权再检查事件；事件循环那边是先记事件再尝试获得所有权，
+    // 两边都是顺序一致的原子操作，所以持有期间到达的事件至少会被其中一方看到
+    hot().state.store(next);
+    return drive();
+}
+
+void http_conn::wait_for_disk()
+{
+    // 先进入CONN_DISK_WAIT再提交：预读可能在disk_prefetch返回之前就完成了。
+    // 这期间事件循环和空闲超时都不会碰这个连接，到达的事件记在conn_hot的events里；文件的映射由m_file持有，一直有效
+    hot().state.store(CONN_DISK_WAIT);
+    disk_prefetch(m_cold, [this]() {
+        // 预读完成，连接当作等到了可写事件交出去，谁先drive谁继续发送
+        hot().events.fetch_or(EPOLLOUT);
+        hot().state.store(CONN_WRITE_BLOCKED);
+        if (m_disk_done)
+            m_disk_done(this);
+        else
+            resume_write();
+    });
+}
+
+void http_conn::resume_write()
+{
+    if (drive())
+        process();
+}
+
+bool http_conn::handle_event(uint32_t events)
+{
+    hot().events.fetch_or(events);
+    return drive();
+}
+
+bool http_conn::resume_reads()
+{
+    if (hot().sockfd == -1 || !(hot().events.load() & EPOLLIN))
+        return false;
+    return drive();
+}
+
+bool http_conn::drive()
+{
+    const uint32_t close_events = EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+    conn_hot &h = hot();
+    while (true)
     {
-        int temp = writev(m_sockfd, m_iv, m_iv_count);
-        
-        if (temp <= -1)
+        int state = h.state.load();
+        uint32_t events = h.events.load();
+        bool readable = state == CONN_IDLE && (events & (EPOLLIN | close_events));
+        bool writable = state == CONN_WRITE_BLOCKED && (events & (EPOLLOUT | close_events));
+        bool proxying = state == CONN_PROXY_WAIT && (events & (h.proxy_wait.load() | close_events));
+        if (!readable && !writable && !proxying)
+            return false; // 没有可处理的事件，或者连接正被其他线程持有，事件留给持有者
+        if (readable && !(events & close_events) && mem_level() >= MEM_PAUSE)
+        {
+            // 内存快用完了，先不读新的请求：可读事件留在conn_hot的events里，压力解除后由事件循环resume_reads
+            mem_count_paused();
+            return false;
+        }
+        if (!h.state.compare_exchange_strong(state, readable ? CONN_READING : CONN_WRITING))
+            continue;
+
+        uint32_t arrived = h.events.load();
+        if ((arrived & EPOLLERR) && !(arrived & (EPOLLRDHUP | EPOLLHUP)) && m_out.zerocopy_used())
         {
-            if (errno == EAGAIN)
+            // 零拷贝的完成通知也以EPOLLERR报告：读出通知，socket没有真正出错时还原状态，按其余的事件重新判断
+            if (!m_out.reap(h.sockfd))
             {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);  // 重新注册写事件
-                return true;
+                close_conn();
+                return false;
             }
-            unmap();
+            h.events.fetch_and(~(uint32_t)EPOLLERR);
+            h.state.store(state);
+            continue;
+        }
+        if (arrived & close_events)
+        {
+            close_conn();
             return false;
         }
-        
-        bytes_have_send += temp;
-        bytes_to_send -= temp;
-        
-        // 更新iovec数组，处理部分写入情况
-        if (bytes_have_send >= m_iv[0].iov_len)
+        if (readable)
         {
-            // 响应头已发送完
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = (char*)m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
+            h.events.fetch_and(~(uint32_t)EPOLLIN);
+            if (!read())
+            {
+                close_conn(); // 读取失败则关闭
+                return false;
+            }
+            h.state.store(CONN_PROCESSING);
+            return true;
         }
-        else
+        if (proxying)
         {
-            // 响应头未发送完
-            m_iv[0].iov_base = (char*)m_iv[0].iov_base + bytes_have_send;
-            m_iv[0].iov_len -= bytes_have_send;
+            // 转发在事件循环里推进：两边的socket都是非阻塞的，大块的数据用splice在内核里搬运
+            h.events.fetch_and(~h.proxy_wait.load());
+            int next = after_proxy(m_proxy->step());
+            if (next < 0)
+                return false;
+            if (next == CONN_DISK_WAIT)
+            {
+                wait_for_disk();
+                return false;
+            }
+            h.state.store(next);
+            continue;
         }
-        
-        // 数据已全部发送
-        if (bytes_to_send <= 0)
+        h.events.fetch_and(~(uint32_t)EPOLLOUT);
+        if (m_tls && !m_tls->established())
         {
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);  // 重新注册读事件
-            
-            if (m_linger)
+            // 握手在等可写，交给工作线程继续握手
+            h.state.store(CONN_PROCESSING);
+            return true;
+        }
+        int next = after_write(write());
+        if (next < 0)
+            return false;
+        if (next == CONN_DISK_WAIT)
+        {
+            wait_for_disk();
+            return false;
+        }
+        h.state.store(next); // 放弃所有权，回到循环开头再检查一次事件
+    }
+}
+
+// 处理客户请求的入口，由线程池子中的工作线程调用，进入时本线程持有连接（CONN_PROCESSING）
+void http_conn::process()
+{
+    bool more = true;
+    while (more)
+    {
+        if (m_tls && !m_tls->established())
+        {
+            // 握手的计算（密钥交换、签名）放在工作线程里，不占用事件循环
+            int next = tls_handshake();
+            if (next < 0)
             {
-                init();  // 重置连接状态，准备下一个请求
-                return true;
+                close_conn();
+                return;
             }
-            else
+            if (next != CONN_PROCESSING)
             {
-                return false;  // 返回false会关闭连接
+                more = release((CONN_STATE)next);
+                continue;
             }
         }
+        if (!m_h2 && detect_h2_preface() < 0)
+        {
+            more = release(CONN_IDLE); // 前言还没收全
+            continue;
+        }
+        if (m_h2)
+        {
+            more = process_h2();
+            continue;
+        }
+
+        HTTP_CODE read_ret = process_read();
+        if (read_ret == NO_REQUEST)
+        {
+            // 请求还不完整，放弃所有权等待更多数据；如果数据已经在这期间到达，release会直接读出来
+            more = release(CONN_IDLE);
+            continue;
+        }
+
+        m_request_count.fetch_add(1, std::memory_order_relaxed);
+        if (read_ret == PROXY_REQUEST)
+        {
+            more = start_proxy();
+            continue;
+        }
+        if (m_upgrade_h2c && start_h2_upgrade(read_ret))
+        {
+            hot().state.store(CONN_WRITING);
+            more = flush();
+            continue;
+        }
+        if (!process_write(read_ret))
+        {
+            close_conn();
+            return;
+        }
+
+        // 直接在工作线程里尝试发送，大多数响应一次就能发完，不需要再经过事件循环
+        hot().state.store(CONN_WRITING);
+        more = flush();
     }
-    
-    return true;
 }
 
-// 处理客户请求的入口（调度读/写）由线程池子中的工作线程调用
-void http_conn::process()
+int http_conn::tls_handshake()
 {
-    sleep(3);
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST)
+    switch (m_tls->handshake())
     {
-        // 由于设置了EPOLLONESHOT 该事件只会被处理一次 如果没有处理完毕 程序必须重新设置m_sockfd 确保报文下一次到来的时候能被线程处理
-        modfd(m_epollfd, m_sockfd, EPOLLIN); // 重新监听读事件
-        return;
+    case tls_conn::TLS_WANT_READ:
+        return CONN_IDLE;
+    case tls_conn::TLS_WANT_WRITE:
+        return CONN_WRITE_BLOCKED;
+    case tls_conn::TLS_ERROR:
+        return -1;
+    default:
+        break;
     }
+    // 客户端可能把第一个请求和Finished一起发了过来，边沿触发不会再通知，握手完成后马上读一次
+    hot().last_active = time(nullptr);
+    return read() ? CONN_PROCESSING : -1;
+}
 
-    bool write_ret = process_write(read_ret);
-    
-    if (!write_ret)
-        close_conn();
+// 会话的输入缓冲区至少要放得下一个最大的帧，也要放得下切换前读缓冲区里已有的数据
+static http2_session *new_http2_session(const server_config &cfg, const limiter_ticket &limit)
+{
+    int input_size = http_conn::m_read_buffer_size;
+    if (input_size < http2_session::INPUT_SIZE)
+        input_size = http2_session::INPUT_SIZE;
+    return new http2_session(cfg.http2_max_streams, input_size, limit);
+}
+
+int http_conn::detect_h2_preface()
+{
+    // 只在一个请求的开头检查，HTTP/1.1请求不可能以 "PRI * HTTP/2.0" 开头
+    if (m_check_state != CHECK_STATE_REQUESTLINE || m_start_line != 0 || m_read_idx == 0 || m_read_buf[0] != 'P')
+        return 0;
+    int n = m_read_idx < http2_session::PREFACE_LEN ? m_read_idx : http2_session::PREFACE_LEN;
+    if (memcmp(m_read_buf, http2_session::PREFACE, n) != 0)
+        return 0;
+    if (n < http2_session::PREFACE_LEN)
+        return -1;
+    rcu_read_guard guard;
+    const server_config *cfg = config_read();
+    if (!cfg->http2)
+        return 0; // 没有开启HTTP/2，按HTTP/1.1解析，客户端会收到400
+    // 前言和之后已经读到的帧一起交给会话解析
+    m_h2 = new_http2_session(*cfg, m_limit);
+    memcpy(m_h2->input(), m_read_buf, m_read_idx);
+    return 1;
+}
+
+bool http_conn::start_h2_upgrade(HTTP_CODE code)
+{
+    // 带请求体的请求、处理函数生成的响应和目录列表不升级，按HTTP/1.1回应
+    const http_span *settings = m_request.header(HEADER_HTTP2_SETTINGS);
+    if (!settings || m_content_length || code == DYNAMIC_REQUEST || code == CHUNKED_REQUEST)
+        return false;
+    rcu_read_guard guard;
+    const server_config *cfg = config_read();
+    if (!cfg->http2)
+        return false;
+    http2_session *h2 = new_http2_session(*cfg, m_limit);
+    if (!h2->upgrade(settings->data, settings->len, code, m_file, false))
+    {
+        delete h2;
+        return false;
+    }
+    // 文件缓存条目交给了流1，升级请求之后客户端要等收到101才会发送连接前言；之后的流各自计入虚拟主机
+    m_h2 = h2;
+    if (m_vhost_entered)
+    {
+        vhost_leave(m_vhost);
+        m_vhost_entered = false;
+    }
+    m_file = nullptr;
+    m_file_address = nullptr;
+    m_read_idx = 0;
+    return true;
+}
 
-    // 这里首次设置写事件的监听
-    modfd(m_epollfd, m_sockfd, EPOLLOUT); // 监听写事件
-}
\ No newline at end of file
+bool http_conn::process_h2()
+{
+    m_read_idx = m_h2->on_input(m_read_idx);
+    // 优雅退出期间告诉客户端不要再开新的流，已经开始的流照常发完
+    if (m_draining.load())
+        m_h2->shutdown();
+    hot().state.store(CONN_WRITING);
+    return flush();
+}
@@ -19,19 +19,53 @@
 #include <stdarg.h>
 #include <errno.h>
 #include<sys/uio.h>
-#include "/home/asus/linux-high-effective/linux-high-effective/multithread-programming/code/locker.h"
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "locker.h"
+#include "router.h"
+#include "limiter.h"
+#include "http_request.h"
+#include "out_queue.h"
 
+class http2_session;
+class tls_conn;
+class proxy_session;
+struct proxy_route;
+struct vhost;
+struct file_entry;
+class autoindex_stream;
+struct ssl_ctx_st;
 
-class http_conn
+/*
+    连接中会被持有者以外的线程访问的字段：事件循环每收到一个事件都要CAS所有权状态、记下持有期间到达的事件，
+    空闲检查和优雅退出要扫描每个fd的socket、所属的事件循环和最后活跃时间。
+    这些字段不放在http_conn里，而是放在按fd排列的紧凑数组里，每个连接独占一个缓存行：
+    扫描只读这个数组（65536个fd共4MB），事件循环CAS状态时也不会和工作线程正在修改的解析状态抢同一个缓存行
+*/
+struct alignas(64) conn_hot
 {
-public:
-    /* 文件名的最大长度 */
-    static const int FILENAME_LEN = 200;
+    /* 所有权状态，取值为http_conn::CONN_STATE */
+    std::atomic<int> state{0};
+    /* 连接被持有期间到达、尚未处理的epoll事件 */
+    std::atomic<uint32_t> events{0};
+    /* CONN_PROXY_WAIT状态下等待的事件，上游socket的事件为PROXY_UPSTREAM_IN/OUT */
+    std::atomic<uint32_t> proxy_wait{0};
+    /* 该HTTP连接的socket，关闭后为-1 */
+    int sockfd = -1;
+    /* 连接注册到的epoll内核事件表，有多个事件循环时每个循环有各自的epoll */
+    int epollfd = -1;
+    /* 最后一次读写的时间，用于关闭空闲连接；持有者写，事件循环读 */
+    std::atomic<time_t> last_active{0};
+};
+static_assert(sizeof(conn_hot) == 64, "conn_hot should fill exactly one cache line");
 
-    /* 读缓冲区的大小 */
-    static const int READ_BUFFER_SIZE = 2048;
-    /* 写缓冲区的大小 */
-    static const int WRITE_BUFFER_SIZE = 1024;
+/* 连接对象按缓存行对齐，数组里相邻的两个连接不共享缓存行 */
+class alignas(64) http_conn
+{
+public:
 /* HTTP请求方法，但我们仅支持GET */
 enum METHOD { 
     GET = 0,        // 获取资源（代码中主要支持的方法）
@@ -62,7 +96,44 @@ enum HTTP_CODE
     FORBIDDEN_REQUEST,    // 请求的资源存在，但客户端无访问权限（如文件不可读）
     FILE_REQUEST,         // 请求的资源存在且可访问，已准备好返回文件内容
     INTERNAL_ERROR,       // 服务器内部错误（如代码逻辑异常）
-    CLOSED_CONNECTION     // 客户端主动关闭连接
+    CLOSED_CONNECTION,    // 客户端主动关闭连接
+    PROXY_REQUEST,        // 请求头解析完毕，URL匹配了反向代理路由，交给上游处理
+    BAD_GATEWAY,          // 没有可用的上游服务器，或者上游没有给出合法的响应
+    SERVICE_UNAVAILABLE,  // 虚拟主机同时处理的请求数达到了上限
+    TOO_MANY_REQUESTS,    // 客户端地址的请求速率超过了限流的上限
+    DYNAMIC_REQUEST,      // 路由的处理函数（或者目录列表）生成了响应体
+    DIRECTORY_REQUEST,    // 目录下没有index.html而且开启了autoindex，map_file返回的是目录的条目
+    CHUNKED_REQUEST       // 大目录的列表，用chunked编码边生成边发送
+};
+
+/*
+    连接的所有权状态。每个socket只在init时以EPOLLIN|EPOLLOUT|EPOLLET注册一次，不再用EPOLLONESHOT反复modfd；
+    同一时刻只有一个线程（"持有者"）能推进连接的状态机，持有者通过CAS从空闲状态进入READING/WRITING获得所有权。
+    持有期间到达的事件记在conn_hot的events里，持有者放弃所有权后会再检查一次，保证事件不会丢失
+*/
+enum CONN_STATE {
+    CONN_IDLE = 0,        // 无人持有：等待可读事件
+    CONN_READING,         // 持有：正在读socket
+    CONN_PROCESSING,      // 持有：工作线程正在解析请求、准备响应
+    CONN_WRITING,         // 持有：正在发送响应
+    CONN_WRITE_BLOCKED,   // 无人持有：发送缓冲区已满，等待可写事件后继续发送
+    CONN_PROXY_WAIT,      // 无人持有：反向代理在等conn_hot的proxy_wait中的事件（客户端或上游socket）
+    CONN_DISK_WAIT        // 由磁盘I/O线程的预读持有：要发送的文件页不在内存里，读完后交回线程池继续发送
+};
+
+/* write()的结果 */
+enum WRITE_RESULT {
+    WRITE_DONE = 0,       // 响应已全部发出
+    WRITE_AGAIN,          // 内核发送缓冲区满了，等可写后再继续
+    WRITE_ERROR,          // 出错或没有东西可写，需要关闭连接
+    WRITE_DISK            // 要发送的文件页不在内存里，m_cold是要预读的部分
+};
+
+/* 交给线程池时的优先级，对应ThreadPool的队列，越小越先处理 */
+enum TASK_CLASS {
+    TASK_ADMIN = 0,       // 内置的处理函数（metrics、health），运维在过载时也要能看到
+    TASK_CHEAP,           // 小文件、缓存的页面、错误页面和转发
+    TASK_BULK             // 大文件和分块生成的目录列表，发送时可能因为缺页而阻塞在磁盘上
 };
 
 /* 行的读取状态（用于判断HTTP请求中单行数据的解析结果） */
@@ -73,102 +144,224 @@ enum LINE_STATUS {
 };
 
 public:
-    http_conn() {}
-    ~http_conn() {}
+    http_conn() : m_read_buf(nullptr), m_write_buf(nullptr), m_vhost_entered(false), m_h2(nullptr), m_tls(nullptr),
+                  m_file(nullptr), m_buf_node(-1), m_proxy(nullptr), m_proxy_route(nullptr), m_vhost(nullptr),
+                  m_route(nullptr), m_listing(nullptr) {}
+    ~http_conn();
 
-    /* 初始化新接受的连接 */
-    void init(int sockfd, const sockaddr_in& addr);
+    /* 初始化新接受的连接，epollfd是负责该连接的事件循环的epoll；tls为true时先完成TLS握手 */
+    /* limit是accept时通过限流检查后计入的槽，连接关闭时释放 */
+    void init(int sockfd, const sockaddr_in& addr, int epollfd, const limiter_ticket& limit, bool tls = false);
     /* 关闭连接 */
     void close_conn(bool real_close = true);
-    /* 处理客户请求 */
+    /* 处理客户请求，由工作线程调用，调用时连接处于CONN_PROCESSING状态 */
     void process();
+    /* 事件循环收到该连接上的事件时调用。返回true表示事件循环获得了所有权并读到了数据，
+       连接已进入CONN_PROCESSING状态，调用者需要把process交给线程池 */
+    bool handle_event(uint32_t events);
+    /* 内存压力解除后由事件循环调用：暂停期间留下的可读事件重新推进，返回值同handle_event */
+    bool resume_reads();
+    /* handle_event返回true后由事件循环调用，决定process排进哪个优先级的队列 */
+    TASK_CLASS task_class() const;
+    /* 预读完成后由m_disk_done安排的任务调用：数据已经在内存里，继续发送 */
+    void resume_write();
+    /* 空闲超过timeout秒且无人持有时关闭连接，关闭了返回true */
+    bool close_if_idle(time_t now, int timeout);
+    /* 退出时调用：关闭两次请求之间的keep-alive连接；force为true时关闭所有无人持有的连接 */
+    bool close_if_drainable(bool force);
+    bool is_open() const { return hot().sockfd != -1; }
+    /* 该连接属于哪个事件循环 */
+    int epollfd() const { return hot().epollfd; }
+
+    /// @brief 把URL映射到根目录下的文件，HTTP/1.1请求和HTTP/2的流共用
+    /// @param root 根目录（虚拟主机或者静态路由的目录），为nullptr时使用doc_root
+    /// @param path 接在根目录后面的路径，不含查询参数，直接交给文件缓存，不需要以'\0'结尾
+    /// @param file 返回FILE_REQUEST时为打开文件缓存中的条目（含文件状态和映射），DIRECTORY_REQUEST时为目录的条目，
+    ///             由调用方file_cache_release
+    static HTTP_CODE map_file(const char* root, http_span path, file_entry*& file);
+    /// @brief 为map_file返回的目录生成列表，并释放目录的条目
+    /// @param target 请求的目标（路径和查询参数），列表中的链接以其中的路径为前缀
+    /// @return DYNAMIC_REQUEST（page为整页）、CHUNKED_REQUEST（stream为分块输出）或者错误
+    static HTTP_CODE list_directory(file_entry* dir, http_span target, std::shared_ptr<const std::string>& page,
+                                    autoindex_stream*& stream, const char*& content_type);
+    /// @brief 按请求的路由和虚拟主机决定map_file的根目录和路径，path传入完整的请求路径（不含查询参数）
+    static void resolve_static(const route* r, const route_match& m, const vhost* host, const char*& root,
+                               http_span& path);
+    /// @brief 处理结果对应的状态码、原因短语和页面内容（FILE_REQUEST时为文件为空时的页面）
+    /// @return code不是一个可以回应的结果时返回false
+    static bool status_page(HTTP_CODE code, int& status, const char*& title, const char*& form);
+
+private:
+    /* 本连接在m_hot中的条目，下标就是连接在m_conns中的下标（fd），不需要读连接对象本身 */
+    conn_hot& hot() const { return m_hot[this - m_conns]; }
     /* 非阻塞读操作 */
     bool read();
     /* 非阻塞写操作 */
-    bool write();
-
-private:
+    WRITE_RESULT write();
     /* 初始化连接 */
     void init();
+    /* 释放读写缓冲区，下一次init时重新分配 */
+    void free_buffers();
+    /* 从无人持有的from状态抢占所有权 */
+    bool try_own(int from);
+    /* 根据已经到达的事件尝试获得所有权并推进状态机，返回值同handle_event */
+    bool drive();
+    /* 持有者放弃所有权进入next状态（某个无人持有的状态），返回值同handle_event */
+    bool release(CONN_STATE next);
+    /* 持有者进入CONN_DISK_WAIT，并把m_cold交给磁盘I/O线程预读 */
+    void wait_for_disk();
+    /* 持有者发送响应，根据结果决定下一个状态，返回值同handle_event */
+    bool flush();
+    /* 读缓冲区开头是否为HTTP/2连接前言：1表示已切换到HTTP/2，0表示不是，-1表示前言还没收全 */
+    int detect_h2_preface();
+    /* 处理 "Upgrade: h2c"：升级成功时101响应和流1的响应都已交给HTTP/2会话 */
+    bool start_h2_upgrade(HTTP_CODE code);
+    /* HTTP/2连接的process()，返回值同handle_event */
+    bool process_h2();
+    /* 推进TLS握手，返回握手完成前连接应进入的无人持有状态；握手完成返回CONN_PROCESSING，失败返回-1 */
+    int tls_handshake();
+    /* write()之后连接应进入的无人持有状态，连接被关闭时返回-1 */
+    int after_write(WRITE_RESULT ret);
+    /* 把请求交给反向代理，返回值同handle_event */
+    bool start_proxy();
+    /* 反向代理推进一步（proxy_session::RESULT）之后连接应进入的无人持有状态，连接被关闭时返回-1 */
+    int after_proxy(int ret);
     /* 解析HTTP请求 */
     HTTP_CODE process_read();
     /* 填充HTTP应答 */
     bool process_write(HTTP_CODE ret);
 
     /* 下面这一组函数被process_read调用以分析HTTP请求 */
-    HTTP_CODE parse_request_line(char* text);
-    HTTP_CODE parse_headers(char* text);
-    HTTP_CODE parse_content(char* text);
+    HTTP_CODE parse_request_line(http_span text);
+    HTTP_CODE parse_headers(http_span text);
+    HTTP_CODE parse_content();
     HTTP_CODE do_request();
-    char* get_line() { return m_read_buf + m_start_line; }
+    /* 调用路由的处理函数，响应体放在m_dynamic_body */
+    HTTP_CODE run_handler();
+    /* 当前请求计入虚拟主机的并发请求数，超过上限时返回false */
+    bool enter_vhost();
+    /* parse_line刚得到的一行，不含行尾的\r\n */
+    http_span get_line() const { return http_span{m_read_buf + m_start_line, (uint32_t)(m_checked_idx - 2 - m_start_line)}; }
     LINE_STATUS parse_line();
 
     /* 下面这一组函数被process_write调用以填充HTTP应答 */
     void unmap();
+    /* 分块输出时生成下一块放进m_out，没有更多数据时返回false */
+    bool next_chunk();
     bool add_response(const char* format, ...);
     bool add_content(const char* content);
     bool add_status_line(int status, const char* title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    bool add_headers(off_t content_length);
+    bool add_content_length(off_t content_length);
     bool add_linger();
     bool add_blank_line();
 
 public:
-    /* 所有socket上的事件都被注册到同一个epoll内核事件表中，所以将epoll文件描述符设置为静态的 */
-    static int m_epollfd;
-    /* 统计用户数量 */
-    static int m_user_count;
+    /* 统计用户数量，多个事件循环和工作线程都会修改 */
+    static std::atomic<int> m_user_count;
+    /* 服务器正在优雅退出：响应发完后不再保持连接 */
+    static std::atomic<bool> m_draining;
+    /* 已解析的请求数和epoll_ctl调用次数，退出时打印，用来衡量每个请求的系统调用开销 */
+    static std::atomic<long> m_request_count;
+    static std::atomic<long> m_epoll_ctl_count;
+    /* 响应体超过这个字节数的文件算作大文件，连接上的下一个请求排进TASK_BULK队列 */
+    static std::atomic<long> m_bulk_bytes;
+    /* 一次发送中不小于这个字节数的文件数据用MSG_ZEROCOPY发送，0表示不用零拷贝 */
+    static std::atomic<long> m_zerocopy_bytes;
+    /* 磁盘I/O线程预读完成后调用，把resume_write交给线程池；为空时直接在I/O线程上调用 */
+    static void (*m_disk_done)(http_conn* conn);
+    /* 读、写缓冲区的大小，启动时由配置决定 */
+    static int m_read_buffer_size;
+    static int m_write_buffer_size;
+    /* 缓冲区是否要在接受连接的事件循环所在的NUMA节点上分配 */
+    static bool m_numa_local;
+    /* 缓冲区槽开头放请求头数组的字节数，按缓存行对齐 */
+    static const size_t HEADER_INDEX_BYTES = (sizeof(http_header_index) + 63) & ~(size_t)63;
+    /* 按fd排列的缓冲区区域（大页），每个fd一个m_buf_slot字节的槽，依次是请求头数组、读缓冲区、写缓冲区；为空时单独new */
+    static char* m_buf_arena;
+    static size_t m_buf_slot;
+    /* 按fd排列的连接数组和与之一一对应的conn_hot数组，启动时由main设置 */
+    static http_conn* m_conns;
+    static conn_hot* m_hot;
+    /* TLS监听socket上接受的连接共用的SSL_CTX，没有开启TLS时为空 */
+    static ssl_ctx_st* m_tls_ctx;
 
 private:
-    /* 该HTTP连接的socket和对方的socket地址 */
-    int m_sockfd;
-    sockaddr_in m_address;
-
-    /* 读缓冲区 */
-    char m_read_buf[READ_BUFFER_SIZE];
+    /*
+        下面的字段只有持有者读写。每个请求都要用到的放在对象开头：
+        第一行是读socket和解析请求用的，事件循环处理可读事件时只碰这一行；接下来是发送响应用的发送队列和文件。其余的按需访问，放在后面
+    */
+    /* 读缓冲区，第一次使用时按m_read_buffer_size分配 */
+    char* m_read_buf;
+    /* 写缓冲区，第一次使用时按m_write_buffer_size分配 */
+    char* m_write_buf;
     /* 标识读缓冲区中已经读入的客户数据的最后一个字节的下一个位置 */
     int m_read_idx;
     /* 当前正在分析的字符在读缓冲区中的位置 */
     int m_checked_idx;
     /* 当前正在解析的行的起始位置 */
     int m_start_line;
-    /* 写缓冲区 */
-    char m_write_buf[WRITE_BUFFER_SIZE];
     /* 写缓冲区中待发送的字节数 */
     int m_write_idx;
-
     /* 主状态机当前所处的状态 */
     CHECK_STATE m_check_state;
     /* 请求方法 */
     METHOD m_method;
-
-    /* 客户请求的目标文件的完整路径，其内容等于doc_root + m_url, doc_root是网站根目录 */
-    char m_real_file[FILENAME_LEN];
-    /* 客户请求的目标文件名 */
-    char* m_url;
-    /* HTTP协议版本号，我们仅支持HTTP/1.1 */
-    char* m_version;
-    /* 主机名 */
-    char* m_host;
-    /* HTTP请求的消息体的长度 */
-    int m_content_length;
+    /* 上一个响应的开销，请求行里看不出来时下一个请求按它排队；持有者写，持有者读 */
+    TASK_CLASS m_task_class;
     /* HTTP请求是否要求保持连接 */
     bool m_linger;
-
-    /* 客户请求的目标文件被mmap到内存中的起始位置 */
-    char* m_file_address;
-    /* 目标文件的状态。用于判断文件是否存在、是否为目录、是否可读等 */
-    struct stat m_file_stat;
-
-    /* 采用writev执行写操作时的内存块相关成员，m_iv_count表示被写内存块的数量 */
-    struct iovec m_iv[2];
+    /* 请求带有 "Upgrade: h2c"，HTTP2-Settings的值在m_request里 */
+    bool m_upgrade_h2c;
+    /* 请求带有 "Expect: 100-continue"，只对转发给上游的请求有意义 */
+    bool m_expect_continue;
+    /* 当前请求已经计入m_vhost的并发请求数，请求结束时要减回去 */
+    bool m_vhost_entered;
+    /* 切换到HTTP/2（h2c）之后的会话，之后的读写都交给它；HTTP/1.1连接为空 */
+    http2_session* m_h2;
+    /* TLS连接的记录层，明文连接为空；握手完成前read/write不碰socket */
+    tls_conn* m_tls;
+    /* 待发送的响应：响应头、响应体、文件数据按顺序排队，write()从队头用writev/sendmsg发送 */
+    out_queue m_out;
     //iovec的核心作用是描述一块内存的"起始地址和长度" 配合writev和readv系统调用实现分散读和集中写 从而提高IO效率
     /*
         传统的write和read一次只能操作一个缓冲区 如果要发送/接受多段数据 比如HTTP响应头+响应体 需要多次调用write/read
         每次write/read都需要用户态->内核态的切换 而且多次write无法保证数据的连续写入 可能 被其他进程的写操作打断
         write和readv+iovec一次可以系统同调用多个缓冲区
     */
-    int m_iv_count;
+    /* 客户请求的目标文件被mmap到内存中的起始位置（条目的映射） */
+    char* m_file_address;
+    /* 目标文件在打开文件缓存中的条目，响应发完后释放 */
+    file_entry* m_file;
+    /* HTTP请求的消息体的长度 */
+    int m_content_length;
+
+    /* 对方的socket地址 */
+    sockaddr_in m_address;
+    /* 连接在限流表中计入的槽 */
+    limiter_ticket m_limit;
+    /* 缓冲区被分配（首次写入）时所在的NUMA节点 */
+    int m_buf_node;
+    /* 反向代理的转发状态，第一次转发时创建，之后的请求复用；m_proxy_route为当前请求匹配的路由 */
+    proxy_session* m_proxy;
+    const proxy_route* m_proxy_route;
+    /* Host头选中的虚拟主机，解析请求头时查表得到，没有Host头时为空 */
+    vhost* m_vhost;
+    /* 请求路径匹配的路由和其中参数段的位置（指向读缓冲区），没有匹配时为空 */
+    const route* m_route;
+    route_match m_route_match;
+    /* 请求行和请求头，都是读缓冲区上的片段；目标路径直接交给路由和文件缓存，不再复制 */
+    http_request m_request;
+    /* 目标文件的状态。用于判断文件是否存在、是否为目录、是否可读等 */
+    struct stat m_file_stat;
+    /* 发送前检查出的不在内存里的文件页，交给磁盘I/O线程预读 */
+    std::vector<iovec> m_cold;
+    /* 处理函数或者目录列表生成的响应体和Content-Type */
+    std::shared_ptr<const std::string> m_dynamic_body;
+    std::string m_dynamic_type;
+    /* 分块输出的目录列表，以及正在发送的一块（含chunked编码的长度行） */
+    autoindex_stream* m_listing;
+    std::string m_chunk;
 };
 int setnonblocking(int fd);
 
@@ -176,7 +369,8 @@ int setnonblocking(int fd);
 /// @param epollfd 
 /// @param fd 
 /// @param one_shot epoll下的一种事件触发模式,该文件描述符上的epoll事件只会被epoll触发一次 一旦被处理过 epoll也不会再向事件列表中添加这个事件 知道通过epoll_ctl重新设置事件
-void addfd(int epollfd, int fd, bool one_shot);
+/// @param writable 同时监听EPOLLOUT，连接socket用它一次性注册读写事件，之后不再修改
+void addfd(int epollfd, int fd, bool one_shot, bool writable = false);
 
 /// @brief 修改已注册到 epoll 实例中的文件描述符（fd）的监听事件属性
 /// @param epollfd epoll内核事件表的标识
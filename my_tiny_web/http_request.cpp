@@ -0,0 +1,156 @@
+#include "http_request.h"
+
+/*
+    请求头名字和请求方法的完美哈希表在编译期生成：构造函数不断换种子，直到表中每个名字都落在不同的槽里。
+    查找时算一次哈希、取出槽里唯一可能的名字比较一次，认识的名字再多也不会变成逐个比较
+*/
+
+struct name_entry
+{
+    const char* name;
+    int value;
+};
+
+static constexpr char lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static constexpr size_t const_strlen(const char* s)
+{
+    size_t n = 0;
+    while (s[n])
+        ++n;
+    return n;
+}
+
+// FNV-1a，按小写计算，所以查找不区分大小写
+static constexpr uint32_t name_hash(const char* s, size_t len, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (uint8_t)lower(s[i])) * 16777619u;
+    return h ^ (h >> 16);
+}
+
+// SLOTS是2的幂，槽里存名字的下标，-1表示空槽
+template <size_t N, size_t SLOTS>
+struct name_table
+{
+    name_entry entries[N];
+    size_t lens[N];
+    int8_t slots[SLOTS];
+    uint32_t seed;
+
+    constexpr name_table(const name_entry (&e)[N]) : entries(), lens(), slots(), seed(0)
+    {
+        static_assert((SLOTS & (SLOTS - 1)) == 0 && N < SLOTS && SLOTS <= 128, "bad table size");
+        for (size_t i = 0; i < N; ++i)
+        {
+            entries[i] = e[i];
+            lens[i] = const_strlen(e[i].name);
+        }
+        for (uint32_t s = 1; s < 100000 && !seed; ++s)
+        {
+            for (size_t j = 0; j < SLOTS; ++j)
+                slots[j] = -1;
+            bool ok = true;
+            for (size_t i = 0; i < N && ok; ++i)
+            {
+                size_t j = name_hash(entries[i].name, lens[i], s) & (SLOTS - 1);
+                if (slots[j] >= 0)
+                    ok = false;
+                else
+                    slots[j] = (int8_t)i;
+            }
+            if (ok)
+                seed = s;
+        }
+    }
+
+    int find(const char* name, size_t len, int missing) const
+    {
+        int i = slots[name_hash(name, len, seed) & (SLOTS - 1)];
+        if (i < 0 || lens[i] != len || strncasecmp(name, entries[i].name, len) != 0)
+            return missing;
+        return entries[i].value;
+    }
+};
+
+static constexpr name_entry g_header_names[] = {
+    {"Host", HEADER_HOST},
+    {"Connection", HEADER_CONNECTION},
+    {"Content-Length", HEADER_CONTENT_LENGTH},
+    {"Transfer-Encoding", HEADER_TRANSFER_ENCODING},
+    {"Upgrade", HEADER_UPGRADE},
+    {"HTTP2-Settings", HEADER_HTTP2_SETTINGS},
+    {"Expect", HEADER_EXPECT},
+    {"Authorization", HEADER_AUTHORIZATION},
+    {"Keep-Alive", HEADER_KEEP_ALIVE},
+    {"Proxy-Connection", HEADER_PROXY_CONNECTION},
+    {"TE", HEADER_TE},
+    {"Trailer", HEADER_TRAILER},
+    {"Accept-Encoding", HEADER_ACCEPT_ENCODING},
+    {"Range", HEADER_RANGE},
+    {"If-None-Match", HEADER_IF_NONE_MATCH},
+    {"If-Modified-Since", HEADER_IF_MODIFIED_SINCE},
+    {"Cookie", HEADER_COOKIE},
+};
+static constexpr name_table<sizeof(g_header_names) / sizeof(g_header_names[0]), 64> g_headers(g_header_names);
+static_assert(g_headers.seed != 0, "no perfect hash for header names");
+
+/* 顺序和http_conn::METHOD相同 */
+static constexpr name_entry g_method_names[] = {
+    {"GET", 0}, {"POST", 1}, {"HEAD", 2}, {"PUT", 3}, {"DELETE", 4}, {"TRACE", 5}, {"OPTIONS", 6}, {"CONNECT", 7},
+    {"PATCH", 8},
+};
+static constexpr name_table<sizeof(g_method_names) / sizeof(g_method_names[0]), 32> g_methods(g_method_names);
+static_assert(g_methods.seed != 0, "no perfect hash for methods");
+
+HTTP_HEADER http_header_id(const char* name, size_t len)
+{
+    return (HTTP_HEADER)g_headers.find(name, len, HEADER_OTHER);
+}
+
+int http_method_id(const char* name, size_t len)
+{
+    return g_methods.find(name, len, -1);
+}
+
+const char* http_method_name(int id)
+{
+    return g_method_names[id].name;
+}
+
+void http_request::reset()
+{
+    method = target = path = version = http_span{nullptr, 0};
+    memset(known, 0, sizeof(known));
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+bool http_request::add_header(const char* line, size_t len, http_span& name, http_span& value, HTTP_HEADER& id)
+{
+    const char* colon = (const char*)memchr(line, ':', len);
+    if (!colon || colon == line)
+        return false;
+    const char* v = colon + 1;
+    const char* end = line + len;
+    while (v < end && is_space(*v))
+        ++v;
+    while (end > v && is_space(end[-1]))
+        --end;
+    name = http_span{line, (uint32_t)(colon - line)};
+    value = http_span{v, (uint32_t)(end - v)};
+    id = http_header_id(line, colon - line);
+    if (id != HEADER_OTHER && !known[id])
+    {
+        known[id] = true;
+        headers->values[id] = value;
+    }
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+    解析后的HTTP/1.1请求。请求行和请求头都是读缓冲区上的(指针, 长度)片段，解析时不改写缓冲区（不再把\r\n换成\0），
+    也不复制；常用的请求头在解析时换成编号，值按编号记在一个固定大小的数组里，之后按编号直接取值。
+    片段只在这个请求处理完之前有效（读缓冲区在下一个请求开始时被覆盖）
+*/
+
+/* 缓冲区上的一段字节，不以'\0'结尾 */
+struct http_span
+{
+    const char* data;
+    uint32_t len;
+
+    bool empty() const { return len == 0; }
+    /* 和以'\0'结尾的s比较，忽略大小写 */
+    bool iequals(const char* s) const { return strlen(s) == len && strncasecmp(data, s, len) == 0; }
+};
+
+/* 需要按编号访问的请求头，其余的都是HEADER_OTHER */
+enum HTTP_HEADER
+{
+    HEADER_OTHER = 0,
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_HTTP2_SETTINGS,
+    HEADER_EXPECT,
+    HEADER_AUTHORIZATION,
+    /* 以下几个只用来判断是不是逐跳头部 */
+    HEADER_KEEP_ALIVE,
+    HEADER_PROXY_CONNECTION,
+    HEADER_TE,
+    HEADER_TRAILER,
+    /* 以下几个目前只是记下编号，供处理函数按编号取值 */
+    HEADER_ACCEPT_ENCODING,
+    HEADER_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_COOKIE,
+    HEADER_COUNT
+};
+
+/// @brief 请求头名字对应的编号（忽略大小写），不认识的名字返回HEADER_OTHER
+/// 查的是编译期生成的完美哈希表：一次哈希、一次比较，和认识多少种请求头无关
+HTTP_HEADER http_header_id(const char* name, size_t len);
+
+/// @brief 请求方法对应的编号，顺序和http_conn::METHOD相同；不认识的方法返回-1
+int http_method_id(const char* name, size_t len);
+/// @brief http_method_id返回的编号对应的方法名（大写）
+const char* http_method_name(int id);
+
+/* 一个请求中常用头部的值，按编号存放，每种只记第一次出现的 */
+struct http_header_index
+{
+    http_span values[HEADER_COUNT];
+};
+
+struct http_request
+{
+    http_span method;
+    /* 请求行中的目标（路径和查询参数），以及去掉查询参数的路径 */
+    http_span target;
+    http_span path;
+    http_span version;
+
+    /* 连接拿到缓冲区时指向和缓冲区一起分配的数组，解析请求头之前必须设置 */
+    http_header_index* headers = nullptr;
+    /* 每种常用头部是否出现过 */
+    bool known[HEADER_COUNT];
+
+    void reset();
+    /// @brief 解析一行请求头（不含\r\n），名字和值（去掉了两端的空白）存入name、value，编号存入id；
+    ///        常用头部第一次出现时记下它的值，不认识的头部和重复的常用头部只解析、不记录，
+    ///        所以请求头的个数没有上限（请求头的总长度受读缓冲区大小限制）
+    /// @return 没有冒号或者名字为空时返回false
+    bool add_header(const char* line, size_t len, http_span& name, http_span& value, HTTP_HEADER& id);
+    /// @brief 常用头部的值，没有时返回nullptr
+    const http_span* header(HTTP_HEADER id) const { return known[id] ? &headers->values[id] : nullptr; }
+};
+
+#endif
@@ -0,0 +1,264 @@
+#include "limiter.h"
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+/* 令牌的计量单位：1个令牌 = 1024个单位，按毫秒补充时不会因为取整丢得太多 */
+static const uint32_t TOKEN = 1024;
+/* 线性探测最多看这么多个槽，找不到就当表满 */
+static const int MAX_PROBE = 16;
+/* 回收槽时先把连接数从0换成这个值，期间计数的准入检查看到负数就知道槽正在换主人 */
+static const int32_t CLAIMED = INT32_MIN;
+/* 准入检查和回收撞上时重新找槽的次数 */
+static const int MAX_RETRY = 3;
+
+/* 一个地址（或者网段）的槽，两个槽占一个缓存行 */
+struct alignas(32) limiter_slot
+{
+    /* 高32位为1（/32）或2（/24），低32位为主机字节序的地址；0为空槽 */
+    std::atomic<uint64_t> key;
+    /* 高32位为上次补充令牌的时间（毫秒），低32位为令牌数 */
+    std::atomic<uint64_t> bucket;
+    std::atomic<int32_t> conns;
+};
+
+/* /32和/24各自的上限，重载配置时更新 */
+struct limiter_level
+{
+    std::atomic<int> max_conns;
+    std::atomic<int> rate;
+    std::atomic<uint32_t> capacity;
+};
+
+static limiter_slot* g_table = nullptr;
+static uint32_t g_mask = 0;
+static limiter_level g_levels[2];
+static std::atomic<bool> g_enabled(false);
+
+static std::atomic<long> g_rejected_conns(0);
+static std::atomic<long> g_rejected_requests(0);
+static std::atomic<long> g_table_full(0);
+
+void limiter_init(int slots)
+{
+    uint32_t n = 64;
+    while (n < (uint32_t)slots)
+        n <<= 1;
+    g_table = new limiter_slot[n]();
+    g_mask = n - 1;
+}
+
+void limiter_configure(const server_config& cfg)
+{
+    const int conns[2] = {cfg.limit_conn_per_ip, cfg.limit_conn_per_net};
+    const int rates[2] = {cfg.limit_rate_per_ip, cfg.limit_rate_per_net};
+    for (int l = 0; l < 2; ++l)
+    {
+        g_levels[l].max_conns.store(conns[l]);
+        g_levels[l].rate.store(rates[l]);
+        g_levels[l].capacity.store(rates[l] ? (uint32_t)(rates[l] + cfg.limit_burst) * TOKEN : 0);
+    }
+    g_enabled.store(conns[0] || conns[1] || rates[0] || rates[1]);
+}
+
+// 粗粒度的单调时钟（vDSO，不进内核），毫秒，回绕时按差值计算不受影响
+static inline uint32_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// 按经过的时间补充令牌后的桶
+static inline uint64_t refill(uint64_t b, uint32_t now, const limiter_level& lv)
+{
+    uint32_t last = b >> 32;
+    uint64_t tokens = (uint32_t)b;
+    // 别的线程可能用稍晚的时间更新过桶，经过的时间按有符号数算
+    int32_t elapsed = (int32_t)(now - last);
+    uint64_t add = elapsed > 0 ? (uint64_t)elapsed * lv.rate.load(std::memory_order_relaxed) * TOKEN / 1000 : 0;
+    uint32_t cap = lv.capacity.load(std::memory_order_relaxed);
+    // 不足一个单位时不推进时间，避免频繁的请求把零头一直舍掉
+    if (add)
+        last = now;
+    tokens += add;
+    if (tokens > cap)
+        tokens = cap;
+    return (uint64_t)last << 32 | tokens;
+}
+
+// 令牌是否已经补满（不限速时总是满的）
+static bool bucket_full(limiter_slot& s, uint64_t key, uint32_t now)
+{
+    const limiter_level& lv = g_levels[(key >> 32) == 1 ? 0 : 1];
+    return (uint32_t)refill(s.bucket.load(std::memory_order_relaxed), now, lv) >=
+           lv.capacity.load(std::memory_order_relaxed);
+}
+
+// 槽是否可以让给别的地址：没有连接，令牌也已经补满
+static bool idle(limiter_slot& s, uint64_t key, uint32_t now)
+{
+    return s.conns.load(std::memory_order_relaxed) == 0 && bucket_full(s, key, now);
+}
+
+// 把idx处的槽（空槽，或者old_key的空闲槽）换给key，返回key现在所在的槽，失败时返回-1。
+// 先把连接数从0换成CLAIMED占住它：之后旧地址的准入检查只会看到负数而退出，连接数不会被新地址继承；
+// 没有连接也就没有人扣令牌，这时再确认一次令牌是满的。
+// 两个线程可能同时为同一个key占住探测范围内不同的槽，所以换上key之后再看一遍探测范围，看到另一个槽也是key
+// 就把自己的槽空出来、改用那一个；两边的换key和检查都是seq_cst，至少有一边会看到另一边
+static int32_t claim(uint32_t start, uint32_t idx, uint64_t old_key, uint64_t key, uint32_t now,
+                     const limiter_level& lv)
+{
+    limiter_slot& s = g_table[idx];
+    int32_t zero = 0;
+    if (!s.conns.compare_exchange_strong(zero, CLAIMED))
+        return -1;
+    int32_t result = -1;
+    if ((old_key == 0 || bucket_full(s, old_key, now)) && s.key.compare_exchange_strong(old_key, key))
+    {
+        s.bucket.store((uint64_t)now << 32 | lv.capacity.load(std::memory_order_relaxed));
+        result = idx;
+        for (int i = 0; i < MAX_PROBE; ++i)
+        {
+            uint32_t j = (start + i) & g_mask;
+            if (j != idx && g_table[j].key.load() == key)
+            {
+                s.key.store(0);
+                result = j;
+                break;
+            }
+        }
+    }
+    // 减去CLAIMED，期间看到负数的准入检查各自还会减去自己加的1
+    s.conns.fetch_sub(CLAIMED);
+    return result;
+}
+
+static int32_t find_slot(uint64_t key, uint32_t now, const limiter_level& lv)
+{
+    uint32_t start = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & g_mask;
+    int32_t victim = -1;
+    uint64_t victim_key = 0;
+    for (int i = 0; i < MAX_PROBE; ++i)
+    {
+        uint32_t idx = (start + i) & g_mask;
+        limiter_slot& s = g_table[idx];
+        uint64_t k = s.key.load(std::memory_order_acquire);
+        if (k == key)
+            return idx;
+        if (k == 0)
+        {
+            int32_t got = claim(start, idx, 0, key, now, lv);
+            if (got >= 0)
+                return got;
+            continue;
+        }
+        if (victim < 0 && idle(s, k, now))
+        {
+            victim = idx;
+            victim_key = k;
+        }
+    }
+    // 探测范围内都被占用，回收一个空闲的槽
+    return victim >= 0 ? claim(start, victim, victim_key, key, now, lv) : -1;
+}
+
+// 找到key的槽并计入一个连接，prev为计入之前的连接数；找不到槽时返回-1
+static int32_t acquire_slot(uint64_t key, uint32_t now, const limiter_level& lv, int32_t& prev)
+{
+    for (int attempt = 0; attempt < MAX_RETRY; ++attempt)
+    {
+        int32_t idx = find_slot(key, now, lv);
+        if (idx < 0)
+            return -1;
+        limiter_slot& s = g_table[idx];
+        prev = s.conns.fetch_add(1);
+        if (prev >= 0 && s.key.load() == key)
+            return idx;
+        // 找到槽之后、计数之前，槽正在或者已经被回收给别的地址
+        s.conns.fetch_sub(1);
+    }
+    return -1;
+}
+
+bool limiter_admit(uint32_t ip, limiter_ticket& t)
+{
+    t.slot[0] = t.slot[1] = -1;
+    if (!g_enabled.load(std::memory_order_relaxed))
+        return true;
+    uint32_t host = ntohl(ip);
+    const uint64_t keys[2] = {1ull << 32 | host, 2ull << 32 | (host & 0xffffff00u)};
+    uint32_t now = now_ms();
+    for (int l = 0; l < 2; ++l)
+    {
+        const limiter_level& lv = g_levels[l];
+        int max_conns = lv.max_conns.load(std::memory_order_relaxed);
+        int rate = lv.rate.load(std::memory_order_relaxed);
+        if (!max_conns && !rate)
+            continue;
+        int32_t prev;
+        int32_t idx = acquire_slot(keys[l], now, lv, prev);
+        if (idx < 0)
+        {
+            // 表满时放行，只记个数
+            g_table_full.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        limiter_slot& s = g_table[idx];
+        t.slot[l] = idx;
+        if ((max_conns && prev >= max_conns) ||
+            (rate && (uint32_t)refill(s.bucket.load(std::memory_order_relaxed), now, lv) < TOKEN))
+        {
+            limiter_release(t);
+            g_rejected_conns.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    return true;
+}
+
+void limiter_release(limiter_ticket& t)
+{
+    for (int l = 0; l < 2; ++l)
+    {
+        if (t.slot[l] >= 0)
+            g_table[t.slot[l]].conns.fetch_sub(1);
+        t.slot[l] = -1;
+    }
+}
+
+bool limiter_take(const limiter_ticket& t)
+{
+    uint32_t now = 0;
+    for (int l = 0; l < 2; ++l)
+    {
+        const limiter_level& lv = g_levels[l];
+        if (t.slot[l] < 0 || !lv.rate.load(std::memory_order_relaxed))
+            continue;
+        if (!now)
+            now = now_ms();
+        std::atomic<uint64_t>& bucket = g_table[t.slot[l]].bucket;
+        uint64_t b = bucket.load(std::memory_order_relaxed);
+        while (true)
+        {
+            uint64_t nb = refill(b, now, lv);
+            if ((uint32_t)nb < TOKEN)
+            {
+                // 已经扣掉的/32的令牌不退回，被限速的客户端本来就该慢下来
+                g_rejected_requests.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (bucket.compare_exchange_weak(b, nb - TOKEN, std::memory_order_relaxed))
+                break;
+        }
+    }
+    return true;
+}
+
+void limiter_stats(long& rejected_conns, long& rejected_requests, long& table_full)
+{
+    rejected_conns = g_rejected_conns.load();
+    rejected_requests = g_rejected_requests.load();
+    table_full = g_table_full.load();
+}
@@ -0,0 +1,47 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stdint.h>
+#include "config.h"
+
+/*
+    按客户端地址限制连接数和请求速率。
+    每个客户端IP（/32）和它所在的/24网段各占哈希表的一个槽，槽里是当前连接数和一个令牌桶。
+    哈希表大小固定，用线性探测、CAS占用空槽，所有事件循环和工作线程共享、不加锁；
+    连接数为0、令牌已经补满的槽可以被新的地址回收。
+    表满时放行（fail open）：探测范围内的槽都被有连接或者令牌没补满的地址占着时，新地址不受限制，
+    宁可不限也不误伤；大量伪造来源地址时限流会因此失效，放行的次数在/metrics的limit_table_full里，
+    持续增长时应当调大limit_table_slots。
+    IPv6的客户端不经过这里（监听socket只有IPv4），网段按/24算。
+    超过连接数上限、或者令牌已经用完的客户端在accept之后立即关闭；
+    已经建立的连接上每个请求（HTTP/2的每个流）消耗一个令牌，用完时回429
+*/
+
+/* 一个连接计入的/32和/24的槽，-1表示没有计入 */
+struct limiter_ticket
+{
+    int32_t slot[2];
+};
+
+/// @brief 启动时调用，slots为哈希表的槽数（向上取整到2的幂）
+void limiter_init(int slots);
+
+/// @brief 启动和重载配置时调用，更新各项上限
+void limiter_configure(const server_config& cfg);
+
+/// @brief 新连接的准入检查，通过时连接计入t里的槽，关闭时要调用limiter_release
+/// @param ip 网络字节序的IPv4地址
+/// @return 超过连接数上限或者没有令牌时返回false，这时没有计入任何槽；
+///         找不到槽（表满）时那一级不计入、不限制，照样返回true
+bool limiter_admit(uint32_t ip, limiter_ticket& t);
+
+/// @brief 连接关闭，减去它的连接数
+void limiter_release(limiter_ticket& t);
+
+/// @brief 一个请求消耗一个令牌，令牌用完时返回false
+bool limiter_take(const limiter_ticket& t);
+
+/// @brief 在accept时拒绝的连接数、回了429的请求数、表满放行的次数
+void limiter_stats(long& rejected_conns, long& rejected_requests, long& table_full);
+
+#endif
@@ -0,0 +1,146 @@
+// 限流准入检查的微基准：测limiter_admit+limiter_release（每个新连接一次）和limiter_take（每个请求一次）的耗时
+//   admit/take 1线程     单线程，同一个地址
+//   admit/take 同一地址   多个线程都用同一个地址，争用/32和/24的同一对槽
+//   admit 不同地址        每个线程一个/24网段里的地址，各用各的槽
+// 速率按配置允许的最大值设置（400万/秒，突发400万），令牌用完之后被拒绝的请求也照样计时，输出里给出拒绝的次数。
+// 耗时是每次操作平均用掉的CPU时间，线程数多于CPU时也能比较；多核上争用的代价（缓存行来回）才会完整体现出来。
+// 最后是槽回收的压力检查：很小的表、每个IP最多1个连接、比槽多的地址轮流进出，回收槽和准入检查并发时
+// 同一个IP不应该同时持有两个计入了槽的连接；发现时报错并以1退出。
+//
+// 用法: limiter_bench [-t 线程数] [-n 每个线程的操作次数]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include "limiter.h"
+
+static uint32_t addr(uint32_t host) { return htonl(host); }
+
+// 线程自己用掉的CPU时间（纳秒），线程多于CPU时不把等待调度的时间算进去
+static double thread_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// threads个线程各做n次op(线程号, 序号)，返回每次操作平均用掉的CPU时间
+template <class OP>
+static double run(int threads, long n, OP op) {
+    std::vector<std::thread> workers;
+    std::vector<double> cpu(threads);
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            double start = thread_cpu_ns();
+            for (long i = 0; i < n; ++i) op(t, i);
+            cpu[t] = thread_cpu_ns() - start;
+        });
+    }
+    for (auto& w : workers) w.join();
+    double total = 0;
+    for (double c : cpu) total += c;
+    return total / ((double)n * threads);
+}
+
+static void configure(int conn_per_ip, int rate) {
+    server_config cfg;
+    cfg.limit_conn_per_ip = conn_per_ip;
+    cfg.limit_conn_per_net = conn_per_ip ? conn_per_ip * 1000 : 0;
+    cfg.limit_rate_per_ip = cfg.limit_rate_per_net = rate / 2;
+    cfg.limit_burst = rate / 2;
+    limiter_configure(cfg);
+}
+
+static void report(const char* name, double ns, long base_conns, long base_requests) {
+    long conns, requests, full;
+    limiter_stats(conns, requests, full);
+    printf("%-22s %7.1f ns/次  拒绝连接 %ld  拒绝请求 %ld  表满放行 %ld\n", name, ns, conns - base_conns,
+           requests - base_requests, full);
+}
+
+static void bench(int threads, long n) {
+    limiter_init(65536);
+    configure(1000000, 4000000);
+    long c, r, f;
+    const uint32_t one = 0x0a000001; // 10.0.0.1
+
+    limiter_stats(c, r, f);
+    report("admit 1线程", run(1, n, [&](int, long) {
+               limiter_ticket t;
+               if (limiter_admit(addr(one), t)) limiter_release(t);
+           }), c, r);
+    limiter_ticket held;
+    limiter_admit(addr(one), held);
+    limiter_stats(c, r, f);
+    report("take 1线程", run(1, n, [&](int, long) { limiter_take(held); }), c, r);
+    limiter_release(held);
+
+    configure(1000000, 4000000);
+    limiter_stats(c, r, f);
+    report("admit 同一地址", run(threads, n, [&](int, long) {
+               limiter_ticket t;
+               if (limiter_admit(addr(one), t)) limiter_release(t);
+           }), c, r);
+    limiter_stats(c, r, f);
+    report("admit 不同地址", run(threads, n, [&](int th, long) {
+               limiter_ticket t;
+               if (limiter_admit(addr(0x0b000001 + ((uint32_t)th << 8)), t)) limiter_release(t);
+           }), c, r);
+    configure(1000000, 4000000);
+    limiter_admit(addr(one), held);
+    limiter_stats(c, r, f);
+    report("take 同一地址", run(threads, n, [&](int, long) { limiter_take(held); }), c, r);
+    limiter_release(held);
+}
+
+// 表只有64个槽、每个IP最多1个连接、不限速、不限/24，128个地址随机准入，每个线程手里轮流持有最近的HELD个连接，
+// 槽一直在被回收。holders记着每个IP当前计入了槽的连接数，准入成功后加一时不应该已经是1
+static bool recycle_check(int threads, long n) {
+    limiter_init(1);
+    server_config cfg;
+    cfg.limit_conn_per_ip = 1;
+    limiter_configure(cfg);
+    const int IPS = 128, HELD = 4;
+    static std::atomic<int> holders[IPS];
+    std::atomic<long> violations(0), counted(0);
+    std::vector<limiter_ticket> tickets(threads * HELD, limiter_ticket{{-1, -1}});
+    std::vector<int> owners(threads * HELD, -1);
+    run(threads, n, [&](int th, long i) {
+        int k = th * HELD + (int)(i % HELD);
+        if (owners[k] >= 0) {
+            holders[owners[k]].fetch_sub(1);
+            owners[k] = -1;
+        }
+        limiter_release(tickets[k]);
+        uint32_t ip = (uint32_t)((i * 2654435761u + th * 40503u) >> 7) % IPS;
+        if (!limiter_admit(addr(0x0c000000 + (ip << 8 | 1)), tickets[k]) || tickets[k].slot[0] < 0) return;
+        counted.fetch_add(1, std::memory_order_relaxed);
+        if (holders[ip].fetch_add(1) != 0) violations.fetch_add(1);
+        owners[k] = (int)ip;
+    });
+    for (int k = 0; k < threads * HELD; ++k) {
+        if (owners[k] >= 0) holders[owners[k]].fetch_sub(1);
+        limiter_release(tickets[k]);
+    }
+    printf("槽回收：计入槽的准入 %ld 次，同一IP同时持有两个连接 %ld 次\n", counted.load(), violations.load());
+    return violations.load() == 0;
+}
+
+int main(int argc, char* argv[]) {
+    int threads = 4;
+    long n = 2000000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-t") == 0) threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0) n = atol(argv[i + 1]);
+    }
+    printf("线程 %d 个，CPU %u 个，每个线程 %ld 次\n", threads, std::thread::hardware_concurrency(), n);
+    bench(threads, n);
+    if (!recycle_check(threads, n / 10)) {
+        printf("槽被回收时继承了旧地址的连接数\n");
+        return 1;
+    }
+    return 0;
+}
@@ -11,12 +11,139 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <thread>
 #include "locker.h"
 #include "threadpool-dynamic.h"
 #include "http_conn.h"
+#include "config.h"
+#include "affinity.h"
+#include "tls.h"
+#include "proxy.h"
+#include "cache.h"
+#include "vhost.h"
+#include "router.h"
+#include "file_cache.h"
+#include "autoindex.h"
+#include "limiter.h"
+#include "mem_budget.h"
+#include "disk_io.h"
+#include "out_queue.h"
+#include "arena.h"
+#include "sock_tune.h"
+#include "rcu.h"
+#include <new>
 
-#define MAX_FD 65536           // 最大文件描述符数
-#define MAX_EVENT_NUMBER 10000 // epoll最大监听事件数
+// epoll的busy poll参数（Linux 6.9+），旧的头文件里没有
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// 热升级时通过环境变量把监听socket传给新进程
+#define ENV_LISTEN_FDS "MY_TINY_WEB_LISTEN_FDS"
+#define ENV_TLS_LISTEN_FDS "MY_TINY_WEB_TLS_LISTEN_FDS"
+#define ENV_UPGRADE_PARENT "MY_TINY_WEB_UPGRADE_PARENT"
+
+// 信号只设置标志，由主事件循环处理
+static volatile sig_atomic_t g_reload = 0;   // SIGHUP: 重新加载配置
+static volatile sig_atomic_t g_stop = 0;     // SIGTERM/SIGINT: 优雅退出
+static volatile sig_atomic_t g_upgrade = 0;  // SIGUSR2: 启动新的可执行文件并交出监听socket
+
+// 所有事件循环共享的eventfd，开始退出时写一次用来唤醒阻塞在epoll_wait里的循环
+static int g_wakeup_fd = -1;
+// 线程池，metrics处理函数要报告各优先级队列的排队时间
+static ThreadPool* g_pool = nullptr;
+
+void sig_reload(int) {
+    g_reload = 1;
+}
+
+void sig_stop(int) {
+    g_stop = 1;
+}
+
+void sig_upgrade(int) {
+    g_upgrade = 1;
+}
+
+// 所有事件循环的监听socket，第i个循环使用plain[i]和tls[i]（没有开启TLS时tls为空）
+struct listen_sockets {
+    std::vector<int> plain;
+    std::vector<int> tls;
+};
+
+// 低延迟模式下一个事件循环的自旋状态
+struct loop_spin {
+    int budget_us = 1;
+    long hits = 0;
+    long misses = 0;
+};
+
+// 一个事件循环在内存预算下的状态
+struct loop_memory {
+    bool paused = false;     // 本循环有连接因为内存压力暂停了读取
+    long next_check_ms = 0;  // 下一次检查压力的时间
+    time_t last_shrink = 0;  // 上一次缩减缓存的时间，每秒至多一次
+};
+
+// 各事件循环退出时把自旋统计累加到这里
+static std::atomic<long> g_loop_spin_hits(0);
+static std::atomic<long> g_loop_spin_misses(0);
+
+// 等待事件。低延迟模式下先用epoll_wait(..., 0)忙等至多budget微秒，
+// 等到事件就把预算加倍，白白自旋就减半，然后才在内核里阻塞
+int wait_for_events(int epollfd, epoll_event* events, int max_events, int timeout_ms,
+                    int max_spin_us, loop_spin& spin) {
+    if (max_spin_us > 0 && timeout_ms != 0) {
+        spin.budget_us = std::min(std::max(spin.budget_us, 1), max_spin_us);
+        timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (true) {
+            int n = epoll_wait(epollfd, events, max_events, 0);
+            if (n != 0) {
+                if (n > 0) {
+                    spin.hits++;
+                    spin.budget_us = std::min(spin.budget_us * 2, max_spin_us);
+                }
+                return n;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed_us = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+            if (elapsed_us >= spin.budget_us) break;
+            cpu_relax();
+        }
+        spin.misses++;
+        spin.budget_us = std::max(spin.budget_us / 2, 1);
+    }
+    return epoll_wait(epollfd, events, max_events, timeout_ms);
+}
+
+// 开启内核busy poll：epoll实例上设置EPIOCSPARAMS，监听socket上设置SO_BUSY_POLL（accept出的socket会继承）
+void enable_busy_poll(int epollfd, int listenfd, int usecs) {
+    epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = usecs;
+    params.busy_poll_budget = 8;
+    if (ioctl(epollfd, EPIOCSPARAMS, &params) == -1) {
+        printf("EPIOCSPARAMS not supported: %s\n", strerror(errno));
+    }
+    if (setsockopt(listenfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1) {
+        printf("SO_BUSY_POLL failed: %s\n", strerror(errno));
+    }
+}
 
 // 注册信号处理函数
 void addsig(int sig, void(handler)(int), bool restart = true) {
@@ -34,115 +161,819 @@ void show_error(int connfd, const char* info) {
     close(connfd);
 }
 
-int main(int argc, char* argv[]) {
-    if (argc <= 2) {
-        printf("Usage: %s ip_address port_number\n", basename(argv[0]));
-        return 1;
+// 监听socket上设置socket参数预设和TCP Fast Open，accept出的连接继承这些选项；
+// 新建的socket在listen之前调用，SO_RCVBUF赶在握手之前生效
+void tune_listen_socket(const server_config& cfg, int listenfd) {
+    sock_profile profile;
+    std::string err;
+    sock_profile_resolve(cfg, profile, err);
+    if (!sock_profile_apply(listenfd, profile, err)) {
+        printf("socket profile %s: %s\n", cfg.socket_profile.c_str(), err.c_str());
     }
-
-    const char* ip = argv[1];
-    int port = atoi(argv[2]);
-
-    // 忽略SIGPIPE信号（避免写关闭的连接导致进程终止）
-    addsig(SIGPIPE, SIG_IGN);
-
-    // 创建线程池（使用新的 ThreadPool）
-    ThreadPool* pool = nullptr;
-    try {
-        // 保持默认最小线程数4,最大为硬件并发数
-        pool = new ThreadPool(3, 8); 
-    } catch (...) {
-        return 1;
+    if (cfg.tcp_fastopen > 0 && !sock_enable_fastopen(listenfd, cfg.tcp_fastopen, err)) {
+        printf("%s\n", err.c_str());
     }
+}
 
-    // 预分配HTTP连接对象数组
-    http_conn* users = new http_conn[MAX_FD];
-    assert(users);
-    int user_count = 0;
-
-    // 创建监听socket
+// 创建监听socket，多个事件循环时用SO_REUSEPORT让每个循环拥有自己的监听socket，由内核在它们之间分配连接
+// incoming_cpu >= 0 时设置SO_INCOMING_CPU，内核优先把在该CPU上收到的连接分给这个socket
+int create_listen_socket(const server_config& cfg, int port, bool reuse_port, int incoming_cpu) {
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listenfd >= 0);
+    if (listenfd < 0) return -1;
 
     // 允许地址重用 方便与服务器多次启动
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuse_port) {
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+    if (incoming_cpu >= 0) {
+        setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof(incoming_cpu));
+    }
+    tune_listen_socket(cfg, listenfd);
 
     // 绑定地址
     struct sockaddr_in address;
     bzero(&address, sizeof(address));
     address.sin_family = AF_INET;
-    inet_pton(AF_INET, ip, &address.sin_addr);
     address.sin_port = htons(port);
+    if (inet_pton(AF_INET, cfg.ip.c_str(), &address.sin_addr) != 1 ||
+        bind(listenfd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(listenfd, cfg.backlog) == -1) {
+        printf("bind/listen %s:%d failed: %s\n", cfg.ip.c_str(), port, strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+// 从环境变量name中取回旧进程传下来的监听socket，没有则返回空
+std::vector<int> inherit_listen_sockets(const char* name) {
+    std::vector<int> fds;
+    const char* env = getenv(name);
+    if (!env) return fds;
+    std::string list = env;
+    unsetenv(name);
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) comma = list.size();
+        int fd = atoi(list.substr(pos, comma - pos).c_str());
+        int accepting = 0;
+        socklen_t len = sizeof(accepting);
+        // 只接受确实处于listen状态的socket
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == 0 && accepting) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fds.push_back(fd);
+        }
+        pos = comma + 1;
+    }
+    return fds;
+}
+
+// 热升级：fork并exec同一路径上的（新）可执行文件，监听socket通过fd继承传过去
+// 新进程开始服务后会给本进程发SIGTERM，本进程随即优雅退出，整个过程中监听socket一直有人accept
+void spawn_upgrade(char* argv[], const listen_sockets& listeners) {
+    std::string list, tls_list;
+    for (int fd : listeners.plain) {
+        if (!list.empty()) list += ",";
+        list += std::to_string(fd);
+    }
+    for (int fd : listeners.tls) {
+        if (!tls_list.empty()) tls_list += ",";
+        tls_list += std::to_string(fd);
+    }
+    std::string parent = std::to_string(getpid());
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("upgrade: fork failed: %s\n", strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        // 子进程：只有监听socket需要跨过exec，其余fd都带有CLOEXEC
+        for (int fd : listeners.plain) {
+            fcntl(fd, F_SETFD, 0);
+        }
+        for (int fd : listeners.tls) {
+            fcntl(fd, F_SETFD, 0);
+        }
+        setenv(ENV_LISTEN_FDS, list.c_str(), 1);
+        if (!tls_list.empty()) {
+            setenv(ENV_TLS_LISTEN_FDS, tls_list.c_str(), 1);
+        }
+        setenv(ENV_UPGRADE_PARENT, parent.c_str(), 1);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    printf("upgrade: started new process %d\n", (int)pid);
+}
+
+// 路由处理函数 metrics：以纯文本输出运行计数器，每行 "名字 值"
+bool metrics_handler(const route_request&, std::string& body, std::string& content_type) {
+    char line[128];
+    snprintf(line, sizeof(line), "requests %ld\nconnections %d\nepoll_ctl %ld\n",
+             http_conn::m_request_count.load(), http_conn::m_user_count.load(),
+             http_conn::m_epoll_ctl_count.load());
+    body = line;
+    long file_hits, file_misses, file_revalidated, file_evictions;
+    file_cache_stats(file_hits, file_misses, file_revalidated, file_evictions);
+    snprintf(line, sizeof(line), "file_cache_hits %ld\nfile_cache_misses %ld\n", file_hits, file_misses);
+    body += line;
+    if (proxy_enabled()) {
+        long proxied, connects, reused, retries;
+        proxy_stats(proxied, connects, reused, retries);
+        snprintf(line, sizeof(line), "proxy_requests %ld\nproxy_connects %ld\nproxy_reused %ld\nproxy_retries %ld\n",
+                 proxied, connects, reused, retries);
+        body += line;
+    }
+    if (cache_enabled()) {
+        long hits, stale, fetches, coalesced, stores, evictions;
+        cache_stats(hits, stale, fetches, coalesced, stores, evictions);
+        snprintf(line, sizeof(line), "cache_hits %ld\ncache_stale %ld\ncache_fetches %ld\ncache_coalesced %ld\n",
+                 hits, stale, fetches, coalesced);
+        body += line;
+    }
+    long limit_conns, limit_requests, limit_full;
+    limiter_stats(limit_conns, limit_requests, limit_full);
+    snprintf(line, sizeof(line), "limit_rejected_connections %ld\nlimit_rejected_requests %ld\nlimit_table_full %ld\n",
+             limit_conns, limit_requests, limit_full);
+    body += line;
+    long mem_used[MEM_CLASSES], rss, budget, refused, paused, shrinks;
+    mem_stats(mem_used, rss, budget, refused, paused, shrinks);
+    snprintf(line, sizeof(line), "memory_rss %ld\nmemory_budget %ld\nmemory_buffers %ld\nmemory_cache %ld\n", rss,
+             budget, mem_used[MEM_BUFFERS], mem_used[MEM_CACHE]);
+    body += line;
+    snprintf(line, sizeof(line), "memory_mapped %ld\nmemory_tasks %ld\nmemory_refused %ld\nmemory_paused %ld\n",
+             mem_used[MEM_MAPPED], mem_used[MEM_TASKS], refused, paused);
+    body += line;
+    snprintf(line, sizeof(line), "memory_pressure %ld\n", mem_pressure());
+    body += line;
+    long thp, hugetlb;
+    arena_huge_usage(thp, hugetlb);
+    snprintf(line, sizeof(line), "memory_thp %ld\nmemory_hugetlb %ld\n", thp, hugetlb);
+    body += line;
+    long disk_checks, disk_prefetches, disk_prefetch_us;
+    disk_stats(disk_checks, disk_prefetches, disk_prefetch_us);
+    snprintf(line, sizeof(line), "disk_checks %ld\ndisk_prefetches %ld\ndisk_prefetch_us %ld\n", disk_checks,
+             disk_prefetches, disk_prefetch_us);
+    body += line;
+    long zc_sends, zc_bytes, zc_copied;
+    zerocopy_stats(zc_sends, zc_bytes, zc_copied);
+    snprintf(line, sizeof(line), "zerocopy_sends %ld\nzerocopy_bytes %ld\nzerocopy_copied %ld\n", zc_sends, zc_bytes,
+             zc_copied);
+    body += line;
+    long rcu_retired, rcu_freed, rcu_overflow;
+    rcu_stats(rcu_retired, rcu_freed, rcu_overflow);
+    snprintf(line, sizeof(line), "rcu_retired %ld\nrcu_freed %ld\nrcu_overflow_reads %ld\n", rcu_retired, rcu_freed,
+             rcu_overflow);
+    body += line;
+    if (g_pool) {
+        static const char* const names[ThreadPool::PRIORITIES] = {"admin", "cheap", "bulk"};
+        long dequeued[ThreadPool::PRIORITIES], wait_us[ThreadPool::PRIORITIES];
+        g_pool->getQueueStats(dequeued, wait_us);
+        for (int i = 0; i < ThreadPool::PRIORITIES; ++i) {
+            snprintf(line, sizeof(line), "queue_%s_tasks %ld\nqueue_%s_wait_us %ld\n", names[i], dequeued[i],
+                     names[i], wait_us[i]);
+            body += line;
+        }
+    }
+    content_type = "text/plain";
+    return true;
+}
+
+// 路由处理函数 health：进程还在处理请求就回 "ok"
+bool health_handler(const route_request&, std::string& body, std::string& content_type) {
+    body = http_conn::m_draining.load() ? "draining\n" : "ok\n";
+    content_type = "text/plain";
+    return true;
+}
 
-    assert(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) != -1);
-    assert(listen(listenfd, 5) != -1); // 监听队列长度为5
-    
-    printf("Server started, listening on %s:%d\n", ip, port);
+// 磁盘预读完成后在工作线程里继续发送；队列满了就直接在I/O线程里发送，数据已经在内存里，不会再等磁盘
+void resume_after_disk(http_conn* conn) {
+    ThreadPool* pool = g_pool;
+    if (!pool || !pool->addTask([conn]() { conn->resume_write(); }, http_conn::TASK_BULK)) {
+        conn->resume_write();
+    }
+}
+
+// 连接数组的内存区，conn_arena为0时是普通的new[]
+struct conn_arena {
+    http_conn* users = nullptr;
+    size_t users_bytes = 0;
+    conn_hot* hot = nullptr;
+    size_t hot_bytes = 0;
+    size_t buf_bytes = 0;
+};
+
+// 预分配连接数组和按fd排列的conn_hot数组。开启conn_arena时它们和按fd排列的缓冲区各占一块大页内存，
+// 缓冲区的槽按缓存行取整，相邻fd的缓冲区不共享缓存行
+http_conn* create_connections(const server_config& cfg, conn_arena& arena) {
+    if (!cfg.conn_arena) {
+        http_conn::m_hot = new conn_hot[cfg.max_fd];
+        http_conn::m_conns = new http_conn[cfg.max_fd];
+        return http_conn::m_conns;
+    }
+    ARENA_PAGES want = (ARENA_PAGES)cfg.conn_arena, got_users, got_hot, got_bufs;
+    arena.users_bytes = sizeof(http_conn) * cfg.max_fd;
+    arena.hot_bytes = sizeof(conn_hot) * cfg.max_fd;
+    void* mem = arena_map(arena.users_bytes, want, cfg.arena_prefault, got_users);
+    void* hot = arena_map(arena.hot_bytes, want, cfg.arena_prefault, got_hot);
+    if (!mem || !hot) {
+        arena_unmap(mem, arena.users_bytes);
+        arena_unmap(hot, arena.hot_bytes);
+        return nullptr;
+    }
+    arena.users = (http_conn*)mem;
+    arena.hot = (conn_hot*)hot;
+    for (int i = 0; i < cfg.max_fd; ++i) {
+        new (arena.hot + i) conn_hot;
+        new (arena.users + i) http_conn;
+    }
+    http_conn::m_hot = arena.hot;
+    http_conn::m_conns = arena.users;
+    http_conn::m_buf_slot =
+        (http_conn::HEADER_INDEX_BYTES + cfg.read_buffer_size + cfg.write_buffer_size + 63) & ~(size_t)63;
+    arena.buf_bytes = http_conn::m_buf_slot * cfg.max_fd;
+    http_conn::m_buf_arena = (char*)arena_map(arena.buf_bytes, want, cfg.arena_prefault, got_bufs);
+    if (!http_conn::m_buf_arena) {
+        arena.buf_bytes = 0; // 缓冲区退回单独new
+    }
+    static const char* const kinds[] = {"4KB pages", "transparent huge pages", "hugetlbfs pages"};
+    printf("connection arena: %zu MB of state and %zu MB of hot state on %s, %zu MB of buffers on %s%s\n",
+           arena.users_bytes >> 20, arena.hot_bytes >> 20, kinds[got_users < got_hot ? got_users : got_hot],
+           arena.buf_bytes >> 20, http_conn::m_buf_arena ? kinds[got_bufs] : "the heap",
+           cfg.arena_prefault ? " (prefaulted)" : "");
+    return arena.users;
+}
+
+void destroy_connections(http_conn* users, int max_fd, conn_arena& arena) {
+    if (!arena.users) {
+        delete[] users;
+        delete[] http_conn::m_hot;
+    } else {
+        for (int i = 0; i < max_fd; ++i) {
+            users[i].~http_conn();
+        }
+        arena_unmap(arena.users, arena.users_bytes);
+        arena_unmap(arena.hot, arena.hot_bytes);
+        arena_unmap(http_conn::m_buf_arena, arena.buf_bytes);
+        http_conn::m_buf_arena = nullptr;
+    }
+    http_conn::m_conns = nullptr;
+    http_conn::m_hot = nullptr;
+}
+
+// 线程池各优先级队列的权重和大文件的界限，启动和重载时调用
+void configure_scheduler(ThreadPool* pool, const server_config& cfg) {
+    pool->setWeights({cfg.sched_weight_admin, cfg.sched_weight_cheap, cfg.sched_weight_bulk});
+    http_conn::m_bulk_bytes.store((long)cfg.sched_bulk_kb << 10);
+}
+
+// 发送路径的配置，启动和重载时调用
+void configure_output(const server_config& cfg) {
+    http_conn::m_zerocopy_bytes.store((long)cfg.zerocopy_kb << 10);
+}
+
+// 预算比服务器一开始就占用的内存还小时，所有新连接都会被拒绝；启动和重载时采样一次，提醒而不是悄悄拒绝
+void warn_memory_baseline() {
+    if (mem_sample() < MEM_REFUSE) return;
+    long mem_used[MEM_CLASSES], rss, budget, refused, paused, shrinks;
+    mem_stats(mem_used, rss, budget, refused, paused, shrinks);
+    printf("warning: memory_budget_mb=%ld is too small, %ld MB is already in use (rss %ld MB); "
+           "new connections will be refused until usage drops\n",
+           budget >> 20, mem_pressure() >> 20, rss >> 20);
+}
+
+// 重新读取配置文件，只应用可以热更新的配置项；已建立的连接不受影响
+void reload_config(const config_args& args, ThreadPool* pool) {
+    server_config fresh;
+    std::string err;
+    if (!config_build(args, fresh, err)) {
+        printf("reload failed, keeping old config: %s\n", err.c_str());
+        return;
+    }
+    std::shared_ptr<const server_config> old_cfg = config_current();
+    server_config merged = config_merge_reloadable(*old_cfg, fresh);
+    config_publish(std::make_shared<const server_config>(merged));
+    pool->setThreadLimits(merged.pool_min, merged.pool_max);
+    pool->setMaxTasks(merged.queue_limit);
+    pool->setSpin(merged.low_latency ? merged.spin_us : 0);
+    configure_scheduler(pool, merged);
+    configure_output(merged);
+    limiter_configure(merged);
+    mem_configure(merged);
+    printf("config reloaded: doc_root=%s pool=%d..%d queue_limit=%d idle_timeout=%d\n",
+           merged.doc_root.c_str(), merged.pool_min, merged.pool_max,
+           merged.queue_limit, merged.idle_timeout);
+    warn_memory_baseline();
+}
+
+// 关闭本事件循环中空闲超时的连接
+void close_idle_connections(http_conn* users, int max_fd, int epollfd, int timeout) {
+    time_t now = time(nullptr);
+    for (int fd = 0; fd < max_fd; ++fd) {
+        if (users[fd].epollfd() == epollfd) {
+            users[fd].close_if_idle(now, timeout);
+        }
+    }
+}
+
+// 优雅退出时调用：关闭本事件循环中空闲的keep-alive连接，force为true时关闭所有不在线程池中的连接
+// 返回本事件循环中仍然打开的连接数
+int drain_connections(http_conn* users, int max_fd, int epollfd, bool force) {
+    int alive = 0;
+    for (int fd = 0; fd < max_fd; ++fd) {
+        http_conn& conn = users[fd];
+        if (!conn.is_open() || conn.epollfd() != epollfd) continue;
+        // 正被其他线程持有的连接不能强制关闭，等持有者处理完再关
+        if (conn.close_if_drainable(force)) {
+            continue;
+        }
+        ++alive;
+    }
+    return alive;
+}
+
+// 监听socket是边缘触发，要一直accept到EAGAIN；tls为true时新连接先进行TLS握手
+void accept_connections(int listenfd, bool tls, http_conn* users, int max_fd, int epollfd) {
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int connfd = accept4(listenfd, (struct sockaddr*)&client_addr, &client_len, SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("accept error: %d\n", errno);
+            }
+            break;
+        }
+        // 内存快用完时不再接受新连接，已有的连接先把响应发完
+        if (mem_level() >= MEM_REFUSE) {
+            mem_count_refused();
+            close(connfd);
+            continue;
+        }
+        // 超过连接数上限或者令牌用完的客户端直接关闭，不回任何内容
+        limiter_ticket ticket;
+        if (!limiter_admit(client_addr.sin_addr.s_addr, ticket)) {
+            close(connfd);
+            continue;
+        }
+        if (connfd >= max_fd || http_conn::m_user_count >= max_fd) {
+            limiter_release(ticket);
+            show_error(connfd, "Internal server busy");
+            continue;
+        }
+        users[connfd].init(connfd, client_addr, epollfd, ticket, tls); // 初始化新连接
+    }
+}
+
+// 把连接的process按请求的开销排进线程池的优先级队列，排队的任务计入内存预算；
+// 队列已满时直接关闭连接（此时仍由本线程持有）
+void dispatch(ThreadPool* pool, http_conn* conn, int sockfd) {
+    mem_charge(MEM_TASKS, MEM_TASK_COST);
+    bool queued = pool->addTask([conn]() {
+        mem_charge(MEM_TASKS, -MEM_TASK_COST);
+        conn->process();
+    }, conn->task_class());
+    if (!queued) {
+        mem_charge(MEM_TASKS, -MEM_TASK_COST);
+        printf("task queue full, dropping fd %d\n", sockfd);
+        conn->close_conn();
+    }
+}
+
+// 内存预算的背压，每100ms至多检查一次。主循环采样RSS，压力大时每秒把缓存缩减一半；
+// 到了暂停档，各循环关闭自己的空闲keep-alive连接，回落之后把暂停读取的连接重新交给线程池
+void apply_memory_pressure(bool is_main, loop_memory& mem, http_conn* users, int max_fd, int epollfd,
+                           ThreadPool* pool) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    long now_ms = ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+    if (now_ms < mem.next_check_ms) return;
+    mem.next_check_ms = now_ms + 100;
+    MEM_LEVEL level = is_main ? mem_sample() : mem_level();
+    if (is_main && level >= MEM_SHRINK && ts.tv_sec != mem.last_shrink) {
+        mem.last_shrink = ts.tv_sec;
+        cache_shrink();
+        file_cache_shrink();
+        autoindex_shrink();
+        mem_count_shrink();
+    }
+    if (level >= MEM_PAUSE) {
+        mem.paused = true;
+        drain_connections(users, max_fd, epollfd, false);
+    } else if (mem.paused) {
+        mem.paused = false;
+        for (int fd = 0; fd < max_fd; ++fd) {
+            if (users[fd].epollfd() == epollfd && users[fd].resume_reads()) {
+                dispatch(pool, users + fd, fd);
+            }
+        }
+    }
+}
+
+// 一个事件循环：接受自己监听socket上的连接，并处理这些连接上的读写事件
+// 第0个循环（运行在主线程）同时负责响应信号
+// 退出流程：停止accept -> 关闭空闲连接 -> 等进行中的请求完成 -> 超过drain_timeout后强制关闭
+void run_event_loop(int index, http_conn* users, ThreadPool* pool,
+                    const config_args* args, char** argv, const listen_sockets* listeners) {
+    std::shared_ptr<const server_config> cfg = config_current();
+    const int listenfd = listeners->plain[index];
+    const int tls_listenfd = index < (int)listeners->tls.size() ? listeners->tls[index] : -1;
+    const int max_fd = cfg->max_fd;
+    const bool is_main = index == 0;
+
+    // 绑核要在分配epoll事件数组之前，让这些内存落在本循环所在的NUMA节点
+    std::vector<int> cpus;
+    std::string err;
+    parse_cpu_list(cfg->loop_cpus, cpus, err);
+    if (!cpus.empty()) {
+        pin_current_thread(std::vector<int>(1, cpus[index % cpus.size()]));
+    }
 
     // 创建epoll实例
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
+    std::vector<epoll_event> events(cfg->max_event_number);
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
     assert(epollfd != -1);
     addfd(epollfd, listenfd, false); // 监听socket不设EPOLLONESHOT
-    http_conn::m_epollfd = epollfd;
+    if (tls_listenfd >= 0) {
+        addfd(epollfd, tls_listenfd, false);
+    }
+    epoll_event wakeup;
+    wakeup.data.u64 = (uint32_t)g_wakeup_fd;
+    wakeup.events = EPOLLIN | EPOLLET;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, g_wakeup_fd, &wakeup);
+    if (cfg->busy_poll_us > 0) {
+        enable_busy_poll(epollfd, listenfd, cfg->busy_poll_us);
+        if (tls_listenfd >= 0) {
+            setsockopt(tls_listenfd, SOL_SOCKET, SO_BUSY_POLL, &cfg->busy_poll_us, sizeof(int));
+        }
+    }
+    time_t last_sweep = time(nullptr);
+    loop_spin spin;
+    loop_memory mem;
+    bool draining = false;
+    time_t drain_deadline = 0;
 
     while (true) {
-        // epoll等待事件
-        int event_count = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        int idle_timeout, max_spin_us;
+        bool governed;
+        {
+            rcu_read_guard guard;
+            const server_config* now_cfg = config_read();
+            idle_timeout = now_cfg->idle_timeout;
+            max_spin_us = now_cfg->low_latency ? now_cfg->spin_us : 0;
+            governed = now_cfg->memory_budget_mb > 0;
+        }
+        // 开启空闲超时、反向代理或者内存预算时每秒至少醒来一次，退出过程中和暂停读取期间每100ms一次
+        bool sweep = idle_timeout > 0 || proxy_enabled() || governed;
+        int wait_ms = draining || mem.paused ? 100 : (sweep ? 1000 : -1);
+        int event_count = wait_for_events(epollfd, events.data(), (int)events.size(), wait_ms, max_spin_us, spin);
         if (event_count < 0 && errno != EINTR) {
             printf("epoll failure\n");
             break;
         }
+        if (is_main && g_reload) {
+            g_reload = 0;
+            reload_config(*args, pool);
+        }
+        // 重载时换下的配置快照，发布时还有读者没离开的，在这里等它们离开后释放（没有待释放的版本时只读一个计数）
+        if (is_main) {
+            rcu_reclaim();
+        }
+        if (is_main && g_upgrade) {
+            g_upgrade = 0;
+            spawn_upgrade(argv, *listeners);
+        }
+        if (is_main && g_stop && !http_conn::m_draining.load()) {
+            printf("shutting down, draining connections\n");
+            http_conn::m_draining.store(true);
+            uint64_t one = 1;
+            ::write(g_wakeup_fd, &one, sizeof(one));
+        }
+        if (!draining && http_conn::m_draining.load()) {
+            // 停止accept，监听socket由main统一关闭（热升级时新进程还在用它）
+            draining = true;
+            drain_deadline = time(nullptr) + config_current()->drain_timeout;
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfd, NULL);
+            if (tls_listenfd >= 0) {
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, tls_listenfd, NULL);
+            }
+        }
         // 处理每个事件
         for (int i = 0; i < event_count; ++i) {
-            int sockfd = events[i].data.fd;
+            // data.u64的低32位是fd，高32位区分客户端socket和反向代理的上游socket
+            int sockfd = (int)(uint32_t)events[i].data.u64;
+            uint32_t conn_events = events[i].events;
+            http_conn* conn = nullptr;
+            if (events[i].data.u64 >> 32 == PROXY_EVENT_TAG) {
+                // 上游socket上的事件转成持有它的客户端连接上的事件，空闲的上游连接在这里就处理完了
+                conn = proxy_on_event(sockfd, events[i].events, conn_events);
+            } else if (sockfd == g_wakeup_fd) {
+                continue;
+            }
             // 新连接事件
-            if (sockfd == listenfd) {
-                struct sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_addr, &client_len);
-                if (connfd < 0) {
-                    printf("accept error: %d\n", errno);
-                    continue;
-                }
-                if (http_conn::m_user_count >= MAX_FD) {
-                    show_error(connfd, "Internal server busy");
-                    continue;
-                }
-                users[connfd].init(connfd, client_addr); // 初始化新连接
-            } 
-            // 连接关闭/错误事件
-            else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) { 
-                //EPOLLRDHUP：表示对端关闭了连接（即 TCP 的 FIN 包已到达），常用于检测客户端主动断开连接
-                //EPOLLHUP：表示挂起事件，通常是 socket 被关闭或出现严重错误时触发。它意味着连接已经不可用。
-                //EPOLLERR：表示发生错误事件，如 socket 出现异常（比如写入/读取错误），需要及时处理。
-                users[sockfd].close_conn();
-            } 
-            // 读事件
-            else if (events[i].events & EPOLLIN) {
-                if (users[sockfd].read()) { // 读取成功
-                    http_conn* conn = users + sockfd;
-                    // 将任务封装为无参函数并传给新的线程池
-                    pool->addTask([conn]() { conn->process(); });
-                } else {
-                    users[sockfd].close_conn(); // 读取失败则关闭
-                }
-            } 
-            // 写事件
-            else if (events[i].events & EPOLLOUT) {
-                if (!users[sockfd].write()) { // 写入失败则关闭
-                    users[sockfd].close_conn();
-                }
+            else if (sockfd == listenfd || sockfd == tls_listenfd) {
+                if (draining) continue;
+                accept_connections(sockfd, sockfd == tls_listenfd, users, max_fd, epollfd);
+            }
+            // 连接上的读/写/关闭事件交给连接的状态机：连接空闲时在这里读取或继续发送，
+            // 正被工作线程持有时只记下事件，由持有者放弃所有权时处理
+            //EPOLLRDHUP：表示对端关闭了连接（即 TCP 的 FIN 包已到达），常用于检测客户端主动断开连接
+            //EPOLLHUP：表示挂起事件，通常是 socket 被关闭或出现严重错误时触发。它意味着连接已经不可用。
+            //EPOLLERR：表示发生错误事件，如 socket 出现异常（比如写入/读取错误），需要及时处理。
+            else if (sockfd < max_fd) {
+                conn = users + sockfd;
             }
+            if (conn && conn->handle_event(conn_events)) {
+                // 读到了数据，将任务封装为无参函数并传给新的线程池
+                dispatch(pool, conn, sockfd);
+            }
+        }
+        // 预算在重载时被关掉，也要把暂停的连接恢复
+        if (governed || mem.paused) {
+            apply_memory_pressure(is_main, mem, users, max_fd, epollfd, pool);
+        }
+        time_t now = time(nullptr);
+        if (draining) {
+            if (drain_connections(users, max_fd, epollfd, now >= drain_deadline) == 0) {
+                break;
+            }
+        } else if (sweep && now != last_sweep) {
+            last_sweep = now;
+            if (idle_timeout > 0) {
+                close_idle_connections(users, max_fd, epollfd, idle_timeout);
+            }
+            proxy_sweep(epollfd, now);
         }
     }
 
-    // 资源释放
+    g_loop_spin_hits += spin.hits;
+    g_loop_spin_misses += spin.misses;
     close(epollfd);
-    close(listenfd);
+}
+
+int main(int argc, char* argv[]) {
+    config_args args;
+    server_config cfg;
+    std::string err;
+    if (!config_parse_args(argc, argv, args, err) || !config_build(args, cfg, err)) {
+        printf("%s\n", err.c_str());
+        printf("Usage: %s [-c config_file] [--key=value ...] [ip_address port_number]\n", basename(argv[0]));
+        return 1;
+    }
+
+    // 热升级启动的新进程直接沿用旧进程的监听socket，事件循环数量跟随继承来的socket数量
+    listen_sockets listeners;
+    listeners.plain = inherit_listen_sockets(ENV_LISTEN_FDS);
+    listeners.tls = inherit_listen_sockets(ENV_TLS_LISTEN_FDS);
+    if (!listeners.plain.empty() && (int)listeners.plain.size() != cfg.event_loops) {
+        printf("inherited %zu listen socket(s), using event_loops=%zu\n", listeners.plain.size(), listeners.plain.size());
+        cfg.event_loops = (int)listeners.plain.size();
+    }
+    // 新配置关掉了TLS，或者事件循环比继承来的TLS监听socket少
+    while ((int)listeners.tls.size() > (cfg.tls_port ? cfg.event_loops : 0)) {
+        close(listeners.tls.back());
+        listeners.tls.pop_back();
+    }
+    if (cfg.tls_port) {
+        http_conn::m_tls_ctx = tls_create_context(cfg, err);
+        if (!http_conn::m_tls_ctx) {
+            printf("tls: %s\n", err.c_str());
+            return 1;
+        }
+    }
+
+    config_publish(std::make_shared<const server_config>(cfg));
+    http_conn::m_read_buffer_size = cfg.read_buffer_size;
+    http_conn::m_write_buffer_size = cfg.write_buffer_size;
+    std::vector<int> loop_cpus, worker_cpus;
+    parse_cpu_list(cfg.loop_cpus, loop_cpus, err);
+    parse_cpu_list(cfg.worker_cpus, worker_cpus, err);
+    http_conn::m_numa_local = cfg.numa_local_buffers && !loop_cpus.empty() && !cfg.conn_arena;
+
+    // 忽略SIGPIPE信号（避免写关闭的连接导致进程终止）
+    addsig(SIGPIPE, SIG_IGN);
+    // 其余信号只由主线程处理：先屏蔽，让之后创建的线程继承屏蔽字，线程创建完后主线程再解除屏蔽
+    addsig(SIGHUP, sig_reload);
+    addsig(SIGTERM, sig_stop);
+    addsig(SIGINT, sig_stop);
+    addsig(SIGUSR2, sig_upgrade);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    router_register_handler("metrics", metrics_handler);
+    router_register_handler("health", health_handler);
+    if (!vhost_init(cfg, err)) {
+        printf("vhosts: %s\n", err.c_str());
+        return 1;
+    }
+    cache_init(cfg.microcache_mb);
+    file_cache_init(cfg.file_cache_entries);
+    disk_init(cfg.disk_threads);
+    http_conn::m_disk_done = resume_after_disk;
+    autoindex_init(cfg.autoindex_cache_kb);
+    limiter_init(cfg.limit_table_slots);
+    limiter_configure(cfg);
+    mem_configure(cfg);
+    // 反向代理的健康检查线程也要继承信号屏蔽字
+    if (!proxy_init(cfg, err)) {
+        printf("proxy: %s\n", err.c_str());
+        return 1;
+    }
+    if (!router_init(cfg, err)) {
+        printf("routes: %s\n", err.c_str());
+        return 1;
+    }
+
+    // 创建线程池（使用新的 ThreadPool）
+    ThreadPool* pool = nullptr;
+    try {
+        pool = new ThreadPool(cfg.pool_min, cfg.pool_max, worker_cpus);
+    } catch (...) {
+        return 1;
+    }
+    pool->setMaxTasks(cfg.queue_limit);
+    pool->setSpin(cfg.low_latency ? cfg.spin_us : 0);
+    configure_scheduler(pool, cfg);
+    configure_output(cfg);
+    g_pool = pool;
+
+    // 预分配HTTP连接对象数组
+    conn_arena arena;
+    http_conn* users = create_connections(cfg, arena);
+    if (!users) {
+        printf("cannot map the connection arena\n");
+        return 1;
+    }
+
+    // 创建监听socket，每个事件循环一个（热升级继承来的socket不用再创建，但换上这次的socket参数）
+    for (int listenfd : listeners.plain) {
+        tune_listen_socket(cfg, listenfd);
+    }
+    for (int listenfd : listeners.tls) {
+        tune_listen_socket(cfg, listenfd);
+    }
+    bool reuse_port = cfg.event_loops > 1;
+    for (int i = (int)listeners.plain.size(); i < cfg.event_loops; ++i) {
+        int incoming_cpu = reuse_port && !loop_cpus.empty() ? loop_cpus[i % loop_cpus.size()] : -1;
+        int listenfd = create_listen_socket(cfg, cfg.port, reuse_port, incoming_cpu);
+        if (listenfd < 0) return 1;
+        listeners.plain.push_back(listenfd);
+    }
+    for (int i = (int)listeners.tls.size(); cfg.tls_port && i < cfg.event_loops; ++i) {
+        int incoming_cpu = reuse_port && !loop_cpus.empty() ? loop_cpus[i % loop_cpus.size()] : -1;
+        int listenfd = create_listen_socket(cfg, cfg.tls_port, reuse_port, incoming_cpu);
+        if (listenfd < 0) return 1;
+        listeners.tls.push_back(listenfd);
+    }
+    // 程序挂在整个SO_REUSEPORT组上，每个端口设置一次
+    if (reuse_port && cfg.reuseport_steer) {
+        if (!sock_steer_reuseport(listeners.plain[0], loop_cpus, cfg.event_loops, err) ||
+            (!listeners.tls.empty() && !sock_steer_reuseport(listeners.tls[0], loop_cpus, cfg.event_loops, err))) {
+            printf("reuseport steering disabled: %s\n", err.c_str());
+        }
+    }
+    g_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(g_wakeup_fd != -1);
+
+    printf("Server started, listening on %s:%d with %d event loop(s)\n", cfg.ip.c_str(), cfg.port, cfg.event_loops);
+    sock_profile profile;
+    sock_profile_resolve(cfg, profile, err);
+    printf("socket profile %s: %s%s%s\n", cfg.socket_profile.c_str(), sock_profile_describe(profile).c_str(),
+           cfg.tcp_fastopen > 0 ? ", fastopen" : "", reuse_port && cfg.reuseport_steer ? ", steered by cpu" : "");
+    if (cfg.tls_port) {
+        printf("TLS on %s:%d (ktls=%d, tickets=%d)\n", cfg.ip.c_str(), cfg.tls_port, cfg.ktls, cfg.tls_tickets);
+    }
+    warn_memory_baseline();
+
+    // 主线程运行第0个事件循环，其余的事件循环各占一个线程
+    std::vector<std::thread> loops;
+    for (int i = 1; i < cfg.event_loops; ++i) {
+        loops.emplace_back(run_event_loop, i, users, pool, &args, argv, &listeners);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+    // 新进程已经开始服务，通知旧进程优雅退出
+    const char* parent = getenv(ENV_UPGRADE_PARENT);
+    if (parent) {
+        kill((pid_t)atoi(parent), SIGTERM);
+        unsetenv(ENV_UPGRADE_PARENT);
+    }
+
+    run_event_loop(0, users, pool, &args, argv, &listeners);
+
+    for (auto& t : loops) {
+        t.join();
+    }
+
+    // 资源释放
+    for (int listenfd : listeners.plain) {
+        close(listenfd);
+    }
+    for (int listenfd : listeners.tls) {
+        close(listenfd);
+    }
+    close(g_wakeup_fd);
+    long requests = http_conn::m_request_count.load();
+    printf("syscall stats: requests=%ld epoll_ctl=%ld (%.2f per request)\n", requests,
+           http_conn::m_epoll_ctl_count.load(),
+           requests ? (double)http_conn::m_epoll_ctl_count.load() / requests : 0.0);
+    // 报告自旋的收益（命中率）与代价（进程CPU时间），对照压测客户端测得的延迟
+    long worker_hits = 0, worker_misses = 0;
+    pool->getSpinStats(worker_hits, worker_misses);
+    if (g_loop_spin_hits + g_loop_spin_misses + worker_hits + worker_misses > 0) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        printf("spin stats: loop hits=%ld misses=%ld, worker hits=%ld misses=%ld, cpu user=%ld.%03lds sys=%ld.%03lds\n",
+               g_loop_spin_hits.load(), g_loop_spin_misses.load(), worker_hits, worker_misses,
+               (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000,
+               (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000);
+    }
+    // 各优先级队列的平均排队时间：大文件积压时小请求的排队时间应当保持很短
+    long dequeued[ThreadPool::PRIORITIES], wait_us[ThreadPool::PRIORITIES];
+    pool->getQueueStats(dequeued, wait_us);
+    printf("queue stats: admin=%ld (avg wait %ldus) cheap=%ld (avg wait %ldus) bulk=%ld (avg wait %ldus)\n",
+           dequeued[0], dequeued[0] ? wait_us[0] / dequeued[0] : 0, dequeued[1],
+           dequeued[1] ? wait_us[1] / dequeued[1] : 0, dequeued[2], dequeued[2] ? wait_us[2] / dequeued[2] : 0);
+    if (http_conn::m_tls_ctx) {
+        long handshakes, resumed, ktls_send;
+        tls_stats(handshakes, resumed, ktls_send);
+        printf("tls stats: handshakes=%ld resumed=%ld ktls_send=%ld\n", handshakes, resumed, ktls_send);
+    }
+    if (proxy_enabled()) {
+        long proxied, connects, reused, retries;
+        proxy_stats(proxied, connects, reused, retries);
+        printf("proxy stats: requests=%ld connects=%ld reused=%ld retries=%ld\n", proxied, connects, reused, retries);
+    }
+    if (cache_enabled()) {
+        long hits, stale, fetches, coalesced, stores, evictions;
+        cache_stats(hits, stale, fetches, coalesced, stores, evictions);
+        long lookups = hits + stale + fetches + coalesced;
+        printf("cache stats: hits=%ld stale=%ld fetches=%ld coalesced=%ld stores=%ld evictions=%ld (hit rate %.1f%%)\n",
+               hits, stale, fetches, coalesced, stores, evictions, lookups ? 100.0 * (hits + stale) / lookups : 0.0);
+    }
+    long file_hits, file_misses, file_revalidated, file_evictions;
+    file_cache_stats(file_hits, file_misses, file_revalidated, file_evictions);
+    printf("file cache stats: hits=%ld misses=%ld revalidated=%ld evictions=%ld\n", file_hits, file_misses,
+           file_revalidated, file_evictions);
+    long index_hits, index_renders, index_streamed;
+    autoindex_stats(index_hits, index_renders, index_streamed);
+    if (index_hits + index_renders + index_streamed > 0) {
+        printf("autoindex stats: cached=%ld rendered=%ld streamed=%ld\n", index_hits, index_renders, index_streamed);
+    }
+    long limit_conns, limit_requests, limit_full;
+    limiter_stats(limit_conns, limit_requests, limit_full);
+    if (limit_conns + limit_requests + limit_full > 0) {
+        printf("limiter stats: rejected_connections=%ld rejected_requests=%ld table_full=%ld\n", limit_conns,
+               limit_requests, limit_full);
+    }
+    long mem_used[MEM_CLASSES], rss, budget, refused, paused, shrinks;
+    mem_stats(mem_used, rss, budget, refused, paused, shrinks);
+    if (budget > 0) {
+        printf("memory stats: budget=%ldMB rss=%ldMB refused=%ld paused_reads=%ld cache_shrinks=%ld\n", budget >> 20,
+               rss >> 20, refused, paused, shrinks);
+    }
+    if (vhost_enabled()) {
+        const std::vector<vhost*>& hosts = vhost_list();
+        for (size_t i = 0; i < hosts.size(); ++i)
+            printf("vhost stats: %s requests=%ld rejected=%ld\n", hosts[i]->name.c_str(),
+                   hosts[i]->requests.load(), hosts[i]->rejected.load());
+        vhost* fallback = vhost_lookup(nullptr, 0);
+        printf("vhost stats: (default) requests=%ld\n", fallback->requests.load());
+    }
+    long disk_checks, disk_prefetches, disk_prefetch_us;
+    disk_stats(disk_checks, disk_prefetches, disk_prefetch_us);
+    if (disk_prefetches > 0) {
+        printf("disk stats: checks=%ld prefetches=%ld avg prefetch=%ldus\n", disk_checks, disk_prefetches,
+               disk_prefetch_us / disk_prefetches);
+    }
+    long zc_sends, zc_bytes, zc_copied;
+    zerocopy_stats(zc_sends, zc_bytes, zc_copied);
+    if (zc_sends > 0) {
+        printf("zerocopy stats: sends=%ld bytes=%ldMB copied_by_kernel=%ld\n", zc_sends, zc_bytes >> 20, zc_copied);
+    }
+    long rcu_retired, rcu_freed, rcu_overflow;
+    rcu_stats(rcu_retired, rcu_freed, rcu_overflow);
+    if (rcu_retired > 0) {
+        printf("rcu stats: retired=%ld freed=%ld overflow_reads=%ld\n", rcu_retired, rcu_freed, rcu_overflow);
+    }
+    // 所有连接都已关闭，不会再有预读；I/O线程要在线程池之前回收，完成回调会用到线程池
+    disk_shutdown();
+    g_pool = nullptr;
     delete pool;
-    delete[] users;
+    proxy_shutdown();
+    destroy_connections(users, cfg.max_fd, arena);
+    if (http_conn::m_tls_ctx) {
+        SSL_CTX_free(http_conn::m_tls_ctx);
+    }
+    printf("Server stopped\n");
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,114 @@
+#include "mem_budget.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+
+/* 各档位的起点，为预算的百分比；暂停读之后还在处理的请求仍会分配一些内存，所以留出余量 */
+static const int SHRINK_PERCENT = 70;
+static const int REFUSE_PERCENT = 80;
+static const int PAUSE_PERCENT = 90;
+
+static std::atomic<long> g_used[MEM_CLASSES];
+/* 计入压力的记账之和（不含MEM_MAPPED），mem_level只读它和下面两个值 */
+static std::atomic<long> g_total(0);
+/* 上一次采样时RSS的匿名页中没有记账的部分 */
+static std::atomic<long> g_unaccounted(0);
+static std::atomic<long> g_budget(0);
+static std::atomic<long> g_rss(0);
+
+static std::atomic<long> g_refused(0);
+static std::atomic<long> g_paused(0);
+static std::atomic<long> g_shrinks(0);
+
+void mem_configure(const server_config& cfg)
+{
+    g_budget.store((long)cfg.memory_budget_mb << 20);
+}
+
+void mem_charge(MEM_CLASS c, long bytes)
+{
+    g_used[c].fetch_add(bytes, std::memory_order_relaxed);
+    if (c != MEM_MAPPED)
+        g_total.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+MEM_LEVEL mem_level()
+{
+    long budget = g_budget.load(std::memory_order_relaxed);
+    if (!budget)
+        return MEM_OK;
+    long percent = mem_pressure() * 100 / budget;
+    if (percent >= PAUSE_PERCENT)
+        return MEM_PAUSE;
+    if (percent >= REFUSE_PERCENT)
+        return MEM_REFUSE;
+    if (percent >= SHRINK_PERCENT)
+        return MEM_SHRINK;
+    return MEM_OK;
+}
+
+// /proc/self/statm的第二、三个字段是驻留的页数和其中文件页（以及共享内存）的页数
+static bool read_rss(long& rss, long& file)
+{
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char buf[128];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buf[n] = '\0';
+    char* p = nullptr;
+    strtol(buf, &p, 10);
+    long page = sysconf(_SC_PAGESIZE);
+    rss = strtol(p, &p, 10) * page;
+    file = strtol(p, nullptr, 10) * page;
+    return true;
+}
+
+long mem_pressure()
+{
+    return g_total.load(std::memory_order_relaxed) + g_unaccounted.load(std::memory_order_relaxed);
+}
+
+MEM_LEVEL mem_sample()
+{
+    long rss, file;
+    if (read_rss(rss, file))
+    {
+        g_rss.store(rss);
+        // 缓冲区记账时按整块算，其中没碰过的页还不在RSS里，记账的量可能比匿名页还大，这时没有记账的部分算作0
+        long unaccounted = rss - file - g_total.load();
+        g_unaccounted.store(unaccounted > 0 ? unaccounted : 0);
+    }
+    return mem_level();
+}
+
+void mem_count_refused()
+{
+    g_refused.fetch_add(1, std::memory_order_relaxed);
+}
+
+void mem_count_paused()
+{
+    g_paused.fetch_add(1, std::memory_order_relaxed);
+}
+
+void mem_count_shrink()
+{
+    g_shrinks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void mem_stats(long used[MEM_CLASSES], long& rss, long& budget, long& refused, long& paused, long& shrinks)
+{
+    for (int i = 0; i < MEM_CLASSES; ++i)
+        used[i] = g_used[i].load();
+    rss = g_rss.load();
+    budget = g_budget.load();
+    refused = g_refused.load();
+    paused = g_paused.load();
+    shrinks = g_shrinks.load();
+}
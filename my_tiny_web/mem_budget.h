@@ -0,0 +1,63 @@
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+#include "config.h"
+
+/*
+    全局内存预算。连接的读写缓冲区、HTTP/2会话的输入缓冲区、微缓存和目录列表缓存、打开文件缓存的映射、
+    排队的任务都在分配和释放时记账；没有记账的部分（连接数组、堆的碎片、std::string等）
+    由主事件循环定期读/proc/self/statm，用RSS中的匿名页减去已记账的量得到。
+    文件映射只报告、不计入压力：映射的是干净的页缓存，内核随时可以回收，按文件大小算的话一个客户下载一个大文件
+    就能让整个服务器拒绝连接；驻留的文件页（包括代码）也不算在RSS的匿名页里。
+    记账和没有记账的部分之和按预算分为几档，越往后越严厉：
+        MEM_SHRINK  缓存淘汰到一半，关闭的连接不再保留缓冲区
+        MEM_REFUSE  新连接在accept之后直接关闭
+        MEM_PAUSE   空闲的连接不再读新的请求（已经在处理的请求照常发完），关闭两次请求之间的keep-alive连接
+    预算为0时不做任何限制，记账照常进行（/metrics里可以看到各部分的占用）
+*/
+
+enum MEM_CLASS
+{
+    MEM_BUFFERS = 0,   // 连接和HTTP/2会话的缓冲区
+    MEM_CACHE,         // 微缓存和目录列表的整页缓存
+    MEM_MAPPED,        // 打开文件缓存中文件的映射，不计入压力
+    MEM_TASKS,         // 线程池队列中的任务
+    MEM_CLASSES
+};
+
+enum MEM_LEVEL
+{
+    MEM_OK = 0,
+    MEM_SHRINK,
+    MEM_REFUSE,
+    MEM_PAUSE
+};
+
+/* 一个排队的任务计入的字节数（std::function和队列节点） */
+static const long MEM_TASK_COST = 64;
+
+/// @brief 启动和重载配置时调用，更新预算
+void mem_configure(const server_config& cfg);
+
+/// @brief 记账，bytes为负数时表示释放
+void mem_charge(MEM_CLASS c, long bytes);
+
+/// @brief 当前的压力档位，只读几个原子变量，可以在每次accept、每次读之前调用
+MEM_LEVEL mem_level();
+
+/// @brief 由主事件循环定期调用：读RSS，更新没有记账的部分
+/// @return 更新后的档位
+MEM_LEVEL mem_sample();
+
+/// @brief 最近一次采样时计入压力的字节数（记账的部分加上没有记账的匿名页），和预算比较的就是它
+long mem_pressure();
+
+/// @brief 记一次因为内存压力拒绝的连接、暂停的读、缩减缓存
+void mem_count_refused();
+void mem_count_paused();
+void mem_count_shrink();
+
+/// @brief 各部分的记账、最近一次采样的RSS、预算（字节），以及拒绝的连接数、暂停的读、缩减缓存的次数
+void mem_stats(long used[MEM_CLASSES], long& rss, long& budget, long& refused, long& paused, long& shrinks);
+
+#endif
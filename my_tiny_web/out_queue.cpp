@@ -0,0 +1,233 @@
+#include "out_queue.h"
+#include "file_cache.h"
+#include "disk_io.h"
+#include "tls.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <atomic>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+static std::atomic<long> g_zc_sends(0);
+static std::atomic<long> g_zc_bytes(0);
+static std::atomic<long> g_zc_copied(0);
+
+ssize_t (*out_sendmsg)(int sockfd, const msghdr *msg, int flags) = sendmsg;
+
+void out_queue::push(const void *data, size_t len, bool file)
+{
+    if (len == 0)
+        return;
+    m_segs.push_back(out_segment{(const char *)data, len, file});
+    m_bytes += len;
+}
+
+int out_queue::gather(iovec *iov, bool *file, int max) const
+{
+    int count = 0;
+    for (size_t i = m_cursor.seg; i < m_segs.size() && count < max; ++i, ++count)
+    {
+        size_t skip = i == m_cursor.seg ? m_cursor.offset : 0;
+        iov[count].iov_base = (void *)(m_segs[i].data + skip);
+        iov[count].iov_len = m_segs[i].len - skip;
+        file[count] = m_segs[i].file;
+    }
+    return count;
+}
+
+void out_queue::advance(size_t n)
+{
+    m_bytes -= n;
+    n += m_cursor.offset;
+    while (m_cursor.seg < m_segs.size() && n >= m_segs[m_cursor.seg].len)
+        n -= m_segs[m_cursor.seg++].len;
+    m_cursor.offset = n;
+    if (empty())
+        clear();
+}
+
+void out_queue::clear()
+{
+    m_segs.clear();
+    m_cursor = out_cursor{0, 0};
+    m_bytes = 0;
+}
+
+OUT_RESULT out_queue::send(int sockfd, tls_conn *tls, bool more, size_t zerocopy_bytes, std::vector<iovec> &cold)
+{
+    while (!empty())
+    {
+        iovec iv[OUT_IOV];
+        bool file[OUT_IOV];
+        int count = gather(iv, file, OUT_IOV);
+        bool zerocopy = false;
+        for (int i = 0; i < count; ++i)
+        {
+            if (!file[i])
+                continue;
+            // 文件数据一次最多发送DISK_WINDOW字节，发送前确认这一段都在内存里，不在的交给磁盘I/O线程读进来，
+            // 发送的线程（可能是事件循环）不会因为缺页等磁盘；截短了的段后面的段这次不发
+            if (disk_enabled())
+            {
+                cold.clear();
+                if (!disk_resident(&iv[i], 1, DISK_WINDOW, cold))
+                {
+                    if (i == 0)
+                        return OUT_DISK;
+                    count = i; // 先把前面的段发出去
+                    break;
+                }
+                if (iv[i].iov_len > DISK_WINDOW)
+                {
+                    iv[i].iov_len = DISK_WINDOW;
+                    count = i + 1;
+                }
+            }
+            // 大块的文件数据单独用一次零拷贝的sendmsg发送，前面的响应头这次先发
+            if (zerocopy_bytes && !tls && iv[i].iov_len >= zerocopy_bytes && zerocopy_ready(sockfd))
+            {
+                zerocopy = i == 0;
+                count = i == 0 ? 1 : i;
+                break;
+            }
+        }
+        size_t bytes = 0;
+        for (int i = 0; i < count; ++i)
+            bytes += iv[i].iov_len;
+
+        ssize_t sent;
+        if (tls)
+            sent = tls->writev(iv, count);
+        else
+        {
+            // 这次发不完整个响应时用MSG_MORE告诉内核后面还有数据，响应头和响应体凑成满的TCP段
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iv;
+            msg.msg_iovlen = count;
+            int flags = bytes < m_bytes || more ? MSG_MORE : 0;
+            sent = out_sendmsg(sockfd, &msg, flags | (zerocopy ? MSG_ZEROCOPY : 0));
+            if (sent < 0 && zerocopy && errno == ENOBUFS)
+            {
+                // 没读的完成通知占满了socket的optmem，这一次退回拷贝
+                zerocopy = false;
+                sent = out_sendmsg(sockfd, &msg, flags);
+            }
+        }
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? OUT_AGAIN : OUT_ERROR;
+        if (zerocopy)
+        {
+            ++m_zc_next;
+            g_zc_sends.fetch_add(1, std::memory_order_relaxed);
+            g_zc_bytes.fetch_add(sent, std::memory_order_relaxed);
+        }
+        advance(sent);
+    }
+    return OUT_DONE;
+}
+
+bool out_queue::zerocopy_ready(int sockfd)
+{
+    if (m_zc_off)
+        return false;
+    if (!m_zc_enabled)
+    {
+        int one = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+        {
+            m_zc_off = true;
+            return false;
+        }
+        m_zc_enabled = true;
+    }
+    return true;
+}
+
+void out_queue::hold(file_entry *file)
+{
+    m_held.push_back(held_file{file, m_zc_next});
+}
+
+void out_queue::release_done()
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < m_held.size(); ++i)
+    {
+        // 编号会回绕，按差值比较
+        if ((int32_t)(m_zc_done - m_held[i].seq) >= 0)
+            file_cache_release(m_held[i].file);
+        else
+            m_held[kept++] = m_held[i];
+    }
+    m_held.resize(kept);
+}
+
+bool out_queue::reap(int sockfd)
+{
+    char control[256];
+    while (true)
+    {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                           (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!recverr)
+                continue;
+            const sock_extended_err *err = (const sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+                return false;
+            // 一条通知覆盖编号[ee_info, ee_data]的一段，TCP上按顺序到达
+            m_zc_done = err->ee_data + 1;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                // 网卡不支持分散/聚集，或者是回环：内核还是拷贝了，零拷贝只多了通知的开销
+                m_zc_off = true;
+                g_zc_copied.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+    release_done();
+    // 错误队列读空了，EPOLLERR也可能是socket本身出错
+    int soerr = 0;
+    socklen_t len = sizeof(soerr);
+    return getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &soerr, &len) == 0 && soerr == 0;
+}
+
+void out_queue::reset()
+{
+    clear();
+    for (size_t i = 0; i < m_held.size(); ++i)
+        file_cache_release(m_held[i].file);
+    m_held.clear();
+    m_zc_enabled = m_zc_off = false;
+    m_zc_next = m_zc_done = 0;
+}
+
+void zerocopy_stats(long &sends, long &bytes, long &copied)
+{
+    sends = g_zc_sends.load();
+    bytes = g_zc_bytes.load();
+    copied = g_zc_copied.load();
+}
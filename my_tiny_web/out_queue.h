@@ -0,0 +1,119 @@
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <vector>
+
+struct file_entry;
+class tls_conn;
+
+/*
+    连接的发送队列。一个响应由若干段组成：写缓冲区里的响应头、缓存的页面、文件映射中的数据、分块输出的一块，
+    按顺序排在队列里，段本身不再修改；发送进度只记在一个游标里（第几段、段内第几个字节），
+    每次从游标处取出尽量多的段交给一次writev/sendmsg，内核接受了多少游标就前进多少，
+    短写、EAGAIN之后从同一个位置继续，不会重发也不会跳过。
+    大块的文件数据用MSG_ZEROCOPY发送：内核直接引用文件映射里的页，不拷贝进socket缓冲区，
+    数据真正发完后在socket的错误队列里给出完成通知（同时以EPOLLERR唤醒epoll）。
+    通知到达之前，发送过的文件条目由队列持有，不交还给文件缓存
+*/
+
+/* 一次发送最多合并的段数 */
+static const int OUT_IOV = 8;
+
+/* out_queue::send的结果 */
+enum OUT_RESULT
+{
+    OUT_DONE = 0,     // 队列里的数据都发出去了
+    OUT_AGAIN,        // 内核发送缓冲区满了，等可写后再继续
+    OUT_ERROR,        // 发送出错
+    OUT_DISK          // 下一段文件数据不在内存里，cold是要预读的部分
+};
+
+/* 队列里的一段 */
+struct out_segment
+{
+    const char* data;
+    size_t len;
+    /* 文件映射中的数据：发送前要检查是否在内存里，足够大时零拷贝发送 */
+    bool file;
+};
+
+/* 发送的位置：第seg段已经发出了offset字节，之前的段都已发完 */
+struct out_cursor
+{
+    size_t seg;
+    size_t offset;
+};
+
+class out_queue
+{
+public:
+    out_queue() : m_cursor{0, 0}, m_bytes(0), m_zc_enabled(false), m_zc_off(false), m_zc_next(0), m_zc_done(0) {}
+
+    /// @brief 在队尾追加一段，len为0时忽略
+    void push(const void* data, size_t len, bool file = false);
+    bool empty() const { return m_cursor.seg == m_segs.size(); }
+    /// @brief 还没有发出的字节数
+    size_t bytes() const { return m_bytes; }
+    /// @brief 从游标处发送，直到队列发完、发送缓冲区满了或者出错。文件数据一次最多发送DISK_WINDOW字节，
+    ///        开启了磁盘I/O线程时先确认要发的页都在内存里
+    /// @param tls 不为空时通过TLS记录层发送，不用零拷贝和MSG_MORE
+    /// @param more 队列发完后这个响应还有数据（分块输出的下一块），最后一段也带MSG_MORE
+    /// @param zerocopy_bytes 一次发送中不小于这个字节数的文件数据零拷贝发送，0表示不用零拷贝
+    /// @param cold 返回OUT_DISK时为要预读的文件页
+    OUT_RESULT send(int sockfd, tls_conn* tls, bool more, size_t zerocopy_bytes, std::vector<iovec>& cold);
+    /// @brief 丢掉待发送的段，零拷贝的记录留着：上一个响应的完成通知可能还没到
+    void clear();
+
+    /// @brief 这个socket上用过零拷贝，EPOLLERR可能只是完成通知
+    bool zerocopy_used() const { return m_zc_enabled; }
+    /// @brief 还有零拷贝发送没有收到完成通知
+    bool zerocopy_pending() const { return m_zc_done != m_zc_next; }
+    /// @brief 响应结束时调用：文件条目交给队列持有，已经发出的零拷贝数据都完成后再file_cache_release
+    void hold(file_entry* file);
+    /// @brief 读出错误队列中的完成通知，释放已经完成的文件条目
+    /// @return socket上有真正的错误时返回false
+    bool reap(int sockfd);
+    /// @brief 连接关闭时调用：释放持有的文件条目（内核自己引用着还在发送的页），清空队列和零拷贝状态
+    void reset();
+
+private:
+    /* 持有的文件条目，序号小于seq的零拷贝发送都完成后释放 */
+    struct held_file
+    {
+        file_entry* file;
+        uint32_t seq;
+    };
+    void release_done();
+    /* 从游标处起取出最多max段放进iov（第一段去掉已发出的部分），file[i]标出其中的文件数据，返回段数 */
+    int gather(iovec* iov, bool* file, int max) const;
+    /* 内核接受了n个字节，游标前进 */
+    void advance(size_t n);
+    /* 这个socket能不能零拷贝发送：第一次调用时打开SO_ZEROCOPY，
+       内核不支持、或者完成通知说内核还是拷贝了（比如回环）时不再尝试 */
+    bool zerocopy_ready(int sockfd);
+
+    /* 待发送的段，追加后不再修改；clear时保留容量，之后的请求不再分配 */
+    std::vector<out_segment> m_segs;
+    out_cursor m_cursor;
+    /* 游标之后还没有发出的字节数 */
+    size_t m_bytes;
+    /* socket上已经打开了SO_ZEROCOPY / 不再尝试零拷贝 */
+    bool m_zc_enabled;
+    bool m_zc_off;
+    /* 内核给每次零拷贝发送编号：下一次的编号，和已经完成的编号的上界 */
+    uint32_t m_zc_next;
+    uint32_t m_zc_done;
+    std::vector<held_file> m_held;
+};
+
+/* 发送用的系统调用，默认为sendmsg；write_fuzz把它换成随机短写、随机EAGAIN的版本 */
+extern ssize_t (*out_sendmsg)(int sockfd, const msghdr* msg, int flags);
+
+/// @brief 零拷贝发送的次数和字节数，以及内核退回拷贝的完成通知数
+void zerocopy_stats(long& sends, long& bytes, long& copied);
+
+#endif
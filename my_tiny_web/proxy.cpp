@@ -0,0 +1,1337 @@
+#include "proxy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include "http_conn.h"
+#include "tls.h"
+#include "cache.h"
+#include "vhost.h"
+#include "rcu.h"
+
+/* 上游响应头的最大长度 */
+static const size_t MAX_RESPONSE_HEAD = 16384;
+/* 一次搬运的最大字节数，等于默认的管道容量 */
+static const size_t RELAY_CHUNK = 65536;
+
+/* 按fd索引的上游连接表，和users数组一样大 */
+struct upstream_conn
+{
+    std::atomic<upstream_server*> server{nullptr};
+    /* 连接注册到的epoll，也就是它所属的事件循环 */
+    int epollfd = -1;
+    /* 正在使用它的客户端连接，放在连接池里时为空 */
+    std::atomic<http_conn*> owner{nullptr};
+    time_t idle_since = 0;
+};
+
+static std::vector<std::unique_ptr<upstream_server>> g_servers;
+static std::vector<std::unique_ptr<proxy_route>> g_routes;
+static upstream_conn* g_conns = nullptr;
+static int g_max_fd = 0;
+
+static std::thread g_health_thread;
+static std::atomic<bool> g_health_stop(false);
+
+static std::atomic<long> g_requests(0);
+static std::atomic<long> g_connects(0);
+static std::atomic<long> g_reused(0);
+static std::atomic<long> g_retries(0);
+
+// 去掉字符串首尾的空白
+static std::string trim(const std::string& s)
+{
+    size_t b = s.find_first_not_of(" \t");
+    if (b == std::string::npos)
+        return "";
+    size_t e = s.find_last_not_of(" \t");
+    return s.substr(b, e - b + 1);
+}
+
+static bool parse_address(const std::string& text, sockaddr_in& addr)
+{
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+    char* end = nullptr;
+    long port = strtol(text.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535)
+        return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    return inet_pton(AF_INET, text.substr(0, colon).c_str(), &addr.sin_addr) == 1;
+}
+
+bool proxy_parse_routes(const std::string& text, std::vector<std::pair<std::string, std::vector<sockaddr_in>>>& routes,
+                        std::string& err)
+{
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t semi = text.find(';', pos);
+        if (semi == std::string::npos)
+            semi = text.size();
+        std::string item = trim(text.substr(pos, semi - pos));
+        pos = semi + 1;
+        if (item.empty())
+            continue;
+        size_t eq = item.find('=');
+        std::string prefix = eq == std::string::npos ? "" : trim(item.substr(0, eq));
+        if (prefix.empty() || prefix[0] != '/')
+        {
+            err = "bad route '" + item + "', expected /prefix=ip:port[,ip:port...]";
+            return false;
+        }
+        std::vector<sockaddr_in> servers;
+        std::string list = item.substr(eq + 1);
+        size_t p = 0;
+        while (p <= list.size())
+        {
+            size_t comma = list.find(',', p);
+            if (comma == std::string::npos)
+                comma = list.size();
+            std::string one = trim(list.substr(p, comma - p));
+            p = comma + 1;
+            sockaddr_in addr;
+            if (!parse_address(one, addr))
+            {
+                err = "bad upstream address '" + one + "' in route " + prefix + " (expected IPv4 ip:port)";
+                return false;
+            }
+            servers.push_back(addr);
+        }
+        routes.emplace_back(prefix, servers);
+    }
+    return true;
+}
+
+static void close_upstream(int fd)
+{
+    g_conns[fd].server.store(nullptr);
+    g_conns[fd].owner.store(nullptr);
+    close(fd);
+}
+
+// 被动健康检查：连续失败proxy_max_fails次后暂停使用proxy_fail_timeout秒
+static void mark_failure(upstream_server* s)
+{
+    std::shared_ptr<const server_config> cfg = config_current();
+    if (s->fails.fetch_add(1) + 1 >= cfg->proxy_max_fails)
+    {
+        s->fails.store(0);
+        s->down_until.store(time(nullptr) + cfg->proxy_fail_timeout);
+        printf("upstream %s failed %d times, suspended for %ds\n", s->name.c_str(), cfg->proxy_max_fails,
+               cfg->proxy_fail_timeout);
+    }
+}
+
+// 最少连接数：在可用的服务器中选正在转发的请求最少的，数量相同时从轮转位置开始的第一个
+static upstream_server* pick_server(const proxy_route* route, upstream_server* exclude)
+{
+    time_t now = time(nullptr);
+    size_t n = route->servers.size();
+    unsigned start = route->next.fetch_add(1, std::memory_order_relaxed);
+    upstream_server* best = nullptr;
+    int best_active = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        upstream_server* s = route->servers[(start + i) % n];
+        if (s == exclude || !s->healthy.load() || s->down_until.load() > now)
+            continue;
+        int active = s->active.load();
+        if (!best || active < best_active)
+        {
+            best = s;
+            best_active = active;
+        }
+    }
+    return best;
+}
+
+// 从连接池取一个属于本事件循环的空闲连接，取最近放回的那个
+static int acquire_idle(upstream_server* s, int epollfd, http_conn* owner)
+{
+    int fd = -1;
+    s->lock.lock();
+    for (size_t i = s->idle.size(); i-- > 0 && fd < 0;)
+    {
+        int candidate = s->idle[i];
+        if (g_conns[candidate].epollfd != epollfd)
+            continue;
+        s->idle.erase(s->idle.begin() + i);
+        // 空闲期间上游不应该发任何数据，读到EOF或者数据都说明这个连接不能再用
+        char c;
+        if (recv(candidate, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            g_conns[candidate].owner.store(owner);
+            fd = candidate;
+        }
+        else
+        {
+            close_upstream(candidate);
+        }
+    }
+    s->lock.unlock();
+    return fd;
+}
+
+// 非阻塞connect，连接立即注册到客户端所在的事件循环，读写事件一次注册，之后不再修改
+static int connect_new(upstream_server* s, int epollfd, http_conn* owner)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (fd >= g_max_fd)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (sockaddr*)&s->addr, sizeof(s->addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    upstream_conn& c = g_conns[fd];
+    c.epollfd = epollfd;
+    c.owner.store(owner);
+    c.server.store(s);
+    epoll_event event;
+    event.data.u64 = ((uint64_t)PROXY_EVENT_TAG << 32) | (uint32_t)fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    http_conn::m_epoll_ctl_count.fetch_add(1, std::memory_order_relaxed);
+    g_connects.fetch_add(1, std::memory_order_relaxed);
+    return fd;
+}
+
+// 请求结束：能复用的连接放回连接池（仍然注册在epoll里，被上游关闭时由proxy_on_event清理），否则关闭
+static void release_upstream(int fd, bool reusable)
+{
+    upstream_conn& c = g_conns[fd];
+    upstream_server* s = c.server.load();
+    if (reusable && s)
+    {
+        int limit;
+        {
+            rcu_read_guard guard;
+            limit = config_read()->proxy_keepalive;
+        }
+        s->lock.lock();
+        if ((int)s->idle.size() < limit)
+        {
+            c.owner.store(nullptr);
+            c.idle_since = time(nullptr);
+            s->idle.push_back(fd);
+            s->lock.unlock();
+            return;
+        }
+        s->lock.unlock();
+    }
+    close_upstream(fd);
+}
+
+static bool wait_fd(int fd, short events)
+{
+    pollfd p;
+    p.fd = fd;
+    p.events = events;
+    p.revents = 0;
+    return poll(&p, 1, 2000) == 1 && !(p.revents & (POLLERR | POLLNVAL));
+}
+
+// 主动健康检查：2秒内连得上，配置了proxy_health_uri时还要返回2xx或3xx
+static bool check_server(const upstream_server& s, const std::string& uri)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    bool ok = false;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if ((connect(fd, (const sockaddr*)&s.addr, sizeof(s.addr)) == 0 || errno == EINPROGRESS) &&
+        wait_fd(fd, POLLOUT) && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+    {
+        ok = uri.empty();
+        if (!ok)
+        {
+            std::string request = "GET " + uri + " HTTP/1.1\r\nHost: " + s.name + "\r\nConnection: close\r\n\r\n";
+            char status[16] = {0};
+            size_t got = 0;
+            if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size())
+            {
+                while (got < 12 && wait_fd(fd, POLLIN))
+                {
+                    ssize_t n = recv(fd, status + got, 12 - got, 0);
+                    if (n <= 0)
+                        break;
+                    got += n;
+                }
+            }
+            ok = got == 12 && strncmp(status, "HTTP/1.", 7) == 0 && (status[9] == '2' || status[9] == '3');
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+static void health_loop()
+{
+    time_t last = 0;
+    while (!g_health_stop.load())
+    {
+        std::shared_ptr<const server_config> cfg = config_current();
+        int interval = cfg->proxy_health_interval;
+        std::string uri = cfg->proxy_health_uri;
+        cfg.reset();
+        time_t now = time(nullptr);
+        if (interval > 0 && now - last >= interval)
+        {
+            last = now;
+            for (size_t i = 0; i < g_servers.size() && !g_health_stop.load(); ++i)
+            {
+                upstream_server& s = *g_servers[i];
+                bool ok = check_server(s, uri);
+                if (ok != s.healthy.load())
+                {
+                    printf("upstream %s is %s\n", s.name.c_str(), ok ? "up" : "down");
+                    s.healthy.store(ok);
+                    // 主动检查确认恢复了，不必等被动检查的暂停时间结束
+                    if (ok)
+                        s.down_until.store(0);
+                }
+            }
+        }
+        else if (interval <= 0)
+        {
+            // 关掉主动检查（热更新）后不再沿用旧的结果
+            for (size_t i = 0; i < g_servers.size(); ++i)
+                g_servers[i]->healthy.store(true);
+        }
+        usleep(100 * 1000);
+    }
+}
+
+bool proxy_init(const server_config& cfg, std::string& err)
+{
+    std::vector<std::pair<std::string, std::vector<sockaddr_in>>> routes;
+    if (!proxy_parse_routes(cfg.proxy_routes, routes, err))
+        return false;
+    if (routes.empty())
+        return true;
+    for (size_t i = 0; i < routes.size(); ++i)
+    {
+        std::unique_ptr<proxy_route> route(new proxy_route);
+        route->prefix = routes[i].first;
+        for (size_t j = 0; j < routes[i].second.size(); ++j)
+        {
+            const sockaddr_in& addr = routes[i].second[j];
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+            std::string name = std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+            upstream_server* server = nullptr;
+            for (size_t k = 0; k < g_servers.size() && !server; ++k)
+                if (g_servers[k]->name == name)
+                    server = g_servers[k].get();
+            if (!server)
+            {
+                g_servers.emplace_back(new upstream_server);
+                server = g_servers.back().get();
+                server->name = name;
+                server->addr = addr;
+            }
+            route->servers.push_back(server);
+        }
+        g_routes.push_back(std::move(route));
+    }
+    g_max_fd = cfg.max_fd;
+    g_conns = new upstream_conn[g_max_fd];
+    g_health_thread = std::thread(health_loop);
+    return true;
+}
+
+void proxy_shutdown()
+{
+    if (!g_conns)
+        return;
+    g_health_stop.store(true);
+    g_health_thread.join();
+    for (size_t i = 0; i < g_servers.size(); ++i)
+    {
+        upstream_server& s = *g_servers[i];
+        s.lock.lock();
+        for (size_t j = 0; j < s.idle.size(); ++j)
+            close_upstream(s.idle[j]);
+        s.idle.clear();
+        s.lock.unlock();
+    }
+}
+
+bool proxy_enabled()
+{
+    return !g_routes.empty();
+}
+
+std::vector<const proxy_route*> proxy_route_list()
+{
+    std::vector<const proxy_route*> list;
+    for (size_t i = 0; i < g_routes.size(); ++i)
+        list.push_back(g_routes[i].get());
+    return list;
+}
+
+http_conn* proxy_on_event(int fd, uint32_t events, uint32_t& client_events)
+{
+    client_events = 0;
+    if (!g_conns || fd < 0 || fd >= g_max_fd)
+        return nullptr;
+    const uint32_t readable = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+    if (events & readable)
+        client_events |= PROXY_UPSTREAM_IN;
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        client_events |= PROXY_UPSTREAM_OUT;
+    upstream_conn& c = g_conns[fd];
+    http_conn* owner = c.owner.load();
+    if (owner)
+        return owner;
+    upstream_server* s = c.server.load();
+    if (!s || !(events & readable))
+        return nullptr;
+    // 连接池里的连接可读：上游关闭了连接（keep-alive超时）或者发来了多余的数据，这个连接不能再用了
+    s->lock.lock();
+    std::vector<int>::iterator it = std::find(s->idle.begin(), s->idle.end(), fd);
+    if (it != s->idle.end())
+    {
+        s->idle.erase(it);
+        close_upstream(fd);
+    }
+    s->lock.unlock();
+    return nullptr;
+}
+
+void proxy_sweep(int epollfd, time_t now)
+{
+    int timeout = config_current()->proxy_keepalive_timeout;
+    for (size_t i = 0; i < g_servers.size(); ++i)
+    {
+        upstream_server& s = *g_servers[i];
+        s.lock.lock();
+        for (size_t j = 0; j < s.idle.size();)
+        {
+            int fd = s.idle[j];
+            if (g_conns[fd].epollfd == epollfd && now - g_conns[fd].idle_since >= timeout)
+            {
+                s.idle.erase(s.idle.begin() + j);
+                close_upstream(fd);
+            }
+            else
+            {
+                ++j;
+            }
+        }
+        s.lock.unlock();
+    }
+}
+
+void proxy_stats(long& requests, long& connects, long& reused, long& retries)
+{
+    requests = g_requests.load();
+    connects = g_connects.load();
+    reused = g_reused.load();
+    retries = g_retries.load();
+}
+
+// chunked扫描器的状态
+enum
+{
+    CHUNK_SIZE = 0,    // 块大小的十六进制数字
+    CHUNK_EXT,         // 块扩展，忽略到\r
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START, // 最后一个块之后：空行结束，否则是一行trailer
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LF,
+    CHUNK_END_LF,
+    CHUNK_DONE
+};
+
+bool proxy_session::chunk_scanner::done() const
+{
+    return state == CHUNK_DONE;
+}
+
+ssize_t proxy_session::chunk_scanner::feed(const char* p, size_t n)
+{
+    size_t i = 0;
+    while (i < n && state != CHUNK_DONE)
+    {
+        char c = p[i];
+        switch (state)
+        {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char)c))
+            {
+                if (size >> 56)
+                    return -1;
+                size = size * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+            }
+            else if (c == ';' || c == ' ' || c == '\t')
+                state = CHUNK_EXT;
+            else if (c == '\r')
+                state = CHUNK_SIZE_LF;
+            else
+                return -1;
+            ++i;
+            break;
+        case CHUNK_EXT:
+            if (c == '\r')
+                state = CHUNK_SIZE_LF;
+            ++i;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            state = size ? CHUNK_DATA : CHUNK_TRAILER_START;
+            ++i;
+            break;
+        case CHUNK_DATA:
+        {
+            // 块数据整段跳过
+            size_t k = std::min<uint64_t>(size, n - i);
+            size -= k;
+            i += k;
+            if (size == 0)
+                state = CHUNK_DATA_CR;
+            break;
+        }
+        case CHUNK_DATA_CR:
+            if (c != '\r')
+                return -1;
+            state = CHUNK_DATA_LF;
+            ++i;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return -1;
+            state = CHUNK_SIZE;
+            ++i;
+            break;
+        case CHUNK_TRAILER_START:
+            state = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER;
+            ++i;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\r')
+                state = CHUNK_TRAILER_LF;
+            ++i;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (c != '\n')
+                return -1;
+            state = CHUNK_TRAILER_START;
+            ++i;
+            break;
+        case CHUNK_END_LF:
+            if (c != '\n')
+                return -1;
+            state = CHUNK_DONE;
+            ++i;
+            break;
+        }
+    }
+    return i;
+}
+
+proxy_session::proxy_session()
+    : m_route(nullptr), m_server(nullptr), m_owner(nullptr), m_epollfd(-1), m_client_fd(-1), m_tls(nullptr),
+      m_upstream_fd(-1), m_reused(false), m_attempts(0), m_phase(IDLE), m_wait(0), m_head_request(false),
+      m_get_request(false), m_has_host(false), m_has_auth(false), m_client_keep_alive(false),
+      m_upstream_keep_alive(false), m_out_pos(0), m_body_left(0), m_body_streamed(false), m_client_pos(0),
+      m_resp_left(0), m_chunked(false), m_pipe_bytes(0), m_buf_pos(0), m_buf_len(0), m_cache_fetch(false),
+      m_wait_fd(-1), m_hit_sent(0), m_capturing(false), m_cache_ttl(0), m_cache_swr(0),
+      m_cache_max(0)
+{
+    m_pipe[0] = m_pipe[1] = -1;
+    m_scanner.reset();
+}
+
+proxy_session::~proxy_session()
+{
+    finish(false);
+    if (m_pipe[0] >= 0)
+    {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+void proxy_session::begin(const proxy_route* route, const char* method, const char* url, size_t url_len, bool head)
+{
+    m_route = route;
+    m_head_request = head;
+    m_get_request = strcmp(method, "GET") == 0;
+    m_has_host = false;
+    m_has_auth = false;
+    m_url.assign(url, url_len);
+    m_host.clear();
+    m_out.clear();
+    m_out_pos = 0;
+    m_out += method;
+    m_out += ' ';
+    m_out.append(url, url_len);
+    m_out += " HTTP/1.1\r\n";
+}
+
+bool proxy_session::add_header(const http_span& name, const http_span& value, HTTP_HEADER id)
+{
+    // 逐跳头部只对客户端到我们这一跳有效，不转发；Expect由我们自己回应
+    switch (id)
+    {
+    case HEADER_TRANSFER_ENCODING:
+        return false;
+    case HEADER_CONNECTION:
+    case HEADER_KEEP_ALIVE:
+    case HEADER_PROXY_CONNECTION:
+    case HEADER_TE:
+    case HEADER_TRAILER:
+    case HEADER_UPGRADE:
+    case HEADER_HTTP2_SETTINGS:
+    case HEADER_EXPECT:
+        return true;
+    case HEADER_HOST:
+        m_has_host = true;
+        m_host.assign(value.data, value.len);
+        break;
+    case HEADER_AUTHORIZATION:
+        m_has_auth = true;
+        break;
+    default:
+        break;
+    }
+    m_out.append(name.data, name.len);
+    m_out += ": ";
+    m_out.append(value.data, value.len);
+    m_out += "\r\n";
+    return true;
+}
+
+proxy_session::RESULT proxy_session::start(http_conn* owner, int epollfd, int client_fd, tls_conn* tls,
+                                           const sockaddr_in& client_addr, const char* body, size_t buffered,
+                                           int64_t content_length, bool keep_alive, bool expect_continue,
+                                           const vhost* host)
+{
+    g_requests.fetch_add(1, std::memory_order_relaxed);
+    if (m_client_fd != client_fd)
+    {
+        // 上游的响应头和响应体经常分两次到达，转发给客户端也是两次小的写，开着Nagle的话第二次要等客户端的延迟ACK
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    m_owner = owner;
+    m_epollfd = epollfd;
+    m_client_fd = client_fd;
+    m_tls = tls;
+    m_client_keep_alive = keep_alive;
+    m_upstream_keep_alive = false;
+    m_attempts = 0;
+    m_body.assign(body, buffered);
+    m_body_left = content_length - (int64_t)buffered;
+    m_body_streamed = false;
+    m_in.clear();
+    m_client_out.clear();
+    m_client_pos = 0;
+    m_resp_left = 0;
+    m_chunked = false;
+    m_wait = 0;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+    m_client_ip = ip;
+
+    // 带认证信息的请求的响应可能因人而异，不经过缓存；配置了虚拟主机时别名共用主机名作为键
+    m_cache_key.clear();
+    if (cache_enabled() && host->cache && (m_get_request || m_head_request) && content_length == 0 && !m_has_auth)
+    {
+        m_cache_key = (host->name.empty() ? m_host : host->name) + m_url;
+        std::shared_ptr<const cache_entry> entry;
+        int r = cache_lookup(m_cache_key, m_out, m_get_request, -1, entry);
+        if (r == CACHE_WAIT)
+            r = wait_for_fetch();
+        else
+            m_hit = entry;
+        if (r == CACHE_HIT || r == CACHE_STALE)
+        {
+            serve_cached(r == CACHE_HIT ? "HIT" : "STALE");
+            return step();
+        }
+        if (r == CACHE_WAIT)
+        {
+            m_phase = WAIT_FETCH;
+            m_wait = PROXY_UPSTREAM_IN;
+            return PROXY_WAIT;
+        }
+        m_cache_fetch = r == CACHE_FETCH;
+        if (r == CACHE_PASS)
+            m_cache_key.clear();
+    }
+
+    if (!forward())
+        return fail(false);
+    if (expect_continue && m_body_left > 0)
+    {
+        m_client_out = "HTTP/1.1 100 Continue\r\n\r\n";
+        m_phase = SEND_CONTINUE;
+    }
+    return step();
+}
+
+bool proxy_session::forward()
+{
+    if (!connect_upstream(nullptr, true))
+        return false;
+    if (!m_has_host)
+        m_out += "Host: " + m_server->name + "\r\n";
+    m_out += "X-Forwarded-For: ";
+    m_out += m_client_ip;
+    m_out += "\r\nConnection: keep-alive\r\n\r\n";
+    m_out += m_body;
+    m_phase = SEND_REQUEST;
+    return true;
+}
+
+int proxy_session::wait_for_fetch()
+{
+    // 排队的请求用一个eventfd代替上游socket注册到自己的事件循环里，取完的请求写它，
+    // 之后和上游socket上的事件走同一条路径唤醒这个连接
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        return CACHE_PASS;
+    if (fd >= g_max_fd)
+    {
+        close(fd);
+        return CACHE_PASS;
+    }
+    upstream_conn& c = g_conns[fd];
+    c.epollfd = m_epollfd;
+    c.server.store(nullptr);
+    c.owner.store(m_owner);
+    epoll_event event;
+    event.data.u64 = ((uint64_t)PROXY_EVENT_TAG << 32) | (uint32_t)fd;
+    event.events = EPOLLIN | EPOLLET;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
+    http_conn::m_epoll_ctl_count.fetch_add(1, std::memory_order_relaxed);
+    m_wait_fd = fd;
+
+    std::shared_ptr<const cache_entry> entry;
+    int r = cache_lookup(m_cache_key, m_out, true, fd, entry);
+    if (r != CACHE_WAIT)
+        close_wait_fd(); // 取的请求已经结束了，没有登记
+    if (r == CACHE_HIT || r == CACHE_STALE)
+        m_hit = entry;
+    return r;
+}
+
+void proxy_session::close_wait_fd()
+{
+    if (m_wait_fd < 0)
+        return;
+    cache_cancel_wait(m_cache_key, m_wait_fd);
+    g_conns[m_wait_fd].owner.store(nullptr);
+    close(m_wait_fd);
+    m_wait_fd = -1;
+}
+
+void proxy_session::serve_cached(const char* label)
+{
+    m_hit_tail = "X-Cache: ";
+    m_hit_tail += label;
+    m_hit_tail += m_client_keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+    m_hit_sent = 0;
+    m_phase = SEND_CACHED;
+}
+
+int proxy_session::send_cached()
+{
+    struct iovec iov[3];
+    int count = m_hit->fill_iov(iov, m_hit_tail, m_head_request);
+    size_t total = 0;
+    for (int i = 0; i < count; ++i)
+        total += iov[i].iov_len;
+    while (m_hit_sent < total)
+    {
+        // 跳过已经发出的部分
+        int first = 0;
+        size_t skip = m_hit_sent;
+        while (skip >= iov[first].iov_len)
+            skip -= iov[first++].iov_len;
+        struct iovec rest[3];
+        for (int i = first; i < count; ++i)
+            rest[i - first] = iov[i];
+        rest[0].iov_base = (char*)rest[0].iov_base + skip;
+        rest[0].iov_len -= skip;
+        ssize_t n = m_tls ? m_tls->writev(rest, count - first) : writev(m_client_fd, rest, count - first);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                m_wait = EPOLLOUT;
+                return 0;
+            }
+            return -1;
+        }
+        m_hit_sent += n;
+    }
+    return 1;
+}
+
+bool proxy_session::connect_upstream(upstream_server* exclude, bool pooled)
+{
+    for (size_t i = 0; i < m_route->servers.size(); ++i)
+    {
+        upstream_server* s = pick_server(m_route, exclude);
+        if (!s)
+            return false;
+        int fd = pooled ? acquire_idle(s, m_epollfd, m_owner) : -1;
+        m_reused = fd >= 0;
+        if (m_reused)
+            g_reused.fetch_add(1, std::memory_order_relaxed);
+        else
+            fd = connect_new(s, m_epollfd, m_owner);
+        if (fd >= 0)
+        {
+            m_server = s;
+            m_upstream_fd = fd;
+            s->active.fetch_add(1);
+            ++m_attempts;
+            return true;
+        }
+        mark_failure(s);
+        exclude = s;
+    }
+    return false;
+}
+
+bool proxy_session::retry(bool server_failed)
+{
+    // 请求体已经开始从客户端搬运，或者已经收到了响应的一部分，都不能重发
+    if (m_body_streamed || !m_in.empty() || m_attempts > (int)m_route->servers.size())
+        return false;
+    upstream_server* failed = m_server;
+    drop_upstream(false);
+    if (server_failed)
+        mark_failure(failed);
+    g_retries.fetch_add(1, std::memory_order_relaxed);
+    m_out_pos = 0;
+    m_phase = SEND_REQUEST;
+    // 复用的空闲连接被上游关掉不是服务器的问题，向同一个服务器建新连接；真正的失败换一个服务器
+    return connect_upstream(server_failed ? failed : nullptr, false);
+}
+
+proxy_session::RESULT proxy_session::fail(bool server_failed)
+{
+    if (server_failed && m_server)
+        mark_failure(m_server);
+    bool responded = m_phase >= SEND_HEAD;
+    finish(false);
+    return responded ? PROXY_ABORT : PROXY_FAILED;
+}
+
+void proxy_session::drop_upstream(bool reusable)
+{
+    if (m_upstream_fd >= 0)
+    {
+        release_upstream(m_upstream_fd, reusable);
+        m_upstream_fd = -1;
+    }
+    if (m_server)
+    {
+        m_server->active.fetch_sub(1);
+        m_server = nullptr;
+    }
+}
+
+void proxy_session::finish(bool reusable)
+{
+    drop_upstream(reusable);
+    close_wait_fd();
+    // 没取到可以缓存的响应（上游失败、客户端中途断开），排队的请求自己去上游
+    if (m_cache_fetch)
+    {
+        cache_abandon(m_cache_key, 0);
+        m_cache_fetch = false;
+    }
+    m_capturing = false;
+    m_capture.clear();
+    m_capture_head.clear();
+    m_hit.reset();
+    m_phase = IDLE;
+    // 中途放弃的转发可能在管道里留下数据，管道不能再给下一个请求用
+    if (m_pipe_bytes > 0)
+    {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+        m_pipe[0] = m_pipe[1] = -1;
+        m_pipe_bytes = 0;
+    }
+    m_buf_pos = m_buf_len = 0;
+}
+
+ssize_t proxy_session::client_write(const char* data, size_t len)
+{
+    if (m_tls)
+    {
+        struct iovec iov;
+        iov.iov_base = (void*)data;
+        iov.iov_len = len;
+        return m_tls->writev(&iov, 1);
+    }
+    return send(m_client_fd, data, len, MSG_NOSIGNAL);
+}
+
+int proxy_session::flush_client()
+{
+    while (m_client_pos < m_client_out.size())
+    {
+        ssize_t n = client_write(m_client_out.data() + m_client_pos, m_client_out.size() - m_client_pos);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                m_wait = EPOLLOUT;
+                return 0;
+            }
+            return -1;
+        }
+        m_client_pos += n;
+    }
+    m_client_out.clear();
+    m_client_pos = 0;
+    return 1;
+}
+
+int proxy_session::relay(int src, tls_conn* src_tls, uint32_t src_event, int dst, tls_conn* dst_tls,
+                         uint32_t dst_event, int64_t& left, chunk_scanner* chunked)
+{
+    // 两端都是内核里的明文socket（客户端开了kTLS发送也算）时用splice，数据只在内核里经过管道；
+    // 否则经过用户态缓冲区，由OpenSSL加解密；chunked响应要在用户态找到消息结尾
+    bool zero_copy = !chunked && !m_capturing && !src_tls && (!dst_tls || dst_tls->ktls_send());
+    if (zero_copy && m_pipe[0] < 0 && pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        m_pipe[0] = m_pipe[1] = -1;
+        zero_copy = false;
+    }
+    if (!zero_copy && m_buf.empty())
+        m_buf.resize(RELAY_CHUNK);
+    while (true)
+    {
+        // 先把已经读出来的数据写完，再读下一段
+        if (zero_copy ? m_pipe_bytes > 0 : m_buf_pos < m_buf_len)
+        {
+            ssize_t n;
+            if (zero_copy)
+                n = splice(m_pipe[0], NULL, dst, NULL, m_pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            else if (dst_tls)
+            {
+                struct iovec iov;
+                iov.iov_base = m_buf.data() + m_buf_pos;
+                iov.iov_len = m_buf_len - m_buf_pos;
+                n = dst_tls->writev(&iov, 1);
+            }
+            else
+                n = send(dst, m_buf.data() + m_buf_pos, m_buf_len - m_buf_pos, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    m_wait = dst_event;
+                    return 0;
+                }
+                return -1;
+            }
+            if (zero_copy)
+                m_pipe_bytes -= n;
+            else
+                m_buf_pos += n;
+            continue;
+        }
+        if (left == 0 || (chunked && chunked->done()))
+            return 1;
+        size_t want = left < 0 || left > (int64_t)RELAY_CHUNK ? RELAY_CHUNK : (size_t)left;
+        ssize_t n;
+        if (zero_copy)
+            n = splice(src, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else if (src_tls)
+            n = src_tls->read(m_buf.data(), want);
+        else
+            n = recv(src, m_buf.data(), want, 0);
+        if (n < 0)
+        {
+            // 管道在读之前总是空的，所以这里的EAGAIN只可能来自src
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                m_wait = src_event;
+                return 0;
+            }
+            return -1;
+        }
+        if (n == 0)
+            return left < 0 && !chunked ? 1 : -1; // 以关闭连接结束的响应体到头了，否则是被截断
+        if (chunked)
+        {
+            ssize_t k = chunked->feed(m_buf.data(), n);
+            if (k < 0)
+                return -1;
+            if (k < n)
+                m_upstream_keep_alive = false; // 消息结尾之后还有数据，这个连接不能再用
+            n = k;
+        }
+        if (!zero_copy)
+            capture(m_buf.data(), n);
+        if (left > 0)
+            left -= n;
+        if (zero_copy)
+            m_pipe_bytes = n;
+        else
+        {
+            m_buf_pos = 0;
+            m_buf_len = n;
+        }
+    }
+}
+
+bool proxy_session::parse_response_head(size_t head_len)
+{
+    const char* p = m_in.c_str();
+    if (head_len < 12 || strncmp(p, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)p[9]))
+        return false;
+    bool http10 = p[7] == '0';
+    int status = atoi(p + 9);
+    if (status < 100 || status > 999 || status == 101)
+        return false;
+    if (status < 200)
+    {
+        // 中间响应（103 Early Hints等）直接丢掉，继续读最终响应
+        m_in.erase(0, head_len);
+        return true;
+    }
+    m_server->fails.store(0);
+
+    bool keep_alive = !http10;
+    bool chunked = false;
+    int64_t length = -1;
+    bool set_cookie = false;
+    std::string cache_control;
+    m_vary.clear();
+    m_client_out.clear();
+    m_client_pos = 0;
+    const char* line = p;
+    const char* end = p + head_len - 2; // 最后的空行
+    bool first = true;
+    while (line < end)
+    {
+        const char* eol = strstr(line, "\r\n");
+        size_t len = eol - line;
+        bool forward = true;
+        if (first)
+            first = false;
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+        {
+            std::string value(line + 11, len - 11);
+            if (strcasestr(value.c_str(), "close"))
+                keep_alive = false;
+            else if (strcasestr(value.c_str(), "keep-alive"))
+                keep_alive = true;
+            forward = false;
+        }
+        else if (strncasecmp(line, "Keep-Alive:", 11) == 0 || strncasecmp(line, "Proxy-Connection:", 17) == 0)
+            forward = false;
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            chunked = strcasestr(std::string(line + 18, len - 18).c_str(), "chunked") != nullptr;
+        else if (strncasecmp(line, "Content-Length:", 15) == 0)
+            length = strtoll(line + 15, nullptr, 10);
+        else if (strncasecmp(line, "Set-Cookie:", 11) == 0)
+            set_cookie = true;
+        else if (strncasecmp(line, "Cache-Control:", 14) == 0)
+            cache_control.append(line + 14, len - 14).append(",");
+        else if (strncasecmp(line, "Vary:", 5) == 0)
+        {
+            size_t v = strspn(line + 5, " \t");
+            m_vary.assign(line + 5 + v, len - 5 - v);
+        }
+        if (forward)
+            m_client_out.append(line, len + 2);
+        line = eol + 2;
+    }
+
+    bool no_body = m_head_request || status == 204 || status == 304;
+    m_chunked = !no_body && chunked;
+    if (no_body)
+        m_resp_left = 0;
+    else if (chunked)
+    {
+        m_resp_left = -1;
+        m_scanner.reset();
+    }
+    else if (length >= 0)
+        m_resp_left = length;
+    else
+    {
+        // 没有长度的响应体以上游关闭连接结束，客户端也只能靠关闭连接知道响应结束
+        m_resp_left = -1;
+        keep_alive = false;
+        m_client_keep_alive = false;
+    }
+    m_upstream_keep_alive = keep_alive;
+    decide_cache(status, set_cookie, cache_control, no_body || chunked || length >= 0, no_body ? 0 : length);
+    if (!m_cache_key.empty())
+        m_client_out += "X-Cache: MISS\r\n";
+    m_client_out += m_client_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    // 和响应头一起读到的响应体开头
+    const char* body = m_in.data() + head_len;
+    size_t extra = m_in.size() - head_len;
+    size_t take = extra;
+    if (no_body)
+        take = 0;
+    else if (m_chunked)
+    {
+        ssize_t k = m_scanner.feed(body, extra);
+        if (k < 0)
+            return false;
+        take = k;
+    }
+    else if (m_resp_left >= 0 && (int64_t)extra > m_resp_left)
+        take = m_resp_left;
+    if (take < extra)
+        m_upstream_keep_alive = false;
+    if (!m_chunked && m_resp_left > 0)
+        m_resp_left -= take;
+    m_client_out.append(body, take);
+    capture(body, take);
+    m_in.clear();
+    m_phase = SEND_HEAD;
+    return true;
+}
+
+// Cache-Control里某个指令的秒数，没有这个指令返回-1
+static int cache_control_seconds(const std::string& cc, const char* name)
+{
+    size_t len = strlen(name);
+    for (size_t pos = 0; (pos = cc.find(name, pos)) != std::string::npos; pos += len)
+    {
+        // 指令要从值的开头或者逗号、空白之后开始，避免max-age匹配到s-maxage之类的后缀
+        if ((pos == 0 || cc[pos - 1] == ',' || cc[pos - 1] == ' ' || cc[pos - 1] == '\t') &&
+            pos + len < cc.size() && cc[pos + len] == '=')
+            return atoi(cc.c_str() + pos + len + 1);
+    }
+    return -1;
+}
+
+void proxy_session::decide_cache(int status, bool set_cookie, const std::string& cache_control, bool framed,
+                                 int64_t length)
+{
+    if (!m_cache_fetch)
+        return;
+    rcu_read_guard guard;
+    const server_config* cfg = config_read();
+    std::string cc = cache_control;
+    for (size_t i = 0; i < cc.size(); ++i)
+        cc[i] = tolower((unsigned char)cc[i]);
+    int ttl = cfg->microcache_ttl;
+    int swr = cfg->microcache_swr;
+    int v;
+    if ((v = cache_control_seconds(cc, "s-maxage")) >= 0 || (v = cache_control_seconds(cc, "max-age")) >= 0)
+        ttl = v;
+    if ((v = cache_control_seconds(cc, "stale-while-revalidate")) >= 0)
+        swr = v;
+    // 上游明确表示不能共享的响应，在一个默认TTL内同一个键的请求都不再排队
+    bool pass = set_cookie || m_vary == "*" || ttl <= 0 || cc.find("no-store") != std::string::npos ||
+                cc.find("private") != std::string::npos || cc.find("no-cache") != std::string::npos;
+    bool status_ok = status == 200 || status == 203 || status == 301 || status == 404 || status == 410;
+    m_cache_max = (size_t)cfg->microcache_max_entry_kb * 1024;
+    if (!pass && status_ok && framed && (length < 0 || (uint64_t)length <= m_cache_max))
+    {
+        m_capturing = true;
+        m_cache_ttl = ttl;
+        m_cache_swr = swr;
+        m_capture_head = m_client_out;
+        m_capture.clear();
+        if (length > 0)
+            m_capture.reserve(length);
+        return;
+    }
+    // 太大的响应也记hit-for-pass；错误和重定向等不记，下一个请求重新取
+    cache_abandon(m_cache_key, pass || (status_ok && framed) ? cfg->microcache_ttl : 0);
+    m_cache_fetch = false;
+}
+
+void proxy_session::capture(const char* p, size_t n)
+{
+    if (!m_capturing)
+        return;
+    if (m_capture.size() + n > m_cache_max)
+    {
+        // chunked响应事先不知道长度，超过上限时才发现
+        m_capturing = false;
+        std::string().swap(m_capture);
+        m_capture_head.clear();
+        cache_abandon(m_cache_key, config_current()->microcache_ttl);
+        m_cache_fetch = false;
+        return;
+    }
+    m_capture.append(p, n);
+}
+
+proxy_session::RESULT proxy_session::step()
+{
+    while (true)
+    {
+        switch (m_phase)
+        {
+        case SEND_CONTINUE:
+        {
+            int r = flush_client();
+            if (r <= 0)
+                return r == 0 ? PROXY_WAIT : fail(false);
+            m_phase = SEND_REQUEST;
+            break;
+        }
+        case SEND_REQUEST:
+            while (m_out_pos < m_out.size())
+            {
+                // 还在连接中的socket上send返回EAGAIN，连上后的可写事件会让我们回到这里
+                ssize_t n = send(m_upstream_fd, m_out.data() + m_out_pos, m_out.size() - m_out_pos, MSG_NOSIGNAL);
+                if (n < 0)
+                {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        m_wait = PROXY_UPSTREAM_OUT;
+                        return PROXY_WAIT;
+                    }
+                    // 新连接连不上算服务器失败；复用的空闲连接可能刚被上游关掉，换新连接再试
+                    if (!retry(!m_reused))
+                        return fail(false);
+                    continue;
+                }
+                m_out_pos += n;
+            }
+            m_phase = m_body_left > 0 ? SEND_BODY : READ_HEAD;
+            break;
+        case SEND_BODY:
+        {
+            m_body_streamed = true;
+            int r = relay(m_client_fd, m_tls, EPOLLIN, m_upstream_fd, nullptr, PROXY_UPSTREAM_OUT, m_body_left,
+                          nullptr);
+            if (r == 0)
+                return PROXY_WAIT;
+            if (r < 0)
+                return fail(false);
+            m_phase = READ_HEAD;
+            break;
+        }
+        case READ_HEAD:
+        {
+            size_t end = m_in.find("\r\n\r\n");
+            if (end != std::string::npos)
+            {
+                if (!parse_response_head(end + 4))
+                    return fail(true);
+                break;
+            }
+            if (m_in.size() >= MAX_RESPONSE_HEAD)
+                return fail(true);
+            char buf[4096];
+            ssize_t n = recv(m_upstream_fd, buf, sizeof(buf), 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                m_wait = PROXY_UPSTREAM_IN;
+                return PROXY_WAIT;
+            }
+            if (n <= 0)
+            {
+                // 复用的连接在我们发请求的同时被上游关掉了，请求没有被处理，可以安全地重发
+                if (m_reused && retry(false))
+                    break;
+                return fail(true);
+            }
+            m_in.append(buf, n);
+            break;
+        }
+        case SEND_HEAD:
+        {
+            int r = flush_client();
+            if (r <= 0)
+                return r == 0 ? PROXY_WAIT : fail(false);
+            m_phase = RELAY_BODY;
+            break;
+        }
+        case RELAY_BODY:
+        {
+            int r = relay(m_upstream_fd, nullptr, PROXY_UPSTREAM_IN, m_client_fd, m_tls, EPOLLOUT, m_resp_left,
+                          m_chunked ? &m_scanner : nullptr);
+            if (r == 0)
+                return PROXY_WAIT;
+            if (r < 0)
+                return fail(false);
+            if (m_capturing)
+            {
+                cache_store(m_cache_key, m_out, m_vary, m_capture_head, m_capture, m_cache_ttl, m_cache_swr);
+                m_capturing = false;
+                m_cache_fetch = false;
+            }
+            finish(m_upstream_keep_alive && (m_chunked || m_resp_left == 0));
+            return PROXY_DONE;
+        }
+        case WAIT_FETCH:
+        {
+            uint64_t value;
+            if (::read(m_wait_fd, &value, sizeof(value)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                m_wait = PROXY_UPSTREAM_IN;
+                return PROXY_WAIT;
+            }
+            close_wait_fd();
+            std::shared_ptr<const cache_entry> entry;
+            int r = cache_lookup(m_cache_key, m_out, false, -1, entry);
+            if (r == CACHE_HIT || r == CACHE_STALE)
+            {
+                m_hit = entry;
+                serve_cached(r == CACHE_HIT ? "HIT" : "STALE");
+                break;
+            }
+            // 取的请求没有拿到可以缓存的响应，自己去上游
+            m_cache_key.clear();
+            if (!forward())
+                return fail(false);
+            break;
+        }
+        case SEND_CACHED:
+        {
+            int r = send_cached();
+            if (r <= 0)
+                return r == 0 ? PROXY_WAIT : fail(false);
+            m_hit.reset();
+            m_phase = IDLE;
+            return PROXY_DONE;
+        }
+        case IDLE:
+            return PROXY_FAILED;
+        }
+    }
+}
@@ -0,0 +1,234 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include "locker.h"
+#include "config.h"
+#include "http_request.h"
+
+class http_conn;
+class tls_conn;
+struct cache_entry;
+struct vhost;
+
+/*
+    反向代理：按URL前缀把请求转发给上游HTTP服务器。
+    上游连接和客户端连接一样注册在接受该客户端的事件循环的epoll里（只注册一次），
+    epoll_event.data.u64的高32位为PROXY_EVENT_TAG，用来和客户端socket区分。
+    上游socket上的事件被转成客户端连接conn_hot的events里的PROXY_UPSTREAM_IN/OUT位，
+    由客户端连接的所有权状态机统一处理，所以转发过程不需要额外的锁。
+    开启微缓存（microcache_mb）时GET/HEAD请求先查缓存，见cache.h
+*/
+
+/* 上游socket在epoll中的标记 */
+const uint32_t PROXY_EVENT_TAG = 1;
+/* 记在客户端连接conn_hot的events里的上游事件，取epoll没有使用的位 */
+const uint32_t PROXY_UPSTREAM_IN = 1u << 16;
+const uint32_t PROXY_UPSTREAM_OUT = 1u << 17;
+
+/* 一个上游服务器，多个路由写了同一个地址时共用 */
+struct upstream_server
+{
+    std::string name; // host:port，同时作为转发请求缺少Host头时的Host
+    sockaddr_in addr;
+    /* 正在转发的请求数，最少连接数均衡的依据 */
+    std::atomic<int> active{0};
+    /* 被动健康检查：连续失败的次数，达到proxy_max_fails后在down_until之前不再选它 */
+    std::atomic<int> fails{0};
+    std::atomic<time_t> down_until{0};
+    /* 主动健康检查的结果 */
+    std::atomic<bool> healthy{true};
+    /* 空闲的keep-alive连接，每个连接属于创建它的事件循环 */
+    locker lock;
+    std::vector<int> idle;
+};
+
+struct proxy_route
+{
+    std::string prefix;
+    std::vector<upstream_server*> servers;
+    /* 活跃请求数相同的服务器之间轮流选择 */
+    mutable std::atomic<unsigned> next{0};
+};
+
+/// @brief 解析proxy_routes，格式为 "前缀=host:port,host:port;前缀=host:port"，只检查语法时servers可以为空
+bool proxy_parse_routes(const std::string& text, std::vector<std::pair<std::string, std::vector<sockaddr_in>>>& routes,
+                        std::string& err);
+
+/// @brief 启动时调用：建立路由表，分配按fd索引的上游连接表，开启主动健康检查线程
+bool proxy_init(const server_config& cfg, std::string& err);
+/// @brief 退出时调用：停止健康检查，关闭所有空闲的上游连接
+void proxy_shutdown();
+/* 是否配置了任何路由 */
+bool proxy_enabled();
+/* 所有路由，由router编译进URL路由表 */
+std::vector<const proxy_route*> proxy_route_list();
+
+/// @brief 事件循环收到上游socket上的事件时调用
+/// @param client_events 转换后的客户端事件（PROXY_UPSTREAM_IN/OUT）
+/// @return 持有该上游连接的客户端连接；空闲连接被上游关闭时在这里直接关闭并返回nullptr
+http_conn* proxy_on_event(int fd, uint32_t events, uint32_t& client_events);
+/* 关闭本事件循环中空闲超过proxy_keepalive_timeout的上游连接 */
+void proxy_sweep(int epollfd, time_t now);
+/* 退出时打印的统计 */
+void proxy_stats(long& requests, long& connects, long& reused, long& retries);
+
+/*
+    一个客户端连接上的转发状态，由http_conn持有，只被连接的持有者访问。
+    请求头在解析时逐行交给它，请求体和响应体在两个socket之间用splice经过管道搬运，
+    数据不进入用户态；客户端是用户态TLS（没有kTLS）、响应是chunked编码或者响应要写入缓存时退回到读写拷贝
+*/
+class proxy_session
+{
+public:
+    enum RESULT {
+        PROXY_WAIT = 0,   // 等待wait_events()中的事件
+        PROXY_DONE,       // 响应已经完整转发
+        PROXY_FAILED,     // 还没有向客户端发出任何响应，可以回502
+        PROXY_ABORT       // 响应发了一半，只能关闭客户端连接
+    };
+
+    proxy_session();
+    ~proxy_session();
+
+    /// @brief 开始一个新请求的请求头
+    void begin(const proxy_route* route, const char* method, const char* url, size_t url_len, bool head);
+    /// @brief 一个请求头，id为解析时得到的编号；逐跳头部被丢弃，带Transfer-Encoding的请求体不支持，返回false
+    bool add_header(const http_span& name, const http_span& value, HTTP_HEADER id);
+
+    /// @brief 请求头解析完毕，选择上游并开始转发
+    /// @param body 已经读进客户端读缓冲区的请求体，buffered为其长度（不超过content_length）
+    /// @param keep_alive 客户端要求保持连接
+    /// @param expect_continue 客户端在等 "100 Continue" 才发送请求体
+    /// @param host 请求所属的虚拟主机，决定能否使用微缓存以及缓存的键
+    RESULT start(http_conn* owner, int epollfd, int client_fd, tls_conn* tls, const sockaddr_in& client_addr,
+                 const char* body, size_t buffered, int64_t content_length, bool keep_alive, bool expect_continue,
+                 const vhost* host);
+    /* 推进转发直到需要等待事件或者结束 */
+    RESULT step();
+    /* PROXY_WAIT时等待的事件：EPOLLIN/EPOLLOUT为客户端socket，PROXY_UPSTREAM_IN/OUT为上游socket */
+    uint32_t wait_events() const { return m_wait; }
+    /* 响应发完后客户端连接还能不能继续使用 */
+    bool client_keep_alive() const { return m_client_keep_alive; }
+    /* 客户端连接关闭或者请求结束时调用：上游连接能复用就放回连接池，否则关闭 */
+    void finish(bool reusable);
+
+private:
+    enum PHASE { IDLE, WAIT_FETCH, SEND_CONTINUE, SEND_REQUEST, SEND_BODY, READ_HEAD, SEND_HEAD, RELAY_BODY,
+                 SEND_CACHED };
+
+    /* 增量扫描chunked编码的响应体，只为了找到消息的结尾，数据原样转发 */
+    struct chunk_scanner
+    {
+        int state;
+        uint64_t size;
+        void reset() { state = 0; size = 0; }
+        bool done() const;
+        /* 返回属于当前消息的字节数（遇到结尾时小于n），格式错误返回-1 */
+        ssize_t feed(const char* p, size_t n);
+    };
+
+    /* 选一个上游服务器并取得连接，补全请求头，准备发送；没有可用的上游时返回false */
+    bool forward();
+    /* 选一个上游服务器并取得连接，pooled为false时不使用空闲连接 */
+    bool connect_upstream(upstream_server* exclude, bool pooled);
+    /* 放弃当前的上游连接，能复用就放回连接池 */
+    void drop_upstream(bool reusable);
+    /* 上游连接失败（或者复用的空闲连接已经被上游关闭）时换一个连接重试，不能重试时返回false */
+    bool retry(bool server_failed);
+    /* 转发失败，server_failed时计入服务器的被动健康检查 */
+    RESULT fail(bool server_failed);
+    bool parse_response_head(size_t head_len);
+    /* 把src上的数据搬到dst：返回1表示left字节搬完（left为-1时直到src关闭），0表示要等待，-1表示出错 */
+    int relay(int src, tls_conn* src_tls, uint32_t src_event, int dst, tls_conn* dst_tls, uint32_t dst_event,
+              int64_t& left, chunk_scanner* chunked);
+    /* 向客户端写m_client_out，返回1写完，0要等待，-1出错 */
+    int flush_client();
+    /* 别的请求正在取同一个键：登记一个eventfd等它取完，返回再次查找缓存的结果 */
+    int wait_for_fetch();
+    void close_wait_fd();
+    /* 用缓存的响应回应客户端，label为X-Cache头的值 */
+    void serve_cached(const char* label);
+    /* 发送缓存的响应，返回值同flush_client */
+    int send_cached();
+    /* 根据响应头决定是否写入缓存，不能缓存时让排队的请求直接去上游 */
+    void decide_cache(int status, bool set_cookie, const std::string& cache_control, bool framed, int64_t length);
+    /* 记下要写入缓存的响应体，超过microcache_max_entry_kb时放弃 */
+    void capture(const char* p, size_t n);
+    ssize_t client_write(const char* data, size_t len);
+
+    const proxy_route* m_route;
+    upstream_server* m_server;
+    http_conn* m_owner;
+    int m_epollfd;
+    int m_client_fd;
+    tls_conn* m_tls;
+    int m_upstream_fd;
+    bool m_reused;
+    int m_attempts;
+
+    PHASE m_phase;
+    uint32_t m_wait;
+    bool m_head_request;
+    bool m_get_request;
+    bool m_has_host;
+    bool m_has_auth;
+    bool m_client_keep_alive;
+    bool m_upstream_keep_alive;
+
+    /* 请求的URL和Host头，缓存的键 */
+    std::string m_url;
+    std::string m_host;
+    std::string m_client_ip;
+    /* 和请求头一起读到的请求体开头，连接上游后接在请求头后面 */
+    std::string m_body;
+    /* 发往上游的请求头（以及已经读到的请求体），m_out_pos之前的部分已经发出 */
+    std::string m_out;
+    size_t m_out_pos;
+    int64_t m_body_left;
+    /* 请求体已经开始从客户端socket搬运，不能再换连接重试 */
+    bool m_body_streamed;
+
+    /* 上游响应头，以及和它一起读到的响应体开头 */
+    std::string m_in;
+    /* 发往客户端的数据（100 Continue或者改写后的响应头），m_client_pos之前的部分已经发出 */
+    std::string m_client_out;
+    size_t m_client_pos;
+    int64_t m_resp_left;
+    bool m_chunked;
+    chunk_scanner m_scanner;
+
+    /* splice用的管道和其中的字节数；拷贝路径用的缓冲区和其中待写的区间 */
+    int m_pipe[2];
+    size_t m_pipe_bytes;
+    std::vector<char> m_buf;
+    size_t m_buf_pos;
+    size_t m_buf_len;
+
+    /* 缓存的键，为空表示这个请求不使用缓存 */
+    std::string m_cache_key;
+    /* 这个请求负责去上游取这个键，结束前必须写入缓存或者放弃 */
+    bool m_cache_fetch;
+    /* 排队等别的请求取完时登记的eventfd */
+    int m_wait_fd;
+    /* 正在发送的缓存响应：结尾的X-Cache和Connection头，以及已经发出的字节数 */
+    std::shared_ptr<const cache_entry> m_hit;
+    std::string m_hit_tail;
+    size_t m_hit_sent;
+    /* 正在记录的要写入缓存的响应 */
+    bool m_capturing;
+    std::string m_capture_head;
+    std::string m_capture;
+    std::string m_vary;
+    int m_cache_ttl;
+    int m_cache_swr;
+    size_t m_cache_max;
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include "rcu.h"
+#include "locker.h"
+#include <vector>
+
+/* 一个读线程的槽：所在读区开始时的全局纪元，0表示不在读区 */
+struct alignas(64) rcu_slot
+{
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> used{false};
+};
+
+/* 等待释放的旧版本，epoch为换下它时的纪元 */
+struct rcu_retired
+{
+    void* ptr;
+    void (*deleter)(void*);
+    uint64_t epoch;
+};
+
+static rcu_slot g_slots[RCU_SLOTS];
+/* 领取过的槽都在[0, g_slot_high)之内，回收时只扫描这一段 */
+static std::atomic<int> g_slot_high(0);
+/* 全局纪元从1开始，槽里的0留给不在读区的状态 */
+static std::atomic<uint64_t> g_epoch(1);
+/* 没有领到槽、正在读区里的读者数，不为0时不回收 */
+static std::atomic<int> g_overflow(0);
+
+/* 写者很少（重载配置），等待释放的列表用普通的锁保护，读者从不碰它 */
+static locker g_lock;
+static std::vector<rcu_retired> g_retired;
+static std::atomic<long> g_pending(0);
+
+static std::atomic<long> g_retired_count(0);
+static std::atomic<long> g_freed_count(0);
+static std::atomic<long> g_overflow_count(0);
+
+/* 线程自己的读者状态，线程退出时交还槽 */
+struct rcu_reader
+{
+    rcu_slot* slot = nullptr;
+    bool tried = false;
+    bool overflow = false;
+    int depth = 0;
+    ~rcu_reader()
+    {
+        if (slot)
+            slot->used.store(false, std::memory_order_release);
+    }
+};
+
+static thread_local rcu_reader t_reader;
+
+// 领取一个空闲的槽，扫描次数有上限；领不到时这个线程以后都走共享计数
+static rcu_slot* claim_slot()
+{
+    for (int i = 0; i < RCU_SLOTS; ++i)
+    {
+        bool expected = false;
+        if (g_slots[i].used.load(std::memory_order_relaxed) ||
+            !g_slots[i].used.compare_exchange_strong(expected, true))
+            continue;
+        int high = g_slot_high.load();
+        while (high < i + 1 && !g_slot_high.compare_exchange_weak(high, i + 1))
+            ;
+        return &g_slots[i];
+    }
+    return nullptr;
+}
+
+void rcu_read_lock()
+{
+    rcu_reader& r = t_reader;
+    if (r.depth++ > 0)
+        return;
+    if (!r.slot && !r.tried)
+    {
+        r.tried = true;
+        r.slot = claim_slot();
+    }
+    r.overflow = r.slot == nullptr;
+    if (r.slot)
+    {
+        // 读到纪元E时，E之前换下的版本对这个读者都已经不可见（acquire与写者加纪元配对）
+        r.slot->epoch.store(g_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+    else
+    {
+        g_overflow.fetch_add(1);
+        g_overflow_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    // 槽的写入要先于之后对受保护指针的读取被回收者看到：回收者要么看到这个槽，要么读者看到新版本
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void rcu_read_unlock()
+{
+    rcu_reader& r = t_reader;
+    if (--r.depth > 0)
+        return;
+    if (r.overflow)
+        g_overflow.fetch_sub(1, std::memory_order_release);
+    else
+        r.slot->epoch.store(0, std::memory_order_release);
+}
+
+void rcu_retire(void* ptr, void (*deleter)(void*))
+{
+    // 调用方已经换上了新版本；换下之前进入读区的读者的纪元都不超过这里读到的值
+    uint64_t epoch = g_epoch.fetch_add(1);
+    g_lock.lock();
+    g_retired.push_back(rcu_retired{ptr, deleter, epoch});
+    g_lock.unlock();
+    g_pending.fetch_add(1);
+    g_retired_count.fetch_add(1, std::memory_order_relaxed);
+    rcu_reclaim();
+}
+
+int rcu_reclaim()
+{
+    if (g_pending.load(std::memory_order_relaxed) == 0 || g_overflow.load() > 0)
+        return 0;
+    // 纪元小于所有读区中读者的纪元的旧版本都可以释放
+    uint64_t oldest = g_epoch.load();
+    int high = g_slot_high.load();
+    for (int i = 0; i < high; ++i)
+    {
+        uint64_t e = g_slots[i].epoch.load();
+        if (e != 0 && e < oldest)
+            oldest = e;
+    }
+    std::vector<rcu_retired> done;
+    g_lock.lock();
+    size_t kept = 0;
+    for (size_t i = 0; i < g_retired.size(); ++i)
+    {
+        if (g_retired[i].epoch < oldest)
+            done.push_back(g_retired[i]);
+        else
+            g_retired[kept++] = g_retired[i];
+    }
+    g_retired.resize(kept);
+    g_lock.unlock();
+    // 析构函数可能很重（比如释放整份配置），放在锁外
+    for (size_t i = 0; i < done.size(); ++i)
+        done[i].deleter(done[i].ptr);
+    g_pending.fetch_sub((long)done.size());
+    g_freed_count.fetch_add((long)done.size(), std::memory_order_relaxed);
+    return (int)done.size();
+}
+
+void rcu_stats(long& retired, long& freed, long& overflow)
+{
+    retired = g_retired_count.load();
+    freed = g_freed_count.load();
+    overflow = g_overflow_count.load();
+}
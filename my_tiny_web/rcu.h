@@ -0,0 +1,70 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+    基于纪元（epoch）的RCU：全局共享、读多写少的数据（配置快照等）做成不可变的版本，
+    读者不加锁、不写任何共享的缓存行，写者原子地换上新版本，旧版本等所有可能还在读它的读者离开后再释放。
+    每个读线程第一次进入读区时领取一个独占缓存行的槽，进入读区时把当前的全局纪元写进自己的槽，离开时清零，
+    进出读区都是固定的几条指令（wait-free）。写者换下旧版本时记下当时的纪元并把全局纪元加一；
+    所有在读区里的读者的纪元都大于这个纪元时，不会再有人看到旧版本，可以释放。
+    写者从不等待读者：读区长一些（比如中间有系统调用）只是推迟回收。读到的指针只在读区内有效，
+    要跨读区使用的数据应当自己复制或者持有引用。
+    槽用完时（同时存在的读线程超过RCU_SLOTS个）读者退回一个共享的计数，期间暂停所有回收，结果仍然正确
+*/
+
+/* 同时持有槽的读线程数的上限，线程退出时交还 */
+static const int RCU_SLOTS = 512;
+
+/// @brief 进入读区，可以嵌套
+void rcu_read_lock();
+/// @brief 离开读区
+void rcu_read_unlock();
+
+/// @brief 写者换下的旧版本，在没有读者可能看到它之后调用deleter(ptr)释放；
+///        之后顺便尝试回收已经安全的旧版本
+void rcu_retire(void* ptr, void (*deleter)(void*));
+
+/// @brief 释放已经没有读者的旧版本，返回释放的个数；写者之外的线程也可以定期调用，不会阻塞
+int rcu_reclaim();
+
+/// @brief 换下的版本数、已经释放的版本数、槽用完后退回共享计数的读区次数
+void rcu_stats(long& retired, long& freed, long& overflow);
+
+/* 作用域内处于读区 */
+class rcu_read_guard
+{
+public:
+    rcu_read_guard() { rcu_read_lock(); }
+    ~rcu_read_guard() { rcu_read_unlock(); }
+    rcu_read_guard(const rcu_read_guard&) = delete;
+    rcu_read_guard& operator=(const rcu_read_guard&) = delete;
+};
+
+/* 由RCU保护的一个不可变版本的指针 */
+template <class T>
+class rcu_snapshot
+{
+public:
+    explicit rcu_snapshot(const T* initial = nullptr) : m_ptr(initial) {}
+    /// @brief 进程退出时释放当前版本，这时不应该再有读者
+    ~rcu_snapshot() { delete m_ptr.load(); }
+
+    /// @brief 当前版本，只能在读区内调用，指针在离开读区前有效
+    const T* read() const { return m_ptr.load(std::memory_order_acquire); }
+    /// @brief 换上新版本（之后归快照所有），旧版本交给rcu_retire
+    void publish(const T* next)
+    {
+        const T* old = m_ptr.exchange(next);
+        if (old)
+            rcu_retire((void*)old, destroy);
+    }
+
+private:
+    static void destroy(void* p) { delete (const T*)p; }
+    std::atomic<const T*> m_ptr;
+};
+
+#endif
@@ -0,0 +1,199 @@
+// RCU读端的竞争基准：多个读线程不停地读一份全局快照，一个写线程定期发布新版本，比较
+//   mutex          std::mutex保护的指针
+//   shared_mutex   读写锁，读者加共享锁
+//   atomic_sp      std::atomic_load/atomic_store一个shared_ptr（原来config_current的做法）
+//   rcu+sp         RCU读区里复制shared_ptr（现在的config_current，读者仍要改引用计数）
+//   rcu            RCU读区里直接读指针（现在的config_read）
+// 快照释放时把内容改成毒值，读者每次检查快照的内容前后一致，读到已经释放的快照时报错并以1退出。
+// 输出每种方式的总读取次数、每次读取的平均耗时（按线程数折算）、写者发布的次数和最慢的一次发布
+// （读写锁偏向读者，读者多时写者可能一直拿不到锁）
+//
+// 用法: rcu_bench [-t 读线程数] [-d 每种方式的毫秒数] [-w 写者发布间隔微秒]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "rcu.h"
+
+// 模拟配置快照：check总是version的相反数，析构时写成毒值
+struct snapshot {
+    long version;
+    long check;
+    std::string doc_root;
+    explicit snapshot(long v) : version(v), check(-v), doc_root("output/www") {}
+    ~snapshot() { version = check = 0x5a5a5a5a; }
+};
+
+static std::atomic<bool> g_bad(false);
+
+static inline long use(const snapshot* s) {
+    if (s->check != -s->version) g_bad.store(true);
+    return s->version + (long)s->doc_root.size();
+}
+
+struct source {
+    virtual ~source() {}
+    virtual long read() = 0;
+    virtual void publish(long version) = 0;
+};
+
+struct mutex_source : source {
+    std::mutex lock;
+    snapshot* ptr = new snapshot(1);
+    ~mutex_source() { delete ptr; }
+    long read() override {
+        std::lock_guard<std::mutex> g(lock);
+        return use(ptr);
+    }
+    void publish(long v) override {
+        snapshot* next = new snapshot(v);
+        snapshot* old;
+        {
+            std::lock_guard<std::mutex> g(lock);
+            old = ptr;
+            ptr = next;
+        }
+        delete old;
+    }
+};
+
+struct rwlock_source : source {
+    std::shared_mutex lock;
+    snapshot* ptr = new snapshot(1);
+    ~rwlock_source() { delete ptr; }
+    long read() override {
+        std::shared_lock<std::shared_mutex> g(lock);
+        return use(ptr);
+    }
+    void publish(long v) override {
+        snapshot* next = new snapshot(v);
+        snapshot* old;
+        {
+            std::unique_lock<std::shared_mutex> g(lock);
+            old = ptr;
+            ptr = next;
+        }
+        delete old;
+    }
+};
+
+struct atomic_sp_source : source {
+    std::shared_ptr<const snapshot> ptr = std::make_shared<snapshot>(1);
+    long read() override {
+        std::shared_ptr<const snapshot> s = std::atomic_load(&ptr);
+        return use(s.get());
+    }
+    void publish(long v) override { std::atomic_store(&ptr, std::shared_ptr<const snapshot>(new snapshot(v))); }
+};
+
+struct rcu_sp_source : source {
+    rcu_snapshot<std::shared_ptr<const snapshot>> ptr{new std::shared_ptr<const snapshot>(new snapshot(1))};
+    long read() override {
+        std::shared_ptr<const snapshot> s;
+        {
+            rcu_read_guard guard;
+            s = *ptr.read();
+        }
+        return use(s.get());
+    }
+    void publish(long v) override { ptr.publish(new std::shared_ptr<const snapshot>(new snapshot(v))); }
+};
+
+struct rcu_source : source {
+    rcu_snapshot<snapshot> ptr{new snapshot(1)};
+    long read() override {
+        rcu_read_guard guard;
+        return use(ptr.read());
+    }
+    void publish(long v) override { ptr.publish(new snapshot(v)); }
+};
+
+static volatile long g_sink;
+
+static void run(const char* name, source& src, int threads, int ms, int write_us) {
+    std::atomic<bool> stop(false);
+    std::vector<long> reads(threads * 8, 0); // 每个线程的计数隔开一个缓存行
+    std::vector<std::thread> readers;
+    for (int t = 0; t < threads; ++t) {
+        readers.emplace_back([&, t]() {
+            long n = 0, sum = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 64; ++i) sum += src.read();
+                n += 64;
+            }
+            reads[t * 8] = n;
+            g_sink = sum;
+        });
+    }
+    // 写者在自己的线程里发布，被读者饿住时主线程照样按时结束这一轮
+    std::atomic<long> published(0);
+    double worst_us = 0;
+    std::thread writer([&]() {
+        while (!stop.load()) {
+            auto t0 = std::chrono::steady_clock::now();
+            src.publish(published.load() + 2);
+            double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+            if (us > worst_us) worst_us = us;
+            published.fetch_add(1);
+            if (write_us > 0) usleep(write_us);
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    usleep(ms * 1000);
+    stop = true;
+    for (auto& r : readers) r.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    writer.join();
+    long total = 0;
+    for (int t = 0; t < threads; ++t) total += reads[t * 8];
+    printf("%-13s %8.1f M次/s  %7.1f ns/次  发布 %ld 次，最慢一次 %.0f us\n", name, total / seconds / 1e6,
+           total ? seconds * threads * 1e9 / total : 0.0, published.load(), worst_us);
+}
+
+int main(int argc, char* argv[]) {
+    int threads = 16, ms = 1000, write_us = 1000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-t") == 0) threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-d") == 0) ms = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-w") == 0) write_us = atoi(argv[i + 1]);
+    }
+    printf("读线程 %d 个，CPU %u 个，每种方式 %d ms，写者每 %d us 发布一次\n", threads,
+           std::thread::hardware_concurrency(), ms, write_us);
+    {
+        mutex_source s;
+        run("mutex", s, threads, ms, write_us);
+    }
+    {
+        rwlock_source s;
+        run("shared_mutex", s, threads, ms, write_us);
+    }
+    {
+        atomic_sp_source s;
+        run("atomic_sp", s, threads, ms, write_us);
+    }
+    {
+        rcu_sp_source s;
+        run("rcu+sp", s, threads, ms, write_us);
+    }
+    {
+        rcu_source s;
+        run("rcu", s, threads, ms, write_us);
+    }
+    rcu_reclaim();
+    long retired, freed, overflow;
+    rcu_stats(retired, freed, overflow);
+    printf("rcu: 换下 %ld 个版本，已释放 %ld 个，退回共享计数的读区 %ld 次\n", retired, freed, overflow);
+    if (g_bad.load()) {
+        printf("读到了已经释放的快照\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,319 @@
+#include "router.h"
+#include "proxy.h"
+#include <string.h>
+#include <map>
+#include <memory>
+
+/*
+    编译后的节点。标签是从父节点走到这里要匹配的一段字面字符（参数节点的标签是参数名，不参与匹配），
+    子节点是[first_child, first_child + child_count)这一段，参数子节点单独记录
+*/
+struct trie_node
+{
+    uint32_t label;
+    uint16_t label_len;
+    uint16_t child_count;
+    uint32_t first_child;
+    int32_t param_child;
+    /* 路径在这里结束时匹配的路由，以及 '*' 在这里开始的路由，没有为-1 */
+    int32_t route;
+    int32_t wildcard;
+};
+
+static std::vector<route> g_routes;
+static std::vector<trie_node> g_nodes;
+/* g_first[i]为节点i的标签的首字节，分派时按它扫描子节点，不用访问节点本身 */
+static std::vector<unsigned char> g_first;
+static std::string g_labels;
+static std::vector<std::pair<std::string, route_handler>> g_handlers;
+
+/* 编译前按字符展开的树 */
+struct trie_builder
+{
+    std::map<unsigned char, std::unique_ptr<trie_builder>> kids;
+    std::unique_ptr<trie_builder> param;
+    std::string param_name;
+    int route = -1;
+    int wildcard = -1;
+};
+
+static std::string trim(const std::string& s)
+{
+    size_t b = s.find_first_not_of(" \t");
+    if (b == std::string::npos)
+        return "";
+    size_t e = s.find_last_not_of(" \t");
+    return s.substr(b, e - b + 1);
+}
+
+void router_register_handler(const char* name, route_handler handler)
+{
+    g_handlers.emplace_back(name, handler);
+}
+
+bool router_parse(const std::string& text, std::vector<std::pair<std::string, std::string>>& routes,
+                  std::string& err)
+{
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t semi = text.find(';', pos);
+        if (semi == std::string::npos)
+            semi = text.size();
+        std::string item = trim(text.substr(pos, semi - pos));
+        pos = semi + 1;
+        if (item.empty())
+            continue;
+        size_t eq = item.find('=');
+        std::string pattern = eq == std::string::npos ? "" : trim(item.substr(0, eq));
+        std::string target = eq == std::string::npos ? "" : trim(item.substr(eq + 1));
+        if (pattern.empty() || pattern[0] != '/' ||
+            (target.compare(0, 7, "static:") != 0 && target.compare(0, 8, "handler:") != 0) ||
+            target.size() == target.find(':') + 1)
+        {
+            err = "bad route '" + item + "', expected /pattern=static:dir or /pattern=handler:name";
+            return false;
+        }
+        routes.emplace_back(pattern, target);
+    }
+    return true;
+}
+
+static bool insert(trie_builder* b, const std::string& p, int index, std::vector<std::string>& names,
+                   std::string& err)
+{
+    size_t i = 0;
+    while (i < p.size())
+    {
+        char c = p[i];
+        if (c == ':' && i > 0 && p[i - 1] == '/')
+        {
+            size_t j = p.find('/', i);
+            if (j == std::string::npos)
+                j = p.size();
+            std::string name = p.substr(i + 1, j - i - 1);
+            if (name.empty() || names.size() == (size_t)route_match::MAX_PARAMS)
+            {
+                err = "bad parameter in route " + p;
+                return false;
+            }
+            if (!b->param)
+            {
+                b->param.reset(new trie_builder);
+                b->param_name = name;
+            }
+            else if (b->param_name != name)
+            {
+                err = "route " + p + " names parameter ':" + name + "' but another route uses ':" + b->param_name +
+                      "' at the same position";
+                return false;
+            }
+            names.push_back(name);
+            b = b->param.get();
+            i = j;
+            continue;
+        }
+        if (c == '*')
+        {
+            if (i + 1 != p.size() || b->wildcard >= 0)
+            {
+                err = i + 1 != p.size() ? "'*' must end route " + p : "duplicate route " + p;
+                return false;
+            }
+            b->wildcard = index;
+            return true;
+        }
+        std::unique_ptr<trie_builder>& kid = b->kids[(unsigned char)c];
+        if (!kid)
+            kid.reset(new trie_builder);
+        b = kid.get();
+        ++i;
+    }
+    if (b->route >= 0)
+    {
+        err = "duplicate route " + p;
+        return false;
+    }
+    b->route = index;
+    return true;
+}
+
+static uint32_t add_label(const std::string& label)
+{
+    uint32_t off = g_labels.size();
+    g_labels += label;
+    return off;
+}
+
+// 把builder b的内容写进已经分配好的节点idx，子节点在数组末尾连续分配
+static void flatten(uint32_t idx, const trie_builder* b)
+{
+    uint32_t first = g_nodes.size();
+    uint32_t count = b->kids.size();
+    g_nodes.resize(first + count + (b->param ? 1 : 0));
+    g_first.resize(g_nodes.size());
+    std::vector<const trie_builder*> ends;
+    uint32_t k = first;
+    for (std::map<unsigned char, std::unique_ptr<trie_builder>>::const_iterator it = b->kids.begin();
+         it != b->kids.end(); ++it, ++k)
+    {
+        // 只有一个字面子节点、自己又不是终点的链压缩成一个标签
+        std::string label(1, (char)it->first);
+        const trie_builder* e = it->second.get();
+        while (e->kids.size() == 1 && !e->param && e->route < 0 && e->wildcard < 0)
+        {
+            label += (char)e->kids.begin()->first;
+            e = e->kids.begin()->second.get();
+        }
+        g_nodes[k].label = add_label(label);
+        g_nodes[k].label_len = label.size();
+        g_first[k] = it->first;
+        ends.push_back(e);
+    }
+    trie_node& n = g_nodes[idx];
+    n.first_child = first;
+    n.child_count = count;
+    n.route = b->route;
+    n.wildcard = b->wildcard;
+    n.param_child = -1;
+    if (b->param)
+    {
+        n.param_child = k;
+        g_nodes[k].label = add_label(b->param_name);
+        g_nodes[k].label_len = b->param_name.size();
+        ends.push_back(b->param.get());
+    }
+    for (size_t i = 0; i < ends.size(); ++i)
+        flatten(first + i, ends[i]);
+}
+
+bool router_compile(const std::vector<route>& routes, std::string& err)
+{
+    trie_builder root;
+    std::vector<route> compiled = routes;
+    for (size_t i = 0; i < compiled.size(); ++i)
+    {
+        compiled[i].names.clear();
+        if (!insert(&root, compiled[i].pattern, i, compiled[i].names, err))
+            return false;
+    }
+    g_routes.swap(compiled);
+    g_nodes.assign(1, trie_node());
+    g_first.assign(1, 0);
+    g_labels.clear();
+    flatten(0, &root);
+    g_nodes.shrink_to_fit();
+    return true;
+}
+
+bool router_init(const server_config& cfg, std::string& err)
+{
+    std::vector<std::pair<std::string, std::string>> items;
+    if (!router_parse(cfg.routes, items, err))
+        return false;
+    std::vector<route> routes;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        route r;
+        r.pattern = items[i].first;
+        r.proxy = nullptr;
+        r.handler = nullptr;
+        const std::string& target = items[i].second;
+        if (target.compare(0, 7, "static:") == 0)
+        {
+            r.kind = ROUTE_STATIC;
+            r.doc_root = target.substr(7);
+        }
+        else
+        {
+            r.kind = ROUTE_HANDLER;
+            std::string name = target.substr(8);
+            for (size_t h = 0; h < g_handlers.size() && !r.handler; ++h)
+                if (g_handlers[h].first == name)
+                    r.handler = g_handlers[h].second;
+            if (!r.handler)
+            {
+                err = "unknown handler '" + name + "' in route " + r.pattern;
+                return false;
+            }
+        }
+        routes.push_back(r);
+    }
+    // 反向代理一直是按字节前缀匹配的，编译成以 '*' 结尾的路由保持原来的行为
+    std::vector<const proxy_route*> proxies = proxy_route_list();
+    for (size_t i = 0; i < proxies.size(); ++i)
+    {
+        route r;
+        r.pattern = proxies[i]->prefix + "*";
+        r.kind = ROUTE_PROXY;
+        r.proxy = proxies[i];
+        r.handler = nullptr;
+        routes.push_back(r);
+    }
+    return router_compile(routes, err);
+}
+
+static int match_node(uint32_t idx, const char* p, const char* end, route_match& m)
+{
+    const trie_node& n = g_nodes[idx];
+    if (p == end)
+    {
+        if (n.route >= 0)
+            return n.route;
+        if (n.wildcard >= 0)
+            m.tail = p;
+        return n.wildcard;
+    }
+    // 子节点的首字节互不相同，最多只有一个字面分支
+    const unsigned char* first = g_first.data() + n.first_child;
+    const void* hit = memchr(first, (unsigned char)*p, n.child_count);
+    if (hit)
+    {
+        uint32_t child = n.first_child + ((const unsigned char*)hit - first);
+        const trie_node& c = g_nodes[child];
+        if ((size_t)(end - p) >= c.label_len && memcmp(g_labels.data() + c.label, p, c.label_len) == 0)
+        {
+            int r = match_node(child, p + c.label_len, end, m);
+            if (r >= 0)
+                return r;
+        }
+    }
+    if (n.param_child >= 0)
+    {
+        const char* seg = p;
+        while (seg < end && *seg != '/')
+            ++seg;
+        if (seg > p)
+        {
+            int k = m.count++;
+            m.value[k] = p;
+            m.len[k] = seg - p;
+            int r = match_node(n.param_child, seg, end, m);
+            if (r >= 0)
+                return r;
+            m.count = k; // 回溯
+        }
+    }
+    if (n.wildcard >= 0)
+        m.tail = p;
+    return n.wildcard;
+}
+
+const route* router_match(const char* path, size_t len, route_match& m)
+{
+    m.count = 0;
+    m.tail = nullptr;
+    if (g_routes.empty())
+        return nullptr;
+    size_t n = 0;
+    while (n < len && path[n] && path[n] != '?')
+        ++n;
+    int r = match_node(0, path, path + n, m);
+    return r >= 0 ? &g_routes[r] : nullptr;
+}
+
+void router_stats(size_t& nodes, size_t& bytes)
+{
+    nodes = g_nodes.size();
+    bytes = g_nodes.size() * (sizeof(trie_node) + 1) + g_labels.size();
+}
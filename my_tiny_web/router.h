@@ -0,0 +1,93 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "http_request.h"
+
+struct proxy_route;
+
+/*
+    URL路由：启动时把所有路由编译成一棵基数树（radix trie），按请求路径（不含查询参数）分派给
+    静态目录、反向代理或者C++处理函数。
+    路由的写法：
+        /exact/path        只匹配这个路径
+        /users/:id/posts   :name 匹配一整段（直到下一个'/'），取到的值通过route_match.params返回
+        /static*           '*' 只能出现在结尾，匹配剩下的任意字节（可以为空）
+    同一个位置上优先匹配字面字符，其次是参数段，最后是通配符；字面分支走不通时会回溯。
+    树的节点放在一个连续的数组里，同一个节点的子节点相邻存放，子节点的首字节另外放在一个紧凑的数组里，
+    分派时逐层扫描首字节、比较压缩后的整段标签，不分配内存也不加锁
+*/
+
+enum ROUTE_KIND
+{
+    ROUTE_STATIC = 0,   // 映射到目录下的文件
+    ROUTE_PROXY,        // 转发给上游（proxy_routes里的每个前缀自动注册为 "前缀*"）
+    ROUTE_HANDLER       // 调用注册的处理函数生成响应
+};
+
+/* 一次匹配的结果：参数段的值和通配符匹配到的部分，都指向请求路径本身 */
+struct route_match
+{
+    static const int MAX_PARAMS = 8;
+    int count;
+    const char* value[MAX_PARAMS];
+    uint16_t len[MAX_PARAMS];
+    /* '*' 匹配到的部分的起点，没有通配符时为nullptr */
+    const char* tail;
+};
+
+/* 交给处理函数的请求 */
+struct route_request
+{
+    const char* method;
+    const char* path;
+    size_t path_len;
+    const route_match* match;
+    /* 按路由中出现的顺序，参数段的名字 */
+    const std::vector<std::string>* names;
+    /* HTTP/1.1请求解析出的请求行和请求头，HTTP/2的流为nullptr */
+    const http_request* request;
+};
+
+/// @brief 处理函数，可能同时被多个工作线程调用
+/// @param body 响应体
+/// @param content_type 响应的Content-Type，留空则不发送
+/// @return 返回false时回404
+typedef bool (*route_handler)(const route_request& req, std::string& body, std::string& content_type);
+
+struct route
+{
+    std::string pattern;
+    ROUTE_KIND kind;
+    /* ROUTE_STATIC：目录，通配符匹配到的部分接在它后面；为空时使用虚拟主机的根目录和完整的URL */
+    std::string doc_root;
+    const proxy_route* proxy;
+    route_handler handler;
+    std::vector<std::string> names;
+};
+
+/// @brief 注册一个可以在routes里用 "handler:名字" 引用的处理函数，要在router_init之前调用
+void router_register_handler(const char* name, route_handler handler);
+
+/// @brief 解析routes，格式为 "模式=static:目录;模式=handler:名字"，只检查语法
+bool router_parse(const std::string& text, std::vector<std::pair<std::string, std::string>>& routes,
+                  std::string& err);
+
+/// @brief 启动时调用（在proxy_init之后）：编译routes和反向代理的前缀
+bool router_init(const server_config& cfg, std::string& err);
+
+/// @brief 按请求路径分派，path遇到'?'或者len字节处结束
+/// @return 没有匹配时返回nullptr，这时按虚拟主机的根目录找文件
+const route* router_match(const char* path, size_t len, route_match& m);
+
+/// @brief 单独编译一组路由，供微基准测试使用；成功后router_match使用这组路由
+bool router_compile(const std::vector<route>& routes, std::string& err);
+
+/* 编译后的节点数和占用的字节数 */
+void router_stats(size_t& nodes, size_t& bytes);
+
+#endif
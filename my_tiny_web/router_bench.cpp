@@ -0,0 +1,141 @@
+// URL路由微基准：生成一组路由（字面、:参数、结尾 '*' 三种混合），比较编译后的基数树和
+// 逐条比较模式的线性查找，输出每次查找的平均耗时和树的大小
+//
+// 用法: router_bench [-r 服务数] [-n 查找次数]
+// 每个服务生成4条路由，查找的路径在各种路由和不匹配的路径之间轮换
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "router.h"
+#include "proxy.h"
+
+// router.cpp在router_init里注册反向代理的前缀；微基准只用router_compile，不链接proxy.cpp
+std::vector<const proxy_route*> proxy_route_list() {
+    return std::vector<const proxy_route*>();
+}
+
+static bool dummy_handler(const route_request&, std::string&, std::string&) {
+    return true;
+}
+
+// 对照组：按顺序逐条比较模式，:参数匹配一整段，'*' 匹配剩下的部分
+static bool naive_match_one(const std::string& pattern, const char* p, const char* end) {
+    size_t i = 0;
+    while (i < pattern.size()) {
+        char c = pattern[i];
+        if (c == '*') return true;
+        if (c == ':' && i > 0 && pattern[i - 1] == '/') {
+            const char* seg = p;
+            while (seg < end && *seg != '/') ++seg;
+            if (seg == p) return false;
+            p = seg;
+            while (i < pattern.size() && pattern[i] != '/') ++i;
+            continue;
+        }
+        if (p == end || *p != c) return false;
+        ++p;
+        ++i;
+    }
+    return p == end;
+}
+
+static int naive_match(const std::vector<route>& routes, const char* path, size_t len) {
+    const char* end = path;
+    while ((size_t)(end - path) < len && *end && *end != '?') ++end;
+    for (size_t i = 0; i < routes.size(); ++i) {
+        if (naive_match_one(routes[i].pattern, path, end)) return i;
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+    int services = 250;
+    long lookups = 2000000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-r") == 0) services = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0) lookups = atol(argv[i + 1]);
+    }
+
+    std::vector<route> routes;
+    std::vector<std::string> paths;
+    char buf[256];
+    for (int s = 0; s < services; ++s) {
+        route r;
+        r.kind = ROUTE_HANDLER;
+        r.proxy = nullptr;
+        r.handler = dummy_handler;
+        snprintf(buf, sizeof(buf), "/api/v1/svc%d/health", s);
+        r.pattern = buf;
+        routes.push_back(r);
+        snprintf(buf, sizeof(buf), "/api/v1/svc%d/users/:id", s);
+        r.pattern = buf;
+        routes.push_back(r);
+        snprintf(buf, sizeof(buf), "/api/v1/svc%d/users/:id/orders/:order", s);
+        r.pattern = buf;
+        routes.push_back(r);
+        snprintf(buf, sizeof(buf), "/static/svc%d/*", s);
+        r.pattern = buf;
+        r.kind = ROUTE_STATIC;
+        routes.push_back(r);
+
+        snprintf(buf, sizeof(buf), "/api/v1/svc%d/health", s);
+        paths.push_back(buf);
+        snprintf(buf, sizeof(buf), "/api/v1/svc%d/users/%d", s, s * 7 + 1);
+        paths.push_back(buf);
+        snprintf(buf, sizeof(buf), "/api/v1/svc%d/users/%d/orders/%d?expand=1", s, s, s * 3);
+        paths.push_back(buf);
+        snprintf(buf, sizeof(buf), "/static/svc%d/css/site.css", s);
+        paths.push_back(buf);
+        snprintf(buf, sizeof(buf), "/missing/svc%d/index.html", s);
+        paths.push_back(buf);
+    }
+
+    std::string err;
+    auto t0 = std::chrono::steady_clock::now();
+    if (!router_compile(routes, err)) {
+        printf("compile failed: %s\n", err.c_str());
+        return 1;
+    }
+    double compile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    size_t nodes, bytes;
+    router_stats(nodes, bytes);
+    printf("routes=%zu nodes=%zu trie bytes=%zu compile=%.2fms\n", routes.size(), nodes, bytes, compile_ms);
+
+    // 两种实现的结果必须一致
+    for (size_t i = 0; i < paths.size(); ++i) {
+        route_match m;
+        const route* r = router_match(paths[i].data(), paths[i].size(), m);
+        int expect = naive_match(routes, paths[i].data(), paths[i].size());
+        if ((r ? r->pattern : std::string()) != (expect >= 0 ? routes[expect].pattern : std::string())) {
+            printf("mismatch for %s\n", paths[i].c_str());
+            return 1;
+        }
+    }
+
+    long found = 0;
+    t0 = std::chrono::steady_clock::now();
+    for (long i = 0; i < lookups; ++i) {
+        const std::string& p = paths[i % paths.size()];
+        route_match m;
+        found += router_match(p.data(), p.size(), m) != nullptr;
+    }
+    double trie_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / lookups;
+
+    // 线性查找慢得多，次数减少一些
+    long naive_lookups = lookups / 20 + 1;
+    long naive_found = 0;
+    t0 = std::chrono::steady_clock::now();
+    for (long i = 0; i < naive_lookups; ++i) {
+        const std::string& p = paths[i % paths.size()];
+        naive_found += naive_match(routes, p.data(), p.size()) >= 0;
+    }
+    double naive_ns =
+        std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / naive_lookups;
+
+    printf("radix trie:  %.1f ns/lookup (%ld lookups, %ld matched)\n", trie_ns, lookups, found);
+    printf("linear scan: %.1f ns/lookup (%ld lookups, %ld matched)\n", naive_ns, naive_lookups, naive_found);
+    return 0;
+}
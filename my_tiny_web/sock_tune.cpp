@@ -0,0 +1,162 @@
+#include "sock_tune.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/* 内核对keepalive参数的上限（MAX_TCP_KEEPIDLE等） */
+static const int KEEPALIVE_TIME_MAX = 32767;
+static const int KEEPALIVE_CNT_MAX = 127;
+/* 缓冲区类的选项按KB配置，换算成字节后不能超过int */
+static const int BUFFER_KB_MAX = 1024 * 1024;
+
+struct profile_preset
+{
+    const char* name;
+    sock_profile p;
+};
+
+static const profile_preset g_presets[] = {
+    {"default", {-1, -1, -1, -1, -1, -1, -1}},
+    {"latency", {1, -1, -1, 16 * 1024, -1, -1, -1}},
+    {"throughput", {-1, 4 * 1024 * 1024, -1, -1, -1, -1, -1}},
+    {"mobile", {1, -1, -1, 128 * 1024, 60, 10, 5}},
+};
+
+// 配置项大于等于0时覆盖预设
+static void override_value(int& field, int value, int scale)
+{
+    if (value >= 0)
+        field = value * scale;
+}
+
+bool sock_profile_resolve(const server_config& cfg, sock_profile& p, std::string& err)
+{
+    const profile_preset* preset = nullptr;
+    for (const profile_preset& it : g_presets)
+    {
+        if (cfg.socket_profile == it.name)
+            preset = &it;
+    }
+    if (!preset)
+    {
+        err = "unknown socket_profile '" + cfg.socket_profile + "', expected default, latency, throughput or mobile";
+        return false;
+    }
+    if (cfg.tcp_nodelay < -1 || cfg.tcp_nodelay > 1)
+        err = "tcp_nodelay must be -1, 0 or 1";
+    else if (cfg.sndbuf_kb < -1 || cfg.sndbuf_kb > BUFFER_KB_MAX || cfg.rcvbuf_kb < -1 ||
+             cfg.rcvbuf_kb > BUFFER_KB_MAX || cfg.notsent_lowat_kb < -1 || cfg.notsent_lowat_kb > BUFFER_KB_MAX)
+        err = "sndbuf_kb, rcvbuf_kb and notsent_lowat_kb must be in -1..1048576";
+    else if (cfg.keepalive_idle < -1 || cfg.keepalive_idle > KEEPALIVE_TIME_MAX || cfg.keepalive_intvl < -1 ||
+             cfg.keepalive_intvl == 0 || cfg.keepalive_intvl > KEEPALIVE_TIME_MAX || cfg.keepalive_cnt < -1 ||
+             cfg.keepalive_cnt == 0 || cfg.keepalive_cnt > KEEPALIVE_CNT_MAX)
+        err = "keepalive_idle must be in -1..32767, keepalive_intvl in 1..32767 and keepalive_cnt in 1..127 (or -1)";
+    else
+    {
+        p = preset->p;
+        override_value(p.nodelay, cfg.tcp_nodelay, 1);
+        override_value(p.sndbuf, cfg.sndbuf_kb, 1024);
+        override_value(p.rcvbuf, cfg.rcvbuf_kb, 1024);
+        override_value(p.notsent_lowat, cfg.notsent_lowat_kb, 1024);
+        override_value(p.keepalive_idle, cfg.keepalive_idle, 1);
+        override_value(p.keepalive_intvl, cfg.keepalive_intvl, 1);
+        override_value(p.keepalive_cnt, cfg.keepalive_cnt, 1);
+        return true;
+    }
+    return false;
+}
+
+// 设置一个int选项，失败时把选项名和原因追加到err
+static bool set_option(int fd, int level, int name, int value, const char* what, std::string& err)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == 0)
+        return true;
+    if (!err.empty())
+        err += "; ";
+    err += std::string(what) + ": " + strerror(errno);
+    return false;
+}
+
+bool sock_profile_apply(int listenfd, const sock_profile& p, std::string& err)
+{
+    err.clear();
+    bool ok = true;
+    if (p.nodelay >= 0)
+        ok &= set_option(listenfd, IPPROTO_TCP, TCP_NODELAY, p.nodelay, "TCP_NODELAY", err);
+    // 内核会把设置的值翻倍（留出簿记开销），并且不超过net.core.wmem_max/rmem_max
+    if (p.sndbuf >= 0)
+        ok &= set_option(listenfd, SOL_SOCKET, SO_SNDBUF, p.sndbuf, "SO_SNDBUF", err);
+    if (p.rcvbuf >= 0)
+        ok &= set_option(listenfd, SOL_SOCKET, SO_RCVBUF, p.rcvbuf, "SO_RCVBUF", err);
+    if (p.notsent_lowat >= 0)
+        ok &= set_option(listenfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p.notsent_lowat, "TCP_NOTSENT_LOWAT", err);
+    if (p.keepalive_idle >= 0)
+        ok &= set_option(listenfd, SOL_SOCKET, SO_KEEPALIVE, p.keepalive_idle > 0, "SO_KEEPALIVE", err);
+    if (p.keepalive_idle > 0)
+    {
+        ok &= set_option(listenfd, IPPROTO_TCP, TCP_KEEPIDLE, p.keepalive_idle, "TCP_KEEPIDLE", err);
+        if (p.keepalive_intvl > 0)
+            ok &= set_option(listenfd, IPPROTO_TCP, TCP_KEEPINTVL, p.keepalive_intvl, "TCP_KEEPINTVL", err);
+        if (p.keepalive_cnt > 0)
+            ok &= set_option(listenfd, IPPROTO_TCP, TCP_KEEPCNT, p.keepalive_cnt, "TCP_KEEPCNT", err);
+    }
+    return ok;
+}
+
+std::string sock_profile_describe(const sock_profile& p)
+{
+    std::string text;
+    char item[64];
+    auto add = [&](const char* name, int value) {
+        if (value < 0)
+            return;
+        snprintf(item, sizeof(item), "%s%s=%d", text.empty() ? "" : " ", name, value);
+        text += item;
+    };
+    add("nodelay", p.nodelay);
+    add("sndbuf", p.sndbuf);
+    add("rcvbuf", p.rcvbuf);
+    add("notsent_lowat", p.notsent_lowat);
+    add("keepalive", p.keepalive_idle);
+    if (p.keepalive_idle > 0)
+    {
+        add("keepintvl", p.keepalive_intvl);
+        add("keepcnt", p.keepalive_cnt);
+    }
+    return text.empty() ? "kernel defaults" : text;
+}
+
+bool sock_enable_fastopen(int listenfd, int qlen, std::string& err)
+{
+    err.clear();
+    return set_option(listenfd, IPPROTO_TCP, TCP_FASTOPEN, qlen, "TCP_FASTOPEN", err);
+}
+
+bool sock_steer_reuseport(int listenfd, const std::vector<int>& cpus, int loops, std::string& err)
+{
+    // A = 收包的CPU；逐个比较绑定的CPU，命中第i个时返回i；都不命中时返回 A % loops
+    std::vector<sock_filter> code;
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)));
+    for (int i = 0; i < loops && i < (int)cpus.size(); ++i)
+    {
+        code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[i], 0, 1));
+        code.push_back(BPF_STMT(BPF_RET | BPF_K, (uint32_t)i));
+    }
+    code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)loops));
+    code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+    sock_fprog prog;
+    prog.len = (unsigned short)code.size();
+    prog.filter = code.data();
+    if (setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0)
+        return true;
+    err = std::string("SO_ATTACH_REUSEPORT_CBPF: ") + strerror(errno);
+    return false;
+}
@@ -0,0 +1,55 @@
+#ifndef SOCK_TUNE_H
+#define SOCK_TUNE_H
+
+#include <string>
+#include <vector>
+#include "config.h"
+
+/*
+    socket参数的预设（profile）。选项都设置在监听socket上：Linux上accept出的连接继承监听socket的
+    TCP_NODELAY、SO_SNDBUF/SO_RCVBUF、TCP_NOTSENT_LOWAT和keepalive，每个新连接不用再多几次setsockopt；
+    SO_RCVBUF在握手前就生效，窗口缩放因子按它协商。
+        default     不设置任何选项，全部沿用内核默认（缓冲区自动调节）
+        latency     TCP_NODELAY，TCP_NOTSENT_LOWAT 16KB：发送缓冲区里只留少量未发出的数据，
+                    EPOLLOUT更早到来，HTTP/2的高优先级帧不会排在大量已写入的数据后面
+        throughput  固定4MB的发送缓冲区（大于自动调节的起点），一次sendmsg能交给内核更多数据
+        mobile      TCP_NODELAY，TCP_NOTSENT_LOWAT 128KB，keepalive 60秒后每10秒探测一次、5次无响应断开：
+                    慢速链路上不在内核里堆积过多数据，NAT超时或者已经掉线的客户端尽快释放
+    配置里的单项（tcp_nodelay、sndbuf_kb等）大于等于0时覆盖预设中的值。
+    多个事件循环时可以给SO_REUSEPORT组挂一个CBPF程序，按收到SYN的CPU选择监听socket：
+    连接交给运行在这个CPU上的事件循环，软中断、accept和之后的读写都在同一个CPU上
+*/
+
+/* 解析后的socket选项，-1表示不设置 */
+struct sock_profile
+{
+    int nodelay;
+    int sndbuf;
+    int rcvbuf;
+    int notsent_lowat;
+    /* keepalive_idle为0时关闭keepalive，大于0时开启，intvl和cnt为-1时沿用内核默认 */
+    int keepalive_idle;
+    int keepalive_intvl;
+    int keepalive_cnt;
+};
+
+/// @brief 按socket_profile取预设，再用配置里的单项覆盖
+/// @return 预设名未知或者某一项超出范围时返回false
+bool sock_profile_resolve(const server_config& cfg, sock_profile& p, std::string& err);
+
+/// @brief 把选项设置到监听socket上，之后accept出的连接都继承这些选项
+/// @return 有选项设置失败时返回false，err为失败的选项和原因，其余选项照常设置
+bool sock_profile_apply(int listenfd, const sock_profile& p, std::string& err);
+
+/// @brief 打印用的描述，如 "nodelay=1 notsent_lowat=16384"
+std::string sock_profile_describe(const sock_profile& p);
+
+/// @brief 开启TCP Fast Open，qlen为未完成握手的TFO请求队列长度；
+///        服务端还需要net.ipv4.tcp_fastopen包含2（默认只开客户端）
+bool sock_enable_fastopen(int listenfd, int qlen, std::string& err);
+
+/// @brief 给listenfd所在的SO_REUSEPORT组挂CBPF程序：收到SYN的CPU等于cpus[i]时选第i个监听socket
+///        （组内按创建顺序编号），不在cpus里的CPU、或者cpus为空时选第 CPU编号 % loops 个
+bool sock_steer_reuseport(int listenfd, const std::vector<int>& cpus, int loops, std::string& err);
+
+#endif
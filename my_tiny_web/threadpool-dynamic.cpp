@@ -1,10 +1,20 @@
 #include "threadpool-dynamic.h"
+#include "affinity.h"
 #include <cstdio>
 #include <functional>
+#include <algorithm>
 
-ThreadPool::ThreadPool(int min, int max) : m_maxThreads(max),
-m_minThreads(min), m_stop(false), m_exitNumber(0)
+ThreadPool::ThreadPool(int min, int max, const vector<int>& cpus) : m_minThreads(min),
+m_maxThreads(max), m_maxTasks(0), m_cpus(cpus), m_spinUs(0), m_taskCount(0), m_sleepers(0),
+m_spinHits(0), m_spinMisses(0), m_stop(false), m_exitNumber(0)
 {
+    for (int i = 0; i < PRIORITIES; ++i)
+    {
+        m_credits[i] = 1;
+        m_weights[i] = 1;
+        m_dequeued[i] = 0;
+        m_waitUs[i] = 0;
+    }
     //m_idleThreads = m_curThreads = max / 2;
     m_idleThreads = m_curThreads = min;
     printf("线程数量: %d\n", m_curThreads.load());
@@ -18,7 +28,21 @@ m_minThreads(min), m_stop(false), m_exitNumber(0)
 
 ThreadPool::~ThreadPool()
 {
-    m_stop = true;
+    {
+        lock_guard<mutex> lck(m_managerMutex);
+        m_stop = true;
+    }
+    m_managerCondition.notify_all();
+    // 先回收管理线程，它可能正在修改m_workers
+    if (m_manager->joinable())
+    {
+        m_manager->join();
+    }
+    delete m_manager;
+    {
+        // 加一次队列锁再通知，避免工作线程在检查m_stop之后、wait之前错过唤醒
+        lock_guard<mutex> locker(m_queueMutex);
+    }
     m_condition.notify_all();
     for (auto& it : m_workers)
     {
@@ -29,20 +53,104 @@ ThreadPool::~ThreadPool()
             t.join();
         }
     }
-    if (m_manager->joinable())
-    {
-        m_manager->join();
-    }
-    delete m_manager;
 }
 
-void ThreadPool::addTask(function<void()> f)
+bool ThreadPool::addTask(function<void()> f, int priority)
 {
+    priority = min(max(priority, 0), PRIORITIES - 1);
     {
         lock_guard<mutex> locker(m_queueMutex);
-        m_tasks.emplace(f);
+        int limit = m_maxTasks.load();
+        if (limit > 0 && m_taskCount.load() >= limit)
+            return false;
+        m_tasks[priority].push(Task{move(f), chrono::steady_clock::now()});
+        m_taskCount++;
+        // 没有线程在休眠时（都在忙或者在自旋），省掉一次futex唤醒
+        if (m_sleepers == 0)
+            return true;
     }
     m_condition.notify_one();
+    return true;
+}
+
+void ThreadPool::setWeights(const vector<int>& weights)
+{
+    for (int i = 0; i < PRIORITIES && i < (int)weights.size(); ++i)
+        m_weights[i].store(max(weights[i], 1));
+}
+
+void ThreadPool::getQueueStats(long dequeued[PRIORITIES], long waitUs[PRIORITIES]) const
+{
+    for (int i = 0; i < PRIORITIES; ++i)
+    {
+        dequeued[i] = m_dequeued[i].load();
+        waitUs[i] = m_waitUs[i].load();
+    }
+}
+
+// 加权轮转，调用时持有m_queueMutex：按优先级从高到低找还有额度的非空队列，
+// 所有非空队列的额度都用完时按权重重新发放。只有一个队列有任务时它不受额度限制
+bool ThreadPool::popTask(function<void()>& task)
+{
+    for (int round = 0; round < 2; ++round)
+    {
+        for (int i = 0; i < PRIORITIES; ++i)
+        {
+            if (m_tasks[i].empty() || m_credits[i] <= 0)
+                continue;
+            m_credits[i]--;
+            Task& t = m_tasks[i].front();
+            task = move(t.fn);
+            long waited = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t.queued).count();
+            m_tasks[i].pop();
+            m_taskCount--;
+            m_dequeued[i].fetch_add(1, memory_order_relaxed);
+            m_waitUs[i].fetch_add(waited, memory_order_relaxed);
+            return true;
+        }
+        for (int i = 0; i < PRIORITIES; ++i)
+            m_credits[i] = m_weights[i].load(memory_order_relaxed);
+    }
+    return false;
+}
+
+void ThreadPool::setSpin(int us)
+{
+    m_spinUs.store(us);
+}
+
+void ThreadPool::getSpinStats(long& hits, long& misses) const
+{
+    hits = m_spinHits.load();
+    misses = m_spinMisses.load();
+}
+
+// 在us微秒内忙等新任务，等到返回true
+bool ThreadPool::spinForTask(int us)
+{
+    auto deadline = chrono::steady_clock::now() + chrono::microseconds(us);
+    while (!m_stop.load())
+    {
+        if (m_taskCount.load(memory_order_acquire) > 0)
+            return true;
+        for (int i = 0; i < 64; ++i)
+            cpu_relax();
+        if (chrono::steady_clock::now() >= deadline)
+            break;
+    }
+    return false;
+}
+
+void ThreadPool::setThreadLimits(int min, int max)
+{
+    m_minThreads.store(min);
+    m_maxThreads.store(max);
+    printf("线程池上下限调整为: min=%d max=%d\n", min, max);
+}
+
+void ThreadPool::setMaxTasks(int maxTasks)
+{
+    m_maxTasks.store(maxTasks);
 }
 
 /// @brief ThreadPool::manager 是一个管理线程池的函数，它通过循环监控线程池的状态，根据空闲线程数量和当前线程数量动态调整线程池的大小。当空闲线程过多时会销毁部分线程，而当没有空闲线程且线程数量未达到上限时会创建新线程
@@ -50,13 +158,23 @@ void ThreadPool::manager()
 {
     while (!m_stop.load())
     {
-        this_thread::sleep_for(chrono::seconds(2));
+        {
+            // 每2秒检查一次，析构时可以被立即唤醒
+            unique_lock<mutex> lck(m_managerMutex);
+            m_managerCondition.wait_for(lck, chrono::seconds(2), [this] { return m_stop.load(); });
+            if (m_stop.load())
+                break;
+        }
         int idle = m_idleThreads.load(); //空闲线程数
         int current = m_curThreads.load();//当前线程数
-        printf("manager check: idle=%d current=%d min=%d\n", idle, current, m_minThreads);
-        if (idle > current / 2 && current > m_minThreads)
+        int minThreads = m_minThreads.load();
+        int maxThreads = m_maxThreads.load();
+        printf("manager check: idle=%d current=%d min=%d\n", idle, current, minThreads);
+        if ((idle > current / 2 && current > minThreads) || current > maxThreads)
         {
-            m_exitNumber.store(2);
+            // 至多退出2个，且不低于最小线程数（上限被调低时至少退出1个）
+            int exitNumber = current > maxThreads ? current - maxThreads : current - minThreads;
+            m_exitNumber.store(exitNumber < 2 ? exitNumber : 2);
             m_condition.notify_all();
             unique_lock<mutex> lck(m_idsMutex);
             for (const auto& id : m_ids)
@@ -71,7 +189,7 @@ void ThreadPool::manager()
             }
             m_ids.clear();
         }
-        else if (idle == 0 && current < m_maxThreads)
+        else if ((idle == 0 || current < minThreads) && current < maxThreads)
         {
             thread t(&ThreadPool::worker, this);
             printf("+++++++++++++++ 添加了一个线程, id: %zu\n", std::hash<std::thread::id>{}(t.get_id()));
@@ -84,40 +202,62 @@ void ThreadPool::manager()
 /// @brief ThreadPool::worker 是线程池中的工作线程函数，它在一个循环中持续运行，等待任务队列中的任务。当任务队列为空时，线程会进入等待状态；当有任务时，线程取出任务执行，并在特定条件下退出线程并更新线程池状态。
 void ThreadPool::worker()
 {
+    pin_current_thread(m_cpus);
+    int spinBudget = 1; // 自适应的自旋预算：自旋等到任务就加倍，白白自旋就减半
     while (!m_stop.load())
     {
+        int maxSpin = m_spinUs.load();
+        if (maxSpin > 0 && m_taskCount.load(memory_order_acquire) == 0)
+        {
+            spinBudget = min(max(spinBudget, 1), maxSpin);
+            if (spinForTask(spinBudget))
+            {
+                m_spinHits++;
+                spinBudget = min(spinBudget * 2, maxSpin);
+            }
+            else
+            {
+                m_spinMisses++;
+                spinBudget = max(spinBudget / 2, 1);
+            }
+        }
         function<void()> task = nullptr;
         {
             unique_lock<mutex> locker(m_queueMutex);
-            while (!m_stop && m_tasks.empty())
+            while (!m_stop && m_taskCount.load() == 0)
             {
+                m_sleepers++;
                 m_condition.wait(locker);
+                m_sleepers--;
                 if (m_exitNumber.load() > 0)//当设置为大于0的时候 说明一些线程需要退出了
                 {
                     printf("----------------- 线程任务结束, ID: %zu\n", std::hash<std::thread::id>{}(this_thread::get_id()));
                     m_exitNumber--;
                     m_curThreads--;
+                    m_idleThreads--;
                     unique_lock<mutex> lck(m_idsMutex);
                     m_ids.emplace_back(this_thread::get_id());
                     return;
                 }
             }
 
-            if (!m_tasks.empty())
-            {
-                printf("取出一个任务...\n");
-                task = move(m_tasks.front());
-                m_tasks.pop();
-            }
+            popTask(task);
         }
 
         if (task)
         {
             m_idleThreads--;
-            task();
+            try
+            {
+                task();
+            }
+            catch (...)
+            {
+                // 任务抛出的异常不能让工作线程退出
+                printf("task threw an exception\n");
+            }
             m_idleThreads++;
         }
-        printf("worker idleThreads=%d\n", m_idleThreads.load());
     }
 }
 
@@ -14,28 +14,67 @@ using namespace std;
 class ThreadPool
 {
 public:
+    /* 任务的优先级数，0最高 */
+    static const int PRIORITIES = 3;
+
     /// @brief ThreadPool::ThreadPool(int min, int max) 是 ThreadPool 类的构造函数，用于初始化线程池。
     /// @param min 当前线程数初始化为 min，并输出线程数量信息。
     /// @param max 最大线程数设置为 max。构造函数还创建了一个管理线程，并根据 min 值创建相应数量的工作线程，工作线程会执行 worker 函数。
-    ThreadPool(int min = 4, int max = thread::hardware_concurrency());
+    /// @param cpus 工作线程允许运行的CPU，为空则不绑定
+    ThreadPool(int min = 4, int max = thread::hardware_concurrency(), const vector<int>& cpus = vector<int>());
     ~ThreadPool();
-    void addTask(function<void()> f);
+    /// @brief 添加任务，队列已满（超过 setMaxTasks 设置的上限）时返回false，任务不会被执行
+    /// @param priority 任务所在的队列，0..PRIORITIES-1，越小越先取
+    bool addTask(function<void()> f, int priority = 0);
+    /// @brief 各优先级队列的权重：都有积压时，一轮里每个队列最多取出权重个任务，高优先级先取；
+    /// 权重保证低优先级的队列不会被饿死
+    void setWeights(const vector<int>& weights);
+    /// @brief 各优先级队列取出的任务数和任务排队的总时间（微秒）
+    void getQueueStats(long dequeued[PRIORITIES], long waitUs[PRIORITIES]) const;
+    /// @brief 运行时调整线程数的上下限，由管理线程在下一次检查时按新值伸缩
+    void setThreadLimits(int min, int max);
+    /// @brief 设置任务队列的上限，0表示不限制
+    void setMaxTasks(int maxTasks);
+    /// @brief 低延迟模式：空闲的工作线程在休眠前最多自旋us微秒等待新任务，0表示不自旋
+    void setSpin(int us);
+    /// @brief 自旋期间等到任务(hits)与自旋超时后休眠(misses)的次数
+    void getSpinStats(long& hits, long& misses) const;
 
 private:
     void manager();
     void worker();
+    bool spinForTask(int us);
+    bool popTask(function<void()>& task);
 private:
     thread* m_manager;
     map<thread::id, thread> m_workers; 
     vector<thread::id> m_ids; //存储将要退出的线程ID
-    int m_minThreads;   //表示线程池中允许的最小线程数量
-    int m_maxThreads;   //表示线程池中允许的最大线程数量
+    atomic<int> m_minThreads;   //表示线程池中允许的最小线程数量
+    atomic<int> m_maxThreads;   //表示线程池中允许的最大线程数量
+    atomic<int> m_maxTasks;     //任务队列的上限 0表示不限制
+    vector<int> m_cpus;         //工作线程绑定的CPU集合
+    atomic<int> m_spinUs;       //自旋预算的上限（微秒）
+    atomic<int> m_taskCount;    //队列中的任务数，自旋时不加锁读取
+    int m_sleepers;             //阻塞在m_condition上的线程数，由m_queueMutex保护
+    atomic<long> m_spinHits;
+    atomic<long> m_spinMisses;
     atomic<bool> m_stop;    //表示线程池是否被停止
     atomic<int> m_curThreads;   //表示当前线程的数量
     atomic<int> m_idleThreads;  //表示当前空闲线程的数量
     atomic<int> m_exitNumber; //用于在线程池中以线程安全的方式存储和操作退出标志或计数器
-    queue<function<void()>> m_tasks;
+    struct Task
+    {
+        function<void()> fn;
+        chrono::steady_clock::time_point queued;
+    };
+    queue<Task> m_tasks[PRIORITIES]; //每个优先级一个队列，由m_queueMutex保护
+    int m_credits[PRIORITIES];       //本轮各队列还能取的任务数，由m_queueMutex保护
+    atomic<int> m_weights[PRIORITIES];
+    atomic<long> m_dequeued[PRIORITIES];
+    atomic<long> m_waitUs[PRIORITIES];
     mutex m_idsMutex;   //管理线程ID列表的锁
     mutex m_queueMutex; //队列操作的锁
     condition_variable m_condition; //用于实现线程间的同步机制，通常用于线程池中协调任务的等待和通知操作
+    mutex m_managerMutex;   //管理线程定时检查用的锁
+    condition_variable m_managerCondition; //析构时唤醒正在等待的管理线程
 };
\ No newline at end of file
@@ -0,0 +1,228 @@
+#include "tls.h"
+#include "rcu.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <atomic>
+#include <openssl/err.h>
+#include "config.h"
+
+static std::atomic<long> g_handshakes{0};
+static std::atomic<long> g_resumed{0};
+static std::atomic<long> g_ktls_send{0};
+
+void tls_stats(long& handshakes, long& resumed, long& ktls_send)
+{
+    handshakes = g_handshakes.load(std::memory_order_relaxed);
+    resumed = g_resumed.load(std::memory_order_relaxed);
+    ktls_send = g_ktls_send.load(std::memory_order_relaxed);
+}
+
+// 把OpenSSL错误队列里最早的错误转成字符串
+static std::string last_error()
+{
+    char buf[256];
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    ERR_clear_error();
+    return buf;
+}
+
+// ALPN：开启http2时优先选h2，否则只接受http/1.1；客户端没有提供两者时不协商，按HTTP/1.1处理
+static int select_alpn(SSL*, const unsigned char** out, unsigned char* outlen,
+                       const unsigned char* in, unsigned int inlen, void*)
+{
+    static const unsigned char h2[] = "\x02h2";
+    static const unsigned char http11[] = "\x08http/1.1";
+    unsigned char* selected = nullptr;
+    bool http2;
+    {
+        rcu_read_guard guard;
+        http2 = config_read()->http2;
+    }
+    if (http2 &&
+        SSL_select_next_proto(&selected, outlen, h2, sizeof(h2) - 1, in, inlen) == OPENSSL_NPN_NEGOTIATED)
+    {
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+    if (SSL_select_next_proto(&selected, outlen, http11, sizeof(http11) - 1, in, inlen) == OPENSSL_NPN_NEGOTIATED)
+    {
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
+SSL_CTX* tls_create_context(const server_config& cfg, std::string& err)
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+    {
+        err = last_error();
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // 对端不发close_notify直接断开时当作正常的EOF，浏览器和curl经常这样做
+    long options = SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION;
+#ifdef SSL_OP_ENABLE_KTLS
+    if (cfg.ktls)
+        options |= SSL_OP_ENABLE_KTLS;
+#endif
+    if (!cfg.tls_tickets)
+        options |= SSL_OP_NO_TICKET;
+    SSL_CTX_set_options(ctx, options);
+    // 非阻塞socket上SSL_write可能只写出一部分，重试时缓冲区的地址可以不同（剩余数据的位置会移动）
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cfg.tls_cert.c_str()) != 1)
+        err = "tls_cert " + cfg.tls_cert + ": " + last_error();
+    else if (SSL_CTX_use_PrivateKey_file(ctx, cfg.tls_key.c_str(), SSL_FILETYPE_PEM) != 1)
+        err = "tls_key " + cfg.tls_key + ": " + last_error();
+    else if (SSL_CTX_check_private_key(ctx) != 1)
+        err = "tls_key does not match tls_cert";
+    if (!err.empty())
+    {
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+
+    // 会话恢复：TLS 1.3用无状态票据（密钥在SSL_CTX里，所有事件循环共享），
+    // TLS 1.2不带票据的客户端用服务器端会话缓存
+    static const unsigned char sid_ctx[] = "my_tiny_web";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    if (cfg.tls_tickets)
+    {
+        SSL_CTX_set_num_tickets(ctx, 1);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    }
+    else
+    {
+        SSL_CTX_set_num_tickets(ctx, 0);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, nullptr);
+    return ctx;
+}
+
+tls_conn::tls_conn(SSL_CTX* ctx, int sockfd)
+    : m_ssl(SSL_new(ctx)), m_sockfd(sockfd), m_established(false), m_ktls_send(false)
+{
+    if (m_ssl)
+    {
+        SSL_set_fd(m_ssl, sockfd);
+        SSL_set_accept_state(m_ssl);
+    }
+    // 一次响应在记录层变成多次小的写（会话票据、响应头记录、文件记录），
+    // 开着Nagle的话后面的小写要等对端的延迟ACK，每个请求平白多出几十毫秒
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+tls_conn::~tls_conn()
+{
+    if (m_ssl)
+        SSL_free(m_ssl);
+}
+
+tls_conn::HANDSHAKE_RESULT tls_conn::handshake()
+{
+    if (!m_ssl)
+        return TLS_ERROR;
+    // 错误队列是线程局部的，工作线程轮流处理不同的连接，先清掉别的连接留下的错误
+    ERR_clear_error();
+    int ret = SSL_do_handshake(m_ssl);
+    if (ret != 1)
+    {
+        switch (SSL_get_error(m_ssl, ret))
+        {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            ERR_clear_error();
+            return TLS_ERROR;
+        }
+    }
+    m_established = true;
+    m_ktls_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+    g_handshakes.fetch_add(1, std::memory_order_relaxed);
+    if (SSL_session_reused(m_ssl))
+        g_resumed.fetch_add(1, std::memory_order_relaxed);
+    if (m_ktls_send)
+        g_ktls_send.fetch_add(1, std::memory_order_relaxed);
+    return TLS_DONE;
+}
+
+ssize_t tls_conn::read(void* buf, size_t len)
+{
+    ERR_clear_error();
+    int n = SSL_read(m_ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if (n > 0)
+        return n;
+    switch (SSL_get_error(m_ssl, n))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        ERR_clear_error();
+        errno = EIO;
+        return -1;
+    }
+}
+
+ssize_t tls_conn::writev(const struct iovec* iov, int iovcnt)
+{
+    // 发送方向已经交给内核：写socket的明文由内核加密成TLS记录，mmap的文件页直接进入内核
+    if (m_ktls_send)
+        return ::writev(m_sockfd, iov, iovcnt);
+
+    // 用户态加密：逐段SSL_write。一段没有写完就返回已经写出的字节数，调用方下次从同一位置重试，
+    // 满足OpenSSL要求的"用相同的数据重试"
+    ssize_t total = 0;
+    ERR_clear_error();
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        const char* p = (const char*)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0)
+        {
+            int n = SSL_write(m_ssl, p, left > INT_MAX ? INT_MAX : (int)left);
+            if (n <= 0)
+            {
+                int e = SSL_get_error(m_ssl, n);
+                if (total > 0)
+                    return total;
+                if (e == SSL_ERROR_WANT_WRITE || e == SSL_ERROR_WANT_READ)
+                    errno = EAGAIN;
+                else
+                {
+                    ERR_clear_error();
+                    errno = EPIPE;
+                }
+                return -1;
+            }
+            p += n;
+            left -= n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+void tls_conn::shutdown()
+{
+    if (m_ssl && m_established)
+    {
+        ERR_clear_error();
+        SSL_shutdown(m_ssl);
+        ERR_clear_error();
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+#include <openssl/ssl.h>
+#include "config.h"
+
+/// @brief 创建服务器端的SSL_CTX：加载证书和私钥，按配置开启会话票据和kTLS，设置ALPN（h2 / http/1.1）
+/// @return 失败时返回nullptr，err中是原因
+SSL_CTX* tls_create_context(const server_config& cfg, std::string& err);
+
+/// @brief 累计的握手次数、其中通过会话票据恢复的次数、发送方向交给内核TLS的连接数
+void tls_stats(long& handshakes, long& resumed, long& ktls_send);
+
+/*
+    一个TLS连接。非阻塞socket上握手，握手完成后：
+    - 内核支持kTLS时，OpenSSL把发送方向的密钥交给内核，之后writev直接写socket，
+      mmap的文件内容由内核加密，不经过用户态的拷贝；
+    - 否则退回到SSL_write，在用户态加密。
+    读总是走SSL_read（开启kTLS接收时OpenSSL内部直接从socket读明文）。
+    和http_conn的其它成员一样，只被连接的持有者访问
+*/
+class tls_conn
+{
+public:
+    enum HANDSHAKE_RESULT {
+        TLS_DONE = 0,      // 握手完成
+        TLS_WANT_READ,     // 等socket可读后继续
+        TLS_WANT_WRITE,    // 等socket可写后继续
+        TLS_ERROR          // 握手失败，关闭连接
+    };
+
+    tls_conn(SSL_CTX* ctx, int sockfd);
+    ~tls_conn();
+
+    /* 推进握手 */
+    HANDSHAKE_RESULT handshake();
+    bool established() const { return m_established; }
+    /* 发送方向是否已经交给内核 */
+    bool ktls_send() const { return m_ktls_send; }
+
+    /* 语义同recv：返回0表示对端关闭，-1且errno为EAGAIN表示暂时没有数据 */
+    ssize_t read(void* buf, size_t len);
+    /* 语义同writev：可能只写出一部分，-1且errno为EAGAIN表示发送缓冲区已满 */
+    ssize_t writev(const struct iovec* iov, int iovcnt);
+    /* 尽力发送close_notify，不等待对端回应 */
+    void shutdown();
+
+private:
+    SSL* m_ssl;
+    int m_sockfd;
+    bool m_established;
+    bool m_ktls_send;
+};
+
+#endif
@@ -0,0 +1,246 @@
+// TLS压测客户端，两种模式：
+//   handshake: 每次新建连接、完成握手并发一个请求后断开，统计每秒握手数；-r 1时复用上一次的会话（票据恢复）
+//   bulk:      每个线程一个keep-alive连接反复下载同一个URL，统计吞吐量
+// 指定服务器pid时统计服务器CPU时间。对比服务器 --ktls=1 与 --ktls=0（用户态加密）的结果，
+// 再用 -s 0 测同样负载下的明文基线
+//
+// 用法: tls_bench ip port [-m handshake|bulk] [-c 线程数] [-n 每个线程的次数] [-u URL] [-r 0|1] [-s 0|1] [-p 服务器pid]
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+struct bench_options {
+    const char* ip = "127.0.0.1";
+    int port = 8443;
+    bool bulk = false;
+    int threads = 4;
+    int count = 200;
+    std::string url = "/index.html";
+    bool resume = false;
+    bool tls = true;
+    int server_pid = 0;
+};
+
+// 一个线程的结果
+struct bench_result {
+    long done = 0;
+    long resumed = 0;
+    long bytes = 0;
+    int errors = 0;
+};
+
+// 读取/proc/<pid>/stat里的utime+stime，单位为时钟滴答
+static long read_cpu_ticks(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) return -1;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    char* p = strrchr(buf, ')');
+    if (!p) return -1;
+    long utime = 0, stime = 0;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime) != 2) return -1;
+    return utime + stime;
+}
+
+static int connect_to(const bench_options& opt) {
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    inet_pton(AF_INET, opt.ip, &addr.sin_addr);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// 明文或TLS连接，阻塞读写
+struct bench_conn {
+    int fd = -1;
+    SSL* ssl = nullptr;
+
+    ssize_t send_all(const std::string& data) {
+        if (ssl) return SSL_write(ssl, data.data(), (int)data.size());
+        return send(fd, data.data(), data.size(), 0);
+    }
+    ssize_t recv_some(char* buf, size_t len) {
+        if (ssl) return SSL_read(ssl, buf, (int)len);
+        return recv(fd, buf, len, 0);
+    }
+    void close_conn() {
+        if (ssl) {
+            SSL_shutdown(ssl);
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+};
+
+// 建立连接并完成握手，session不为空时尝试恢复该会话
+static bool open_conn(const bench_options& opt, SSL_CTX* ctx, SSL_SESSION* session, bench_conn& conn) {
+    conn.fd = connect_to(opt);
+    if (conn.fd < 0) return false;
+    if (!ctx) return true;
+    conn.ssl = SSL_new(ctx);
+    SSL_set_fd(conn.ssl, conn.fd);
+    SSL_set_tlsext_host_name(conn.ssl, "localhost");
+    if (session) SSL_set_session(conn.ssl, session);
+    if (SSL_connect(conn.ssl) != 1) {
+        ERR_clear_error();
+        conn.close_conn();
+        return false;
+    }
+    return true;
+}
+
+// 读完一个完整的响应，返回响应体长度，出错返回-1
+static long read_response(bench_conn& conn, std::string& buf) {
+    size_t header_end;
+    char tmp[65536];
+    while ((header_end = buf.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t n = conn.recv_some(tmp, sizeof(tmp));
+        if (n <= 0) return -1;
+        buf.append(tmp, n);
+    }
+    size_t body_len = 0;
+    size_t pos = buf.find("Content-Length:");
+    if (pos != std::string::npos && pos < header_end) body_len = strtoul(buf.c_str() + pos + 15, nullptr, 10);
+    // 响应体不保存，只计数
+    size_t have = buf.size() - header_end - 4;
+    while (have < body_len) {
+        ssize_t n = conn.recv_some(tmp, sizeof(tmp));
+        if (n <= 0) return -1;
+        have += n;
+    }
+    buf.clear();
+    return (long)body_len;
+}
+
+static void run_thread(const bench_options& opt, SSL_CTX* ctx, bench_result& result) {
+    std::string request = "GET " + opt.url + " HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n";
+    std::string buf;
+    SSL_SESSION* session = nullptr;
+    bench_conn conn;
+    for (int i = 0; i < opt.count; ++i) {
+        if (conn.fd < 0) {
+            buf.clear();
+            if (!open_conn(opt, ctx, opt.resume ? session : nullptr, conn)) {
+                result.errors++;
+                continue;
+            }
+            if (!opt.bulk) {
+                result.done++;
+                if (conn.ssl && SSL_session_reused(conn.ssl)) result.resumed++;
+            }
+        }
+        long body = -1;
+        if (conn.send_all(request) == (ssize_t)request.size()) body = read_response(conn, buf);
+        if (body < 0) {
+            result.errors++;
+            conn.close_conn();
+            continue;
+        }
+        result.bytes += body;
+        if (opt.bulk) {
+            result.done++;
+            continue;
+        }
+        // TLS 1.3的票据在握手之后才发送，读完响应时已经收到，保存下来给下一个连接用
+        if (conn.ssl && opt.resume) {
+            SSL_SESSION* fresh = SSL_get1_session(conn.ssl);
+            if (fresh) {
+                if (session) SSL_SESSION_free(session);
+                session = fresh;
+            }
+        }
+        conn.close_conn();
+    }
+    conn.close_conn();
+    if (session) SSL_SESSION_free(session);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s ip port [-m handshake|bulk] [-c threads] [-n count] [-u url] [-r 0|1] [-s 0|1] [-p server_pid]\n",
+               argv[0]);
+        return 1;
+    }
+    bench_options opt;
+    opt.ip = argv[1];
+    opt.port = atoi(argv[2]);
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-m") == 0) opt.bulk = strcmp(argv[i + 1], "bulk") == 0;
+        else if (strcmp(argv[i], "-c") == 0) opt.threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0) opt.count = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-u") == 0) opt.url = argv[i + 1];
+        else if (strcmp(argv[i], "-r") == 0) opt.resume = atoi(argv[i + 1]) != 0;
+        else if (strcmp(argv[i], "-s") == 0) opt.tls = atoi(argv[i + 1]) != 0;
+        else if (strcmp(argv[i], "-p") == 0) opt.server_pid = atoi(argv[i + 1]);
+    }
+
+    SSL_CTX* ctx = nullptr;
+    if (opt.tls) {
+        // 压测本地的自签名证书，不验证证书
+        ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+    }
+
+    std::vector<bench_result> results(opt.threads);
+    long cpu_before = opt.server_pid ? read_cpu_ticks(opt.server_pid) : -1;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < opt.threads; ++i) {
+        threads.emplace_back(run_thread, std::cref(opt), ctx, std::ref(results[i]));
+    }
+    for (auto& t : threads) t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    long cpu_after = opt.server_pid ? read_cpu_ticks(opt.server_pid) : -1;
+
+    bench_result total;
+    for (const bench_result& r : results) {
+        total.done += r.done;
+        total.resumed += r.resumed;
+        total.bytes += r.bytes;
+        total.errors += r.errors;
+    }
+    if (opt.bulk) {
+        printf("请求数: %ld  错误: %d  耗时: %.3f s  吞吐: %.1f MB/s\n", total.done, total.errors, seconds,
+               total.bytes / seconds / 1048576.0);
+    } else {
+        printf("连接数: %ld  会话恢复: %ld  错误: %d  耗时: %.3f s  握手: %.0f /s\n", total.done, total.resumed,
+               total.errors, seconds, total.done / seconds);
+    }
+    if (cpu_before >= 0 && cpu_after >= 0) {
+        double cpu_seconds = (double)(cpu_after - cpu_before) / sysconf(_SC_CLK_TCK);
+        printf("服务器CPU: %.2f s (%.0f%% 单核)", cpu_seconds, 100.0 * cpu_seconds / seconds);
+        if (opt.bulk && total.bytes > 0)
+            printf("  每MB %.2f ms", cpu_seconds * 1000.0 / (total.bytes / 1048576.0));
+        else if (total.done > 0)
+            printf("  每连接 %.1f us", cpu_seconds * 1e6 / total.done);
+        printf("\n");
+    }
+    if (ctx) SSL_CTX_free(ctx);
+    return total.errors ? 2 : 0;
+}
@@ -0,0 +1,248 @@
+#include "vhost.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* 哈希表的一个槽，name指向vhost_spec里的名字（已经转成小写），为nullptr表示空槽 */
+struct vhost_slot
+{
+    uint32_t hash;
+    uint32_t len;
+    const char* name;
+    vhost* host;
+};
+
+static std::vector<vhost_spec> g_specs;
+static std::vector<vhost*> g_hosts;
+static vhost g_default;
+static std::vector<vhost_slot> g_table;
+static uint32_t g_mask = 0;
+
+static std::string trim(const std::string& s)
+{
+    size_t b = s.find_first_not_of(" \t");
+    if (b == std::string::npos)
+        return "";
+    size_t e = s.find_last_not_of(" \t");
+    return s.substr(b, e - b + 1);
+}
+
+static inline char lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// FNV-1a，忽略大小写；h为前面部分的哈希，用来拼接 "*" 和上一级域名
+static inline uint32_t host_hash(const char* p, size_t n, uint32_t h = 2166136261u)
+{
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ (uint8_t)lower(p[i])) * 16777619u;
+    return h;
+}
+
+// Host值中主机名部分的长度：去掉 ":端口" 和结尾的点，IPv6地址保留方括号
+static size_t host_length(const char* p, size_t len)
+{
+    size_t n = 0;
+    if (len && p[0] == '[')
+    {
+        while (n < len && p[n] != ']')
+            ++n;
+        return n < len ? n + 1 : 0;
+    }
+    while (n < len && p[n] != ':' && p[n] != ' ' && p[n] != '\t')
+        ++n;
+    if (n && p[n - 1] == '.')
+        --n;
+    return n;
+}
+
+bool vhost_parse(const std::string& text, std::vector<vhost_spec>& specs, std::string& err)
+{
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t semi = text.find(';', pos);
+        if (semi == std::string::npos)
+            semi = text.size();
+        std::string item = trim(text.substr(pos, semi - pos));
+        pos = semi + 1;
+        if (item.empty())
+            continue;
+        size_t eq = item.find('=');
+        if (eq == std::string::npos)
+        {
+            err = "bad virtual host '" + item + "', expected name[,name...]=doc_root [max_requests=N] [cache=0|1]";
+            return false;
+        }
+        vhost_spec spec;
+        std::string names = item.substr(0, eq);
+        size_t p = 0;
+        while (p <= names.size())
+        {
+            size_t comma = names.find(',', p);
+            if (comma == std::string::npos)
+                comma = names.size();
+            std::string name = trim(names.substr(p, comma - p));
+            p = comma + 1;
+            for (size_t i = 0; i < name.size(); ++i)
+                name[i] = lower(name[i]);
+            // 通配符只能是最左边的一整段
+            if (name.empty() || host_length(name.data(), name.size()) != name.size() ||
+                name.find('*', 1) != std::string::npos || (name[0] == '*' && (name.size() < 3 || name[1] != '.')))
+            {
+                err = "bad host name '" + name + "' in virtual host '" + item + "'";
+                return false;
+            }
+            spec.names.push_back(name);
+        }
+        // 根目录之后是空白分隔的选项
+        std::string rest = item.substr(eq + 1);
+        size_t q = 0;
+        while (q < rest.size())
+        {
+            size_t b = rest.find_first_not_of(" \t", q);
+            if (b == std::string::npos)
+                break;
+            size_t e = rest.find_first_of(" \t", b);
+            if (e == std::string::npos)
+                e = rest.size();
+            std::string word = rest.substr(b, e - b);
+            q = e;
+            if (spec.doc_root.empty())
+            {
+                spec.doc_root = word;
+                continue;
+            }
+            char* end = nullptr;
+            if (word.compare(0, 13, "max_requests=") == 0)
+                spec.max_requests = strtol(word.c_str() + 13, &end, 10);
+            else if (word.compare(0, 6, "cache=") == 0)
+                spec.cache = strtol(word.c_str() + 6, &end, 10) != 0;
+            if (!end || *end != '\0' || end == word.c_str() + word.find('=') + 1 || spec.max_requests < 0)
+            {
+                err = "bad option '" + word + "' for virtual host " + spec.names[0];
+                return false;
+            }
+        }
+        if (spec.doc_root.empty())
+        {
+            err = "virtual host " + spec.names[0] + " has no doc_root";
+            return false;
+        }
+        specs.push_back(spec);
+    }
+    return true;
+}
+
+static vhost* find(const char* name, size_t n, uint32_t h)
+{
+    for (uint32_t i = h & g_mask;; i = (i + 1) & g_mask)
+    {
+        const vhost_slot& s = g_table[i];
+        if (!s.name)
+            return nullptr;
+        if (s.hash == h && s.len == n && strncasecmp(s.name, name, n) == 0)
+            return s.host;
+    }
+}
+
+bool vhost_init(const server_config& cfg, std::string& err)
+{
+    if (!vhost_parse(cfg.vhosts, g_specs, err))
+        return false;
+    size_t names = 0;
+    for (size_t i = 0; i < g_specs.size(); ++i)
+        names += g_specs[i].names.size();
+    // 装载因子不超过一半，线性探测的平均长度接近1
+    size_t capacity = 16;
+    while (capacity < names * 2)
+        capacity <<= 1;
+    g_table.assign(capacity, vhost_slot());
+    g_mask = capacity - 1;
+    for (size_t i = 0; i < g_specs.size(); ++i)
+    {
+        const vhost_spec& spec = g_specs[i];
+        vhost* host = new vhost;
+        host->name = spec.names[0];
+        host->doc_root = spec.doc_root;
+        host->cache = spec.cache;
+        host->max_requests = spec.max_requests;
+        g_hosts.push_back(host);
+        for (size_t j = 0; j < spec.names.size(); ++j)
+        {
+            const std::string& name = spec.names[j];
+            uint32_t h = host_hash(name.data(), name.size());
+            if (find(name.data(), name.size(), h))
+            {
+                err = "virtual host name '" + name + "' is listed twice";
+                return false;
+            }
+            uint32_t k = h & g_mask;
+            while (g_table[k].name)
+                k = (k + 1) & g_mask;
+            g_table[k].hash = h;
+            g_table[k].len = name.size();
+            g_table[k].name = name.c_str();
+            g_table[k].host = host;
+        }
+    }
+    return true;
+}
+
+bool vhost_enabled()
+{
+    return !g_hosts.empty();
+}
+
+vhost* vhost_lookup(const char* host, size_t len)
+{
+    if (!host || g_hosts.empty())
+        return &g_default;
+    size_t n = host_length(host, len);
+    if (!n)
+        return &g_default;
+    vhost* found = find(host, n, host_hash(host, n));
+    if (found)
+        return found;
+    // a.b.example.com 依次只试 *.b.example.com，和常见服务器一样通配符只代表一段
+    const char* dot = (const char*)memchr(host, '.', n);
+    if (dot)
+    {
+        size_t suffix = n - (dot - host);
+        uint32_t h = host_hash(dot, suffix, host_hash("*", 1));
+        for (uint32_t i = h & g_mask; g_table[i].name; i = (i + 1) & g_mask)
+        {
+            const vhost_slot& s = g_table[i];
+            if (s.hash == h && s.len == suffix + 1 && s.name[0] == '*' && strncasecmp(s.name + 1, dot, suffix) == 0)
+                return s.host;
+        }
+    }
+    return &g_default;
+}
+
+bool vhost_enter(vhost* host)
+{
+    if (g_hosts.empty())
+        return true;
+    host->requests.fetch_add(1, std::memory_order_relaxed);
+    if (host->max_requests > 0 && host->active.fetch_add(1) >= host->max_requests)
+    {
+        host->active.fetch_sub(1);
+        host->rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void vhost_leave(vhost* host)
+{
+    if (host->max_requests > 0)
+        host->active.fetch_sub(1);
+}
+
+const std::vector<vhost*>& vhost_list()
+{
+    return g_hosts;
+}
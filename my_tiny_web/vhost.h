@@ -0,0 +1,63 @@
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "config.h"
+
+/*
+    虚拟主机：按Host头（HTTP/2为:authority）选择网站根目录、是否使用微缓存以及并发请求上限。
+    主机名在启动时放进一张开放寻址的哈希表，解析请求头时直接对读缓冲区里的Host值计算哈希并查表，
+    不复制字符串，查找的代价和主机数量无关。没有匹配的Host（或者没有Host头）使用默认主机，
+    默认主机的根目录就是全局的doc_root，跟随SIGHUP重载
+*/
+
+struct vhost
+{
+    /* 配置里的第一个名字，用作统计和微缓存的键；默认主机为空 */
+    std::string name;
+    /* 网站根目录，为空时使用全局的doc_root */
+    std::string doc_root;
+    /* 转发给上游的响应是否可以进入微缓存 */
+    bool cache = true;
+    /* 同时处理的请求数上限，超过时回503，0表示不限制 */
+    int max_requests = 0;
+
+    std::atomic<int> active{0};
+    std::atomic<long> requests{0};
+    std::atomic<long> rejected{0};
+};
+
+/* 配置里的一个虚拟主机 */
+struct vhost_spec
+{
+    std::vector<std::string> names;
+    std::string doc_root;
+    bool cache = true;
+    int max_requests = 0;
+};
+
+/// @brief 解析vhosts，格式为 "名字,名字=根目录 [max_requests=N] [cache=0|1];..."，名字可以是 *.example.com
+bool vhost_parse(const std::string& text, std::vector<vhost_spec>& specs, std::string& err);
+
+/// @brief 启动时调用：建立主机名哈希表
+bool vhost_init(const server_config& cfg, std::string& err);
+/* 是否配置了任何虚拟主机 */
+bool vhost_enabled();
+
+/// @brief 按Host头的值查找虚拟主机，忽略大小写、端口和结尾的点，先精确匹配再匹配 *.上一级域名
+/// @param host Host头的值，不需要以'\0'结尾；为nullptr时返回默认主机
+/// @return 不会返回nullptr
+vhost* vhost_lookup(const char* host, size_t len);
+
+/// @brief 一个请求开始由这个主机处理，超过max_requests时返回false
+bool vhost_enter(vhost* host);
+/* 请求处理完毕，和成功的vhost_enter配对 */
+void vhost_leave(vhost* host);
+
+/* 按配置顺序的所有虚拟主机（不含默认主机），退出时打印统计用 */
+const std::vector<vhost*>& vhost_list();
+
+#endif
@@ -0,0 +1,243 @@
+// 发送路径的模糊/回归测试：模拟任意的短写和EAGAIN，检查接收端收到的字节和排进队列的完全一致
+//   每一轮随机生成若干段（0字节到几百KB，一部分标记为文件数据），交给out_queue::send发送；
+//   out_sendmsg换成随机的版本：按概率直接返回EAGAIN，或者只发出iovec总长度中随机的一部分；
+//   接收线程按随机的大小、随机的停顿读取。发送端在OUT_AGAIN时poll等可写，和事件循环一样从游标处继续。
+//   先在socketpair上跑，再在回环TCP连接上跑一遍，后者会打开零拷贝（回环上内核仍然拷贝，但走的是同一套分段逻辑）
+// 最后不注入错误，比较out_queue::send和直接writev发送同样数据的吞吐
+//
+// 用法: write_fuzz [-r 轮数] [-s 随机种子] [-e EAGAIN的概率(%)]
+// 发现不一致时打印出错的轮次和第一个不同的字节的位置，返回1
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "out_queue.h"
+
+static std::mt19937 g_rng;
+static int g_eagain_pct = 20;
+static long g_calls, g_short, g_eagain;
+
+// 随机短写、随机EAGAIN的sendmsg
+static ssize_t fuzz_sendmsg(int fd, const msghdr* msg, int flags) {
+    ++g_calls;
+    if ((int)(g_rng() % 100) < g_eagain_pct) {
+        ++g_eagain;
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; ++i) total += msg->msg_iov[i].iov_len;
+    // 一半的调用原样发送，另一半只交给内核随机的一个前缀
+    size_t want = g_rng() % 2 ? total : 1 + g_rng() % total;
+    if (want == total) return sendmsg(fd, msg, flags);
+    ++g_short;
+    iovec iov[OUT_IOV];
+    size_t count = 0;
+    for (size_t i = 0; i < msg->msg_iovlen && want > 0; ++i, ++count) {
+        iov[count] = msg->msg_iov[i];
+        if (iov[count].iov_len > want) iov[count].iov_len = want;
+        want -= iov[count].iov_len;
+    }
+    msghdr m = *msg;
+    m.msg_iov = iov;
+    m.msg_iovlen = count;
+    return sendmsg(fd, &m, flags);
+}
+
+// 接收线程：随机大小地读，偶尔停一下让发送端碰到发送缓冲区满
+static void receive(int fd, size_t expect, std::vector<char>& got, unsigned seed) {
+    std::mt19937 rng(seed);
+    got.clear();
+    std::vector<char> buf(256 * 1024);
+    while (got.size() < expect) {
+        size_t want = 1 + rng() % buf.size();
+        ssize_t n = recv(fd, buf.data(), want, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return;
+        }
+        got.insert(got.end(), buf.data(), buf.data() + n);
+        if (rng() % 8 == 0) usleep(rng() % 200);
+    }
+}
+
+// 一对已连接的socket，发送端非阻塞；tcp为false时用socketpair
+static bool make_pair(bool tcp, int fds[2]) {
+    if (!tcp) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) return false;
+    } else {
+        int lfd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(lfd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0 ||
+            getsockname(lfd, (sockaddr*)&addr, &len) < 0) {
+            close(lfd);
+            return false;
+        }
+        fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fds[0], (sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(lfd);
+            return false;
+        }
+        fds[1] = accept(lfd, nullptr, nullptr);
+        close(lfd);
+        int one = 1;
+        setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    // 小的发送缓冲区让EAGAIN真的发生
+    int sndbuf = 64 * 1024;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+// 发送整个队列，OUT_AGAIN时等可写再继续；零拷贝的完成通知到了就读掉
+static bool drain(out_queue& q, int fd, size_t zerocopy_bytes) {
+    std::vector<iovec> cold;
+    while (true) {
+        OUT_RESULT r = q.send(fd, nullptr, false, zerocopy_bytes, cold);
+        if (r == OUT_DONE) return true;
+        if (r != OUT_AGAIN) return false;
+        pollfd p = {fd, POLLOUT, 0};
+        if (poll(&p, 1, 5000) <= 0) return false;
+        if ((p.revents & POLLERR) && !q.reap(fd)) return false;
+    }
+}
+
+static int fuzz(bool tcp, int rounds, const std::vector<char>& pool) {
+    const char* name = tcp ? "tcp" : "socketpair";
+    long bytes = 0;
+    g_calls = g_short = g_eagain = 0;
+    out_sendmsg = fuzz_sendmsg;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        int fds[2];
+        if (!make_pair(tcp, fds)) {
+            printf("%s: cannot create sockets: %s\n", name, strerror(errno));
+            return 1;
+        }
+        out_queue q;
+        std::vector<char> expect;
+        int segs = 1 + g_rng() % 12;
+        for (int i = 0; i < segs; ++i) {
+            // 各种大小都要有：响应头大小的、几KB的、超过零拷贝界限的
+            size_t size;
+            switch (g_rng() % 3) {
+            case 0: size = g_rng() % 64; break;
+            case 1: size = g_rng() % (16 * 1024); break;
+            default: size = g_rng() % (512 * 1024); break;
+            }
+            size_t off = g_rng() % (pool.size() - size);
+            q.push(pool.data() + off, size, g_rng() % 2);
+            expect.insert(expect.end(), pool.data() + off, pool.data() + off + size);
+        }
+        std::vector<char> got;
+        std::thread reader(receive, fds[1], expect.size(), std::ref(got), (unsigned)g_rng());
+        bool ok = drain(q, fds[0], tcp ? 64 * 1024 : 0);
+        if (!ok) shutdown(fds[0], SHUT_WR);
+        reader.join();
+        if (tcp) q.reap(fds[0]);
+        close(fds[0]);
+        close(fds[1]);
+        if (!ok || got != expect || q.bytes() != 0 || !q.empty()) {
+            size_t diff = 0;
+            while (diff < got.size() && diff < expect.size() && got[diff] == expect[diff]) ++diff;
+            printf("%s: round %d FAILED: sent %s, received %zu of %zu bytes, first difference at %zu\n", name, round,
+                   ok ? "ok" : "error", got.size(), expect.size(), diff);
+            return 1;
+        }
+        bytes += expect.size();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-10s %d 轮 %ld MB 全部一致：sendmsg %ld 次，其中短写 %ld 次、EAGAIN %ld 次（%.1f s）\n", name, rounds,
+           bytes >> 20, g_calls, g_short, g_eagain, seconds);
+    return 0;
+}
+
+// 不注入错误时的吞吐：send为true时用out_queue，否则直接writev同样的数据
+static double throughput(bool use_queue, const std::vector<char>& pool, size_t total) {
+    int fds[2];
+    if (!make_pair(false, fds)) return 0;
+    int big = 4 << 20;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &big, sizeof(big));
+    std::thread reader([&]() {
+        std::vector<char> buf(1 << 20);
+        size_t left = total;
+        while (left > 0) {
+            ssize_t n = recv(fds[1], buf.data(), buf.size() < left ? buf.size() : left, 0);
+            if (n <= 0) break;
+            left -= n;
+        }
+    });
+    out_sendmsg = sendmsg;
+    const size_t header = 200, body = 1 << 20;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t sent = 0; sent < total; sent += header + body) {
+        if (use_queue) {
+            out_queue q;
+            q.push(pool.data(), header);
+            q.push(pool.data() + header, body, true);
+            drain(q, fds[0], 0);
+        } else {
+            iovec iov[2] = {{(void*)pool.data(), header}, {(void*)(pool.data() + header), body}};
+            int cnt = 2;
+            while (cnt > 0) {
+                ssize_t n = writev(fds[0], iov + 2 - cnt, cnt);
+                if (n < 0) {
+                    pollfd p = {fds[0], POLLOUT, 0};
+                    poll(&p, 1, 1000);
+                    continue;
+                }
+                for (int i = 2 - cnt; i < 2 && n > 0; ++i) {
+                    size_t part = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+                    iov[i].iov_base = (char*)iov[i].iov_base + part;
+                    iov[i].iov_len -= part;
+                    n -= part;
+                    if (iov[i].iov_len == 0) --cnt;
+                }
+            }
+        }
+    }
+    reader.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    close(fds[0]);
+    close(fds[1]);
+    return total / seconds / (1 << 20);
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = 500;
+    unsigned seed = 1;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-r") == 0) rounds = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-s") == 0) seed = (unsigned)atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-e") == 0) g_eagain_pct = atoi(argv[i + 1]);
+    }
+    g_rng.seed(seed);
+    std::vector<char> pool(8 << 20);
+    for (size_t i = 0; i < pool.size(); ++i) pool[i] = (char)g_rng();
+    printf("随机种子 %u，EAGAIN概率 %d%%\n", seed, g_eagain_pct);
+    if (fuzz(false, rounds, pool) || fuzz(true, rounds, pool)) return 1;
+
+    const size_t total = (size_t)2 << 30;
+    double raw = throughput(false, pool, total);
+    double queued = throughput(true, pool, total);
+    printf("吞吐（socketpair，%zu GB，响应头200字节+1MB文件）：writev %.0f MB/s，out_queue %.0f MB/s\n", total >> 30,
+           raw, queued);
+    return 0;
+}